@@ -0,0 +1,275 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <boost/filesystem.hpp>
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/resource.h>
+}
+
+extern char **environ;
+
+namespace fs = boost::filesystem;
+
+#define BENCH_MARKER ".cephgeorep-bench" // only directories holding this are wiped
+#define BENCH_BUFF_SIZE (1 << 20) // pattern written into generated files
+
+namespace Bench{
+	class Args{
+		/* --name value pairs from the command line, with defaults.
+		 */
+	private:
+		std::map<std::string, std::string> values_;
+		std::string usage_;
+	public:
+		Args(int argc, char *argv[], const std::string &usage) : usage_(usage){
+			for(int i = 1; i < argc; i++){
+				std::string arg = argv[i];
+				if(arg == "-h" || arg == "--help"){
+					std::cout << "Usage: " << argv[0] << " " << usage_ << std::endl;
+					exit(EXIT_SUCCESS);
+				}
+				if(arg.compare(0, 2, "--") != 0 || i + 1 >= argc){
+					std::cerr << "Usage: " << argv[0] << " " << usage_ << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				values_[arg.substr(2)] = argv[++i];
+			}
+		}
+		std::string str(const std::string &name, const std::string &def) const{
+			std::map<std::string, std::string>::const_iterator itr = values_.find(name);
+			return (itr == values_.end())? def : itr->second;
+		}
+		long num(const std::string &name, long def) const{
+			return std::stol(str(name, std::to_string(def)));
+		}
+		double real(const std::string &name, double def) const{
+			return std::stod(str(name, std::to_string(def)));
+		}
+	};
+	
+	inline uintmax_t parse_size(const std::string &str){
+		/* Bytes from str with optional K, M, G or T suffix (base 1024).
+		 */
+		size_t end;
+		double num = std::stod(str, &end);
+		const std::string units = "KMGT";
+		if(end < str.length()){
+			size_t unit = units.find(toupper(str[end]));
+			if(unit != std::string::npos)
+				num *= std::pow(1024.0, unit + 1);
+		}
+		return (uintmax_t)num;
+	}
+	
+	inline std::string format_rate(double per_sec, const std::string &unit){
+		char buff[64];
+		const char *prefix[] = {"", "K", "M", "G", "T"};
+		int i = 0;
+		while(per_sec >= 1000 && i < 4){
+			per_sec /= 1000;
+			i++;
+		}
+		snprintf(buff, sizeof(buff), "%.2f %s%s/s", per_sec, prefix[i], unit.c_str());
+		return buff;
+	}
+	
+	inline double seconds_since(std::chrono::steady_clock::time_point start){
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	
+	inline long peak_rss_kib(int who = RUSAGE_SELF){
+		/* Peak resident set of this process or its largest reaped child.
+		 */
+		struct rusage usage;
+		getrusage(who, &usage);
+		return usage.ru_maxrss;
+	}
+	
+	inline size_t env_size(void){
+		size_t size = 0;
+		for(char **env = environ; *env; env++)
+			size += strlen(*env) + 1 + sizeof(char *);
+		return size + sizeof(NULL);
+	}
+	
+	inline void scratch_dir(const std::string &dir){
+		/* Empty dir for a run, refusing to wipe one not made by a bench.
+		 */
+		if(fs::exists(dir)){
+			if(!fs::exists(fs::path(dir) / BENCH_MARKER)){
+				std::cerr << dir << " exists and was not made by a benchmark, refusing to wipe it." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			fs::remove_all(dir);
+		}
+		fs::create_directories(dir);
+		FILE *marker = fopen((fs::path(dir) / BENCH_MARKER).c_str(), "w");
+		if(marker)
+			fclose(marker);
+	}
+	
+	inline void write_config(const std::string &path, const std::vector<std::string> &lines){
+		FILE *conf = fopen(path.c_str(), "w");
+		if(!conf){
+			std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		for(const std::string &line : lines)
+			fprintf(conf, "%s\n", line.c_str());
+		fclose(conf);
+	}
+	
+	struct TreeSpec{
+		/* Shape of a generated source tree.
+		 */
+		int fanout_ = 8;
+		/* Subdirectories in each directory above the deepest level.
+		 */
+		int depth_ = 3;
+		/* Levels of subdirectories below the root.
+		 */
+		int files_ = 16;
+		/* Files in each directory.
+		 */
+		uintmax_t min_size_ = 1024;
+		uintmax_t max_size_ = 1024 * 1024;
+		/* File sizes are log-uniform between these, so small files dominate
+		 * the count and large ones the bytes, as on most shares.
+		 */
+		double change_rate_ = 0.1;
+		/* Fraction of files rewritten by change_tree().
+		 */
+		unsigned seed_ = 1;
+		/* Random seed, so runs with the same spec see the same tree.
+		 */
+		void parse(const Args &args){
+			fanout_ = args.num("fanout", fanout_);
+			depth_ = args.num("depth", depth_);
+			files_ = args.num("files", files_);
+			std::string sizes = args.str("size", "");
+			if(!sizes.empty()){
+				size_t colon = sizes.find(':');
+				min_size_ = parse_size(sizes.substr(0, colon));
+				max_size_ = (colon == std::string::npos)? min_size_ : parse_size(sizes.substr(colon + 1));
+			}
+			change_rate_ = args.real("change", change_rate_);
+			seed_ = args.num("seed", seed_);
+		}
+		static const char *usage(void){
+			return "[--fanout N] [--depth N] [--files N] [--size MIN[:MAX]] [--change FRACTION] [--seed N]";
+		}
+	};
+	
+	struct TreeStats{
+		uintmax_t dirs_ = 0;
+		uintmax_t files_ = 0;
+		uintmax_t bytes_ = 0;
+	};
+	
+	class TreeGenerator{
+		/* Writes and modifies trees of files shaped by a TreeSpec.
+		 */
+	private:
+		TreeSpec spec_;
+		std::mt19937_64 gen_;
+		std::vector<char> buff_;
+		uintmax_t draw_size(void){
+			if(spec_.max_size_ <= spec_.min_size_)
+				return spec_.min_size_;
+			std::uniform_real_distribution<double> dist(std::log((double)spec_.min_size_ + 1), std::log((double)spec_.max_size_ + 1));
+			return (uintmax_t)std::exp(dist(gen_)) - 1;
+		}
+		void write_file(const std::string &path, uintmax_t size){
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(fd == -1){
+				std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			// start at a random offset of the pattern so files differ
+			size_t offset = gen_() % buff_.size();
+			while(size){
+				size_t len = std::min<uintmax_t>(size, buff_.size() - offset);
+				if(write(fd, buff_.data() + offset, len) != (ssize_t)len){
+					std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				size -= len;
+				offset = 0;
+			}
+			close(fd);
+		}
+		void generate_dir(const std::string &path, int depth, TreeStats &stats){
+			fs::create_directories(path);
+			stats.dirs_++;
+			for(int i = 0; i < spec_.files_; i++){
+				uintmax_t size = draw_size();
+				write_file(path + "/f" + std::to_string(i), size);
+				stats.files_++;
+				stats.bytes_ += size;
+			}
+			if(depth == 0)
+				return;
+			for(int i = 0; i < spec_.fanout_; i++)
+				generate_dir(path + "/d" + std::to_string(i), depth - 1, stats);
+		}
+	public:
+		explicit TreeGenerator(const TreeSpec &spec) : spec_(spec), gen_(spec.seed_), buff_(BENCH_BUFF_SIZE){
+			for(char &c : buff_)
+				c = (char)gen_();
+		}
+		TreeStats generate(const std::string &root){
+			/* Write the whole tree under root.
+			 */
+			TreeStats stats;
+			generate_dir(root, spec_.depth_, stats);
+			return stats;
+		}
+		TreeStats change(const std::string &root){
+			/* Rewrite change_rate_ of the files under root with new sizes.
+			 */
+			TreeStats stats;
+			std::bernoulli_distribution pick(spec_.change_rate_);
+			for(fs::recursive_directory_iterator itr(root), end; itr != end; ++itr){
+				if(!fs::is_regular_file(itr->symlink_status()) || !pick(gen_))
+					continue;
+				uintmax_t size = draw_size();
+				write_file(itr->path().string(), size);
+				stats.files_++;
+				stats.bytes_ += size;
+			}
+			return stats;
+		}
+	};
+}
@@ -0,0 +1,243 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Check that Bandwidth Limit caps the whole daemon: several roots, one root
+// split into shards, then one root whose fast lane sends files written
+// during its sync, are synced through a stand-in for rsync that records the
+// --bwlimit it was given and when it ran. At no instant may the limits of
+// the processes running add up to more than Bandwidth Limit. Exits non-zero
+// if they do.
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "crawler.hpp"
+#include "concurrency.hpp"
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <fstream>
+
+struct Run{
+	/* One batch as recorded by the stand-in rsync.
+	 */
+	long long start_;
+	long long end_;
+	uintmax_t kib_per_sec_;
+	int fast_;
+	/* 1 if the batch had files written during the sync.
+	 */
+};
+
+struct Case{
+	/* Crawlers built from one config file like main() does, kept alive
+	 * since crawlers register for signal cleanup.
+	 */
+	std::string name_;
+	std::vector<std::unique_ptr<Config>> configs_;
+	std::vector<std::unique_ptr<Crawler>> crawlers_;
+};
+
+static void write_fake_rsync(const std::string &path, const std::string &log_path, double seconds){
+	std::ofstream script(path);
+	script << "#!/bin/sh\n"
+		<< "limit=0\n"
+		<< "fast=0\n"
+		<< "for arg; do case \"$arg\" in --bwlimit=*) limit=\"${arg#--bwlimit=}\";; */fast-*) fast=1;; esac; done\n"
+		<< "start=$(date +%s%N)\n"
+		<< "sleep " << seconds << "\n"
+		<< "echo \"$start $(date +%s%N) $limit $fast\" >> '" << log_path << "'\n";
+	script.close();
+	chmod(path.c_str(), 0755);
+}
+
+static std::vector<Run> read_runs(const std::string &log_path){
+	std::vector<Run> runs;
+	std::ifstream log(log_path);
+	Run run;
+	while(log >> run.start_ >> run.end_ >> run.kib_per_sec_ >> run.fast_)
+		runs.push_back(run);
+	return runs;
+}
+
+static void build_case(Case &test, const std::string &conf){
+	std::vector<std::string> sections = Config::sections(conf);
+	if(sections.empty())
+		sections.push_back(""); // whole file is one root
+	for(const std::string &section : sections){
+		std::unique_ptr<Config> config(new Config(conf, ConfigOverrides(), section));
+		if(test.configs_.empty())
+			Limits::configure(config->bw_limit(), config->meta_op_limit(), config->limit_schedule());
+		std::vector<Config> shards;
+		if(config->shard_depth())
+			shards = config->shards();
+		else
+			shards.push_back(*config);
+		test.configs_.push_back(std::move(config));
+		for(const Config &shard : shards){
+			test.configs_.emplace_back(new Config(shard));
+			test.crawlers_.emplace_back(new Crawler(*test.configs_.back(), Bench::env_size()));
+		}
+	}
+}
+
+static bool run_case(Case &test, const std::string &log_path, uintmax_t limit, int rounds, const std::string &fast_dir = ""){
+	unlink(log_path.c_str());
+	for(int round = 0; round < rounds; round++){
+		std::vector<std::thread> threads;
+		for(std::unique_ptr<Crawler> &crawler : test.crawlers_)
+			threads.emplace_back(&Crawler::poll_base, crawler.get(), true, false, false, true);
+		if(!fast_dir.empty()){
+			// while the cycle is being sent, for the fast lane to pick up
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+			for(int i = 0; i < 4; i++)
+				Bench::write_config(fast_dir + "/fast-" + std::to_string(round) + "-" + std::to_string(i), {"new"});
+		}
+		for(std::thread &th : threads)
+			th.join();
+	}
+	
+	// sum the limits of every batch running when each batch starts
+	std::vector<Run> runs = read_runs(log_path);
+	uintmax_t peak_kib = 0, unlimited = 0;
+	size_t peak_running = 0, fast = 0;
+	for(const Run &run : runs){
+		fast += run.fast_;
+		uintmax_t kib = 0;
+		size_t running = 0;
+		for(const Run &other : runs){
+			if(other.start_ <= run.start_ && run.start_ < other.end_){
+				kib += other.kib_per_sec_;
+				running++;
+			}
+		}
+		if(kib > peak_kib){
+			peak_kib = kib;
+			peak_running = running;
+		}
+		if(!run.kib_per_sec_)
+			unlimited++;
+	}
+	printf("%-8s %zu batches of %zu crawlers, %zu in the fast lane, peak %s with %zu running, limit %s\n",
+		test.name_.c_str(), runs.size(), test.crawlers_.size(), fast, Bench::format_rate(peak_kib * 1024.0, "B").c_str(), peak_running,
+		Bench::format_rate((double)limit, "B").c_str());
+	bool ok = true;
+	if(!fast_dir.empty() && !fast){
+		printf("FAIL: the fast lane sent nothing, raise --hold above Sync Period\n");
+		ok = false;
+	}
+	if(runs.empty() || unlimited){
+		printf("FAIL: %ju of %zu batches ran without --bwlimit\n", unlimited, runs.size());
+		ok = false;
+	}
+	if(peak_kib * 1024 > limit){
+		printf("FAIL: batches running at once were allowed more than Bandwidth Limit\n");
+		ok = false;
+	}
+	if(Limits::bandwidth.granted()){
+		printf("FAIL: %ju B/s of Bandwidth Limit still held after every sync\n", Limits::bandwidth.granted());
+		ok = false;
+	}
+	return ok;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		std::string("[--dir DIR] ") + Bench::TreeSpec::usage()
+		+ " [--roots N] [--nproc N] [--limit BYTES] [--hold SECONDS] [--fast-hold SECONDS] [--rounds N]"
+	);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	Bench::TreeSpec spec;
+	spec.fanout_ = 2;
+	spec.depth_ = 2;
+	spec.files_ = 4;
+	spec.max_size_ = 4096;
+	spec.parse(args);
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench");
+	int roots = args.num("roots", 2);
+	int nproc = args.num("nproc", 4);
+	uintmax_t limit = Bench::parse_size(args.str("limit", "8M"));
+	double hold = args.real("hold", 0.3);
+	int rounds = args.num("rounds", 3);
+	double fast_hold = args.real("fast-hold", 1.5);
+	std::string log_path = dir + "/runs.log", exec = dir + "/fake-rsync", slow_exec = dir + "/slow/fake-rsync";
+	
+	Bench::scratch_dir(dir);
+	fs::create_directories(dir + "/slow");
+	write_fake_rsync(exec, log_path, hold);
+	write_fake_rsync(slow_exec, log_path, fast_hold); // outlasts Sync Period, so a fast lane pass starts
+	for(int i = 0; i < roots; i++)
+		Bench::TreeGenerator(spec).generate(dir + "/root" + std::to_string(i));
+	std::vector<std::string> common = {
+		"Exec = " + exec,
+		"Flags = -a --relative",
+		"Processes = " + std::to_string(nproc),
+		"Threads = 2",
+		"Bandwidth Limit = " + std::to_string(limit),
+		"Rctime Source = scan",
+		"Sync Period = 1",
+		"Propagation Delay = 0",
+		"Log Level = 0"
+	};
+	
+	// a section per root
+	Case by_root;
+	by_root.name_ = "roots";
+	std::vector<std::string> lines = common;
+	lines.push_back("Metadata Directory = " + dir + "/meta-roots/");
+	for(int i = 0; i < roots; i++){
+		std::string name = "root" + std::to_string(i);
+		lines.push_back("[" + name + "]");
+		lines.push_back("Source Directory = " + dir + "/" + name);
+		lines.push_back("Destination = " + dir + "/dst/" + name);
+	}
+	Bench::write_config(dir + "/roots.conf", lines);
+	build_case(by_root, dir + "/roots.conf");
+	
+	// the first root split into a shard per top level directory
+	Case by_shard;
+	by_shard.name_ = "shards";
+	lines = common;
+	lines.push_back("Metadata Directory = " + dir + "/meta-shards/");
+	lines.push_back("Source Directory = " + dir + "/root0");
+	lines.push_back("Destination = " + dir + "/dst/root0");
+	lines.push_back("Shard Depth = 1");
+	Bench::write_config(dir + "/shards.conf", lines);
+	
+	// the first root with a fast lane, sending files written during its sync
+	Case fast_lane;
+	fast_lane.name_ = "fast";
+	lines = common;
+	lines[0] = "Exec = " + slow_exec;
+	lines.push_back("Metadata Directory = " + dir + "/meta-fast/");
+	lines.push_back("Source Directory = " + dir + "/root0");
+	lines.push_back("Destination = " + dir + "/dst/root0");
+	lines.push_back("Fast Lane Threshold = 1M");
+	lines.push_back("Fast Lane Processes = 2");
+	Bench::write_config(dir + "/fast.conf", lines);
+	
+	bool ok = run_case(by_root, log_path, limit, rounds);
+	build_case(by_shard, dir + "/shards.conf");
+	ok = run_case(by_shard, log_path, limit, rounds) && ok;
+	build_case(fast_lane, dir + "/fast.conf");
+	ok = run_case(fast_lane, log_path, limit, 1, dir + "/root0") && ok;
+	if(ok)
+		printf("PASS\n");
+	Logging::log.flush();
+	return (ok)? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,222 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compression of ranged transfers across codecs and levels on mixed data.
+// Each file is piped through the same compressor command the engine runs
+// for ranges sent over ssh. Effective throughput assumes --ranges ranges
+// compressed in parallel in front of a link of --link bytes per second, so
+// a range finishes at whichever runs out first, gateway CPU or the link.
+
+#include "bench.hpp"
+#include "chunker.hpp"
+#include "file.hpp"
+#include "alert.hpp"
+#include <sstream>
+
+extern "C" {
+	#include <sys/wait.h>
+}
+
+struct DataSet{
+	/* One generated file and what auto compression picks for it.
+	 */
+	std::string name_;
+	std::string path_;
+	uintmax_t size_;
+	ChunkedTransfer::Codec auto_codec_;
+};
+
+struct CodecRun{
+	/* Totals from compressing every file one way.
+	 */
+	uintmax_t raw_ = 0;
+	uintmax_t compressed_ = 0;
+	double cpu_secs_ = 0;
+};
+
+static void write_data(const std::string &path, uintmax_t size, const std::string &kind, std::mt19937_64 &rng){
+	/* Fill a file with data shaped like kind.
+	 */
+	static const char *words[] = {
+		"GET", "POST", "/api/v1/objects", "/index.html", "200", "404", "osd", "mds", "client", "session",
+		"opened", "closed", "error", "warning", "bytes", "ms", "user", "pool", "cephfs", "snapshot"
+	};
+	FILE *out = fopen(path.c_str(), "w");
+	if(!out){
+		std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<char> page(4096);
+	uintmax_t written = 0;
+	uint64_t id = 0;
+	while(written < size){
+		std::string chunk;
+		if(kind == "text"){
+			// log lines: timestamp, a few words and numbers
+			std::stringstream line;
+			line << "2021-03-" << 10 + rng() % 20 << " " << rng() % 24 << ":" << rng() % 60 << ":" << rng() % 60 << " ";
+			for(int w = 0, n = 4 + rng() % 8; w < n; w++)
+				line << words[rng() % (sizeof(words) / sizeof(words[0]))] << " ";
+			line << rng() % 100000 << "\n";
+			chunk = line.str();
+		}else if(kind == "records"){
+			// fixed size rows: sequential key, small counters, random hashes
+			uint64_t row[8] = {id++, rng(), rng(), rng() % 1000, rng(), rng(), rng(), rng() % 2};
+			chunk.assign((const char *)row, sizeof(row));
+		}else if(kind == "image"){
+			// disk image pages: zeroed, text or random
+			uint64_t pick = rng() % 10;
+			for(size_t i = 0; i < page.size(); i += sizeof(uint64_t)){
+				uint64_t word = (pick < 4)? 0 : (pick < 7)? 0x2020656c69662061ULL + (rng() % 4) : rng();
+				memcpy(page.data() + i, &word, sizeof(word));
+			}
+			chunk.assign(page.data(), page.size());
+		}else{
+			// already compressed: random bytes
+			for(size_t i = 0; i < page.size(); i += sizeof(uint64_t)){
+				uint64_t word = rng();
+				memcpy(page.data() + i, &word, sizeof(word));
+			}
+			chunk.assign(page.data(), page.size());
+		}
+		size_t len = std::min<uintmax_t>(chunk.size(), size - written);
+		fwrite(chunk.data(), 1, len, out);
+		written += len;
+	}
+	fclose(out);
+}
+
+static double children_cpu_secs(void){
+	struct rusage usage;
+	getrusage(RUSAGE_CHILDREN, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static uintmax_t compress(const std::string &path, ChunkedTransfer::Codec codec, int level, double &cpu_secs){
+	/* Pipe path through codec like ChunkedTransfer::copy_remote does and
+	 * return compressed size. Adds compressor CPU time to cpu_secs.
+	 */
+	int in_fd = open(path.c_str(), O_RDONLY);
+	int pipe_fds[2];
+	if(in_fd == -1 || pipe(pipe_fds) == -1){
+		std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string level_arg = "-" + std::to_string(level);
+	char *argv[] = {(char *)ChunkedTransfer::codec_name(codec), (char *)"-c", (char *)"-q", (level)? (char *)level_arg.c_str() : NULL, NULL};
+	double cpu_before = children_cpu_secs();
+	pid_t pid = fork();
+	if(pid == 0){
+		dup2(in_fd, 0);
+		dup2(pipe_fds[1], 1);
+		close(pipe_fds[0]);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	close(in_fd);
+	close(pipe_fds[1]);
+	std::vector<char> buff(BENCH_BUFF_SIZE);
+	uintmax_t out = 0;
+	ssize_t got;
+	while((got = read(pipe_fds[0], buff.data(), buff.size())) > 0)
+		out += got;
+	close(pipe_fds[0]);
+	int status;
+	if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		std::cerr << argv[0] << " failed on " << path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	cpu_secs += children_cpu_secs() - cpu_before;
+	return out;
+}
+
+static std::string codec_label(ChunkedTransfer::Codec codec, int level){
+	std::string label = ChunkedTransfer::codec_name(codec);
+	if(codec != ChunkedTransfer::CODEC_NONE)
+		label += (level)? " -" + std::to_string(level) : std::string(" default");
+	return label;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		"[--dir DIR] [--size BYTES] [--levels CODEC:LEVEL,...] [--link BYTES/S] [--ranges N] [--seed N]");
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench-codec");
+	uintmax_t size = Bench::parse_size(args.str("size", "32M")); // per data set
+	std::string levels = args.str("levels", "lz4:1,lz4:9,zstd:1,zstd:3,zstd:9,zstd:15");
+	double link = Bench::parse_size(args.str("link", "100M"));
+	int ranges = args.num("ranges", 4);
+	std::mt19937_64 rng(args.num("seed", 1));
+	Logging::log.set_level(0);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	
+	Bench::scratch_dir(dir);
+	const char *kinds[][2] = {{"text", "logs.txt"}, {"records", "table.db"}, {"image", "disk.img"}, {"random", "blob.bin"}, {"random", "photo.jpg"}};
+	std::vector<DataSet> sets;
+	printf("%-10s %10s  %s\n", "file", "size", "auto picks");
+	for(const auto &kind : kinds){
+		DataSet set;
+		set.name_ = kind[1];
+		set.path_ = dir + "/" + kind[1];
+		set.size_ = size;
+		write_data(set.path_, size, kind[0], rng);
+		File file(set.path_.c_str(), dir.length());
+		set.auto_codec_ = ChunkedTransfer::choose_codec(file, ChunkedTransfer::CODEC_AUTO);
+		printf("%-10s %10s  %s\n", set.name_.c_str(), Logging::log.format_bytes(size).c_str(), ChunkedTransfer::codec_name(set.auto_codec_));
+		sets.push_back(set);
+	}
+	
+	// every listed codec and level, then auto at each codec's default
+	std::vector<std::pair<ChunkedTransfer::Codec, int>> configs;
+	configs.emplace_back(ChunkedTransfer::CODEC_NONE, 0);
+	std::stringstream list(levels);
+	std::string item;
+	while(std::getline(list, item, ',')){
+		size_t colon = item.find(':');
+		std::string name = item.substr(0, colon);
+		int level = (colon == std::string::npos)? 0 : std::stoi(item.substr(colon + 1));
+		if(name == "lz4")
+			configs.emplace_back(ChunkedTransfer::CODEC_LZ4, level);
+		else if(name == "zstd")
+			configs.emplace_back(ChunkedTransfer::CODEC_ZSTD, level);
+		else{
+			std::cerr << "Unknown codec " << name << ", expected lz4 or zstd." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	configs.emplace_back(ChunkedTransfer::CODEC_AUTO, 0);
+	
+	printf("\n%d ranges in parallel over a %s link\n", ranges, Bench::format_rate(link, "B").c_str());
+	printf("%-14s %8s %16s %16s %10s\n", "codec", "ratio", "compress/core", "effective", "cores busy");
+	for(const std::pair<ChunkedTransfer::Codec, int> &config : configs){
+		CodecRun run;
+		for(const DataSet &set : sets){
+			ChunkedTransfer::Codec codec = (config.first == ChunkedTransfer::CODEC_AUTO)? set.auto_codec_ : config.first;
+			run.raw_ += set.size_;
+			run.compressed_ += (codec == ChunkedTransfer::CODEC_NONE)? set.size_ : compress(set.path_, codec, config.second, run.cpu_secs_);
+		}
+		// ranges finish when the slower of compressing and sending them does
+		double secs = std::max(run.cpu_secs_ / ranges, run.compressed_ / link);
+		std::string label = (config.first == ChunkedTransfer::CODEC_AUTO)? "auto" : codec_label(config.first, config.second);
+		printf("%-14s %8.2f %16s %16s %10.2f\n", label.c_str(), (double)run.raw_ / run.compressed_,
+			(run.cpu_secs_ > 0)? Bench::format_rate(run.raw_ / run.cpu_secs_, "B").c_str() : "-",
+			Bench::format_rate(run.raw_ / secs, "B").c_str(), run.cpu_secs_ / secs);
+	}
+	fs::remove_all(dir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Local stand-in for `rsync -a --relative` when rsync is not installed:
+# copies each <root>/./<path> argument to <destination>/<path>.
+# Usage: copy.sh [flags] <files>... <destination>
+
+dest="${@: -1}"
+declare -A by_root
+for f in "${@:1:$#-1}"; do
+	case "$f" in
+		-*) continue ;;
+		*/./*) by_root["${f%%/./*}"]+="${f#*/./}"$'\n' ;;
+	esac
+done
+status=0
+for root in "${!by_root[@]}"; do
+	# parents first with mkdir -p, since cp --parents fails if another process makes one at the same time
+	( cd "$root" && printf '%s' "${by_root[$root]}" | sed -n 's|/[^/]*$||p' | sort -u | sed "s|^|$dest/|" | xargs -r -d '\n' mkdir -p \
+		&& printf '%s' "${by_root[$root]}" | xargs -d '\n' cp -a --parents -t "$dest" ) || status=23
+done
+exit $status
@@ -0,0 +1,182 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Delta mode on one large file: a full send that caches block signatures,
+// then a small fraction of blocks rewritten at random and sent again. The
+// source is sparse by default so a 50 GiB file fits in a scratch directory;
+// holes still read and hash like zeroed data. The destination is local.
+
+#include "bench.hpp"
+#include "chunker.hpp"
+#include "delta.hpp"
+#include "file.hpp"
+#include "alert.hpp"
+#include <set>
+
+static void fill_block(std::mt19937_64 &rng, std::vector<char> &buff){
+	for(size_t i = 0; i + sizeof(uint64_t) <= buff.size(); i += sizeof(uint64_t)){
+		uint64_t word = rng();
+		memcpy(buff.data() + i, &word, sizeof(word));
+	}
+}
+
+static bool pwrite_full(int fd, const char *buff, size_t len, off_t offset){
+	while(len){
+		ssize_t n = pwrite(fd, buff, len, offset);
+		if(n <= 0)
+			return false;
+		buff += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool pread_full(int fd, char *buff, size_t len, off_t offset){
+	while(len){
+		ssize_t n = pread(fd, buff, len, offset);
+		if(n <= 0)
+			return false;
+		buff += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static std::set<uintmax_t> pick_blocks(std::mt19937_64 &rng, uintmax_t blocks, uintmax_t count){
+	count = std::min(count, blocks);
+	std::set<uintmax_t> picked;
+	std::uniform_int_distribution<uintmax_t> dist(0, blocks - 1);
+	while(picked.size() < count)
+		picked.insert(dist(rng));
+	return picked;
+}
+
+static void write_blocks(const std::string &path, const std::set<uintmax_t> &blocks, uintmax_t block_size, uintmax_t size, std::mt19937_64 &rng){
+	int fd = open(path.c_str(), O_WRONLY);
+	if(fd == -1){
+		std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<char> buff(block_size);
+	for(uintmax_t block : blocks){
+		uintmax_t offset = block * block_size;
+		fill_block(rng, buff);
+		if(!pwrite_full(fd, buff.data(), std::min(block_size, size - offset), offset)){
+			std::cerr << "Could not write " << path << ": " << strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+}
+
+static double timed_send(ChunkedTransfer &engine, const std::string &src_root, const std::string &path, const Destination &dest){
+	File file(path.c_str(), src_root.length());
+	auto start = std::chrono::steady_clock::now();
+	if(engine.send(file, dest, true) != ChunkedTransfer::SENT){
+		std::cerr << "Sending " << path << " failed." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return Bench::seconds_since(start);
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		"[--dir DIR] [--size BYTES] [--block BYTES] [--chunk BYTES] [--procs N] [--changed FRACTION]\n"
+		"    [--fill FRACTION] [--verify N] [--seed N] [--keep 0|1] [--log-level N]");
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench-delta");
+	uintmax_t size = Bench::parse_size(args.str("size", "50G"));
+	uintmax_t block_size = Bench::parse_size(args.str("block", "128K")); // Delta Block Size default
+	uintmax_t chunk_size = Bench::parse_size(args.str("chunk", "1G")); // Chunk Size default
+	int procs = args.num("procs", 4);
+	double changed = args.real("changed", 0.001);
+	double fill = args.real("fill", 0.01); // fraction of blocks holding data, 1 for a dense file
+	uintmax_t verify = args.num("verify", 1000); // unchanged blocks compared besides every changed one
+	std::mt19937_64 rng(args.num("seed", 1));
+	Logging::log.set_level(args.num("log-level", 0));
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if(!size || !block_size){
+		std::cerr << "--size and --block must not be 0." << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	Bench::scratch_dir(dir);
+	std::string src_root = dir + "/src";
+	std::string path = src_root + "/image.raw";
+	fs::create_directories(src_root);
+	uintmax_t blocks = (size + block_size - 1) / block_size;
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1 || ftruncate(fd, size) == -1){
+		std::cerr << "Could not create " << path << ": " << strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	write_blocks(path, pick_blocks(rng, blocks, blocks * fill), block_size, size, rng);
+	
+	ChunkedTransfer engine(chunk_size, procs);
+	engine.enable_delta(block_size, dir + "/sig");
+	Destination dest(dir + "/dst");
+	fs::create_directories(dest.path_);
+	
+	printf("%-8s %10s %10s %10s %14s\n", "send", "blocks", "bytes", "s", "B/s");
+	double full_secs = timed_send(engine, src_root, path, dest);
+	printf("%-8s %10ju %10s %10.2f %14s\n", "full", blocks, Logging::log.format_bytes(size).c_str(), full_secs,
+		Bench::format_rate(size / full_secs, "B").c_str());
+	
+	// pwrite moves mtime, which is what tells delta mode to hash again
+	std::set<uintmax_t> changed_blocks = pick_blocks(rng, blocks, std::max<uintmax_t>(1, blocks * changed));
+	write_blocks(path, changed_blocks, block_size, size, rng);
+	uintmax_t changed_bytes = changed_blocks.size() * block_size;
+	double delta_secs = timed_send(engine, src_root, path, dest);
+	printf("%-8s %10zu %10s %10.2f %14s\n", "delta", changed_blocks.size(), Logging::log.format_bytes(changed_bytes).c_str(), delta_secs,
+		Bench::format_rate(size / delta_secs, "B").c_str());
+	printf("\ndelta send took %.1f%% of the full send (%.1fx faster), hashing the source at %s\n",
+		100.0 * delta_secs / full_secs, full_secs / delta_secs, Bench::format_rate(size / delta_secs, "B").c_str());
+	
+	// compare every changed block and a sample of the rest against the source
+	std::set<uintmax_t> check = pick_blocks(rng, blocks, verify);
+	check.insert(changed_blocks.begin(), changed_blocks.end());
+	std::string dest_path = dest.path_ + "/image.raw";
+	int src_fd = open(path.c_str(), O_RDONLY);
+	int dst_fd = open(dest_path.c_str(), O_RDONLY);
+	struct stat dst_st;
+	uintmax_t mismatched = 0;
+	if(src_fd == -1 || dst_fd == -1 || fstat(dst_fd, &dst_st) == -1 || (uintmax_t)dst_st.st_size != size){
+		std::cerr << dest_path << " is missing or the wrong size." << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::vector<char> src_buff(block_size), dst_buff(block_size);
+	for(uintmax_t block : check){
+		uintmax_t offset = block * block_size;
+		size_t len = std::min(block_size, size - offset);
+		if(!pread_full(src_fd, src_buff.data(), len, offset) || !pread_full(dst_fd, dst_buff.data(), len, offset)
+		|| memcmp(src_buff.data(), dst_buff.data(), len) != 0)
+			mismatched++;
+	}
+	close(src_fd);
+	close(dst_fd);
+	printf("blocks compared: %zu, mismatched: %ju\n", check.size(), mismatched);
+	printf("peak RSS: %ld KiB\n", Bench::peak_rss_kib());
+	
+	if(!args.num("keep", 0))
+		fs::remove_all(dir);
+	Logging::log.flush();
+	return (mismatched)? EXIT_FAILURE : EXIT_SUCCESS;
+}
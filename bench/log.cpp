@@ -0,0 +1,92 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Log lines per second through Logging::log from many producer threads,
+// checking that warnings survive a full ring while debug lines may not.
+
+#include "bench.hpp"
+#include "alert.hpp"
+#include <thread>
+#include <fstream>
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv, "[--producers N] [--lines N] [--warn-every N] [--rate-limit N]");
+	int producers = args.num("producers", 32);
+	long lines = args.num("lines", 100000); // per producer
+	long warn_every = args.num("warn-every", 100);
+	Logging::log.set_level(2);
+	Logging::log.set_rate_limit(args.num("rate-limit", 0));
+	
+	// everything logged goes to a file, to be counted afterwards
+	char out_path[] = "/tmp/cephgeorep-bench-log.XXXXXX";
+	int out_fd = mkstemp(out_path);
+	if(out_fd == -1){
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	int saved_stdout = dup(1), saved_stderr = dup(2);
+	dup2(out_fd, 1);
+	dup2(out_fd, 2);
+	
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; p++){
+		threads.emplace_back([=](){
+			std::string prefix = "bench " + std::to_string(p) + " line ";
+			for(long i = 0; i < lines; i++){
+				if(warn_every && i % warn_every == 0)
+					Logging::log.warning(prefix + std::to_string(i));
+				else
+					Logging::log.message(prefix + std::to_string(i), 2);
+			}
+		});
+	}
+	for(std::thread &th : threads)
+		th.join();
+	double pushed_secs = Bench::seconds_since(start);
+	Logging::log.flush();
+	double written_secs = Bench::seconds_since(start);
+	
+	dup2(saved_stdout, 1);
+	dup2(saved_stderr, 2);
+	close(out_fd);
+	uintmax_t debug = 0, warnings = 0, dropped = 0, suppressed = 0;
+	std::ifstream out(out_path);
+	std::string line;
+	while(std::getline(out, line)){
+		if(line.compare(0, 15, "Warning: bench ") == 0)
+			warnings++;
+		else if(line.compare(0, 6, "bench ") == 0)
+			debug++;
+		else if(line.find("debug messages dropped") != std::string::npos)
+			dropped += std::stoull(line.substr(9));
+		else if(line.find("suppressed by Log Rate Limit") != std::string::npos)
+			suppressed += std::stoull(line.substr(9));
+	}
+	unlink(out_path);
+	
+	uintmax_t total = (uintmax_t)producers * lines;
+	uintmax_t expected_warnings = (warn_every)? producers * ((lines + warn_every - 1) / warn_every) : 0;
+	printf("%d producers, %ju lines\n", producers, total);
+	printf("Logged in %.3f s: %s\n", pushed_secs, Bench::format_rate(total / pushed_secs, "lines").c_str());
+	printf("Written in %.3f s: %s\n", written_secs, Bench::format_rate((debug + warnings) / written_secs, "lines").c_str());
+	printf("Debug lines: %ju written, %ju dropped, %ju suppressed\n", debug, dropped, suppressed);
+	printf("Warnings: %ju of %ju written\n", warnings, expected_warnings);
+	return (warnings == expected_warnings && debug + dropped + suppressed + warnings == total)? EXIT_SUCCESS : EXIT_FAILURE;
+}
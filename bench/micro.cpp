@@ -0,0 +1,158 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Nanoseconds per entry of the crawler's per-entry work: name filters,
+// File construction and the rctime check, on synthetic snapshot paths.
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "crawler.hpp"
+#include "nameFilter.hpp"
+#include "file.hpp"
+
+#define MICRO_SNAP_ROOT "/mnt/cephfs/.snap/1234snapshot1600000000.000000000"
+
+struct Entry{
+	std::string path_;
+	size_t name_off_;
+	/* Start of the name within path_, as readdir hands it over.
+	 */
+};
+
+static std::vector<Entry> make_entries(size_t count, unsigned seed){
+	// mostly plain names, some hidden, vim swap and Windows lock files
+	std::mt19937 gen(seed);
+	std::uniform_int_distribution<int> pct(0, 99), depth(2, 6), num(0, 9999);
+	std::vector<Entry> entries;
+	entries.reserve(count);
+	for(size_t i = 0; i < count; i++){
+		std::string path = MICRO_SNAP_ROOT;
+		for(int d = depth(gen); d > 0; d--)
+			path += "/projects_" + std::to_string(num(gen) % 64);
+		path += "/";
+		size_t name_off = path.length();
+		int kind = pct(gen);
+		if(kind < 90)
+			path += "report_2021_" + std::to_string(num(gen)) + ".docx";
+		else if(kind < 95)
+			path += ".config_" + std::to_string(num(gen));
+		else if(kind < 98)
+			path += ".notes_" + std::to_string(num(gen)) + ".txt.swp";
+		else
+			path += "~$budget_" + std::to_string(num(gen)) + ".xlsx";
+		entries.push_back({path, name_off});
+	}
+	return entries;
+}
+
+template<typename F>
+static void run(const char *name, size_t entries, F pass){
+	// repeat whole passes for at least 200 ms
+	size_t passes = 0;
+	auto start = std::chrono::steady_clock::now();
+	double secs;
+	do{
+		pass();
+		passes++;
+	}while((secs = Bench::seconds_since(start)) < 0.2);
+	printf("%-28s %8.2f ns/entry\n", name, secs * 1e9 / (passes * entries));
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv, "[--entries N] [--seed N] [--dir DIR]");
+	size_t count = args.num("entries", 200000);
+	std::vector<Entry> entries = make_entries(count, args.num("seed", 1));
+	size_t snap_root_len = strlen(MICRO_SNAP_ROOT);
+	volatile uintmax_t sink = 0;
+	
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0644;
+	st.st_size = 4096;
+	st.st_mtim.tv_sec = 1600000000;
+	
+	run("check_vim_swap", count, [&](){
+		uintmax_t hits = 0;
+		for(const Entry &entry : entries){
+			const char *name = entry.path_.c_str() + entry.name_off_;
+			hits += check_vim_swap(name, entry.path_.length() - entry.name_off_);
+		}
+		sink = sink + hits;
+	});
+	run("name filters (all three)", count, [&](){
+		uintmax_t hits = 0;
+		for(const Entry &entry : entries){
+			const char *name = entry.path_.c_str() + entry.name_off_;
+			size_t len = entry.path_.length() - entry.name_off_;
+			hits += check_hidden(name) || check_win_lock(name) || check_vim_swap(name, len);
+		}
+		sink = sink + hits;
+	});
+	printf("%-28s %8s (name is taken from the dirent)\n", "get_filename/get_last_of", "removed");
+	std::vector<File> files;
+	files.reserve(count);
+	run("File::init (+ delete[])", count, [&](){
+		files.clear();
+		for(const Entry &entry : entries)
+			files.emplace_back(entry.path_.c_str(), entry.path_.length(), snap_root_len, st);
+	});
+	
+	// ignore_entry needs a Crawler with a last rctime to compare against
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench-micro");
+	Bench::scratch_dir(dir);
+	fs::create_directories(dir + "/src");
+	Bench::write_config(dir + "/micro.conf", {
+		"Source Directory = " + dir + "/src",
+		"Destination = " + dir + "/dst",
+		"Metadata Directory = " + dir + "/meta/",
+		"Exec = true",
+		"Flags = -a",
+		"Processes = 1",
+		"Threads = 1",
+		"Sync Period = 1",
+		"Propagation Delay = 0",
+		"Ignore Hidden = true",
+		"Ignore Windows Lock = true",
+		"Ignore Vim Swap = true",
+		"Rctime Source = scan",
+		"Log Level = 0"
+	});
+	Config config(dir + "/micro.conf", ConfigOverrides());
+	Crawler crawler(config, Bench::env_size());
+	run("ignore_entry", count, [&](){
+		uintmax_t hits = 0;
+		for(const File &file : files)
+			hits += crawler.ignore_entry(file);
+		sink = sink + hits;
+	});
+	run("per entry total", count, [&](){
+		uintmax_t hits = 0;
+		files.clear();
+		for(const Entry &entry : entries){
+			const char *name = entry.path_.c_str() + entry.name_off_;
+			size_t len = entry.path_.length() - entry.name_off_;
+			if(check_hidden(name) || check_win_lock(name) || check_vim_swap(name, len))
+				continue;
+			files.emplace_back(entry.path_.c_str(), entry.path_.length(), snap_root_len, st);
+			hits += crawler.ignore_entry(files.back());
+		}
+		sink = sink + hits;
+	});
+	return EXIT_SUCCESS;
+}
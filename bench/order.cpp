@@ -0,0 +1,129 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Total transfer time of one generated tree to a local directory under each
+// Transfer Order. Every run starts from an empty destination, and with
+// --drop-caches 1 (needs root) from a cold page cache, so read locality on
+// the source shows. Strategies take turns for --repeat runs each, and the
+// best and median times are printed.
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "crawler.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <memory>
+
+static bool drop_caches(void){
+	/* Write back and drop the page cache. Returns false if not allowed.
+	 */
+	sync();
+	FILE *drop = fopen("/proc/sys/vm/drop_caches", "w");
+	if(!drop)
+		return false;
+	bool ok = fputs("3\n", drop) >= 0;
+	return (fclose(drop) == 0) && ok;
+}
+
+static uintmax_t count_copied(const std::string &dst){
+	uintmax_t count = 0;
+	for(fs::recursive_directory_iterator itr(dst), end; itr != end; ++itr)
+		if(fs::is_regular_file(itr->symlink_status()))
+			count++;
+	return count;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		std::string("[--dir DIR] ") + Bench::TreeSpec::usage()
+		+ " [--orders ORDER,...] [--repeat N] [--drop-caches 0|1] [--nproc N] [--threads N] [--exec PATH] [--flags FLAGS]"
+	);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	Bench::TreeSpec spec;
+	spec.parse(args);
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench");
+	int repeat = args.num("repeat", 3);
+	bool cold = args.num("drop-caches", 1);
+	std::string src = dir + "/src";
+	std::vector<std::string> orders;
+	std::string list = args.str("orders", "size,directory,inode,hybrid") + ",";
+	for(size_t start = 0, comma; (comma = list.find(',', start)) != std::string::npos; start = comma + 1)
+		if(comma > start)
+			orders.push_back(list.substr(start, comma - start));
+	
+	Bench::scratch_dir(dir);
+	Bench::TreeStats tree = Bench::TreeGenerator(spec).generate(src);
+	printf("Generated %ju files in %ju directories (%ju bytes)\n", tree.files_, tree.dirs_, tree.bytes_);
+	if(cold && !drop_caches()){
+		printf("Cannot drop the page cache, timing warm runs\n");
+		cold = false;
+	}
+	
+	// one daemon instance per order, kept alive since crawlers register for signal cleanup
+	std::vector<std::unique_ptr<Config>> configs;
+	std::vector<std::unique_ptr<Crawler>> crawlers;
+	for(const std::string &order : orders){
+		std::string conf = dir + "/" + order + ".conf";
+		Bench::write_config(conf, {
+			"Source Directory = " + src,
+			"Destination = " + dir + "/dst",
+			"Exec = " + args.str("exec", "rsync"),
+			"Flags = " + args.str("flags", "-a --relative"),
+			"Metadata Directory = " + dir + "/meta-" + order + "/",
+			"Processes = " + std::to_string(args.num("nproc", 4)),
+			"Threads = " + std::to_string(args.num("threads", 4)),
+			"Transfer Order = " + order,
+			"Rctime Source = scan",
+			"Sync Period = 1",
+			"Propagation Delay = 0",
+			"Log Level = 0"
+		});
+		configs.emplace_back(new Config(conf, ConfigOverrides()));
+		crawlers.emplace_back(new Crawler(*configs.back(), Bench::env_size()));
+	}
+	
+	std::vector<std::vector<double>> times(orders.size());
+	for(int run = 0; run < repeat; run++){
+		for(size_t i = 0; i < orders.size(); i++){
+			fs::remove_all(dir + "/dst");
+			fs::create_directories(dir + "/dst");
+			if(cold)
+				drop_caches();
+			auto start = std::chrono::steady_clock::now();
+			crawlers[i]->poll_base(true, false, false, true);
+			times[i].push_back(Bench::seconds_since(start));
+			uintmax_t copied = count_copied(dir + "/dst");
+			if(copied != tree.files_){
+				printf("%s: %ju of %ju files copied\n", orders[i].c_str(), copied, tree.files_);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	
+	printf("%-10s %10s %10s %16s %14s\n", "order", "best s", "median s", "files/s", "B/s");
+	for(size_t i = 0; i < orders.size(); i++){
+		std::sort(times[i].begin(), times[i].end());
+		double best = times[i].front(), median = times[i][times[i].size() / 2];
+		printf("%-10s %10.3f %10.3f %16s %14s\n", orders[i].c_str(), best, median,
+			Bench::format_rate(tree.files_ / median, "files").c_str(),
+			Bench::format_rate(tree.bytes_ / median, "B").c_str());
+	}
+	Logging::log.flush();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// End to end: generate a tree, then time crawl, sort, schedule and
+// transfer of it to a local directory through the daemon's own Crawler.
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "crawler.hpp"
+#include "alert.hpp"
+#include <thread>
+
+static void report(const std::string &round, const Bench::TreeStats &stats, double secs){
+	printf("%-12s %10ju files %12ju bytes %9.3f s  %16s  %14s\n",
+		round.c_str(), stats.files_, stats.bytes_, secs,
+		Bench::format_rate(stats.files_ / secs, "files").c_str(),
+		Bench::format_rate(stats.bytes_ / secs, "B").c_str());
+}
+
+static uintmax_t count_mismatched(const std::string &src, const std::string &dst){
+	// missing from dst or of another size
+	uintmax_t count = 0;
+	for(fs::recursive_directory_iterator itr(src), end; itr != end; ++itr){
+		if(!fs::is_regular_file(itr->symlink_status()))
+			continue;
+		fs::path copy = fs::path(dst) / itr->path().string().substr(src.length());
+		boost::system::error_code ec;
+		if(fs::file_size(copy, ec) != fs::file_size(itr->path()) || ec)
+			count++;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		std::string("[--dir DIR] ") + Bench::TreeSpec::usage()
+		+ " [--rounds N] [--nproc N] [--threads N] [--exec PATH] [--flags FLAGS]"
+	);
+	setvbuf(stdout, NULL, _IOLBF, 0); // in order with the daemon's own log lines
+	Bench::TreeSpec spec;
+	spec.parse(args);
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench");
+	int rounds = args.num("rounds", 1);
+	std::string src = dir + "/src", dst = dir + "/dst", conf = dir + "/bench.conf";
+	
+	Bench::scratch_dir(dir);
+	auto start = std::chrono::steady_clock::now();
+	Bench::TreeStats tree = Bench::TreeGenerator(spec).generate(src);
+	printf("Generated %ju files in %ju directories (%ju bytes) in %.3f s\n", tree.files_, tree.dirs_, tree.bytes_, Bench::seconds_since(start));
+	fs::create_directories(dst);
+	Bench::write_config(conf, {
+		"Source Directory = " + src,
+		"Destination = " + dst,
+		"Exec = " + args.str("exec", "rsync"),
+		"Flags = " + args.str("flags", "-a --relative"),
+		"Metadata Directory = " + dir + "/meta/",
+		"Processes = " + std::to_string(args.num("nproc", 4)),
+		"Threads = " + std::to_string(args.num("threads", 4)),
+		"Rctime Source = scan",
+		"Sync Period = 1",
+		"Propagation Delay = 0",
+		"Log Level = 0"
+	});
+	
+	Config config(conf, ConfigOverrides());
+	Crawler crawler(config, Bench::env_size());
+	
+	start = std::chrono::steady_clock::now();
+	crawler.poll_base(true, false, false, true);
+	report("full", tree, Bench::seconds_since(start));
+	
+	for(int i = 1; i <= rounds; i++){
+		// past the coarse timestamp tick of the last writes, so changes look newer
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		spec.seed_++;
+		Bench::TreeStats changed = Bench::TreeGenerator(spec).change(src);
+		start = std::chrono::steady_clock::now();
+		crawler.poll_base(false, false, false, true);
+		report("incremental", changed, Bench::seconds_since(start));
+	}
+	
+	uintmax_t mismatched = count_mismatched(src, dst);
+	printf("Destination is missing or has stale copies of %ju files\n", mismatched);
+	printf("Peak RSS: daemon %ld KiB, largest transfer process %ld KiB\n", Bench::peak_rss_kib(), Bench::peak_rss_kib(RUSAGE_CHILDREN));
+	Logging::log.flush();
+	return (mismatched == 0)? EXIT_SUCCESS : EXIT_FAILURE;
+}
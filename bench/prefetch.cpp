@@ -0,0 +1,140 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Prefetch against a slowed filesystem: a generated tree is mounted through
+// Bench::SlowFs, which sleeps --latency before answering every read, and
+// synced to a local directory with and without Prefetch Budget. Every run
+// starts from an empty destination and a cold page cache, and the two take
+// turns for --repeat runs each. Needs root, for the FUSE mount.
+
+#include "bench.hpp"
+#include "slowfs.hpp"
+#include "config.hpp"
+#include "crawler.hpp"
+#include "metrics.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <memory>
+
+static bool drop_caches(void){
+	sync();
+	FILE *drop = fopen("/proc/sys/vm/drop_caches", "w");
+	if(!drop)
+		return false;
+	bool ok = fputs("3\n", drop) >= 0;
+	return (fclose(drop) == 0) && ok;
+}
+
+static uintmax_t count_copied(const std::string &dst){
+	uintmax_t count = 0;
+	for(fs::recursive_directory_iterator itr(dst), end; itr != end; ++itr)
+		if(fs::is_regular_file(itr->symlink_status()))
+			count++;
+	return count;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		std::string("[--dir DIR] ") + Bench::TreeSpec::usage()
+		+ " [--latency US] [--servers N] [--budget BYTES] [--repeat N] [--nproc N] [--threads N] [--exec PATH] [--flags FLAGS]"
+	);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	Bench::TreeSpec spec;
+	spec.parse(args);
+	std::string dir = args.str("dir", "/tmp/cephgeorep-bench");
+	std::chrono::microseconds latency(args.num("latency", 2000));
+	int servers = args.num("servers", 16); // reads answered at once, like OSDs
+	std::string budget = args.str("budget", "256M");
+	int repeat = args.num("repeat", 3);
+	std::string backing = dir + "/backing", src = dir + "/src", dst = dir + "/dst";
+	
+	Bench::scratch_dir(dir);
+	Bench::TreeStats tree = Bench::TreeGenerator(spec).generate(backing);
+	printf("Generated %ju files in %ju directories (%ju bytes), reads delayed %ld us\n",
+		tree.files_, tree.dirs_, tree.bytes_, (long)latency.count());
+	fs::create_directories(src);
+	Bench::SlowFs slow(backing, src, latency, servers);
+	if(!slow.mounted()){
+		std::cerr << "Could not mount slowed filesystem at " << src << ": " << strerror(errno) << " (needs root and /dev/fuse)" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if(!drop_caches()){
+		std::cerr << "Could not drop the page cache, runs would not start cold." << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	// one daemon instance each, kept alive since crawlers register for signal cleanup
+	const char *names[] = {"off", "on"};
+	std::vector<std::unique_ptr<Config>> configs;
+	std::vector<std::unique_ptr<Crawler>> crawlers;
+	for(const char *name : names){
+		std::string conf = dir + "/" + name + ".conf";
+		Bench::write_config(conf, {
+			"Source Directory = " + src,
+			"Destination = " + dst,
+			"Exec = " + args.str("exec", "rsync"),
+			"Flags = " + args.str("flags", "-a --relative"),
+			"Metadata Directory = " + dir + "/meta-" + name + "/",
+			"Processes = " + std::to_string(args.num("nproc", 4)),
+			"Threads = " + std::to_string(args.num("threads", 4)),
+			"Prefetch Budget = " + ((std::string(name) == "on")? budget : std::string("0")),
+			"Rctime Source = scan",
+			"Sync Period = 1",
+			"Propagation Delay = 0",
+			"Log Level = 0"
+		});
+		configs.emplace_back(new Config(conf, ConfigOverrides()));
+		crawlers.emplace_back(new Crawler(*configs.back(), Bench::env_size()));
+	}
+	
+	std::vector<std::vector<double>> times(2);
+	uintmax_t prefetched = 0;
+	for(int run = 0; run < repeat; run++){
+		for(size_t i = 0; i < 2; i++){
+			fs::remove_all(dst);
+			fs::create_directories(dst);
+			drop_caches();
+			uintmax_t before = Metrics::bytes_prefetched.value();
+			auto start = std::chrono::steady_clock::now();
+			crawlers[i]->poll_base(true, false, false, true);
+			times[i].push_back(Bench::seconds_since(start));
+			prefetched += Metrics::bytes_prefetched.value() - before;
+			uintmax_t copied = count_copied(dst);
+			if(copied != tree.files_){
+				printf("prefetch %s: %ju of %ju files copied\n", names[i], copied, tree.files_);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	
+	printf("%-12s %10s %10s %16s %14s\n", "prefetch", "best s", "median s", "files/s", "B/s");
+	double median[2];
+	for(size_t i = 0; i < 2; i++){
+		std::sort(times[i].begin(), times[i].end());
+		median[i] = times[i][times[i].size() / 2];
+		std::string label = (i)? std::string("on ") + budget : std::string("off");
+		printf("%-12s %10.3f %10.3f %16s %14s\n", label.c_str(), times[i].front(), median[i],
+			Bench::format_rate(tree.files_ / median[i], "files").c_str(),
+			Bench::format_rate(tree.bytes_ / median[i], "B").c_str());
+	}
+	printf("Prefetch cut the median by %.1f%%, reading ahead %s per run\n",
+		100.0 * (1.0 - median[1] / median[0]), Logging::log.format_bytes(prefetched / repeat).c_str());
+	Logging::log.flush();
+	return EXIT_SUCCESS;
+}
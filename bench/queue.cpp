@@ -0,0 +1,69 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Contention of ConcurrentQueue as the crawler uses it: every worker pops
+// a directory and pushes its children, from 2 to 128 threads.
+
+#include "bench.hpp"
+#include "concurrent_queue.hpp"
+#include <thread>
+#include <atomic>
+
+// node k of the simulated tree has children k * fanout + 1 .. k * fanout + fanout, below nodes
+static void worker(ConcurrentQueue<std::string> &queue, std::atomic<int> &threads_running, std::atomic<long> &seen, long nodes, long fanout, int work){
+	threads_running++;
+	std::string node;
+	while(queue.pop(node, threads_running)){
+		long k = atol(node.c_str());
+		seen++;
+		volatile int spin = 0; // stands in for reading the directory
+		for(int i = 0; i < work; i++)
+			spin = spin + i;
+		for(long c = k * fanout + 1; c <= k * fanout + fanout && c < nodes; c++)
+			queue.push(std::to_string(c));
+	}
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv, "[--nodes N] [--fanout N] [--work N] [--max-threads N]");
+	long nodes = args.num("nodes", 2000000);
+	long fanout = args.num("fanout", 8);
+	int work = args.num("work", 0);
+	int max_threads = args.num("max-threads", 128);
+	printf("%ld nodes, fan-out %ld, %d spins per node, %u CPUs\n", nodes, fanout, work, std::thread::hardware_concurrency());
+	for(int nthreads = 2; nthreads <= max_threads; nthreads *= 2){
+		ConcurrentQueue<std::string> queue;
+		std::atomic<int> threads_running(0);
+		std::atomic<long> seen(0);
+		queue.push(std::string("0"));
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for(int i = 0; i < nthreads; i++)
+			threads.emplace_back(worker, std::ref(queue), std::ref(threads_running), std::ref(seen), nodes, fanout, work);
+		for(std::thread &th : threads)
+			th.join();
+		double secs = Bench::seconds_since(start);
+		if(seen != nodes){
+			printf("threads %3d: popped %ld of %ld nodes\n", nthreads, seen.load(), nodes);
+			return EXIT_FAILURE;
+		}
+		printf("threads %3d  %8.3f s  %16s\n", nthreads, secs, Bench::format_rate(nodes / secs, "nodes").c_str());
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Stress test of ConcurrentQueue for `make tsan`: repeated crawls of a
+// simulated tree wide enough to spill out of the ring, checking that every
+// node is popped exactly once and that every worker returns.
+
+#include "concurrent_queue.hpp"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+static void worker(ConcurrentQueue<long> &queue, std::atomic<int> &threads_running, std::atomic<unsigned char> *popped, long nodes, long fanout){
+	threads_running++;
+	long k;
+	while(queue.pop(k, threads_running)){
+		popped[k]++;
+		for(long c = k * fanout + 1; c <= k * fanout + fanout && c < nodes; c++){
+			if(c & 1)
+				queue.push(c);
+			else
+				queue.push(std::move(c));
+		}
+	}
+}
+
+int main(int argc, char *argv[]){
+	long nodes = (argc > 1)? atol(argv[1]) : 50000;
+	int rounds = (argc > 2)? atoi(argv[2]) : 10;
+	const long fanouts[] = {1, 2, 8, 64}; // a chain, then trees past CONCURRENT_QUEUE_CAPACITY wide
+	for(int round = 0; round < rounds; round++){
+		for(long fanout : fanouts){
+			for(int nthreads = 2; nthreads <= 32; nthreads *= 2){
+				ConcurrentQueue<long> queue;
+				std::atomic<int> threads_running(0);
+				std::unique_ptr<std::atomic<unsigned char>[]> popped(new std::atomic<unsigned char>[nodes]);
+				for(long i = 0; i < nodes; i++)
+					popped[i] = 0;
+				queue.push(0L);
+				std::vector<std::thread> threads;
+				for(int i = 0; i < nthreads; i++)
+					threads.emplace_back(worker, std::ref(queue), std::ref(threads_running), popped.get(), nodes, fanout);
+				for(std::thread &th : threads)
+					th.join();
+				for(long i = 0; i < nodes; i++){
+					if(popped[i] != 1){
+						printf("round %d, fan-out %ld, %d threads: node %ld popped %d times\n", round, fanout, nthreads, i, (int)popped[i]);
+						return EXIT_FAILURE;
+					}
+				}
+				if(!queue.empty()){
+					printf("round %d, fan-out %ld, %d threads: items left in queue\n", round, fanout, nthreads);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+	printf("%d rounds of %ld nodes, fan-out 1 to 64, 2 to 32 threads: every node popped once\n", rounds, nodes);
+	return EXIT_SUCCESS;
+}
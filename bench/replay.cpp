@@ -0,0 +1,276 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Replays crawl and sync samples through the adaptive concurrency controller
+// and prints every decision. Samples come from a daemon log written at log
+// level 2 (--trace), or from a simulated cluster that reacts to the thread and
+// process counts the controller picks. Exits non-zero if the simulated run
+// doesn't settle near the cluster's limits or a replay decides differently.
+
+#include "bench.hpp"
+#include "concurrency.hpp"
+#include "alert.hpp"
+#include <fstream>
+#include <sstream>
+
+#define SAMPLE_TAG "Adaptive concurrency sample: "
+
+struct Sample{
+	/* One crawl or one transfer as seen by the controller.
+	 */
+	bool crawl_;
+	CrawlSample crawl_sample_;
+	SyncSample sync_sample_;
+};
+
+struct Decision{
+	/* Controller state after a sample.
+	 */
+	int threads_;
+	int nproc_;
+	bool operator!=(const Decision &other) const{
+		return threads_ != other.threads_ || nproc_ != other.nproc_;
+	}
+};
+
+static std::chrono::steady_clock::duration micros(uintmax_t us){
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(us));
+}
+
+static std::chrono::steady_clock::duration seconds(double s){
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(s));
+}
+
+static uintmax_t to_micros(std::chrono::steady_clock::duration d){
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+static std::string format_sample(const Sample &sample){
+	/* Same text the daemon logs, so a recorded run replays like a real one.
+	 */
+	std::stringstream ss;
+	if(sample.crawl_)
+		ss << SAMPLE_TAG << "crawl " << sample.crawl_sample_.entries << " "
+			<< to_micros(sample.crawl_sample_.elapsed) << " " << to_micros(sample.crawl_sample_.stat_time);
+	else
+		ss << SAMPLE_TAG << "sync " << sample.sync_sample_.files << " "
+			<< sample.sync_sample_.bytes << " " << to_micros(sample.sync_sample_.elapsed);
+	return ss.str();
+}
+
+static std::vector<Sample> read_trace(const std::string &path){
+	/* Pull samples out of a daemon log, skipping every other line.
+	 */
+	std::ifstream in(path);
+	if(!in){
+		std::cerr << "Cannot open " << path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<Sample> samples;
+	std::string line;
+	while(std::getline(in, line)){
+		size_t pos = line.find(SAMPLE_TAG);
+		if(pos == std::string::npos)
+			continue;
+		std::istringstream fields(line.substr(pos + strlen(SAMPLE_TAG)));
+		std::string kind;
+		uintmax_t a, b, c;
+		if(!(fields >> kind >> a >> b >> c))
+			continue;
+		Sample sample = {};
+		if(kind == "crawl"){
+			sample.crawl_ = true;
+			sample.crawl_sample_ = {a, micros(b), micros(c)};
+		}else if(kind == "sync"){
+			sample.crawl_ = false;
+			sample.sync_sample_ = {a, b, micros(c)};
+		}else{
+			continue;
+		}
+		samples.push_back(sample);
+	}
+	return samples;
+}
+
+static Decision feed(ConcurrencyController &controller, const Sample &sample){
+	if(sample.crawl_)
+		controller.crawled(sample.crawl_sample_);
+	else
+		controller.synced(sample.sync_sample_);
+	Decision decision = {controller.threads(), controller.nproc()};
+	return decision;
+}
+
+class Cluster{
+	/* Stand-in for a CephFS source and a WAN link. Each crawler thread
+	 * stats at a fixed latency until the MDS runs out of capacity, after
+	 * which the rate stays flat and latency grows with the queue. Each
+	 * sync process moves a fixed bandwidth until the link is full, after
+	 * which extra processes cost a little from contention.
+	 */
+private:
+	double stat_latency_us_;
+	double mds_capacity_;
+	double proc_bandwidth_;
+	double link_bandwidth_;
+	double noise_;
+	std::mt19937 rng_;
+	double jitter(void){
+		return 1.0 + std::uniform_real_distribution<double>(-noise_, noise_)(rng_);
+	}
+public:
+	Cluster(double stat_latency_us, double mds_capacity, double proc_bandwidth, double link_bandwidth, double noise, unsigned seed)
+		: stat_latency_us_(stat_latency_us)
+		, mds_capacity_(mds_capacity)
+		, proc_bandwidth_(proc_bandwidth)
+		, link_bandwidth_(link_bandwidth)
+		, noise_(noise)
+		, rng_(seed){}
+	void load(double factor){
+		/* Other clients take all but 1/factor of the MDS.
+		 */
+		mds_capacity_ /= factor;
+	}
+	double thread_knee(void) const{
+		return mds_capacity_ * stat_latency_us_ / 1e6;
+	}
+	double proc_knee(void) const{
+		return link_bandwidth_ / proc_bandwidth_;
+	}
+	Sample crawl(int threads, uintmax_t entries){
+		double rate = std::min(threads * 1e6 / stat_latency_us_, mds_capacity_) * jitter();
+		double elapsed = entries / rate;
+		Sample sample = {};
+		sample.crawl_ = true;
+		// every thread is always waiting on a stat, so stat time is threads * wall time
+		sample.crawl_sample_ = {entries, seconds(elapsed), seconds(elapsed * threads)};
+		return sample;
+	}
+	Sample sync(int nproc, uintmax_t files, uintmax_t bytes){
+		double rate = std::min(nproc * proc_bandwidth_, link_bandwidth_);
+		rate *= (1.0 - 0.01 * std::max(0.0, nproc - proc_knee())) * jitter();
+		Sample sample = {};
+		sample.crawl_ = false;
+		sample.sync_sample_ = {files, bytes, seconds(bytes / rate)};
+		return sample;
+	}
+};
+
+static bool within(const std::string &what, double value, double low, double high){
+	bool ok = value >= low && value <= high;
+	printf("%-40s %6.1f  expected %.1f to %.1f  %s\n", what.c_str(), value, low, high, (ok)? "ok" : "FAIL");
+	return ok;
+}
+
+int main(int argc, char *argv[]){
+	Bench::Args args(argc, argv,
+		"[--trace LOG] [--record FILE] [--cycles N] [--threads N] [--max-threads N] [--procs N] [--max-procs N]\n"
+		"    [--stat-latency US] [--mds-capacity STATS/S] [--load FACTOR] [--entries N]\n"
+		"    [--proc-bandwidth B/S] [--link-bandwidth B/S] [--batch-bytes B] [--noise FRACTION] [--seed N] [--log-level N]");
+	int threads = args.num("threads", 4);
+	int max_threads = args.num("max-threads", 64);
+	int nproc = args.num("procs", 1);
+	int max_nproc = args.num("max-procs", 32);
+	Logging::log.set_level(args.num("log-level", 0));
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	
+	std::vector<Sample> samples;
+	std::vector<Decision> decisions;
+	std::string trace = args.str("trace", "");
+	bool ok = true;
+	if(!trace.empty()){
+		samples = read_trace(trace);
+		if(samples.empty()){
+			std::cerr << "No \"" SAMPLE_TAG "\" lines in " << trace << ", was the daemon run with Log Level = 2?" << std::endl;
+			return EXIT_FAILURE;
+		}
+		ConcurrencyController controller(threads, max_threads, nproc, max_nproc);
+		printf("%6s %-6s %8s %6s\n", "sample", "kind", "threads", "procs");
+		for(size_t i = 0; i < samples.size(); i++){
+			decisions.push_back(feed(controller, samples[i]));
+			printf("%6zu %-6s %8d %6d\n", i, (samples[i].crawl_)? "crawl" : "sync", decisions.back().threads_, decisions.back().nproc_);
+		}
+	}else{
+		int cycles = args.num("cycles", 40);
+		double load = args.real("load", 4.0);
+		uintmax_t entries = args.num("entries", 200000);
+		uintmax_t batch_bytes = Bench::parse_size(args.str("batch-bytes", "20G"));
+		Cluster cluster(
+			args.real("stat-latency", 500),
+			args.real("mds-capacity", 32000),
+			Bench::parse_size(args.str("proc-bandwidth", "50M")),
+			Bench::parse_size(args.str("link-bandwidth", "250M")),
+			args.real("noise", 0.01),
+			args.num("seed", 1)
+		);
+		ConcurrencyController controller(threads, max_threads, nproc, max_nproc);
+		printf("%5s %-6s %8s %14s %11s %6s %14s\n", "cycle", "mds", "threads", "entries/s", "latency us", "procs", "bytes/s");
+		double quiet_knee = cluster.thread_knee();
+		int quiet_threads = threads;
+		for(int cycle = 0; cycle < cycles; cycle++){
+			bool loaded = cycle >= cycles / 2;
+			if(cycle == cycles / 2){
+				quiet_threads = controller.threads();
+				cluster.load(load);
+			}
+			int crawl_threads = controller.threads();
+			samples.push_back(cluster.crawl(crawl_threads, entries));
+			decisions.push_back(feed(controller, samples.back()));
+			int sync_procs = controller.nproc();
+			samples.push_back(cluster.sync(sync_procs, entries / 20, batch_bytes));
+			decisions.push_back(feed(controller, samples.back()));
+			const CrawlSample &crawled = samples[samples.size() - 2].crawl_sample_;
+			const SyncSample &synced = samples.back().sync_sample_;
+			double crawl_secs = std::chrono::duration<double>(crawled.elapsed).count();
+			printf("%5d %-6s %8d %14s %11.0f %6d %14s\n", cycle, (loaded)? "loaded" : "quiet", crawl_threads,
+				Bench::format_rate(crawled.entries / crawl_secs, "").c_str(),
+				std::chrono::duration<double, std::micro>(crawled.stat_time).count() / crawled.entries,
+				sync_procs, Bench::format_rate(synced.bytes / std::chrono::duration<double>(synced.elapsed).count(), "B").c_str());
+		}
+		double loaded_knee = cluster.thread_knee();
+		printf("\n");
+		// hill climbing overshoots by a step and the latency check allows twice the knee
+		ok &= within("threads before load (MDS knee " + std::to_string((int)quiet_knee) + ")", quiet_threads, quiet_knee / 2, quiet_knee * 2);
+		ok &= within("threads under load (MDS knee " + std::to_string((int)loaded_knee) + ")", controller.threads(), 1, loaded_knee * 2);
+		ok &= within("processes (link knee " + std::to_string((int)cluster.proc_knee()) + ")", controller.nproc(), cluster.proc_knee() / 2, cluster.proc_knee() * 2);
+	}
+	
+	std::string record = args.str("record", "");
+	if(!record.empty()){
+		std::ofstream out(record);
+		for(const Sample &sample : samples)
+			out << format_sample(sample) << std::endl;
+	}
+	
+	// decisions depend only on the samples, so a second pass must match exactly
+	ConcurrencyController again(threads, max_threads, nproc, max_nproc);
+	size_t diverged = samples.size();
+	for(size_t i = 0; i < samples.size() && diverged == samples.size(); i++){
+		if(feed(again, samples[i]) != decisions[i])
+			diverged = i;
+	}
+	if(diverged != samples.size()){
+		printf("replay of %zu samples diverged at sample %zu  FAIL\n", samples.size(), diverged);
+		ok = false;
+	}else{
+		printf("replay of %zu samples made the same decisions  ok\n", samples.size());
+	}
+	Logging::log.flush();
+	return (ok)? EXIT_SUCCESS : EXIT_FAILURE;
+}
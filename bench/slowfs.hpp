@@ -0,0 +1,339 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <sys/statvfs.h>
+	#include <sys/mount.h>
+	#include <sys/uio.h>
+	#include <linux/fuse.h>
+}
+
+#define SLOWFS_BUFF_SIZE ((1 << 20) + 4096) // largest request plus headers
+#define SLOWFS_TTL 3600 // seconds the kernel may cache entries and attributes
+
+namespace Bench{
+	class SlowFs{
+		/* Read-only FUSE passthrough of a local directory that sleeps
+		 * before answering every read, standing in for a network
+		 * filesystem with high per-request latency such as CephFS.
+		 * Requests are served by a pool of threads, like OSDs serving
+		 * reads in parallel. Spoken straight over /dev/fuse, so there is
+		 * no libfuse dependency; mounting needs root.
+		 * Opened files keep their page cache, so data read ahead by one
+		 * process is found by the next to open the file.
+		 */
+	private:
+		std::string backing_;
+		/* Directory being mirrored.
+		 */
+		std::string mountpoint_;
+		/* Where it is mounted.
+		 */
+		std::chrono::microseconds latency_;
+		/* Added before each read is answered.
+		 */
+		int fd_;
+		/* /dev/fuse connection, -1 if not mounted.
+		 */
+		std::vector<std::thread> threads_;
+		/* Serve requests.
+		 */
+		std::mutex mutex_;
+		/* Guards paths_.
+		 */
+		std::map<uint64_t, std::string> paths_;
+		/* Backing path of each node id handed to the kernel.
+		 */
+		std::map<std::string, uint64_t> ids_;
+		/* Node id of each backing path.
+		 */
+		
+		std::string path_of(uint64_t node){
+			std::lock_guard<std::mutex> lk(mutex_);
+			std::map<uint64_t, std::string>::iterator itr = paths_.find(node);
+			return (itr == paths_.end())? std::string() : itr->second;
+		}
+		uint64_t id_of(const std::string &path){
+			std::lock_guard<std::mutex> lk(mutex_);
+			std::map<std::string, uint64_t>::iterator itr = ids_.find(path);
+			if(itr != ids_.end())
+				return itr->second;
+			uint64_t node = paths_.size() + FUSE_ROOT_ID;
+			paths_[node] = path;
+			ids_[path] = node;
+			return node;
+		}
+		static void fill_attr(const struct stat &st, struct fuse_attr &attr){
+			memset(&attr, 0, sizeof(attr));
+			attr.ino = st.st_ino;
+			attr.size = st.st_size;
+			attr.blocks = st.st_blocks;
+			attr.atime = st.st_atim.tv_sec;
+			attr.mtime = st.st_mtim.tv_sec;
+			attr.ctime = st.st_ctim.tv_sec;
+			attr.atimensec = st.st_atim.tv_nsec;
+			attr.mtimensec = st.st_mtim.tv_nsec;
+			attr.ctimensec = st.st_ctim.tv_nsec;
+			attr.mode = st.st_mode;
+			attr.nlink = st.st_nlink;
+			attr.uid = st.st_uid;
+			attr.gid = st.st_gid;
+			attr.rdev = st.st_rdev;
+			attr.blksize = st.st_blksize;
+		}
+		void reply(uint64_t unique, int error, const void *data = nullptr, size_t len = 0){
+			/* Answer request unique with -error or data.
+			 */
+			struct fuse_out_header out;
+			out.unique = unique;
+			out.error = -error;
+			out.len = sizeof(out) + ((error)? 0 : len);
+			struct iovec iov[2] = {{&out, sizeof(out)}, {(void *)data, len}};
+			if(writev(fd_, iov, (error || !len)? 1 : 2) == -1 && errno != ENOENT) // ENOENT: request was interrupted
+				perror("slowfs reply");
+		}
+		void handle(const struct fuse_in_header &in, const char *arg){
+			switch(in.opcode){
+			case FUSE_INIT:{
+				const struct fuse_init_in *init = (const struct fuse_init_in *)arg;
+				struct fuse_init_out out;
+				memset(&out, 0, sizeof(out));
+				out.major = FUSE_KERNEL_VERSION;
+				out.minor = std::min<uint32_t>(init->minor, FUSE_KERNEL_MINOR_VERSION);
+				out.max_readahead = init->max_readahead;
+				out.flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES | (init->flags & FUSE_MAX_PAGES);
+				out.max_background = 64; // readahead requests in flight
+				out.congestion_threshold = 48;
+				out.max_write = 1 << 20;
+				out.max_pages = 256;
+				out.time_gran = 1;
+				reply(in.unique, 0, &out, sizeof(out));
+				break;
+			}
+			case FUSE_LOOKUP:{
+				std::string parent = path_of(in.nodeid);
+				std::string path = parent + "/" + arg;
+				struct stat st;
+				if(parent.empty() || lstat(path.c_str(), &st) == -1){
+					reply(in.unique, ENOENT);
+					break;
+				}
+				struct fuse_entry_out out;
+				memset(&out, 0, sizeof(out));
+				out.nodeid = id_of(path);
+				out.entry_valid = out.attr_valid = SLOWFS_TTL;
+				fill_attr(st, out.attr);
+				reply(in.unique, 0, &out, sizeof(out));
+				break;
+			}
+			case FUSE_FORGET:
+			case FUSE_BATCH_FORGET:
+			case FUSE_INTERRUPT:
+				break; // no reply, ids are kept for the life of the mount
+			case FUSE_GETATTR:{
+				struct stat st;
+				std::string path = path_of(in.nodeid);
+				if(path.empty() || lstat(path.c_str(), &st) == -1){
+					reply(in.unique, ENOENT);
+					break;
+				}
+				struct fuse_attr_out out;
+				memset(&out, 0, sizeof(out));
+				out.attr_valid = SLOWFS_TTL;
+				fill_attr(st, out.attr);
+				reply(in.unique, 0, &out, sizeof(out));
+				break;
+			}
+			case FUSE_READLINK:{
+				char target[PATH_MAX];
+				ssize_t len = readlink(path_of(in.nodeid).c_str(), target, sizeof(target));
+				if(len == -1)
+					reply(in.unique, errno);
+				else
+					reply(in.unique, 0, target, len);
+				break;
+			}
+			case FUSE_OPEN:
+			case FUSE_OPENDIR:{
+				const struct fuse_open_in *open_in = (const struct fuse_open_in *)arg;
+				if((open_in->flags & O_ACCMODE) != O_RDONLY){
+					reply(in.unique, EROFS);
+					break;
+				}
+				struct fuse_open_out out;
+				memset(&out, 0, sizeof(out));
+				if(in.opcode == FUSE_OPEN){
+					int fd = open(path_of(in.nodeid).c_str(), O_RDONLY | O_CLOEXEC);
+					if(fd == -1){
+						reply(in.unique, errno);
+						break;
+					}
+					out.fh = fd;
+					out.open_flags = FOPEN_KEEP_CACHE;
+				}
+				reply(in.unique, 0, &out, sizeof(out));
+				break;
+			}
+			case FUSE_READ:{
+				const struct fuse_read_in *read_in = (const struct fuse_read_in *)arg;
+				std::this_thread::sleep_for(latency_);
+				std::vector<char> buff(read_in->size);
+				ssize_t len = pread(read_in->fh, buff.data(), buff.size(), read_in->offset);
+				if(len == -1)
+					reply(in.unique, errno);
+				else
+					reply(in.unique, 0, buff.data(), len);
+				break;
+			}
+			case FUSE_READDIR:{
+				const struct fuse_read_in *read_in = (const struct fuse_read_in *)arg;
+				DIR *dir = opendir(path_of(in.nodeid).c_str());
+				if(!dir){
+					reply(in.unique, errno);
+					break;
+				}
+				// offset is the index of the next entry
+				std::vector<char> buff(read_in->size);
+				size_t used = 0;
+				uint64_t index = 0;
+				struct dirent *entry;
+				while((entry = readdir(dir)) != NULL){
+					if(index++ < read_in->offset)
+						continue;
+					size_t namelen = strlen(entry->d_name);
+					size_t rec = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+					if(used + rec > buff.size())
+						break;
+					struct fuse_dirent *dirent = (struct fuse_dirent *)(buff.data() + used);
+					memset(dirent, 0, rec);
+					dirent->ino = entry->d_ino;
+					dirent->off = index;
+					dirent->namelen = namelen;
+					dirent->type = entry->d_type;
+					memcpy(dirent->name, entry->d_name, namelen);
+					used += rec;
+				}
+				closedir(dir);
+				reply(in.unique, 0, buff.data(), used);
+				break;
+			}
+			case FUSE_RELEASE:
+				close(((const struct fuse_release_in *)arg)->fh);
+				reply(in.unique, 0);
+				break;
+			case FUSE_RELEASEDIR:
+			case FUSE_FLUSH:
+			case FUSE_ACCESS:
+			case FUSE_DESTROY:
+				reply(in.unique, 0);
+				break;
+			case FUSE_STATFS:{
+				struct statvfs vfs;
+				if(statvfs(backing_.c_str(), &vfs) == -1){
+					reply(in.unique, errno);
+					break;
+				}
+				struct fuse_statfs_out out;
+				memset(&out, 0, sizeof(out));
+				out.st.blocks = vfs.f_blocks;
+				out.st.bfree = vfs.f_bfree;
+				out.st.bavail = vfs.f_bavail;
+				out.st.files = vfs.f_files;
+				out.st.ffree = vfs.f_ffree;
+				out.st.bsize = vfs.f_bsize;
+				out.st.namelen = vfs.f_namemax;
+				out.st.frsize = vfs.f_frsize;
+				reply(in.unique, 0, &out, sizeof(out));
+				break;
+			}
+			default:
+				reply(in.unique, ENOSYS);
+				break;
+			}
+		}
+		void serve(void){
+			std::vector<char> buff(SLOWFS_BUFF_SIZE);
+			for(;;){
+				ssize_t len = read(fd_, buff.data(), buff.size());
+				if(len == -1){
+					if(errno == EINTR || errno == EAGAIN || errno == ENOENT)
+						continue;
+					break; // ENODEV once unmounted
+				}
+				if((size_t)len < sizeof(struct fuse_in_header))
+					continue;
+				const struct fuse_in_header *in = (const struct fuse_in_header *)buff.data();
+				handle(*in, buff.data() + sizeof(*in));
+			}
+		}
+	public:
+		SlowFs(const std::string &backing, const std::string &mountpoint, std::chrono::microseconds latency, int threads)
+			: backing_(backing), mountpoint_(mountpoint), latency_(latency), fd_(-1){
+			paths_[FUSE_ROOT_ID] = backing_;
+			ids_[backing_] = FUSE_ROOT_ID;
+			int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+			if(fd == -1)
+				return;
+			std::string opts = "fd=" + std::to_string(fd) + ",rootmode=40000,user_id=0,group_id=0,default_permissions,allow_other";
+			if(mount("slowfs", mountpoint_.c_str(), "fuse.slowfs", MS_NOSUID | MS_NODEV | MS_RDONLY, opts.c_str()) == -1){
+				int err = errno;
+				close(fd);
+				errno = err;
+				return;
+			}
+			fd_ = fd;
+			for(int i = 0; i < threads; i++)
+				threads_.emplace_back(&SlowFs::serve, this);
+		}
+		/* Mount backing at mountpoint. Check mounted() afterwards, errno
+		 * says why not.
+		 */
+		~SlowFs(void){
+			if(fd_ == -1)
+				return;
+			umount2(mountpoint_.c_str(), MNT_DETACH);
+			for(std::thread &thread : threads_)
+				thread.join();
+			close(fd_);
+		}
+		/* Unmount and stop serving.
+		 */
+		bool mounted(void) const{
+			return fd_ != -1;
+		}
+		/* Returns true if mounting worked.
+		 */
+	};
+}
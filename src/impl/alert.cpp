@@ -19,31 +19,237 @@
 
 #include "alert.hpp"
 #include "signal.hpp"
-#include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <cmath>
+#include <chrono>
 #include <algorithm>
 
+extern "C" {
+	#include <unistd.h>
+	#include <errno.h>
+}
+
 namespace Logging{
 	Logger log(1);
 }
 
-Logger::Logger(int log_level){
+Logger::Logger(int log_level)
+	: log_level_(log_level)
+	, rate_limit_(0)
+	, rate_window_(0)
+	, rate_count_(0)
+	, suppressed_(0)
+	, dropped_(0)
+	, ring_(new LogEntry[LOG_RING_SIZE])
+	, enqueue_pos_(0)
+	, dequeue_pos_(0)
+	, sleeping_(false)
+	, stop_(false)
+	, owner_pid_(getpid()){
+	for(int i = 0; i < LOG_N_SUBSYSTEMS; i++)
+		subsystem_levels_[i] = -1;
+	for(size_t i = 0; i < LOG_RING_SIZE; i++)
+		ring_[i].seq_.store(i, std::memory_order_relaxed);
+	consumer_ = new std::thread(&Logger::consume, this);
+}
+
+Logger::~Logger(void){
+	if(getpid() != owner_pid_)
+		return; // forked child, consumer thread does not exist here
+	stop_ = true;
+	{
+		std::unique_lock<std::mutex> lk(mutex_);
+		wake_.notify_one();
+	}
+	consumer_->join();
+	delete consumer_;
+	delete[] ring_;
+}
+
+void Logger::set_level(int log_level){
 	log_level_ = log_level;
-	
 }
 
-void Logger::message(const std::string &msg, int lvl) const{
-	if(log_level_ >= lvl) std::cout << msg << std::endl;
+void Logger::set_level(int log_level, LogSubsystem subsystem){
+	subsystem_levels_[subsystem] = log_level;
+}
+
+void Logger::clear_subsystem_levels(void){
+	for(int i = 0; i < LOG_N_SUBSYSTEMS; i++)
+		subsystem_levels_[i] = -1;
+}
+
+void Logger::set_rate_limit(int lines_per_sec){
+	rate_limit_ = lines_per_sec;
+}
+
+bool Logger::enabled(int lvl, LogSubsystem subsystem) const{
+	int level = subsystem_levels_[subsystem].load(std::memory_order_relaxed);
+	if(level < 0)
+		level = log_level_.load(std::memory_order_relaxed);
+	return level >= lvl;
+}
+
+void Logger::push(int fd, const std::string &msg, bool droppable){
+	size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+	LogEntry *entry;
+	for(;;){
+		entry = &ring_[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = entry->seq_.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0){
+			if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}else if(diff < 0){
+			if(droppable){
+				dropped_.fetch_add(1, std::memory_order_relaxed); // full, debug output never waits for consumer
+				return;
+			}
+			if(getpid() != owner_pid_ || stop_.load(std::memory_order_relaxed)){
+				write_now(fd, msg); // no consumer to make room
+				return;
+			}
+			{
+				// checked again under the lock, the consumer notifies after freeing slots
+				std::unique_lock<std::mutex> lk(mutex_);
+				if((intptr_t)entry->seq_.load(std::memory_order_acquire) - (intptr_t)pos < 0){
+					wake_.notify_one();
+					drained_.wait_for(lk, LOG_DRAIN_PERIOD);
+				}
+			}
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}else{
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}
+	}
+	entry->fd_ = fd;
+	entry->text_.assign(msg);
+	entry->text_.push_back('\n');
+	entry->seq_.store(pos + 1, std::memory_order_release);
+	if(sleeping_.load(std::memory_order_relaxed))
+		wake_.notify_one();
+}
+
+void Logger::write_now(int fd, const std::string &msg){
+	std::string line = msg + "\n";
+	const char *ptr = line.c_str();
+	size_t left = line.length();
+	while(left){
+		ssize_t res = write(fd, ptr, left);
+		if(res == -1){
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+		ptr += res;
+		left -= res;
+	}
+}
+
+bool Logger::drain(void){
+	std::string batch;
+	int batch_fd = 1;
+	bool any = false;
+	auto write_batch = [&](){
+		const char *ptr = batch.c_str();
+		size_t left = batch.length();
+		while(left){
+			ssize_t res = write(batch_fd, ptr, left);
+			if(res == -1){
+				if(errno == EINTR)
+					continue;
+				break; // nowhere to report it
+			}
+			ptr += res;
+			left -= res;
+		}
+		batch.clear();
+	};
+	size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+	for(;;){
+		LogEntry &entry = ring_[pos & (LOG_RING_SIZE - 1)];
+		if(entry.seq_.load(std::memory_order_acquire) != pos + 1)
+			break; // empty or not yet published
+		if(entry.fd_ != batch_fd && !batch.empty())
+			write_batch(); // keep ordering between stdout and stderr
+		batch_fd = entry.fd_;
+		batch.append(entry.text_);
+		entry.seq_.store(pos + LOG_RING_SIZE, std::memory_order_release);
+		pos++;
+		any = true;
+	}
+	uintmax_t suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+	uintmax_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+	if(suppressed || dropped){
+		if(batch_fd != 2 && !batch.empty())
+			write_batch();
+		batch_fd = 2;
+		if(suppressed)
+			batch.append("Warning: " + std::to_string(suppressed) + " debug messages suppressed by Log Rate Limit\n");
+		if(dropped)
+			batch.append("Warning: " + std::to_string(dropped) + " debug messages dropped, log buffer full\n");
+	}
+	if(!batch.empty())
+		write_batch();
+	dequeue_pos_.store(pos, std::memory_order_release);
+	return any;
+}
+
+void Logger::consume(void){
+	signal_handling::block(); // started before main(), leave termination signals to the signal thread
+	for(;;){
+		bool any = drain();
+		if(any){
+			std::unique_lock<std::mutex> lk(mutex_);
+			drained_.notify_all();
+			continue;
+		}
+		if(stop_)
+			break;
+		std::unique_lock<std::mutex> lk(mutex_);
+		sleeping_ = true;
+		wake_.wait_for(lk, LOG_DRAIN_PERIOD);
+		sleeping_ = false;
+	}
+	drain();
+	std::unique_lock<std::mutex> lk(mutex_);
+	drained_.notify_all();
+}
+
+void Logger::flush(void){
+	if(getpid() != owner_pid_)
+		return;
+	size_t target = enqueue_pos_.load(std::memory_order_acquire);
+	std::unique_lock<std::mutex> lk(mutex_);
+	while(dequeue_pos_.load(std::memory_order_acquire) < target){
+		wake_.notify_one();
+		drained_.wait_for(lk, LOG_DRAIN_PERIOD);
+	}
+}
+
+void Logger::message(const std::string &msg, int lvl, LogSubsystem subsystem){
+	if(!enabled(lvl, subsystem))
+		return;
+	if(lvl >= 2 && rate_limit_.load(std::memory_order_relaxed) > 0){
+		int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t window = rate_window_.load(std::memory_order_relaxed);
+		if(window != now && rate_window_.compare_exchange_strong(window, now, std::memory_order_relaxed))
+			rate_count_.store(0, std::memory_order_relaxed);
+		if(rate_count_.fetch_add(1, std::memory_order_relaxed) >= rate_limit_.load(std::memory_order_relaxed)){
+			suppressed_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	push(1, msg, lvl >= 2);
 }
 
-void Logger::warning(const std::string &msg) const{
-	std::cerr << "Warning: " << msg << std::endl;
+void Logger::warning(const std::string &msg){
+	push(2, "Warning: " + msg, false);
 }
 
-void Logger::error(const std::string &msg) const{
-	std::cerr << "Error: " << msg << std::endl;
+void Logger::error(const std::string &msg){
+	push(2, "Error: " + msg, false);
 }
 
 #define N_INDEX 9
@@ -0,0 +1,294 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "checkpoint.hpp"
+#include "alert.hpp"
+#include <fstream>
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+}
+
+template<class T>
+static inline void put(std::string &buffer, T value){
+	buffer.append((const char *)&value, sizeof(value));
+}
+
+static inline void put_path(std::string &buffer, const char *path, size_t len){
+	put<uint32_t>(buffer, len);
+	buffer.append(path, len);
+}
+
+static inline void put_time(std::string &buffer, const timespec &time){
+	put<int64_t>(buffer, time.tv_sec);
+	put<int64_t>(buffer, time.tv_nsec);
+}
+
+template<class T>
+static inline bool get(std::istream &f, T &value){
+	return (bool)f.read((char *)&value, sizeof(value));
+}
+
+static inline bool get_path(std::istream &f, std::string &path){
+	uint32_t len;
+	if(!get(f, len) || len > (1 << 20))
+		return false;
+	path.resize(len);
+	return (bool)f.read(&path[0], len);
+}
+
+static inline bool get_time(std::istream &f, timespec &time){
+	int64_t sec, nsec;
+	if(!get(f, sec) || !get(f, nsec))
+		return false;
+	time.tv_sec = sec;
+	time.tv_nsec = nsec;
+	return true;
+}
+
+void CrawlCheckpoint::enable(const std::string &path, std::chrono::seconds interval){
+	path_ = path;
+	interval_ = interval;
+}
+
+const char *CrawlCheckpoint::rel_of(const char *path, size_t len, size_t &rel_len) const{
+	size_t start = snap_root_len_;
+	while(start < len && path[start] == '/')
+		start++;
+	if(start + 1 < len && path[start] == '.' && path[start + 1] == '/'){
+		start += 2; // /./ that splits file paths
+		while(start < len && path[start] == '/')
+			start++;
+	}
+	rel_len = len - start;
+	return path + start;
+}
+
+bool CrawlCheckpoint::load(CrawlResume &resume, std::vector<File> &files, uintmax_t &total_bytes){
+	std::ifstream f(path_, std::ios::binary);
+	if(!f)
+		return false;
+	char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+	if(!f.read(magic, sizeof(magic)) || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0)
+		return false;
+	if(
+		   !get_path(f, resume.snap_path_)
+		|| !get_time(f, resume.new_rctime_)
+		|| !get_time(f, resume.since_)
+		|| !get_time(f, resume.defer_cutoff_)
+	)
+		return false;
+	valid_len_ = f.tellg();
+	size_t snap_root_len = resume.snap_path_.length();
+	size_t files_start = files.size();
+	std::vector<std::string> found;
+	std::unordered_set<std::string> read;
+	std::vector<File> block_files;
+	std::vector<std::string> block_subdirs;
+	std::string rel;
+	std::string path;
+	char type;
+	while(f.get(type)){
+		if(type == 'F'){
+			uint64_t size, ino;
+			timespec mtime;
+			if(!get(f, size) || !get_time(f, mtime) || !get(f, ino) || !get_path(f, rel))
+				break;
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			st.st_mode = S_IFREG;
+			st.st_size = size;
+			st.st_mtim = mtime;
+			st.st_ino = ino;
+			path = resume.snap_path_ + "/" + rel;
+			block_files.emplace_back(path.c_str(), path.length(), snap_root_len, st);
+		}else if(type == 'S'){
+			if(!get_path(f, rel))
+				break;
+			block_subdirs.push_back(rel);
+		}else if(type == 'D'){
+			timespec oldest_deferred;
+			uint64_t deferred_files;
+			if(!get_path(f, rel) || !get_time(f, oldest_deferred) || !get(f, deferred_files))
+				break;
+			// block complete
+			read.insert(rel);
+			for(std::string &subdir : block_subdirs)
+				found.push_back(std::move(subdir));
+			block_subdirs.clear();
+			for(File &file : block_files){
+				total_bytes += file.size();
+				files.emplace_back(std::move(file));
+			}
+			block_files.clear();
+			if(deferred_files){
+				if(!resume.deferred_files_ || resume.oldest_deferred_ > oldest_deferred)
+					resume.oldest_deferred_ = oldest_deferred;
+				resume.deferred_files_ = std::max(resume.deferred_files_, (uintmax_t)deferred_files);
+			}
+			valid_len_ = f.tellg();
+		}else{
+			break;
+		}
+	}
+	// directories found but never read, the root if nothing was
+	resume.frontier_.clear();
+	if(!read.count(""))
+		resume.frontier_.push_back(resume.snap_path_);
+	for(const std::string &subdir : found){
+		if(!read.count(subdir))
+			resume.frontier_.push_back(resume.snap_path_ + "/" + subdir);
+	}
+	Logging::log.message(
+		"Loaded crawl checkpoint " + path_ + ": " + std::to_string(files.size() - files_start) + " files queued, "
+		+ std::to_string(resume.frontier_.size()) + " directories left", 2, LOG_CRAWLER
+	);
+	return true;
+}
+
+void CrawlCheckpoint::begin(const std::string &snap_path, const timespec &new_rctime, const timespec &since, const timespec &defer_cutoff){
+	std::lock_guard<std::mutex> lk(mutex_);
+	fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd_ == -1){
+		int err = errno;
+		Logging::log.warning("Error creating crawl checkpoint " + path_ + ": " + strerror(err));
+		return;
+	}
+	open_ = true;
+	snap_root_len_ = snap_path.length();
+	buffer_.clear();
+	buffer_.append(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) - 1);
+	put_path(buffer_, snap_path.c_str(), snap_path.length());
+	put_time(buffer_, new_rctime);
+	put_time(buffer_, since);
+	put_time(buffer_, defer_cutoff);
+	write_out(true);
+}
+
+void CrawlCheckpoint::resume(const std::string &snap_path){
+	std::lock_guard<std::mutex> lk(mutex_);
+	fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(fd_ == -1){
+		int err = errno;
+		Logging::log.warning("Error opening crawl checkpoint " + path_ + ": " + strerror(err));
+		return;
+	}
+	open_ = true;
+	snap_root_len_ = snap_path.length();
+	buffer_.clear();
+	last_flush_ = std::chrono::steady_clock::now();
+	if(ftruncate(fd_, valid_len_) == -1){ // drop a torn block so new ones follow complete ones
+		int err = errno;
+		fail("Error truncating crawl checkpoint " + path_ + ": " + strerror(err));
+	}
+}
+
+void CrawlCheckpoint::record(const std::string &dir, const std::vector<File> &files, const std::vector<std::string> &subdirs, const timespec &oldest_deferred, uintmax_t deferred_files){
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(fd_ == -1)
+		return;
+	size_t rel_len;
+	const char *rel;
+	for(const File &file : files){
+		buffer_.push_back('F');
+		put<uint64_t>(buffer_, file.size());
+		put_time(buffer_, file.rctime());
+		put<uint64_t>(buffer_, file.ino());
+		rel = rel_of(file.path(), file.path_len(), rel_len);
+		put_path(buffer_, rel, rel_len);
+	}
+	for(const std::string &subdir : subdirs){
+		buffer_.push_back('S');
+		rel = rel_of(subdir.c_str(), subdir.length(), rel_len);
+		put_path(buffer_, rel, rel_len);
+	}
+	buffer_.push_back('D');
+	rel = rel_of(dir.c_str(), dir.length(), rel_len);
+	put_path(buffer_, rel, rel_len);
+	put_time(buffer_, oldest_deferred);
+	put<uint64_t>(buffer_, deferred_files);
+	bool flush = std::chrono::steady_clock::now() - last_flush_ >= interval_;
+	if(flush || buffer_.size() >= CHECKPOINT_WRITE_BYTES)
+		write_out(flush);
+}
+
+bool CrawlCheckpoint::write_out(bool flush){
+	const char *data = buffer_.data();
+	size_t left = buffer_.size();
+	while(left){
+		ssize_t written = write(fd_, data, left);
+		if(written == -1){
+			int err = errno;
+			if(err == EINTR)
+				continue;
+			fail("Error writing crawl checkpoint " + path_ + ": " + strerror(err));
+			return false;
+		}
+		data += written;
+		left -= written;
+	}
+	buffer_.clear();
+	if(flush){
+		if(fdatasync(fd_) == -1){
+			int err = errno;
+			fail("Error flushing crawl checkpoint " + path_ + ": " + strerror(err));
+			return false;
+		}
+		last_flush_ = std::chrono::steady_clock::now();
+	}
+	return true;
+}
+
+void CrawlCheckpoint::fail(const std::string &msg){
+	Logging::log.warning(msg + ". Crawl will start over if interrupted.");
+	close(fd_);
+	fd_ = -1;
+	unlink(path_.c_str());
+	open_ = false;
+	buffer_.clear();
+}
+
+void CrawlCheckpoint::finish(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(fd_ == -1)
+		return;
+	if(!write_out(true))
+		return;
+	close(fd_);
+	fd_ = -1;
+}
+
+void CrawlCheckpoint::remove(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(fd_ != -1){
+		close(fd_);
+		fd_ = -1;
+	}
+	buffer_.clear();
+	if(unlink(path_.c_str()) == -1 && errno != ENOENT){
+		int err = errno;
+		Logging::log.warning("Error removing crawl checkpoint " + path_ + ": " + strerror(err));
+	}
+	open_ = false;
+}
@@ -0,0 +1,721 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chunker.hpp"
+#include "delta.hpp"
+#include "file.hpp"
+#include "alert.hpp"
+#include <thread>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <boost/filesystem.hpp>
+
+extern "C" {
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <signal.h>
+	#include <sys/wait.h>
+	#include <pwd.h>
+	#include <grp.h>
+}
+
+// formats that are already compressed
+static const char *incompressible_exts[] = {
+	"7z", "aac", "avi", "bz2", "flac", "gif", "gz", "heic", "jpeg", "jpg", "lz4", "lzma", "m4a", "m4v",
+	"mkv", "mov", "mp3", "mp4", "ogg", "opus", "png", "rar", "tgz", "txz", "webm", "webp", "xz", "zip", "zst"
+};
+
+ChunkedTransfer::ChunkedTransfer(uintmax_t chunk_size, int nproc)
+	: chunk_size_(chunk_size), nproc_(nproc), bandwidth_(0), block_size_(0)
+	, codec_(CODEC_NONE), level_(0), owner_(false), group_(false), numeric_ids_(false){}
+
+void ChunkedTransfer::set_nproc(int nproc){
+	nproc_ = nproc;
+}
+
+void ChunkedTransfer::set_compression(Codec codec, int level){
+	codec_ = codec;
+	level_ = level;
+	std::vector<Codec> needed;
+	if(codec == CODEC_AUTO){
+		needed.push_back(CODEC_ZSTD);
+		needed.push_back(CODEC_LZ4);
+	}else if(codec != CODEC_NONE){
+		needed.push_back(codec);
+	}
+	for(Codec c : needed){
+		char *argv[] = {(char *)codec_name(c), (char *)"-V", NULL};
+		int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		pid_t pid = spawn(argv, -1, null_fd);
+		if(null_fd != -1)
+			close(null_fd);
+		if(pid == -1 || wait_exit(pid) != 0){
+			Logging::log.warning(std::string(codec_name(c)) + " not found, ranges will be sent uncompressed.");
+			codec_ = CODEC_NONE;
+		}
+	}
+}
+
+const char *ChunkedTransfer::codec_name(Codec codec){
+	switch(codec){
+	case CODEC_LZ4:
+		return "lz4";
+	case CODEC_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+ChunkedTransfer::Codec ChunkedTransfer::choose_codec(const File &file, Codec codec){
+	if(codec == CODEC_NONE)
+		return CODEC_NONE;
+	
+	// skip known compressed formats without reading them
+	const char *name = strrchr(file.path(), '/');
+	const char *ext = strrchr((name)? name : file.path(), '.');
+	if(ext){
+		std::string lower(ext + 1);
+		for(char &c : lower)
+			c = tolower(c);
+		for(const char *skip : incompressible_exts)
+			if(lower == skip)
+				return CODEC_NONE;
+	}
+	
+	// estimate compressibility from byte entropy of samples spread over the file
+	int fd = open(file.path(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return CODEC_NONE;
+	std::vector<char> buff(COMPRESS_SAMPLE_SIZE);
+	uintmax_t counts[256] = {0};
+	uintmax_t total = 0;
+	uintmax_t stride = file.size() / COMPRESS_SAMPLES;
+	for(int i = 0; i < COMPRESS_SAMPLES; i++){
+		ssize_t got = pread(fd, buff.data(), buff.size(), i * stride);
+		if(got <= 0)
+			break;
+		for(ssize_t j = 0; j < got; j++)
+			counts[(unsigned char)buff[j]]++;
+		total += got;
+	}
+	close(fd);
+	if(total == 0)
+		return CODEC_NONE;
+	double entropy = 0.0;
+	for(uintmax_t count : counts){
+		if(count == 0)
+			continue;
+		double p = (double)count / total;
+		entropy -= p * log2(p);
+	}
+	if(entropy > ENTROPY_FAST)
+		return CODEC_NONE;
+	if(codec == CODEC_AUTO)
+		return (entropy < ENTROPY_STRONG)? CODEC_ZSTD : CODEC_LZ4; // fast codec for data that barely shrinks
+	return codec;
+}
+
+ChunkedTransfer::Codec ChunkedTransfer::pick_codec(const File &file, const Destination &dest){
+	if(codec_ == CODEC_NONE || dest.host_.empty())
+		return CODEC_NONE;
+	Codec codec = choose_codec(file, codec_);
+	if(codec == CODEC_NONE)
+		return CODEC_NONE;
+	
+	// destination has to be able to decompress
+	std::string key = dest.host_ + "/" + codec_name(codec);
+	std::map<std::string, bool>::iterator known = remote_codecs_.find(key);
+	if(known == remote_codecs_.end()){
+		int ret = run_remote(dest, std::string("command -v ") + codec_name(codec) + " >/dev/null");
+		if(ret == 255)
+			return CODEC_NONE; // unreachable, ask again next time
+		if(ret != 0)
+			Logging::log.warning(std::string(codec_name(codec)) + " not found on " + dest.host_ + ", sending uncompressed.");
+		known = remote_codecs_.insert(std::make_pair(key, ret == 0)).first;
+	}
+	return (known->second)? codec : CODEC_NONE;
+}
+
+void ChunkedTransfer::enable_delta(uintmax_t block_size, const std::string &sig_dir){
+	block_size_ = block_size;
+	sig_dir_ = sig_dir;
+	chunk_size_ = (chunk_size_ + block_size_ - 1) / block_size_ * block_size_; // ranges start on block boundaries
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(sig_dir_, ec);
+	if(ec)
+		Logging::log.warning("Error creating " + sig_dir_ + ": " + ec.message());
+}
+
+void ChunkedTransfer::set_flags(const std::string &flags){
+	std::istringstream ss(flags);
+	std::string flag;
+	while(ss >> flag){
+		if(flag == "--archive"){
+			owner_ = group_ = true;
+		}else if(flag == "--owner" || flag == "--no-owner" || flag == "--no-o"){
+			owner_ = (flag == "--owner");
+		}else if(flag == "--group" || flag == "--no-group" || flag == "--no-g"){
+			group_ = (flag == "--group");
+		}else if(flag == "--numeric-ids"){
+			numeric_ids_ = true;
+		}else if(flag.length() > 1 && flag[0] == '-' && flag[1] != '-'){
+			for(char c : flag.substr(1)){
+				if(c == 'a' || c == 'o')
+					owner_ = true;
+				if(c == 'a' || c == 'g')
+					group_ = true;
+			}
+		}
+	}
+}
+
+bool ChunkedTransfer::supported(const Destination &dest){
+	return !dest.host_.empty() || !dest.path_.empty(); // an empty target leaves the destination to the flags
+}
+
+ChunkedTransfer::Result ChunkedTransfer::send(const File &file, const Destination &dest, bool delta){
+	const char *rel = strstr(file.path(), "/./");
+	rel = (rel)? rel + 3 : file.path();
+	std::string final_path = ((dest.path_.empty())? std::string(".") : dest.path_) + "/" + rel;
+	
+	struct stat src_st;
+	if(stat(file.path(), &src_st) == -1){
+		int err = errno;
+		Logging::log.error("Error calling stat on " + std::string(file.path()) + ": " + strerror(err));
+		return FAILED;
+	}
+	
+	Job job;
+	job.src_ = file.path();
+	job.dest_ = &dest;
+	job.size_ = src_st.st_size;
+	job.hashes_ = nullptr;
+	job.codec_ = pick_codec(file, dest);
+	job.ssh_failed_ = 0;
+	job.failed_ = 0;
+	
+	// ranges count as nproc_ sync processes against Bandwidth Limit
+	Limits::bandwidth.set_slots(this, nproc_);
+	bandwidth_.set_rate(Limits::bandwidth.grant(this, nproc_));
+	Result res = (delta && block_size_)? send_delta(job, src_st, rel, final_path) : send_full(job, src_st, rel, final_path);
+	Limits::bandwidth.release_all(this);
+	return res;
+}
+
+ChunkedTransfer::Result ChunkedTransfer::send_full(Job &job, const struct stat &src_st, const std::string &rel, const std::string &final_path){
+	const Destination &dest = *job.dest_;
+	size_t slash = final_path.rfind('/');
+	std::string dir = final_path.substr(0, slash);
+	job.out_path_ = dir + "/." + final_path.substr(slash + 1) + CHUNK_PART_SUFFIX;
+	job.ranges_.clear();
+	for(uintmax_t offset = 0; offset < job.size_; offset += chunk_size_)
+		job.ranges_.emplace_back(offset, std::min(chunk_size_, job.size_ - offset));
+	
+	// with delta mode, hash blocks on the way through for the next send
+	BlockSignatures sig;
+	if(block_size_){
+		sig.rel_path_ = rel;
+		sig.size_ = job.size_;
+		sig.mtime_ = src_st.st_mtim;
+		sig.block_size_ = block_size_;
+		sig.hashes_.resize(sig.blocks());
+		job.hashes_ = &sig.hashes_;
+	}
+	
+	Logging::log.message(
+		"Sending " + rel + " (" + Logging::log.format_bytes(job.size_) + ") to " + dest.target_
+		+ " in " + std::to_string(job.ranges_.size()) + " ranges"
+		+ ((job.codec_ != CODEC_NONE)? std::string(" with ") + codec_name(job.codec_) : std::string()) + ".", 1, LOG_SYNCER
+	);
+	
+	// create sparse temporary file of full size for ranges to land in
+	if(dest.host_.empty()){
+		boost::system::error_code ec;
+		boost::filesystem::create_directories(dir, ec);
+		int fd = open(job.out_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if(fd == -1 || ftruncate(fd, job.size_) == -1){
+			int err = errno;
+			Logging::log.error("Error creating " + job.out_path_ + ": " + strerror(err));
+			if(fd != -1)
+				close(fd);
+			return FAILED;
+		}
+		close(fd);
+	}else{
+		int ret = run_remote(dest, "mkdir -p " + shell_quote(dir) + " && : > " + shell_quote(job.out_path_) + " && truncate -s " + std::to_string(job.size_) + " " + shell_quote(job.out_path_));
+		if(ret != 0){
+			Logging::log.warning("Failed to create " + job.out_path_ + " on " + dest.host_ + ".");
+			return (ret == 255)? UNREACHABLE : FAILED;
+		}
+	}
+	
+	job.digests_.assign(job.ranges_.size(), std::string());
+	run_workers(job, &ChunkedTransfer::copy_ranges, job.ranges_.size());
+	
+	if(job.failed_ || !finish(job, src_st, final_path)){
+		if(dest.host_.empty())
+			unlink(job.out_path_.c_str());
+		else if(!job.ssh_failed_)
+			run_remote(dest, "rm -f " + shell_quote(job.out_path_));
+		Logging::log.warning("Failed to send " + rel + " to " + dest.target_ + " in ranges.");
+		return (job.ssh_failed_)? UNREACHABLE : FAILED;
+	}
+	if(block_size_)
+		sig.save(signature_path(src_st, dest));
+	Logging::log.message("Sent " + rel + " to " + dest.target_ + ".", 2, LOG_SYNCER);
+	return SENT;
+}
+
+ChunkedTransfer::Result ChunkedTransfer::send_delta(Job &job, const struct stat &src_st, const std::string &rel, const std::string &final_path){
+	const Destination &dest = *job.dest_;
+	std::string sig_path = signature_path(src_st, dest);
+	BlockSignatures old_sig;
+	if(!old_sig.load(sig_path) || old_sig.block_size_ != block_size_ || old_sig.rel_path_ != rel)
+		return send_full(job, src_st, rel, final_path);
+	
+	// destination must still hold what was last sent before it is patched in place
+	if(dest.host_.empty()){
+		struct stat st;
+		if(stat(final_path.c_str(), &st) == -1 || (uintmax_t)st.st_size != old_sig.size_ || truncate(final_path.c_str(), job.size_) == -1)
+			return send_full(job, src_st, rel, final_path);
+	}else{
+		int ret = run_remote(dest,
+			"[ \"$(stat -c %s " + shell_quote(final_path) + ")\" = " + std::to_string(old_sig.size_) + " ]"
+			" && truncate -s " + std::to_string(job.size_) + " " + shell_quote(final_path)
+		);
+		if(ret == 255)
+			return UNREACHABLE;
+		if(ret != 0)
+			return send_full(job, src_st, rel, final_path);
+	}
+	job.out_path_ = final_path;
+	
+	BlockSignatures sig;
+	sig.rel_path_ = rel;
+	sig.size_ = job.size_;
+	sig.mtime_ = src_st.st_mtim;
+	sig.block_size_ = block_size_;
+	if(old_sig.size_ == sig.size_ && old_sig.mtime_.tv_sec == sig.mtime_.tv_sec && old_sig.mtime_.tv_nsec == sig.mtime_.tv_nsec){
+		sig.hashes_ = old_sig.hashes_; // content unchanged, only refresh mode
+	}else{
+		sig.hashes_.resize(sig.blocks());
+		job.hashes_ = &sig.hashes_;
+		job.next_ = 0;
+		run_workers(job, &ChunkedTransfer::hash_blocks, sig.hashes_.size());
+		job.hashes_ = nullptr;
+		if(job.failed_)
+			return FAILED;
+	}
+	
+	// merge runs of changed blocks into ranges of at most chunk_size_
+	uintmax_t changed = 0;
+	job.ranges_.clear();
+	for(uintmax_t i = 0; i < sig.hashes_.size(); i++){
+		if(i < old_sig.hashes_.size() && sig.hashes_[i] == old_sig.hashes_[i])
+			continue;
+		changed++;
+		uintmax_t offset = i * block_size_;
+		uintmax_t len = std::min(block_size_, job.size_ - offset);
+		if(!job.ranges_.empty() && job.ranges_.back().first + job.ranges_.back().second == offset
+		&& job.ranges_.back().second + len <= chunk_size_)
+			job.ranges_.back().second += len;
+		else
+			job.ranges_.emplace_back(offset, len);
+	}
+	
+	Logging::log.message(
+		"Sending " + std::to_string(changed) + " of " + std::to_string(sig.hashes_.size()) + " blocks of " + rel
+		+ " (" + Logging::log.format_bytes(changed * block_size_) + ") to " + dest.target_
+		+ ((job.codec_ != CODEC_NONE)? std::string(" with ") + codec_name(job.codec_) : std::string()) + ".", 1, LOG_SYNCER
+	);
+	
+	job.digests_.assign(job.ranges_.size(), std::string());
+	run_workers(job, &ChunkedTransfer::copy_ranges, job.ranges_.size());
+	
+	if(job.failed_ || !finish(job, src_st, final_path)){
+		// signatures are left as they were, so changed blocks are sent again next time
+		Logging::log.warning("Failed to send changed blocks of " + rel + " to " + dest.target_ + ".");
+		return (job.ssh_failed_)? UNREACHABLE : FAILED;
+	}
+	sig.save(sig_path);
+	Logging::log.message("Sent " + rel + " to " + dest.target_ + ".", 2, LOG_SYNCER);
+	return SENT;
+}
+
+void ChunkedTransfer::run_workers(Job &job, void (ChunkedTransfer::*worker)(Job &), uintmax_t items){
+	job.next_ = 0;
+	int nthreads = std::max(1, (int)std::min((uintmax_t)nproc_, items));
+	std::vector<std::thread> threads;
+	for(int i = 0; i < nthreads; i++)
+		threads.emplace_back(worker, this, std::ref(job));
+	for(std::thread &thread : threads)
+		thread.join();
+}
+
+bool ChunkedTransfer::set_owner(const Job &job, const struct stat &src_st) const{
+	if(!owner_ && !group_)
+		return true;
+	if(lchown(job.out_path_.c_str(), (owner_)? src_st.st_uid : (uid_t)-1, (group_)? src_st.st_gid : (gid_t)-1) == 0)
+		return true;
+	int err = errno;
+	if(err == EPERM && geteuid() != 0)
+		return true;
+	Logging::log.error("Error setting owner of " + job.out_path_ + ": " + strerror(err));
+	return false;
+}
+
+std::string ChunkedTransfer::owner_spec(const struct stat &src_st) const{
+	std::string spec;
+	std::vector<char> buff(16384);
+	if(owner_){
+		struct passwd pw, *found = NULL;
+		if(!numeric_ids_)
+			getpwuid_r(src_st.st_uid, &pw, buff.data(), buff.size(), &found);
+		spec = (found)? std::string(found->pw_name) : std::to_string(src_st.st_uid);
+	}
+	if(group_){
+		struct group gr, *found = NULL;
+		if(!numeric_ids_)
+			getgrgid_r(src_st.st_gid, &gr, buff.data(), buff.size(), &found);
+		spec += ":" + ((found)? std::string(found->gr_name) : std::to_string(src_st.st_gid));
+	}
+	return spec;
+}
+
+std::string ChunkedTransfer::verify_script(const Job &job) const{
+	std::ostringstream script;
+	script << "v(){ [ \"$(dd if=" << shell_quote(job.out_path_) << " bs=1M skip=$1 count=$2 iflag=skip_bytes,count_bytes status=none | "
+		CHUNK_DIGEST_PROG ")\" = \"$3  -\" ] || exit " << CHUNK_MISMATCH_EXIT << "; }\n";
+	for(size_t i = 0; i < job.ranges_.size(); i++)
+		script << "v " << job.ranges_[i].first << " " << job.ranges_[i].second << " " << job.digests_[i] << "\n";
+	return script.str();
+}
+
+bool ChunkedTransfer::finish(Job &job, const struct stat &src_st, const std::string &final_path){
+	bool temporary = (job.out_path_ != final_path);
+	if(job.dest_->host_.empty()){
+		struct stat st;
+		timespec times[2] = {{0, UTIME_OMIT}, src_st.st_mtim};
+		if(stat(job.out_path_.c_str(), &st) == -1 || (uintmax_t)st.st_size != job.size_)
+			return false;
+		int ret = run_script(*job.dest_, verify_script(job));
+		if(ret == CHUNK_MISMATCH_EXIT)
+			Logging::log.warning("Ranges of " + job.out_path_ + " do not match " + job.src_ + ".");
+		return ret == 0 && set_owner(job, src_st) // before chmod, which chown would undo for setuid bits
+			&& chmod(job.out_path_.c_str(), src_st.st_mode & 07777) == 0
+			&& utimensat(AT_FDCWD, job.out_path_.c_str(), times, 0) == 0
+			&& (!temporary || rename(job.out_path_.c_str(), final_path.c_str()) == 0);
+	}
+	std::ostringstream cmd;
+	char nsec[10];
+	snprintf(nsec, sizeof(nsec), "%09ld", src_st.st_mtim.tv_nsec);
+	cmd << "[ \"$(stat -c %s " << shell_quote(job.out_path_) << ")\" = " << job.size_ << " ] || exit 1\n"
+		<< verify_script(job);
+	if(owner_ || group_){
+		// only enforced as root, like rsync
+		cmd << "{ chown " << shell_quote(owner_spec(src_st)) << " " << shell_quote(job.out_path_) << " || [ \"$(id -u)\" != 0 ]; } && ";
+	}
+	cmd << "chmod " << std::oct << (src_st.st_mode & 07777) << std::dec << " " << shell_quote(job.out_path_)
+		<< " && touch -m -d @" << src_st.st_mtim.tv_sec << "." << nsec << " " << shell_quote(job.out_path_);
+	if(temporary)
+		cmd << " && mv -f " << shell_quote(job.out_path_) << " " << shell_quote(final_path);
+	cmd << "\n";
+	int ret = run_script(*job.dest_, cmd.str());
+	if(ret == 255)
+		job.ssh_failed_ = 1;
+	else if(ret == CHUNK_MISMATCH_EXIT)
+		Logging::log.warning("Ranges of " + job.out_path_ + " on " + job.dest_->host_ + " do not match " + job.src_ + ".");
+	return ret == 0;
+}
+
+std::string ChunkedTransfer::signature_path(const struct stat &src_st, const Destination &dest) const{
+	return sig_dir_ + "/" + std::to_string(src_st.st_ino) + "." + dest.file_name() + ".sig";
+}
+
+void ChunkedTransfer::copy_ranges(Job &job){
+	// a dead ssh should fail the write with EPIPE, not kill the daemon
+	sigset_t sigpipe;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+	
+	bool local = job.dest_->host_.empty();
+	int src_fd = open(job.src_, O_RDONLY | O_CLOEXEC);
+	int dst_fd = -1;
+	if(local)
+		dst_fd = open(job.out_path_.c_str(), O_WRONLY | O_CLOEXEC);
+	if(src_fd == -1 || (local && dst_fd == -1)){
+		int err = errno;
+		Logging::log.error("Error opening file for ranged copy: " + std::string(strerror(err)));
+		job.failed_ = 1;
+	}
+	while(!job.failed_){
+		uintmax_t idx = job.next_++;
+		if(idx >= job.ranges_.size())
+			break;
+		if(!copy_range(job, idx, src_fd, dst_fd))
+			job.failed_ = 1;
+	}
+	if(src_fd != -1)
+		close(src_fd);
+	if(dst_fd != -1)
+		close(dst_fd);
+}
+
+bool ChunkedTransfer::copy_range(Job &job, uintmax_t idx, int src_fd, int dst_fd){
+	uintmax_t offset = job.ranges_[idx].first;
+	uintmax_t len = job.ranges_[idx].second;
+	
+	// data -> hasher -> digest, fed alongside the destination so the source is read once
+	int data_pipe[2];
+	int digest_pipe[2];
+	if(pipe2(data_pipe, O_CLOEXEC) == -1){
+		int err = errno;
+		Logging::log.error(std::string("Error creating pipe: ") + strerror(err));
+		return false;
+	}
+	if(pipe2(digest_pipe, O_CLOEXEC) == -1){
+		int err = errno;
+		Logging::log.error(std::string("Error creating pipe: ") + strerror(err));
+		close(data_pipe[0]);
+		close(data_pipe[1]);
+		return false;
+	}
+	char *hash_argv[] = {(char *)CHUNK_DIGEST_PROG, NULL};
+	pid_t hash_pid = spawn(hash_argv, data_pipe[0], digest_pipe[1]);
+	close(data_pipe[0]);
+	close(digest_pipe[1]);
+	bool ok = (hash_pid != -1) && ((dst_fd != -1)?
+		copy_fd(job, src_fd, dst_fd, offset, len, true, data_pipe[1])
+		: copy_remote(job, src_fd, offset, len, data_pipe[1]));
+	close(data_pipe[1]);
+	char digest[CHUNK_DIGEST_LEN];
+	size_t got = 0;
+	while(got < CHUNK_DIGEST_LEN){
+		ssize_t ret = read(digest_pipe[0], digest + got, CHUNK_DIGEST_LEN - got);
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+		got += ret;
+	}
+	close(digest_pipe[0]);
+	if(hash_pid > 0 && (wait_exit(hash_pid) != 0 || got != CHUNK_DIGEST_LEN)){
+		Logging::log.error("Error hashing range of " + std::string(job.src_) + " with " CHUNK_DIGEST_PROG ".");
+		ok = false;
+	}
+	if(ok)
+		job.digests_[idx].assign(digest, CHUNK_DIGEST_LEN);
+	return ok;
+}
+
+void ChunkedTransfer::hash_blocks(Job &job){
+	int src_fd = open(job.src_, O_RDONLY | O_CLOEXEC);
+	if(src_fd == -1){
+		int err = errno;
+		Logging::log.error("Error opening " + std::string(job.src_) + ": " + strerror(err));
+		job.failed_ = 1;
+		return;
+	}
+	std::vector<char> buff(block_size_);
+	while(!job.failed_){
+		uintmax_t idx = job.next_++;
+		if(idx >= job.hashes_->size())
+			break;
+		uintmax_t offset = idx * block_size_;
+		size_t len = std::min(block_size_, job.size_ - offset);
+		if(!read_full(src_fd, buff.data(), len, offset)){
+			job.failed_ = 1;
+			break;
+		}
+		(*job.hashes_)[idx] = block_hash(buff.data(), len);
+	}
+	close(src_fd);
+}
+
+bool ChunkedTransfer::copy_remote(Job &job, int src_fd, uintmax_t offset, uintmax_t len, int tee_fd){
+	std::string cmd = "dd of=" + shell_quote(job.out_path_) + " bs=1M seek=" + std::to_string(offset) + " oflag=seek_bytes conv=notrunc status=none";
+	std::string level = "-" + std::to_string(level_);
+	char *comp_argv[] = {(char *)codec_name(job.codec_), (char *)"-c", (char *)"-q", (level_)? (char *)level.c_str() : NULL, NULL};
+	if(job.codec_ != CODEC_NONE){
+		// decompress in front of dd, failing if the decompressor does
+		cmd = std::string("s=$( { { ") + codec_name(job.codec_) + " -dc; echo $? >&3; } | " + cmd + " >&2; } 3>&1 ) && [ \"$s\" = 0 ]";
+	}
+	std::string host = job.dest_->host_;
+	char *ssh_argv[] = {(char *)"ssh", (char *)host.c_str(), (char *)cmd.c_str(), NULL};
+	
+	// data -> [compressor ->] ssh
+	int data_pipe[2];
+	int comp_pipe[2] = {-1, -1};
+	if(pipe2(data_pipe, O_CLOEXEC) == -1 || (job.codec_ != CODEC_NONE && pipe2(comp_pipe, O_CLOEXEC) == -1)){
+		int err = errno;
+		Logging::log.error(std::string("Error creating pipe: ") + strerror(err));
+		return false;
+	}
+	int ssh_in = (job.codec_ != CODEC_NONE)? comp_pipe[0] : data_pipe[0];
+	pid_t ssh_pid = spawn(ssh_argv, ssh_in, -1);
+	pid_t comp_pid = (job.codec_ != CODEC_NONE)? spawn(comp_argv, data_pipe[0], comp_pipe[1]) : 0;
+	close(data_pipe[0]);
+	if(job.codec_ != CODEC_NONE){
+		close(comp_pipe[0]);
+		close(comp_pipe[1]);
+	}
+	bool ok = (ssh_pid != -1 && comp_pid != -1) && copy_fd(job, src_fd, data_pipe[1], offset, len, false, tee_fd);
+	close(data_pipe[1]);
+	if(comp_pid > 0)
+		ok = (wait_exit(comp_pid) == 0) && ok;
+	if(ssh_pid > 0){
+		int ret = wait_exit(ssh_pid);
+		if(ret == 255)
+			job.ssh_failed_ = 1;
+		ok = (ret == 0) && ok;
+	}
+	return ok;
+}
+
+pid_t ChunkedTransfer::spawn(char *const argv[], int in_fd, int out_fd) const{
+	pid_t pid = fork();
+	if(pid == -1){
+		int err = errno;
+		Logging::log.error(std::string("Forking failed: ") + strerror(err));
+		return -1;
+	}
+	if(pid == 0){
+		sigset_t all;
+		sigfillset(&all);
+		sigprocmask(SIG_UNBLOCK, &all, NULL);
+		signal(SIGINT, SIG_DFL);
+		if(in_fd != -1)
+			dup2(in_fd, 0);
+		if(out_fd != -1)
+			dup2(out_fd, 1);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+int ChunkedTransfer::wait_exit(pid_t pid) const{
+	int wstatus;
+	while(waitpid(pid, &wstatus, 0) == -1){
+		if(errno != EINTR)
+			return -1;
+	}
+	return (WIFEXITED(wstatus))? WEXITSTATUS(wstatus) : -1;
+}
+
+bool ChunkedTransfer::copy_fd(Job &job, int src_fd, int out_fd, uintmax_t offset, uintmax_t len, bool positional, int tee_fd){
+	// read whole blocks when hashing, ranges start on block boundaries
+	std::vector<char> buff((job.hashes_)? block_size_ : CHUNK_BUFF_SIZE);
+	uintmax_t done = 0;
+	while(done < len && !job.failed_){
+		size_t want = std::min((uintmax_t)buff.size(), len - done);
+		bandwidth_.acquire(want);
+		if(!read_full(src_fd, buff.data(), want, offset + done))
+			return false;
+		if(job.hashes_)
+			(*job.hashes_)[(offset + done) / block_size_] = block_hash(buff.data(), want);
+		if(!write_full(job, out_fd, buff.data(), want, offset + done, positional)
+		|| (tee_fd != -1 && !write_full(job, tee_fd, buff.data(), want, 0, false)))
+			return false;
+		done += want;
+	}
+	return done == len;
+}
+
+bool ChunkedTransfer::write_full(const Job &job, int fd, const char *buff, size_t len, uintmax_t offset, bool positional) const{
+	size_t written = 0;
+	while(written < len){
+		ssize_t ret = (positional)?
+			pwrite(fd, buff + written, len - written, offset + written)
+			: write(fd, buff + written, len - written);
+		if(ret == -1){
+			if(errno == EINTR)
+				continue;
+			if(errno != EPIPE){
+				int err = errno;
+				Logging::log.error("Error writing range of " + std::string(job.src_) + ": " + strerror(err));
+			}
+			return false;
+		}
+		written += ret;
+	}
+	return true;
+}
+
+bool ChunkedTransfer::read_full(int fd, char *buff, size_t len, uintmax_t offset) const{
+	size_t got = 0;
+	while(got < len){
+		ssize_t ret = pread(fd, buff + got, len - got, offset + got);
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret <= 0){
+			int err = (ret == 0)? EIO : errno; // file shrank under us
+			Logging::log.error("Error reading source file: " + std::string(strerror(err)));
+			return false;
+		}
+		got += ret;
+	}
+	return true;
+}
+
+int ChunkedTransfer::run_script(const Destination &dest, const std::string &script) const{
+	// from a file rather than a pipe, so a dropped connection can't raise SIGPIPE
+	FILE *in = tmpfile();
+	if(!in || fwrite(script.data(), 1, script.length(), in) != script.length() || fflush(in) != 0){
+		int err = errno;
+		Logging::log.error(std::string("Error writing script to temporary file: ") + strerror(err));
+		if(in)
+			fclose(in);
+		return -1;
+	}
+	rewind(in);
+	pid_t pid;
+	if(dest.host_.empty()){
+		char *argv[] = {(char *)"sh", (char *)"-s", NULL};
+		pid = spawn(argv, fileno(in), -1);
+	}else{
+		char *argv[] = {(char *)"ssh", (char *)dest.host_.c_str(), (char *)"sh -s", NULL};
+		pid = spawn(argv, fileno(in), -1);
+	}
+	int ret = (pid == -1)? -1 : wait_exit(pid);
+	fclose(in);
+	return ret;
+}
+
+bool ChunkedTransfer::make_path(const Destination &dest) const{
+	if(dest.path_.empty())
+		return true;
+	if(dest.host_.empty()){
+		boost::system::error_code ec;
+		boost::filesystem::create_directories(dest.path_, ec);
+		return !ec;
+	}
+	return run_remote(dest, "mkdir -p " + shell_quote(dest.path_)) == 0;
+}
+
+int ChunkedTransfer::run_remote(const Destination &dest, const std::string &cmd) const{
+	char *argv[] = {(char *)"ssh", (char *)"-n", (char *)dest.host_.c_str(), (char *)cmd.c_str(), NULL};
+	pid_t pid = spawn(argv, -1, -1);
+	return (pid == -1)? -1 : wait_exit(pid);
+}
@@ -0,0 +1,231 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "concurrency.hpp"
+#include "alert.hpp"
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+AimdDimension::AimdDimension(const std::string &name, int initial, int min, int max)
+	: name_(name)
+	, value_(std::min(std::max(initial, min), max))
+	, min_(min)
+	, max_(max)
+	, last_rate_(0)
+	, last_step_(0){}
+
+int AimdDimension::value(void) const{
+	return value_;
+}
+
+void AimdDimension::set(int value, const std::string &reason){
+	value = std::min(std::max(value, min_), max_);
+	last_step_ = (value > value_) - (value < value_);
+	std::string msg = "Adaptive concurrency: " + name_ + " ";
+	if(last_step_){
+		msg += std::to_string(value_) + " -> " + std::to_string(value) + " (" + reason + ")";
+		value_ = value;
+		Logging::log.message(msg, 1);
+	}else{
+		msg += "held at " + std::to_string(value_) + " (" + reason + ")";
+		Logging::log.message(msg, 2);
+	}
+}
+
+void AimdDimension::update(double rate, const std::string &detail){
+	double last_rate = last_rate_;
+	last_rate_ = rate;
+	if(last_rate == 0){
+		set(value_ + 1, "first sample, probing up, " + detail);
+	}else if(rate > last_rate * (1.0 + ADAPT_TOLERANCE)){
+		// improved, keep going in same direction
+		int step = (last_step_)? last_step_ : 1;
+		set(value_ + step, "rate improved, " + detail);
+	}else if(rate < last_rate * (1.0 - ADAPT_TOLERANCE)){
+		// got worse, undo last step
+		if(last_step_)
+			set(value_ - last_step_, "rate dropped, " + detail);
+		else
+			set(value_ - 1, "rate dropped without change, " + detail);
+	}else{
+		set(value_, "rate unchanged, " + detail);
+	}
+}
+
+void AimdDimension::overloaded(const std::string &detail){
+	last_rate_ = 0;
+	set(value_ / 2, "overloaded, " + detail);
+}
+
+ConcurrencyController::ConcurrencyController(int threads, int max_threads, int nproc, int max_nproc)
+	: threads_("threads", threads, 1, std::max(max_threads, 1))
+	, nproc_("processes", nproc, 1, std::max(max_nproc, 1))
+	, baseline_latency_us_(0){}
+
+int ConcurrencyController::threads(void) const{
+	return threads_.value();
+}
+
+int ConcurrencyController::nproc(void) const{
+	return nproc_.value();
+}
+
+void ConcurrencyController::crawled(const CrawlSample &sample){
+	// raw sample, so a log can be fed back through bench/replay.cpp
+	Logging::log.message("Adaptive concurrency sample: crawl " + std::to_string(sample.entries) + " "
+		+ std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(sample.elapsed).count()) + " "
+		+ std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(sample.stat_time).count()), 2);
+	if(sample.entries < ADAPT_MIN_CRAWL_ENTRIES || sample.elapsed < ADAPT_MIN_SAMPLE_TIME)
+		return;
+	double seconds = std::chrono::duration<double>(sample.elapsed).count();
+	double rate = sample.entries / seconds;
+	double latency_us = std::chrono::duration<double, std::micro>(sample.stat_time).count() / sample.entries;
+	if(baseline_latency_us_ == 0 || latency_us < baseline_latency_us_)
+		baseline_latency_us_ = latency_us;
+	std::stringstream detail;
+	detail << std::fixed << std::setprecision(0) << rate << " entries/s, stat latency ";
+	detail << std::setprecision(1) << latency_us << " us, baseline " << baseline_latency_us_ << " us";
+	if(latency_us > baseline_latency_us_ * ADAPT_LATENCY_FACTOR)
+		threads_.overloaded(detail.str());
+	else
+		threads_.update(rate, detail.str());
+}
+
+void ConcurrencyController::synced(const SyncSample &sample){
+	Logging::log.message("Adaptive concurrency sample: sync " + std::to_string(sample.files) + " "
+		+ std::to_string(sample.bytes) + " "
+		+ std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(sample.elapsed).count()), 2);
+	if(sample.files < ADAPT_MIN_SYNC_FILES || sample.elapsed < ADAPT_MIN_SAMPLE_TIME)
+		return;
+	double seconds = std::chrono::duration<double>(sample.elapsed).count();
+	double rate = sample.bytes / seconds;
+	nproc_.update(rate, Logging::log.format_bytes(rate) + "/s");
+}
+
+namespace Budgets{
+	SharedBudget threads;
+	SharedBudget procs;
+}
+
+SharedBudget::SharedBudget(void) : capacity_(0), available_(0), members_(1), next_ticket_(1){}
+
+void SharedBudget::set_capacity(int capacity, int members){
+	std::lock_guard<std::mutex> lk(mutex_);
+	capacity_ = capacity;
+	available_ = capacity;
+	members_ = std::max(1, members);
+}
+
+bool SharedBudget::grantable(const void *owner){
+	BudgetShare &self = owners_[owner];
+	if(available_ > 0){
+		// uint64_t(-1) puts a root that is not waiting behind those that are
+		uint64_t self_ticket = (self.ticket_)? self.ticket_ : uint64_t(-1);
+		bool next = true;
+		for(const std::pair<const void * const, BudgetShare> &entry : owners_){
+			const BudgetShare &other = entry.second;
+			if(entry.first == owner || !other.ticket_)
+				continue;
+			if(other.held_ < self.held_ || (other.held_ == self.held_ && other.ticket_ < self_ticket)){
+				next = false;
+				break;
+			}
+		}
+		if(next)
+			return true;
+	}
+	if(!self.ticket_)
+		self.ticket_ = next_ticket_++;
+	return false;
+}
+
+void SharedBudget::take(const void *owner){
+	BudgetShare &self = owners_[owner];
+	available_--;
+	self.held_++;
+	self.ticket_ = 0;
+}
+
+bool SharedBudget::try_acquire(const void *owner){
+	if(!capacity_)
+		return true;
+	bool granted, passed_over;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		granted = grantable(owner);
+		if(granted)
+			take(owner);
+		passed_over = !granted && available_ > 0;
+	}
+	if(passed_over)
+		released_.notify_all(); // someone else is next, wake them up
+	return granted;
+}
+
+int SharedBudget::acquire(const void *owner, int wanted){
+	if(!capacity_)
+		return wanted;
+	std::unique_lock<std::mutex> lk(mutex_);
+	wanted = std::min(wanted, std::max(1, capacity_ / members_));
+	int granted = 0;
+	for(;;){
+		while(granted < wanted && grantable(owner)){
+			take(owner);
+			granted++;
+		}
+		if(granted > 0){
+			owners_[owner].ticket_ = 0; // got what it could, stop queueing
+			return granted;
+		}
+		released_.wait(lk);
+	}
+}
+
+void SharedBudget::release(const void *owner, int count){
+	if(!capacity_)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		BudgetShare &self = owners_[owner];
+		count = std::min(count, self.held_);
+		self.held_ -= count;
+		available_ += count;
+	}
+	released_.notify_all();
+}
+
+void SharedBudget::release_all(const void *owner){
+	if(!capacity_)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		std::map<const void *, BudgetShare>::iterator entry = owners_.find(owner);
+		if(entry == owners_.end())
+			return;
+		available_ += entry->second.held_;
+		owners_.erase(entry);
+	}
+	released_.notify_all();
+}
+
+void SharedBudget::wait_for(std::chrono::milliseconds timeout){
+	std::unique_lock<std::mutex> lk(mutex_);
+	released_.wait_for(lk, timeout);
+}
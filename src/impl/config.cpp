@@ -23,6 +23,12 @@
 #include <boost/system/error_code.hpp>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+
+extern "C" {
+	#include <unistd.h>
+	#include <limits.h>
+}
 
 inline void strip_whitespace(std::string &str){
 	std::size_t strItr;
@@ -44,8 +50,72 @@ inline void strip_whitespace(std::string &str){
 	str = str.substr(strItr, str.length() - strItr);
 }
 
-Config::Config(const fs::path &config_path, const ConfigOverrides &config_overrides){
+inline intmax_t parse_size(const std::string &str){
+	// returns -1 on failure
+	std::size_t pos;
+	intmax_t size;
+	try{
+		size = std::stoll(str, &pos);
+	}catch(const std::exception &){
+		return -1;
+	}
+	if(size < 0)
+		return -1;
+	std::string suffix = str.substr(pos);
+	strip_whitespace(suffix);
+	if(suffix.empty() || suffix == "B")
+		return size;
+	const std::string units = "KMGTP";
+	std::size_t exp = units.find(toupper(suffix[0]));
+	if(exp == std::string::npos || (suffix.length() > 1 && suffix.substr(1) != "B" && suffix.substr(1) != "iB"))
+		return -1;
+	for(std::size_t i = 0; i <= exp; i++)
+		size *= 1024;
+	return size;
+}
+
+inline bool apply_log_levels(const std::string &str){
+	// parses "crawler:2,syncer:1" and sets each subsystem's level
+	// returns false on failure
+	std::stringstream ss(str);
+	std::string item;
+	Logging::log.clear_subsystem_levels();
+	while(std::getline(ss, item, ',')){
+		strip_whitespace(item);
+		if(item.empty())
+			continue;
+		std::size_t colon = item.find(':');
+		if(colon == std::string::npos)
+			return false;
+		std::string name = item.substr(0, colon);
+		std::string level_str = item.substr(colon + 1);
+		strip_whitespace(name);
+		strip_whitespace(level_str);
+		int level;
+		try{
+			level = std::stoi(level_str);
+		}catch(const std::exception &){
+			return false;
+		}
+		if(level < 0)
+			return false;
+		if(name == "crawler")
+			Logging::log.set_level(level, LOG_CRAWLER);
+		else if(name == "syncer")
+			Logging::log.set_level(level, LOG_SYNCER);
+		else
+			return false;
+	}
+	return true;
+}
+
+Config::Config(const fs::path &config_path, const ConfigOverrides &config_overrides, const std::string &section) : name_(section){
 	std::string line, key, value;
+	std::string current_section; // section of line, empty for global settings
+	std::string first_section;
+	std::string meta_dir; // Metadata Directory as written, for per section defaults
+	bool section_meta_dir = false;
+	bool section_destinations = false;
 	
 	// open file
 	std::fstream config_file(config_path.string());
@@ -63,6 +133,16 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 		// full line comments:
 		if(line.empty() || line.front() == '#')
 			continue; // ignore comments
+		
+		if(line.front() == '[' && line.back() == ']'){
+			current_section = line.substr(1, line.length() - 2);
+			strip_whitespace(current_section);
+			if(first_section.empty())
+				first_section = current_section;
+			continue;
+		}
+		if(!current_section.empty() && current_section != section)
+			continue; // belongs to another root
 			
 		std::stringstream linestream(line);
 		getline(linestream, key, '=');
@@ -76,6 +156,8 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 		
 		if(key == "Source Directory"){
 			base_path_ = fs::path(value);
+		}else if(key == "Rctime Source"){
+			rctime_source_ = value;
 		}else if(key == "Remote User"){
 			remote_user_ = value;
 		}else if(key == "Remote Host"){
@@ -83,11 +165,26 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 		}else if(key == "Remote Directory"){
 			remote_directory_ = value;
 		}else if(key == "Destination"){
+			if(!current_section.empty() && !section_destinations){
+				destinations_.clear(); // section replaces global destination list
+				section_destinations = true;
+			}
 			if(destinations_.empty())
 				destinations_ = value;
 			else
 				destinations_ += "," + value;
+		}else if(key == "Destination Mode"){
+			if(value == "fanout")
+				fanout_ = true;
+			else if(value == "failover")
+				fanout_ = false;
+			else
+				destination_mode_valid_ = false;
 		}else if(key == "Metadata Directory"){
+			if(!current_section.empty())
+				section_meta_dir = true;
+			else
+				meta_dir = value;
 			last_rctime_path_ = value.append(LAST_RCTIME_NAME);
 		}else if(key == "Sync Period"){
 			try{
@@ -99,6 +196,10 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 			std::istringstream(value) >> std::boolalpha >> ignore_hidden_ >> std::noboolalpha;
 		}else if(key == "Ignore Windows Lock"){
 			std::istringstream(value) >> std::boolalpha >> ignore_win_lock_ >> std::noboolalpha;
+		}else if(key == "Include"){
+			include_ += (include_.empty())? value : "," + value;
+		}else if(key == "Exclude"){
+			exclude_ += (exclude_.empty())? value : "," + value;
 		}else if(key == "Ignore Vim Swap"){
 			std::istringstream(value) >> std::boolalpha >> ignore_vim_swap_ >> std::noboolalpha;
 		}else if(key == "Propagation Delay"){
@@ -110,14 +211,136 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 		}else if(key == "Log Level"){
 			try{
 				log_level_ = stoi(value);
-				Logging::log = Logger(log_level_);
+				Logging::log.set_level(log_level_);
 			}catch(const std::invalid_argument &){
 				log_level_ = -1;
 			}
+		}else if(key == "Log Levels"){
+			log_levels_ = value;
+			log_levels_valid_ = apply_log_levels(value);
+		}else if(key == "Log Rate Limit"){
+			try{
+				log_rate_limit_ = stoi(value);
+				Logging::log.set_rate_limit(std::max(log_rate_limit_, 0));
+			}catch(const std::invalid_argument &){
+				log_rate_limit_ = -1;
+			}
+		}else if(key == "Metrics Port"){
+			try{
+				metrics_port_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				metrics_port_ = -1;
+			}
 		}else if(key == "Exec"){
 			exec_bin_ = value;
 		}else if(key == "Flags"){
 			exec_flags_ = value;
+		}else if(key == "Transfer Order"){
+			transfer_order_ = value;
+		}else if(key == "Large File Threshold"){
+			large_threshold_ = parse_size(value);
+		}else if(key == "Large File Processes"){
+			try{
+				large_nproc_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				large_nproc_ = -1;
+			}
+		}else if(key == "Large File Flags"){
+			large_flags_ = value;
+		}else if(key == "Fast Lane Threshold"){
+			fast_lane_threshold_ = parse_size(value);
+		}else if(key == "Fast Lane Processes"){
+			try{
+				fast_lane_nproc_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				fast_lane_nproc_ = -1;
+			}
+		}else if(key == "Prefetch Budget"){
+			prefetch_budget_ = parse_size(value);
+		}else if(key == "Chunk Threshold"){
+			chunk_threshold_ = parse_size(value);
+		}else if(key == "Chunk Size"){
+			chunk_size_ = parse_size(value);
+		}else if(key == "Compression"){
+			compression_ = value;
+		}else if(key == "Compression Level"){
+			try{
+				compression_level_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				compression_level_ = -1;
+			}
+		}else if(key == "Delta Threshold"){
+			delta_threshold_ = parse_size(value);
+		}else if(key == "Delta Block Size"){
+			delta_block_size_ = parse_size(value);
+		}else if(key == "Propagate Deletes"){
+			std::istringstream(value) >> std::boolalpha >> propagate_deletes_ >> std::noboolalpha;
+		}else if(key == "Defer Recent"){
+			try{
+				defer_recent_s_ = std::chrono::seconds(stoi(value));
+			}catch(const std::invalid_argument &){
+				defer_recent_s_ = std::chrono::seconds(-1);
+			}
+		}else if(key == "Crawl Checkpoint Interval"){
+			try{
+				crawl_checkpoint_s_ = std::chrono::seconds(stoi(value));
+			}catch(const std::invalid_argument &){
+				crawl_checkpoint_s_ = std::chrono::seconds(-1);
+			}
+		}else if(key == "Adaptive Concurrency"){
+			std::istringstream(value) >> std::boolalpha >> adaptive_concurrency_ >> std::noboolalpha;
+		}else if(key == "Max Processes"){
+			try{
+				max_nproc_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				max_nproc_ = -1;
+			}
+		}else if(key == "Max Threads"){
+			try{
+				max_threads_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				max_threads_ = -1;
+			}
+		}else if(key == "Bandwidth Limit"){
+			bw_limit_ = parse_size(value);
+		}else if(key == "Metadata Op Limit"){
+			try{
+				meta_op_limit_ = stoll(value);
+			}catch(const std::invalid_argument &){
+				meta_op_limit_ = -1;
+			}
+		}else if(key == "Limit Schedule"){
+			limit_schedule_valid_ = limit_schedule_.parse(value);
+		}else if(key == "Active Active"){
+			std::istringstream(value) >> std::boolalpha >> active_active_ >> std::noboolalpha;
+		}else if(key == "Lease Directory"){
+			lease_dir_ = value;
+		}else if(key == "Node Name"){
+			node_name_ = value;
+		}else if(key == "Lease Timeout"){
+			try{
+				lease_timeout_s_ = std::chrono::seconds(stoi(value));
+			}catch(const std::invalid_argument &){
+				lease_timeout_s_ = std::chrono::seconds(-1);
+			}
+		}else if(key == "Shard Depth"){
+			try{
+				shard_depth_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				shard_depth_ = -1;
+			}
+		}else if(key == "Total Processes"){
+			try{
+				total_nproc_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				total_nproc_ = -1;
+			}
+		}else if(key == "Total Threads"){
+			try{
+				total_threads_ = stoi(value);
+			}catch(const std::invalid_argument &){
+				total_threads_ = -1;
+			}
 		}else if(key == "Processes"){
 			try{
 				nproc_ = stoi(value);
@@ -134,6 +357,26 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 		// else ignore entry
 	}
 	
+	if(lease_dir_.empty()){
+		if(!meta_dir.empty())
+			lease_dir_ = meta_dir + "leases/";
+		else if(!last_rctime_path_.empty())
+			lease_dir_ = fs::path(last_rctime_path_).parent_path().string() + "/leases/";
+	}
+	if(node_name_.empty()){
+		char hostname[HOST_NAME_MAX + 1] = {0};
+		gethostname(hostname, HOST_NAME_MAX);
+		node_name_ = hostname;
+	}
+	
+	if(!section.empty()){
+		primary_ = (section == first_section);
+		if(!section_meta_dir && !meta_dir.empty())
+			last_rctime_path_ = meta_dir + section + "/" + LAST_RCTIME_NAME; // keep watermarks of roots apart
+	}
+	
+	filter_rules_valid_ = filter_rules_.compile(include_, exclude_);
+	
 	override_fields(config_overrides);
 	
 	verify(config_path);
@@ -141,10 +384,90 @@ Config::Config(const fs::path &config_path, const ConfigOverrides &config_overri
 	if(log_level_ >= 2) dump();
 }
 
+std::vector<std::string> Config::sections(const fs::path &config_path){
+	std::vector<std::string> names;
+	std::ifstream config_file(config_path.string());
+	std::string line;
+	while(getline(config_file, line)){
+		strip_whitespace(line);
+		if(line.empty() || line.front() != '[' || line.back() != ']')
+			continue;
+		std::string name = line.substr(1, line.length() - 2);
+		strip_whitespace(name);
+		if(std::find(names.begin(), names.end(), name) == names.end())
+			names.push_back(name);
+	}
+	return names;
+}
+
+inline void find_shard_dirs(const fs::path &dir, const std::string &rel, int depth, bool ignore_hidden, const FilterRules &filter, std::vector<std::string> &shards){
+	// collects directories depth levels below dir, relative to Source Directory
+	boost::system::error_code ec;
+	std::vector<std::string> names;
+	for(fs::directory_iterator itr(dir, ec), end; !ec && itr != end; itr.increment(ec)){
+		std::string name = itr->path().filename().string();
+		if(name == ".snap" || (ignore_hidden && name.front() == '.'))
+			continue;
+		if(fs::is_symlink(itr->symlink_status()) || !fs::is_directory(itr->status()))
+			continue;
+		std::string path = rel + name;
+		if(!filter.empty() && filter.excluded(name.c_str(), name.length(), path.c_str(), path.length(), true))
+			continue;
+		names.push_back(name);
+	}
+	if(ec)
+		Logging::log.warning("Failed to list " + dir.string() + " for shards: " + ec.message());
+	std::sort(names.begin(), names.end());
+	for(const std::string &name : names){
+		if(depth == 1)
+			shards.push_back(rel + name);
+		else
+			find_shard_dirs(dir / name, rel + name + "/", depth - 1, ignore_hidden, filter, shards);
+	}
+}
+
+std::string Config::unit(void) const{
+	std::string unit = (name_.empty())? "root" : name_;
+	if(!shard_.empty())
+		unit += "." + shard_;
+	for(char &c : unit)
+		if(!isalnum(c) && c != '.' && c != '-' && c != '_')
+			c = '_';
+	return unit;
+}
+
+std::vector<Config> Config::shards(void) const{
+	std::vector<Config> configs;
+	std::vector<std::string> dirs;
+	find_shard_dirs(base_path_, "", shard_depth_, ignore_hidden_, filter_rules_, dirs);
+	std::string meta_dir = fs::path(last_rctime_path_).parent_path().string() + "/shards/";
+	for(const std::string &dir : dirs){
+		configs.push_back(*this);
+		Config &shard = configs.back();
+		shard.shard_depth_ = 0;
+		shard.primary_ = false;
+		shard.shard_ = dir;
+		shard.base_path_ = base_path_ / dir;
+		std::string dir_name = dir;
+		for(char &c : dir_name)
+			if(!isalnum(c) && c != '.' && c != '-' && c != '_')
+				c = '_';
+		shard.last_rctime_path_ = meta_dir + dir_name + "/" + LAST_RCTIME_NAME;
+		shard.rctime_seed_path_ = last_rctime_path_;
+	}
+	// files above the shards
+	configs.push_back(*this);
+	Config &residual = configs.back();
+	residual.shard_depth_ = 0;
+	residual.skip_dirs_.insert(dirs.begin(), dirs.end());
+	return configs;
+}
+
 void Config::override_fields(const ConfigOverrides &config_overrides){
 	if(config_overrides.log_level_override.overridden()){
 		log_level_ = config_overrides.log_level_override.value();
-		Logging::log = Logger(log_level_);
+		Logging::log.set_level(log_level_);
+		Logging::log.clear_subsystem_levels(); // -v and -q override everything
 	}
 	if(config_overrides.nproc_override.overridden()){
 		nproc_ = config_overrides.nproc_override.value();
@@ -164,6 +487,14 @@ void Config::verify(const fs::path &config_path) const{
 		Logging::log.error("Source Directory does not exist.");
 		errors = true;
 	}
+	if(rctime_source_ != "ceph" && rctime_source_ != "xattr" && rctime_source_ != "scan"){
+		Logging::log.error("rctime source must be ceph, xattr or scan (Rctime Source)");
+		errors = true;
+	}
+	if(!filter_rules_valid_){
+		Logging::log.error("include and exclude patterns must not be empty (Include, Exclude)");
+		errors = true;
+	}
 	if(!remote_user_.empty()){
 		Logging::log.warning("Remote User field is deprecated. Instead use `Destination = user@host:directory`.");
 		// just warning
@@ -180,6 +511,10 @@ void Config::verify(const fs::path &config_path) const{
 		Logging::log.error("(Destination) list conflicts with (Remote User, Remote Host, Remote Directory) in config");
 		errors = true;
 	}
+	if(!destination_mode_valid_){
+		Logging::log.error("destination mode must be failover or fanout (Destination Mode)");
+		errors = true;
+	}
 	if(last_rctime_path_.empty()){
 		Logging::log.error("config does not contain a metadata path (Metadata Directory)");
 		errors = true;
@@ -196,6 +531,18 @@ void Config::verify(const fs::path &config_path) const{
 		Logging::log.error("log level must be positive integer (Log Level)");
 		errors = true;
 	}
+	if(!log_levels_valid_){
+		Logging::log.error("log levels must be a list of subsystem:level, subsystems are crawler and syncer (Log Levels)");
+		errors = true;
+	}
+	if(log_rate_limit_ < 0){
+		Logging::log.error("log rate limit must be positive integer (Log Rate Limit)");
+		errors = true;
+	}
+	if(metrics_port_ < 0 || metrics_port_ > 65535){
+		Logging::log.error("metrics port must be between 0 and 65535 (Metrics Port)");
+		errors = true;
+	}
 	if(exec_bin_.empty()){
 		Logging::log.error("config must contain a program to execute! (Exec)");
 		errors = true;
@@ -212,7 +559,105 @@ void Config::verify(const fs::path &config_path) const{
 		Logging::log.error("number of threads must be positive integer (Processes)");
 		errors = true;
 	}
+	if(transfer_order_ != "size" && transfer_order_ != "directory" && transfer_order_ != "inode" && transfer_order_ != "hybrid"){
+		Logging::log.error("transfer order must be size, directory, inode or hybrid (Transfer Order)");
+		errors = true;
+	}
+	if(large_threshold_ < 0){
+		Logging::log.error("large file threshold must be a positive size in bytes, e.g. 1G (Large File Threshold)");
+		errors = true;
+	}
+	if(large_nproc_ < 1){
+		Logging::log.error("number of large file processes must be positive integer (Large File Processes)");
+		errors = true;
+	}
+	if(fast_lane_threshold_ < 0){
+		Logging::log.error("fast lane threshold must be a positive size in bytes, e.g. 1M (Fast Lane Threshold)");
+		errors = true;
+	}
+	if(fast_lane_nproc_ < 1){
+		Logging::log.error("number of fast lane processes must be positive integer (Fast Lane Processes)");
+		errors = true;
+	}
+	if(prefetch_budget_ < 0){
+		Logging::log.error("prefetch budget must be a positive size in bytes, e.g. 1G (Prefetch Budget)");
+		errors = true;
+	}
+	if(chunk_threshold_ < 0){
+		Logging::log.error("chunk threshold must be a positive size in bytes, e.g. 100G (Chunk Threshold)");
+		errors = true;
+	}
+	if(chunk_size_ <= 0){
+		Logging::log.error("chunk size must be a positive size in bytes, e.g. 1G (Chunk Size)");
+		errors = true;
+	}
+	if(compression_ != "off" && compression_ != "auto" && compression_ != "zstd" && compression_ != "lz4"){
+		Logging::log.error("compression must be off, auto, zstd or lz4 (Compression)");
+		errors = true;
+	}
+	if(compression_level_ < 0){
+		Logging::log.error("compression level must be positive integer (Compression Level)");
+		errors = true;
+	}
+	if(delta_threshold_ < 0){
+		Logging::log.error("delta threshold must be a positive size in bytes, e.g. 10G (Delta Threshold)");
+		errors = true;
+	}
+	if(delta_block_size_ <= 0){
+		Logging::log.error("delta block size must be a positive size in bytes, e.g. 128K (Delta Block Size)");
+		errors = true;
+	}
+	if(defer_recent_s_ < std::chrono::seconds(0)){
+		Logging::log.error("defer recent must be a positive number of seconds (Defer Recent)");
+		errors = true;
+	}
+	if(crawl_checkpoint_s_ < std::chrono::seconds(0)){
+		Logging::log.error("crawl checkpoint interval must be a positive number of seconds (Crawl Checkpoint Interval)");
+		errors = true;
+	}
+	if(max_nproc_ < 0){
+		Logging::log.error("max number of processes must be positive integer (Max Processes)");
+		errors = true;
+	}
+	if(max_threads_ < 0){
+		Logging::log.error("max number of threads must be positive integer (Max Threads)");
+		errors = true;
+	}
+	if(active_active_ && lease_timeout_s_ < std::chrono::seconds(3)){
+		Logging::log.error("lease timeout must be at least 3 seconds (Lease Timeout)");
+		errors = true;
+	}
+	if(active_active_ && (node_name_.empty() || node_name_.find_first_of(" /") != std::string::npos)){
+		Logging::log.error("node name must be set and can't contain spaces or slashes (Node Name)");
+		errors = true;
+	}
+	if(shard_depth_ < 0){
+		Logging::log.error("shard depth must be positive integer (Shard Depth)");
+		errors = true;
+	}
+	if(total_nproc_ < 0){
+		Logging::log.error("total number of processes must be positive integer (Total Processes)");
+		errors = true;
+	}
+	if(total_threads_ < 0){
+		Logging::log.error("total number of threads must be positive integer (Total Threads)");
+		errors = true;
+	}
+	if(bw_limit_ < 0){
+		Logging::log.error("bandwidth limit must be a positive size in bytes per second, e.g. 100M (Bandwidth Limit)");
+		errors = true;
+	}
+	if(meta_op_limit_ < 0){
+		Logging::log.error("metadata op limit must be positive integer (Metadata Op Limit)");
+		errors = true;
+	}
+	if(!limit_schedule_valid_){
+		Logging::log.error("limit schedule must be a list of HH:MM-HH:MM windows (Limit Schedule)");
+		errors = true;
+	}
 	if(errors){
+		if(!name_.empty())
+			Logging::log.error("Errors are in section [" + name_ + "]");
 		Logging::log.error("Please fix these mistakes in " + config_path.string());
 		l::exit(EXIT_FAILURE);
 	}
@@ -262,27 +707,65 @@ void Config::init_config_file(const fs::path &config_path) const{
 void Config::dump(void) const{
 	std::stringstream ss;
 	ss << "configuration:" << std::endl;
+	if(!name_.empty())
+		ss << "[" << name_ << "]" << std::endl;
 	ss << std::endl;
 	ss << "source settings:" << std::endl;
 	ss << "Source Directory =" << base_path_.string() << std::endl;
+	ss << "Rctime Source = " << rctime_source_ << std::endl;
 	ss << "Ignore Hidden = " << std::boolalpha << ignore_hidden_ << std::endl;
 	ss << "Ignore Windows Lock = " << std::boolalpha << ignore_win_lock_ << std::endl;
 	ss << "Ignore Vim Swap = " << std::boolalpha << ignore_vim_swap_ << std::endl;
+	ss << "Include = " << include_ << std::endl;
+	ss << "Exclude = " << exclude_ << std::endl;
 	ss << std::endl;
 	ss << "remote settings:" << std::endl;
 	ss << "Remote User = " << remote_user_ << std::endl;
 	ss << "Remote Host = " << remote_host_ << std::endl;
 	ss << "Remote Directory = " << remote_directory_ << std::endl;
 	ss << "Destination = " << destinations_ << std::endl;
+	ss << "Destination Mode = " << ((fanout_)? "fanout" : "failover") << std::endl;
 	ss << std::endl;
 	ss << "daemon settings:" << std::endl;
 	ss << "Exec = " << exec_bin_ << std::endl;
 	ss << "Flags = " << exec_flags_ << std::endl;
+	ss << "Transfer Order = " << transfer_order_ << std::endl;
+	ss << "Large File Threshold = " << Logging::log.format_bytes(large_threshold_) << std::endl;
+	ss << "Large File Processes = " << large_nproc_ << std::endl;
+	ss << "Large File Flags = " << large_flags_ << std::endl;
+	ss << "Fast Lane Threshold = " << Logging::log.format_bytes(fast_lane_threshold_) << std::endl;
+	ss << "Fast Lane Processes = " << fast_lane_nproc_ << std::endl;
+	ss << "Prefetch Budget = " << Logging::log.format_bytes(prefetch_budget_) << std::endl;
+	ss << "Chunk Threshold = " << Logging::log.format_bytes(chunk_threshold_) << std::endl;
+	ss << "Chunk Size = " << Logging::log.format_bytes(chunk_size_) << std::endl;
+	ss << "Compression = " << compression_ << std::endl;
+	ss << "Compression Level = " << compression_level_ << std::endl;
+	ss << "Delta Threshold = " << Logging::log.format_bytes(delta_threshold_) << std::endl;
+	ss << "Delta Block Size = " << Logging::log.format_bytes(delta_block_size_) << std::endl;
+	ss << "Propagate Deletes = " << std::boolalpha << propagate_deletes_ << std::endl;
 	ss << "Metadata Directory = " << last_rctime_path_ << std::endl;
 	ss << "Sync Period = " << sync_period_s_.count() << " (seconds)" << std::endl;
 	ss << "Propagation Delay = " << prop_delay_ms_.count() << " (milliseconds)" << std::endl;
+	ss << "Adaptive Concurrency = " << std::boolalpha << adaptive_concurrency_ << std::endl;
+	ss << "Max Processes = " << max_nproc_ << std::endl;
+	ss << "Max Threads = " << max_threads_ << std::endl;
+	ss << "Shard Depth = " << shard_depth_ << std::endl;
+	ss << "Active Active = " << std::boolalpha << active_active_ << std::endl;
+	ss << "Lease Directory = " << lease_dir_ << std::endl;
+	ss << "Node Name = " << node_name_ << std::endl;
+	ss << "Lease Timeout = " << lease_timeout_s_.count() << " (seconds)" << std::endl;
+	ss << "Total Processes = " << total_nproc_ << std::endl;
+	ss << "Total Threads = " << total_threads_ << std::endl;
+	ss << "Bandwidth Limit = " << Logging::log.format_bytes(bw_limit_) << "/s" << std::endl;
+	ss << "Metadata Op Limit = " << meta_op_limit_ << " (entries/s)" << std::endl;
+	ss << "Limit Schedule = " << limit_schedule_.str() << std::endl;
+	ss << "Defer Recent = " << defer_recent_s_.count() << " (seconds)" << std::endl;
 	ss << "Processes = " << nproc_ << std::endl;
 	ss << "Threads = " << threads_ << std::endl;
+	ss << "Crawl Checkpoint Interval = " << crawl_checkpoint_s_.count() << " (seconds)" << std::endl;
 	ss << "Log Level = " << log_level_ << std::endl;
+	ss << "Log Levels = " << log_levels_ << std::endl;
+	ss << "Log Rate Limit = " << log_rate_limit_ << " (lines/s)" << std::endl;
+	ss << "Metrics Port = " << metrics_port_ << std::endl;
 	Logging::log.message(ss.str(), 2);
 }
@@ -20,86 +20,339 @@
 #include "crawler.hpp"
 #include "alert.hpp"
 #include "signal.hpp"
+#include "metrics.hpp"
+#include "nameFilter.hpp"
 #include <thread>
 #include <chrono>
+#include <sstream>
+#include <cstring>
 
-extern "C"{
-	#include <sys/xattr.h>
+Crawler::Crawler(const fs::path &config_path, size_t envp_size, const ConfigOverrides &config_overrides)
+		: Crawler(Config(config_path, config_overrides), envp_size){}
+
+timespec Crawler::seed_rctime(const Config &config){
+	if(config.rctime_seed_path_.empty())
+		return timespec{0, 0};
+	return LastRctime(config.rctime_seed_path_).rctime();
 }
 
-Crawler::Crawler(const fs::path &config_path, size_t envp_size, const ConfigOverrides &config_overrides)
-		: config_(config_path, config_overrides)
-		, last_rctime_(config_.last_rctime_path_)
-		, syncer(envp_size, config_){
+Crawler::Crawler(const Config &config, size_t envp_size)
+		: config_(config)
+		, rctime_provider_(make_rctime_provider(config_.rctime_source_))
+		, last_rctime_(config_.last_rctime_path_, seed_rctime(config_))
+		, syncer(envp_size, config_)
+		, concurrency_(
+			config_.threads_, (config_.max_threads_)? config_.max_threads_ : config_.threads_,
+			config_.nproc_, (config_.max_nproc_)? config_.max_nproc_ : config_.nproc_
+		)
+		, entries_scanned_(0)
+		, stat_time_(0)
+		, defer_cutoff_{0, 0}
+		, oldest_deferred_{0, 0}
+		, deferred_files_(0)
+		, send_old_(false){
 	base_path_ = config_.base_path_;
+	Logging::log.message("Reading rctime from " + rctime_provider_->describe(), 2, LOG_CRAWLER);
+	if(config_.metrics_port_ && config_.primary_)
+		metrics_server_.start(config_.metrics_port_);
+	time_crawl_ = config_.adaptive_concurrency_ || Metrics::enabled || Profiling::profiler.tracing();
+	if(syncer.fanout()){
+		// each destination keeps its own last synced rctime, starting from the shared one
+		for(const Destination &dest : syncer.destinations())
+			dest_last_rctime_.emplace_back(config_.last_rctime_path_ + "." + dest.file_name(), last_rctime_.rctime());
+		last_rctime_.update(oldest_dest_rctime());
+	}
+	if(config_.fast_lane_threshold_){
+		fast_config_.reset(new Config(config_));
+		fast_config_->nproc_ = config_.fast_lane_nproc_;
+		fast_config_->large_threshold_ = 0;
+		fast_config_->chunk_threshold_ = 0;
+		fast_config_->delta_threshold_ = 0;
+		fast_config_->propagate_deletes_ = false;
+		fast_config_->prefetch_budget_ = 0; // just written, so still cached
+		fast_config_->bw_limit_ = 0; // shares Limits::bandwidth with syncer, never a limit of its own
+		fast_syncer_.reset(new Syncer(envp_size, *fast_config_));
+		fast_syncer_->reserve_procs(); // small files must not wait behind the backlog
+	}
+	if(syncer.tree_ops())
+		tree_changes_.enable(fs::path(config_.last_rctime_path_).parent_path().string() + "/listings");
+	if(config_.crawl_checkpoint_s_.count()){
+		if(syncer.tree_ops())
+			Logging::log.warning("Crawl Checkpoint Interval is ignored with Propagate Deletes, directory listings are only kept in memory until the cycle ends.");
+		else
+			checkpoint_.enable(fs::path(config_.last_rctime_path_).parent_path().string() + "/" CHECKPOINT_FILE, config_.crawl_checkpoint_s_);
+	}
+	leased_ = true;
+	if(config_.active_active_){
+		unit_ = config_.unit();
+		Leases::manager.add_unit(unit_);
+		set_leased(false); // until the lease is taken
+	}
 	set_signal_handlers(this);
 }
 
+Crawler::~Crawler(void){
+	stop_fast_lane();
+}
+
+void Crawler::set_leased(bool leased){
+	leased_ = leased;
+	last_rctime_.set_writable(leased);
+	for(LastRctime &dest_rctime : dest_last_rctime_)
+		dest_rctime.set_writable(leased);
+}
+
+bool Crawler::hold_lease(void){
+	if(unit_.empty())
+		return true;
+	bool held = Leases::manager.hold(unit_);
+	if(held && !leased_){
+		// continue from where the last gateway to hold it got to
+		last_rctime_.reload();
+		for(LastRctime &dest_rctime : dest_last_rctime_)
+			dest_rctime.reload();
+		if(!dest_last_rctime_.empty())
+			last_rctime_.update(oldest_dest_rctime());
+	}
+	if(held != leased_)
+		set_leased(held);
+	return held;
+}
+
+bool Crawler::lost_lease(void){
+	if(unit_.empty() || Leases::manager.holds(unit_))
+		return false;
+	Logging::log.warning("Lost lease of " + unit_ + " during a cycle, leaving the cycle to the gateway that took over.");
+	set_leased(false);
+	return true;
+}
+
+timespec Crawler::oldest_dest_rctime(void) const{
+	timespec oldest = last_rctime_.rctime();
+	bool first = true;
+	for(const LastRctime &dest_rctime : dest_last_rctime_){
+		if(first || oldest > dest_rctime.rctime())
+			oldest = dest_rctime.rctime();
+		first = false;
+	}
+	return oldest;
+}
+
 void Crawler::poll_base(bool seed, bool dry_run, bool set_rctime, bool oneshot){
 	timespec new_rctime = {0};
 	timespec old_rctime_cache = {0};
 	std::chrono::steady_clock::duration last_rctime_flush_period = std::chrono::hours(1);
 	std::chrono::steady_clock::time_point last_rctime_last_flush = std::chrono::steady_clock::now();
-	Logging::log.message("Watching: " + base_path_.string(),1);
-	if(seed && dry_run) old_rctime_cache = last_rctime_.rctime();
-	if(seed) last_rctime_.update({1}); // sync everything
+	Logging::log.message("Watching: " + base_path_.string(), 1, LOG_CRAWLER);
+	std::vector<timespec> old_dest_rctime_cache;
+	if(seed && dry_run){
+		old_rctime_cache = last_rctime_.rctime();
+		for(const LastRctime &dest_rctime : dest_last_rctime_)
+			old_dest_rctime_cache.push_back(dest_rctime.rctime());
+	}
+	if(seed){
+		last_rctime_.update({1}); // sync everything
+		for(LastRctime &dest_rctime : dest_last_rctime_)
+			dest_rctime.update({1});
+	}
 	do{
 		auto start = std::chrono::steady_clock::now();
-		Logging::log.message("Checking for change.", 2);
-		if(last_rctime_.check_for_change(base_path_, new_rctime)){
-			Logging::log.message("Change detected in " + base_path_.string(), 1);
-			std::vector<File> file_list;
-			uintmax_t total_bytes = 0;
-			// take snapshot
-			create_snap(new_rctime);
-			// wait for rctime to trickle to root
-			std::this_thread::sleep_for(config_.prop_delay_ms_);
+		Profiling::profiler.begin_cycle();
+		Logging::log.message("Checking for change.", 2, LOG_CRAWLER);
+		bool changed = false;
+		bool checkpoint = checkpoint_.enabled() && !dry_run && !set_rctime;
+		bool resumed = false;
+		CrawlResume resume;
+		std::vector<File> file_list;
+		uintmax_t total_bytes = 0;
+		if(hold_lease()){
+			ProfileScope scope(PROF_CHECK);
+			if(checkpoint && resume_crawl(resume, file_list, total_bytes)){
+				changed = resumed = true;
+				new_rctime = resume.new_rctime_;
+			}else{
+				rctime_provider_->new_cycle();
+				changed = last_rctime_.check_for_change(base_path_, new_rctime, *rctime_provider_);
+				if(tree_changes_.enabled() && last_rctime_.check_root_change(base_path_, new_rctime))
+					changed = true; // top level entry deleted or renamed
+			}
+		}
+		if(changed){
+			Logging::log.message("Change detected in " + base_path_.string(), 1, LOG_CRAWLER);
+			if(resumed){
+				snap_path_ = resume.snap_path_;
+			}else{
+				// take snapshot
+				{
+					ProfileScope scope(PROF_SNAP_CREATE);
+					create_snap(new_rctime);
+				}
+				// wait for rctime to trickle to root
+				{
+					ProfileScope scope(PROF_PROP_DELAY);
+					signal_handling::sleep_for(config_.prop_delay_ms_);
+				}
+			}
 			// queue files
-			trigger_search(file_list, snap_path_, total_bytes);
-			if(!set_rctime){
+			if(config_.adaptive_concurrency_)
+				config_.threads_ = concurrency_.threads();
+			entries_scanned_ = 0;
+			stat_time_ = 0;
+			defer_cutoff_ = {0, 0};
+			oldest_deferred_ = {0, 0};
+			deferred_files_ = 0;
+			if(resumed){
+				// hold back what was deferred before the restart, against the same cutoff
+				defer_cutoff_ = resume.defer_cutoff_;
+				oldest_deferred_ = resume.oldest_deferred_;
+				deferred_files_ = resume.deferred_files_;
+			}else if(config_.defer_recent_s_.count() && !set_rctime){
+				clock_gettime(CLOCK_REALTIME, &defer_cutoff_);
+				defer_cutoff_.tv_sec -= config_.defer_recent_s_.count();
+			}
+			if(resumed)
+				checkpoint_.resume(snap_path_.string());
+			else if(checkpoint)
+				checkpoint_.begin(snap_path_.string(), new_rctime, last_rctime_.rctime(), defer_cutoff_);
+			auto crawl_start = std::chrono::steady_clock::now();
+			{
+				ProfileScope scope(PROF_CRAWL);
+				trigger_search(file_list, snap_path_, total_bytes, (resumed)? &resume.frontier_ : nullptr);
+			}
+			bool stopped = signal_handling::stopping(); // crawl was cut short, file list is not complete
+			if(!stopped)
+				checkpoint_.finish();
+			if(deferred_files_){
+				Logging::log.message(std::to_string(deferred_files_) + " recently modified files deferred to next cycle.", 1, LOG_CRAWLER);
+				cap_to_deferred(new_rctime, oldest_deferred_);
+			}
+			Metrics::files_queued.add(file_list.size());
+			Metrics::bytes_queued.add(total_bytes);
+			if(config_.adaptive_concurrency_){
+				CrawlSample sample = {
+					entries_scanned_,
+					std::chrono::steady_clock::now() - crawl_start,
+					std::chrono::steady_clock::duration(stat_time_)
+				};
+				concurrency_.crawled(sample);
+			}
+			const std::vector<TreeOp> &tree_ops = tree_changes_.ops();
+			bool retry = tree_changes_.enabled() && tree_changes_.failed(); // some deletes may be missing, find them again
+			if(retry)
+				Logging::log.warning("Not all entries of " + base_path_.string() + " could be checked for deletes, this cycle will be repeated.");
+			if(!set_rctime && !stopped){
 				std::string msg = "New files to sync: " + std::to_string(file_list.size());
 				msg += " (" + Logging::log.format_bytes(total_bytes) + ")";
-				Logging::log.message(msg, 1);
+				Logging::log.message(msg, 1, LOG_CRAWLER);
+				if(!tree_ops.empty())
+					Logging::log.message("Deletes and renames to sync: " + std::to_string(tree_ops.size()), 1, LOG_CRAWLER);
 			}
 			// launch rsync
-			if(!file_list.empty()){
+			bool synced = false;
+			bool deferred = false; // every destination backing off, retry changes next cycle
+			bool missed = dry_run; // keep listings so the same deletes and renames are found next cycle
+			bool lost = lost_lease(); // another gateway took over while crawling
+			if((!file_list.empty() || !tree_ops.empty()) && !lost && !stopped){
 				if(dry_run){
 					std::string msg = config_.exec_bin_ + " " + config_.exec_flags_ + " <file list> ";
 					msg += syncer.construct_destination(config_.remote_user_, config_.remote_host_, config_.remote_directory_);
-					Logging::log.message(msg, 1);
+					Logging::log.message(msg, 1, LOG_CRAWLER);
+					for(const TreeOp &op : tree_ops)
+						Logging::log.message((op.type_ == TreeOp::MOVE)? "Rename " + op.from_ + " -> " + op.to_ : "Delete " + op.from_, 2, LOG_CRAWLER);
 				}else if(!set_rctime){
-					syncer.sync(file_list);
+					if(config_.adaptive_concurrency_)
+						syncer.set_nproc(concurrency_.nproc());
+					std::list<LastRctime>::const_iterator dest_rctime = dest_last_rctime_.begin();
+					for(Destination &dest : syncer.destinations()){
+						if(dest_rctime != dest_last_rctime_.end())
+							dest.since_ = (dest_rctime++)->rctime();
+					}
+					auto sync_start = std::chrono::steady_clock::now();
+					start_fast_lane(new_rctime);
+					deferred = !syncer.sync(file_list, tree_ops);
+					stop_fast_lane();
+					synced = true;
+					if(config_.adaptive_concurrency_ && !deferred){
+						SyncSample sample = {file_list.size(), total_bytes, std::chrono::steady_clock::now() - sync_start};
+						concurrency_.synced(sample);
+					}
 				}
 			}
 			// delete snapshot
-			delete_snap();
+			{
+				ProfileScope scope(PROF_SNAP_DELETE);
+				if(checkpoint_.open() && !stopped)
+					checkpoint_.remove(); // otherwise kept with the snapshot to resume the crawl
+				delete_snap();
+			}
+			if(!lost)
+				lost = lost_lease();
 			// overwrite last_rctime
-			if(!dry_run){
-				last_rctime_.update(new_rctime);
+			if(!dry_run && !deferred && !retry && !lost && !stopped){
+				ProfileScope scope(PROF_FLUSH);
+				if(syncer.fanout()){
+					// destinations that could not be reached keep their rctime to catch up later
+					std::vector<Destination>::const_iterator dest = syncer.destinations().begin();
+					for(LastRctime &dest_rctime : dest_last_rctime_){
+						if(!synced || !dest->failed_)
+							dest_rctime.update(new_rctime);
+						else
+							missed = true;
+						++dest;
+					}
+					last_rctime_.update(oldest_dest_rctime());
+				}else{
+					last_rctime_.update(new_rctime);
+				}
 				auto now = std::chrono::steady_clock::now();
-				if(now - last_rctime_last_flush >= last_rctime_flush_period){
-					last_rctime_.write_last_rctime();
+				Metrics::cycle_duration.observe(now - start);
+				if(synced){
+					timespec wall;
+					clock_gettime(CLOCK_REALTIME, &wall);
+					Metrics::last_sync.set(wall.tv_sec + wall.tv_nsec / 1e9);
+					Metrics::replication_lag.set((wall.tv_sec - new_rctime.tv_sec) + (wall.tv_nsec - new_rctime.tv_nsec) / 1e9);
+				}
+				if(now - last_rctime_last_flush >= last_rctime_flush_period || !unit_.empty()){ // other gateways may take over any time
+					write_last_rctime();
 					last_rctime_last_flush = now;
 				}
 			}
+			if(missed || deferred || retry || lost || stopped)
+				tree_changes_.discard();
+			else
+				tree_changes_.commit();
 			file_list.clear();
 			file_list = std::vector<File>(); // try to free memory taken by vector
+			Profiling::profiler.end_cycle();
+		}else{
+			Profiling::profiler.end_cycle(false);
 		}
-		if(oneshot)
+		if(leased_ && !unit_.empty() && !Leases::manager.done(unit_))
+			set_leased(false);
+		if(oneshot || signal_handling::stopping())
 			break;
 		auto end = std::chrono::steady_clock::now();
 		std::chrono::seconds elapsed = std::chrono::duration_cast<std::chrono::seconds>(end - start);
 		if(elapsed < config_.sync_period_s_ && !seed && !dry_run && !set_rctime) // if it took longer than sync freq, don't wait
-			std::this_thread::sleep_for(config_.sync_period_s_ - elapsed);
-	}while(!seed && !dry_run && !set_rctime);
-	if(seed && dry_run) last_rctime_.update(old_rctime_cache);
+			signal_handling::sleep_for(config_.sync_period_s_ - elapsed);
+	}while(!seed && !dry_run && !set_rctime && !signal_handling::stopping());
+	if(seed && dry_run){
+		last_rctime_.update(old_rctime_cache);
+		std::vector<timespec>::const_iterator old_dest_rctime = old_dest_rctime_cache.begin();
+		for(LastRctime &dest_rctime : dest_last_rctime_)
+			dest_rctime.update(*old_dest_rctime++);
+	}
 }
 
 void Crawler::create_snap(const timespec &rctime){
 	boost::system::error_code ec;
+	if(!rctime_provider_->snapshots()){
+		snap_path_ = base_path_; // crawl live tree
+		return;
+	}
 	std::string pid = std::to_string(getpid());
 	snap_path_ = fs::path(base_path_).append(".snap/"+pid+"snapshot"+rctime);
-	Logging::log.message("Creating snapshot: " + snap_path_.string(), 2);
+	Logging::log.message("Creating snapshot: " + snap_path_.string(), 2, LOG_CRAWLER);
 	fs::create_directories(snap_path_, ec);
 	if(ec){
 		Logging::log.error("Error creating snapshot path: " + ec.message());
@@ -107,151 +360,384 @@ void Crawler::create_snap(const timespec &rctime){
 	}
 }
 
-void Crawler::trigger_search(std::vector<File> &file_list, const fs::path &snap_path, uintmax_t &total_bytes){
+bool Crawler::resume_crawl(CrawlResume &resume, std::vector<File> &file_list, uintmax_t &total_bytes){
+	if(!checkpoint_.load(resume, file_list, total_bytes))
+		return false;
+	timespec since = last_rctime_.rctime();
+	bool snapshot_ok = (rctime_provider_->snapshots())? fs::is_directory(resume.snap_path_) : resume.snap_path_ == base_path_.string();
+	if(snapshot_ok && !(since > resume.since_) && !(resume.since_ > since)){
+		Logging::log.message("Resuming interrupted crawl of " + resume.snap_path_, 1, LOG_CRAWLER);
+		return true;
+	}
+	Logging::log.message("Dropping stale crawl checkpoint of " + resume.snap_path_, 1, LOG_CRAWLER);
+	file_list.clear();
+	total_bytes = 0;
+	checkpoint_.remove();
+	if(rctime_provider_->snapshots() && resume.snap_path_ != base_path_.string()){
+		boost::system::error_code ec;
+		fs::remove(resume.snap_path_, ec);
+		if(ec)
+			Logging::log.warning("Error removing snapshot " + resume.snap_path_ + ": " + ec.message());
+	}
+	return false;
+}
+
+void Crawler::trigger_search(std::vector<File> &file_list, const fs::path &snap_path, uintmax_t &total_bytes, const std::vector<std::string> *frontier){
 	// launch crawler in snapshot
-	Logging::log.message("Launching crawler",2);
-	if(config_.threads_ == 1){ // DFS
+	Logging::log.message("Launching crawler", 2, LOG_CRAWLER);
+	size_t snap_root_len = snap_path.string().length();
+	int nthreads = config_.threads_;
+	if(nthreads > 0)
+		nthreads = Budgets::threads.acquire(this, nthreads); // share of Total Threads
+	if(nthreads == 1){ // DFS
 		// seed recursive function with snap_path
-		find_new_files_recursive(file_list, snap_path, snap_path, total_bytes);
-	}else if(config_.threads_ > 1){ // multithreaded BFS
+		if(frontier){
+			for(const std::string &dir : *frontier)
+				find_new_files_recursive(file_list, dir, snap_root_len, total_bytes);
+		}else{
+			find_new_files_recursive(file_list, snap_path.string(), snap_root_len, total_bytes);
+		}
+	}else if(nthreads > 1){ // multithreaded BFS
 		std::atomic<uintmax_t> total_bytes_at(0);
 		std::atomic<int> threads_running(0);
 		std::vector<std::thread> threads;
-		ConcurrentQueue<fs::path> queue;
+		ConcurrentQueue<std::string> queue;
 		// seed list with root node
-		queue.push(snap_path);
+		if(frontier){
+			for(const std::string &dir : *frontier)
+				queue.push(dir);
+		}else{
+			queue.push(snap_path.string());
+		}
 		// create threads
-		for(int i = 0; i < config_.threads_; i++){
-			threads.emplace_back(&Crawler::find_new_files_mt_bfs, this, std::ref(file_list), std::ref(queue), snap_path, std::ref(total_bytes_at), std::ref(threads_running));
+		for(int i = 0; i < nthreads; i++){
+			threads.emplace_back(&Crawler::find_new_files_mt_bfs, this, std::ref(file_list), std::ref(queue), snap_root_len, std::ref(total_bytes_at), std::ref(threads_running));
 		}
 		for(auto &th : threads) th.join();
 		total_bytes = total_bytes_at;
-	}else{
+	}
+	Budgets::threads.release_all(this);
+	if(nthreads < 1){
 		Logging::log.error("Invalid number of worker threads: " + std::to_string(config_.threads_));
 		l::exit(EXIT_FAILURE);
 	}
+	if(tree_changes_.enabled()){
+		std::vector<std::string> new_dirs, new_files;
+		tree_changes_.resolve(snap_path.string(), new_dirs, new_files);
+		send_old_ = true;
+		for(const std::string &dir : new_dirs){
+			Logging::log.message("Sending all of " + dir + ", which was moved in.", 2, LOG_CRAWLER);
+			find_new_files_recursive(file_list, snap_path.string() + "/" + dir, snap_root_len, total_bytes);
+		}
+		send_old_ = false;
+		for(const std::string &rel : new_files){
+			std::string path = snap_path.string() + "/" + rel;
+			struct stat st;
+			if(lstat(path.c_str(), &st) == -1)
+				continue;
+			total_bytes += st.st_size;
+			file_list.emplace_back(path.c_str(), path.length(), snap_root_len, st);
+			file_list.back().send_always();
+		}
+	}
 	// log list of new files
-	if(config_.log_level_ >= 2){ // skip loop if not logging
-		Logging::log.message("Files to sync:",2);
+	if(Logging::log.enabled(2, LOG_CRAWLER)){ // skip loop if not logging
+		Logging::log.message("Files to sync:", 2, LOG_CRAWLER);
 		for(auto &i : file_list){
-			Logging::log.message(i.path(),2);
+			Logging::log.message(i.path(), 2, LOG_CRAWLER);
 		}
 	}
 }
 
-inline const char *get_last_of(const char *string, char test){
-	const char *last = nullptr;
-	while(*string++ != '\0')
-		if(*string == test)
-			last = string;
-	return last;
-}
-
-inline const char *get_filename(const char *path){
-	const char *file_name =  get_last_of(path, '/');
-	if(file_name == nullptr)
-		return nullptr;
-	return file_name+1;
+inline bool Crawler::ignore_name(const char *file_name, size_t len) const{
+	return ( // returns true if any of the following tests return true, false if all are false
+		    (config_.ignore_hidden_ && check_hidden(file_name))
+		||  (config_.ignore_win_lock_ && check_win_lock(file_name))
+		||  (config_.ignore_vim_swap_ && check_vim_swap(file_name, len))
+	);
 }
 
-inline bool check_hidden(const char *file_name){
-	// /^\./
-	return *file_name == '.';
+bool Crawler::defer_entry(const File &file){
+	if(!(file.rctime() > defer_cutoff_))
+		return false;
+	std::lock_guard<std::mutex> lk(deferred_mt_);
+	if(!deferred_files_++ || oldest_deferred_ > file.rctime())
+		oldest_deferred_ = file.rctime();
+	return true;
 }
 
-inline bool check_win_lock(const char *file_name){
-	// /^~\$/
-	return (file_name[0] == '~' && file_name[1] == '$');
+void Crawler::cap_to_deferred(timespec &new_rctime, const timespec &oldest_deferred){
+	timespec cap = oldest_deferred;
+	if(cap.tv_nsec)
+		cap.tv_nsec--;
+	else{
+		cap.tv_sec--;
+		cap.tv_nsec = 999999999;
+	}
+	if(new_rctime > cap)
+		new_rctime = cap;
 }
 
-inline bool check_vim_swap(const char *file_name){
-	// /^\..*\.swpx?$/
-	// move to end
-	if(!check_hidden(file_name))
+bool Crawler::skip_fast_entry(const File &file, FastPass &pass) const{
+	if(!(rctime_provider_->get_rctime(file) > pass.since_))
+		return true;
+	if(file.is_directory())
 		return false;
-	const char *ext = get_last_of(file_name, '.');
-	if(ext == nullptr)
-		return false;
-	return (
-		   ext[1] == 's'
-		&& ext[2] == 'w'
-		&& ext[3] == 'p'
-		&& (
-			   ext[4] == '\0' /* ends in .swp */
-			|| (
-				   ext[4] == 'x'
-				&& ext[5] == '\0' /* ends in .swpx */
-			)
-		)
-	);
+	if(file.size() > (uintmax_t)config_.fast_lane_threshold_)
+		return true; // left for the next cycle
+	if(pass.defer_cutoff_.tv_sec && file.rctime() > pass.defer_cutoff_){
+		if(!pass.deferred_files_++ || pass.oldest_deferred_ > file.rctime())
+			pass.oldest_deferred_ = file.rctime();
+		return true;
+	}
+	return false;
 }
 
 bool Crawler::ignore_entry(const File &file) const{
-	if(last_rctime_.is_newer(file)){
-		const char *file_name = get_filename(file.path());
-		return ( // returns true if any of the following tests return true, false if all are false
-			    (config_.ignore_hidden_ && check_hidden(file_name))
-			||  (config_.ignore_win_lock_ && check_win_lock(file_name))
-			||  (config_.ignore_vim_swap_ && check_vim_swap(file_name))
-		);
+	return !last_rctime_.is_newer(rctime_provider_->get_rctime(file)); // ignore if older than current last_rctime_
+}
+
+inline bool Crawler::ignore_entry_timed(const File &file, CrawlTimes &times) const{
+	if(!time_crawl_ || !file.is_directory())
+		return ignore_entry(file);
+	// directories read rctime, files only compare mtime from stat
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool ignore = ignore_entry(file);
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+	times.xattr_ += elapsed;
+	Metrics::getxattr_latency.observe(elapsed);
+	return ignore;
+}
+
+inline int Crawler::stat_entry(const char *path, struct stat &st, CrawlTimes &times) const{
+	if(!time_crawl_)
+		return lstat(path, &st);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int res = lstat(path, &st);
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+	times.stat_ += elapsed;
+	Metrics::stat_latency.observe(elapsed);
+	return res;
+}
+
+inline struct dirent *Crawler::next_entry(DIR *dir, CrawlTimes &times) const{
+	if(!time_crawl_)
+		return readdir(dir);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	struct dirent *ent = readdir(dir);
+	times.readdir_ += std::chrono::steady_clock::now() - start;
+	return ent;
+}
+
+void Crawler::record_times(const CrawlTimes &times){
+	entries_scanned_ += times.entries_;
+	Metrics::entries_scanned.add(times.entries_);
+	if(!time_crawl_)
+		return;
+	stat_time_ += times.stat_.count();
+	Profiling::profiler.add(PROF_READDIR, times.readdir_);
+	Profiling::profiler.add(PROF_STAT, times.stat_);
+	Profiling::profiler.add(PROF_XATTR, times.xattr_);
+}
+
+void Crawler::read_dir(const std::string &dir_path, size_t snap_root_len, CrawlTimes &times, std::vector<File> &files, std::vector<std::string> &subdirs, FastPass *fast){
+	DIR *dir;
+	if(time_crawl_){
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		dir = opendir(dir_path.c_str());
+		times.readdir_ += std::chrono::steady_clock::now() - start;
 	}else{
-		return true; // ignore if older than current last_rctime_
+		dir = opendir(dir_path.c_str());
+	}
+	if(!dir){
+		int err = errno;
+		if(err == ENOENT && !rctime_provider_->snapshots())
+			return; // removed from live tree since parent was read
+		Logging::log.error("Error opening directory " + dir_path + ": " + strerror(err));
+		l::exit(EXIT_FAILURE);
+	}
+	// reuse one buffer for every child path
+	std::string path = dir_path;
+	if(path.back() != '/')
+		path.push_back('/');
+	size_t dir_len = path.length();
+	size_t rel_start = snap_root_len;
+	while(rel_start < dir_len && path[rel_start] == '/')
+		rel_start++; // start of path relative to Source Directory
+	DirListing listing;
+	if(tree_changes_.enabled() && !fast)
+		tree_changes_.open(listing, (rel_start < dir_len)? path.substr(rel_start, dir_len - rel_start - 1) : std::string(), send_old_);
+	struct dirent *ent;
+	while((ent = next_entry(dir, times)) != nullptr){
+		const char *name = ent->d_name;
+		if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue; // . and ..
+		size_t name_len = strlen(name);
+		times.entries_++;
+		if(ignore_name(name, name_len))
+			continue; // skip stat entirely
+		path.resize(dir_len);
+		path.append(name, name_len);
+		bool filtered = !config_.filter_rules_.empty();
+		bool type_known = (ent->d_type != DT_UNKNOWN);
+		const char *rel_path = path.c_str() + rel_start;
+		size_t rel_len = path.length() - rel_start;
+		std::string root_rel_path;
+		if(filtered && !config_.shard_.empty()){
+			// patterns are relative to the whole root, not the shard
+			root_rel_path = config_.shard_ + "/" + rel_path;
+			rel_path = root_rel_path.c_str();
+			rel_len = root_rel_path.length();
+		}
+		if(filtered && type_known && config_.filter_rules_.excluded(name, name_len, rel_path, rel_len, ent->d_type == DT_DIR))
+			continue; // excluded before stat, directories are never descended
+		if(type_known && ent->d_type == DT_DIR && skip_dir(rel_path, rel_len))
+			continue; // crawled by its own shard
+		Limits::meta_ops.acquire();
+		struct stat st;
+		if(stat_entry(path.c_str(), st, times) == -1){
+			int err = errno;
+			if(err == ENOENT && !rctime_provider_->snapshots())
+				continue; // removed from live tree since readdir
+			Logging::log.error(std::string("Error calling stat on file: ") + strerror(err));
+			l::exit(EXIT_FAILURE);
+		}
+		if(filtered && !type_known && config_.filter_rules_.excluded(name, name_len, rel_path, rel_len, S_ISDIR(st.st_mode)))
+			continue;
+		if(!type_known && S_ISDIR(st.st_mode) && skip_dir(rel_path, rel_len))
+			continue;
+		bool added = tree_changes_.record(listing, name, name_len, st);
+		File file(path.c_str(), path.length(), snap_root_len, st);
+		if(fast){
+			if(skip_fast_entry(file, *fast))
+				continue;
+		}else if(send_old_){
+			if(!file.is_directory() && !ignore_entry(file))
+				continue; // new files were queued by the regular crawl
+		}else if(!(added && !file.is_directory()) && ignore_entry_timed(file, times)){
+			continue; // files renamed or replaced since last cycle are sent even if old
+		}
+		if(!fast && defer_cutoff_.tv_sec && !file.is_directory() && defer_entry(file))
+			continue; // possibly still being written
+		if(added || send_old_)
+			file.send_always(); // moved, so older than what fan-out destinations wait for
+		if(file.is_directory())
+			subdirs.push_back(path);
+		else
+			files.emplace_back(std::move(file));
 	}
+	closedir(dir);
+	tree_changes_.close(listing, dir_path);
 }
 
-void Crawler::find_new_files_recursive(std::vector<File> &file_list, fs::path current_path, const fs::path &snap_root, uintmax_t &total_bytes){
-	size_t snap_root_len = snap_root.string().length();
-	for(fs::directory_iterator itr{current_path}; itr != fs::directory_iterator{}; *itr++){
-		fs::directory_entry entry = *itr;
-		const char *path = entry.path().c_str();
-		File file(path, snap_root_len);
-		if(ignore_entry(file)) continue;
-		if(file.is_directory()){
-			find_new_files_recursive(file_list, entry.path(), snap_root, total_bytes); // recurse
-		}else{
-			total_bytes += file.size();
-			file_list.emplace_back(std::move(file));
-		}
+void Crawler::find_new_files_recursive(std::vector<File> &file_list, const std::string &current_path, size_t snap_root_len, uintmax_t &total_bytes, FastPass *fast){
+	if(signal_handling::stopping())
+		return; // left in the checkpoint's frontier
+	CrawlTimes times;
+	std::vector<File> files;
+	std::vector<std::string> subdirs;
+	std::chrono::steady_clock::time_point dir_start;
+	if(Profiling::profiler.tracing())
+		dir_start = std::chrono::steady_clock::now();
+	read_dir(current_path, snap_root_len, times, files, subdirs, fast);
+	record_times(times);
+	if(!fast && !send_old_)
+		checkpoint_dir(current_path, files, subdirs);
+	for(File &file : files){
+		total_bytes += file.size();
+		file_list.emplace_back(std::move(file));
+	}
+	if(Profiling::profiler.tracing()){
+		std::chrono::steady_clock::time_point dir_end = std::chrono::steady_clock::now();
+		if(dir_end - dir_start >= PROFILE_DIR_SPAN_MIN)
+			Profiling::profiler.span("directory", dir_start, dir_end, "\"path\":" + Profiler::json_string(current_path));
 	}
+	for(const std::string &subdir : subdirs)
+		find_new_files_recursive(file_list, subdir, snap_root_len, total_bytes, fast); // recurse
 }
 
-void Crawler::find_new_files_mt_bfs(std::vector<File> &file_list, ConcurrentQueue<fs::path> &queue, const fs::path &snap_root, std::atomic<uintmax_t> &total_bytes, std::atomic<int> &threads_running){
+void Crawler::find_new_files_mt_bfs(std::vector<File> &file_list, ConcurrentQueue<std::string> &queue, size_t snap_root_len, std::atomic<uintmax_t> &total_bytes, std::atomic<int> &threads_running){
 	threads_running++;
-	bool nodes_left = true;
-	fs::path node;
+	std::string node;
 	std::vector<File> files_to_enqueue;
 	files_to_enqueue.reserve(128);
-	size_t snap_root_len = snap_root.string().length();
-	while(nodes_left){
-		nodes_left = queue.pop(node, threads_running);
-		if(!nodes_left) return;
+	std::vector<std::string> subdirs;
+	bool tracing = Profiling::profiler.tracing();
+	std::chrono::steady_clock::time_point worker_start = std::chrono::steady_clock::now();
+	CrawlTimes worker_times;
+	uintmax_t dirs = 0;
+	while(queue.pop(node, threads_running)){
+		if(signal_handling::stopping())
+			continue; // drain, left in the checkpoint's frontier
+		CrawlTimes times;
+		std::chrono::steady_clock::time_point dir_start;
+		if(tracing)
+			dir_start = std::chrono::steady_clock::now();
+		read_dir(node, snap_root_len, times, files_to_enqueue, subdirs);
+		checkpoint_dir(node, files_to_enqueue, subdirs);
 		// put all child directories back in queue
-		for(fs::directory_iterator itr{node}; itr != fs::directory_iterator{}; *itr++){
-			File file(itr->path().c_str(), snap_root_len);
-			if(!ignore_entry(file)){
-				if(file.is_directory()){
-					// put child directory into queue
-					queue.push(*itr);
-				}else{
-					// save non-directory children in temp queue
-					files_to_enqueue.emplace_back(std::move(file));
-				}
-			}
-		}
-		for(File &file : files_to_enqueue){
-			total_bytes += file.size();
-			{
-				std::unique_lock<std::mutex> lk(file_list_mt_);
+		for(std::string &subdir : subdirs)
+			queue.push(std::move(subdir));
+		subdirs.clear();
+		uintmax_t bytes = 0;
+		for(const File &file : files_to_enqueue)
+			bytes += file.size();
+		total_bytes += bytes;
+		if(!files_to_enqueue.empty()){
+			std::unique_lock<std::mutex> lk(file_list_mt_);
+			for(File &file : files_to_enqueue)
 				file_list.emplace_back(std::move(file));
-			}
 		}
 		files_to_enqueue.clear();
+		record_times(times);
+		dirs++;
+		if(tracing){
+			worker_times.entries_ += times.entries_;
+			worker_times.readdir_ += times.readdir_;
+			worker_times.stat_ += times.stat_;
+			worker_times.xattr_ += times.xattr_;
+			std::chrono::steady_clock::time_point dir_end = std::chrono::steady_clock::now();
+			if(dir_end - dir_start >= PROFILE_DIR_SPAN_MIN)
+				Profiling::profiler.span("directory", dir_start, dir_end, "\"path\":" + Profiler::json_string(node));
+		}
+	}
+	if(tracing){
+		std::ostringstream args;
+		args << "\"directories\":" << dirs << ",\"entries\":" << worker_times.entries_;
+		args << ",\"readdir_ms\":" << std::chrono::duration_cast<std::chrono::microseconds>(worker_times.readdir_).count() / 1000.0;
+		args << ",\"stat_ms\":" << std::chrono::duration_cast<std::chrono::microseconds>(worker_times.stat_).count() / 1000.0;
+		args << ",\"xattr_ms\":" << std::chrono::duration_cast<std::chrono::microseconds>(worker_times.xattr_).count() / 1000.0;
+		Profiling::profiler.span("crawl worker", worker_start, std::chrono::steady_clock::now(), args.str());
 	}
 }
 
+void Crawler::checkpoint_dir(const std::string &dir, const std::vector<File> &files, const std::vector<std::string> &subdirs){
+	if(!checkpoint_.open())
+		return;
+	timespec oldest_deferred;
+	uintmax_t deferred_files;
+	{
+		std::lock_guard<std::mutex> lk(deferred_mt_);
+		oldest_deferred = oldest_deferred_;
+		deferred_files = deferred_files_;
+	}
+	checkpoint_.record(dir, files, subdirs, oldest_deferred, deferred_files);
+}
+
 void Crawler::delete_snap(void) const{
 	boost::system::error_code ec;
-	Logging::log.message("Removing snapshot: " + snap_path_.string(), 2);
+	if(!rctime_provider_->snapshots())
+		return;
+	{
+		std::unique_lock<std::mutex> lk(fast_snap_mt_);
+		if(!fast_snap_path_.empty())
+			fs::remove(fast_snap_path_, ec); // interrupted during a fast lane pass
+	}
+	if(checkpoint_.open()){
+		Logging::log.message("Keeping snapshot for crawl checkpoint: " + snap_path_.string(), 2, LOG_CRAWLER);
+		return;
+	}
+	Logging::log.message("Removing snapshot: " + snap_path_.string(), 2, LOG_CRAWLER);
 	fs::remove(snap_path_, ec);
 	if(ec){
 		Logging::log.error("Error removing snapshot path: " + ec.message());
@@ -259,6 +745,89 @@ void Crawler::delete_snap(void) const{
 	}
 }
 
+void Crawler::start_fast_lane(const timespec &since){
+	if(!fast_syncer_)
+		return;
+	fast_stop_ = false;
+	fast_thread_ = std::thread(&Crawler::fast_lane, this, since);
+}
+
+void Crawler::stop_fast_lane(void){
+	if(!fast_thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lk(fast_mt_);
+		fast_stop_ = true;
+	}
+	fast_cv_.notify_all();
+	fast_thread_.join();
+}
+
+void Crawler::fast_lane(timespec since){
+	std::chrono::seconds period = std::max(config_.sync_period_s_, std::chrono::seconds(1));
+	std::unique_lock<std::mutex> lk(fast_mt_);
+	while(!fast_cv_.wait_for(lk, period, [this]{ return fast_stop_; })){
+		lk.unlock();
+		fast_pass(since);
+		lk.lock();
+	}
+}
+
+void Crawler::fast_pass(timespec &since){
+	timespec new_rctime = since;
+	rctime_provider_->new_cycle();
+	if(!LastRctime::changed_since(base_path_, since, new_rctime, *rctime_provider_))
+		return;
+	FastPass pass;
+	pass.since_ = since;
+	if(config_.defer_recent_s_.count()){
+		clock_gettime(CLOCK_REALTIME, &pass.defer_cutoff_);
+		pass.defer_cutoff_.tv_sec -= config_.defer_recent_s_.count();
+	}
+	fs::path snap_path = base_path_;
+	if(rctime_provider_->snapshots()){
+		boost::system::error_code ec;
+		snap_path = fs::path(base_path_).append(".snap/"+std::to_string(getpid())+"fast"+new_rctime);
+		Logging::log.message("Creating fast lane snapshot: " + snap_path.string(), 2, LOG_CRAWLER);
+		fs::create_directories(snap_path, ec);
+		if(ec){
+			Logging::log.warning("Error creating fast lane snapshot: " + ec.message() + ". Leaving changes for next cycle.");
+			return;
+		}
+		std::unique_lock<std::mutex> lk(fast_snap_mt_);
+		fast_snap_path_ = snap_path;
+	}
+	std::this_thread::sleep_for(config_.prop_delay_ms_);
+	std::vector<File> file_list;
+	uintmax_t total_bytes = 0;
+	find_new_files_recursive(file_list, snap_path.string(), snap_path.string().length(), total_bytes, &pass);
+	if(pass.deferred_files_)
+		cap_to_deferred(new_rctime, pass.oldest_deferred_);
+	bool sent = true;
+	if(!file_list.empty()){
+		std::string msg = "Fast lane files to sync: " + std::to_string(file_list.size());
+		msg += " (" + Logging::log.format_bytes(total_bytes) + ")";
+		Logging::log.message(msg, 1, LOG_CRAWLER);
+		Metrics::files_queued.add(file_list.size());
+		Metrics::bytes_queued.add(total_bytes);
+		sent = fast_syncer_->sync(file_list, std::vector<TreeOp>());
+	}
+	std::unique_lock<std::mutex> lk(fast_snap_mt_);
+	if(!fast_snap_path_.empty()){
+		boost::system::error_code ec;
+		Logging::log.message("Removing fast lane snapshot: " + fast_snap_path_.string(), 2, LOG_CRAWLER);
+		fs::remove(fast_snap_path_, ec);
+		if(ec)
+			Logging::log.warning("Error removing fast lane snapshot: " + ec.message());
+		fast_snap_path_.clear();
+	}
+	lk.unlock();
+	if(sent)
+		since = new_rctime; // fan-out destinations that failed catch up next cycle
+}
+
 void Crawler::write_last_rctime(void) const{
 	last_rctime_.write_last_rctime();
+	for(const LastRctime &dest_rctime : dest_last_rctime_)
+		dest_rctime.write_last_rctime();
 }
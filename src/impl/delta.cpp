@@ -0,0 +1,163 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "delta.hpp"
+#include "alert.hpp"
+#include <fstream>
+#include <cstring>
+
+extern "C" {
+	#include <stdio.h>
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+inline uint64_t rotl64(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const char *p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t read32(const char *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint64_t hash_round(uint64_t acc, uint64_t input){
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+inline uint64_t hash_merge(uint64_t acc, uint64_t val){
+	acc ^= hash_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t block_hash(const char *data, size_t len){
+	const char *p = data;
+	const char *end = data + len;
+	uint64_t h;
+	if(len >= 32){
+		uint64_t v[4] = {PRIME64_1 + PRIME64_2, PRIME64_2, 0, (uint64_t)0 - PRIME64_1};
+		const char *limit = end - 32;
+		do{
+			for(int i = 0; i < 4; i++)
+				v[i] = hash_round(v[i], read64(p + 8 * i));
+			p += 32;
+		}while(p <= limit);
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+		for(int i = 0; i < 4; i++)
+			h = hash_merge(h, v[i]);
+	}else{
+		h = PRIME64_5;
+	}
+	h += len;
+	for(; p + 8 <= end; p += 8){
+		h ^= hash_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if(p + 4 <= end){
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for(; p < end; p++){
+		h ^= (uint64_t)(unsigned char)*p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uintmax_t BlockSignatures::blocks(void) const{
+	return (block_size_)? (size_ + block_size_ - 1) / block_size_ : 0;
+}
+
+bool BlockSignatures::load(const std::string &path){
+	std::ifstream f(path, std::ios::binary);
+	if(!f)
+		return false;
+	char magic[sizeof(SIG_MAGIC) - 1];
+	uint64_t size, block_size, rel_len, count;
+	int64_t sec, nsec;
+	f.read(magic, sizeof(magic));
+	if(!f || memcmp(magic, SIG_MAGIC, sizeof(magic)) != 0)
+		return false;
+	f.read((char *)&size, sizeof(size));
+	f.read((char *)&sec, sizeof(sec));
+	f.read((char *)&nsec, sizeof(nsec));
+	f.read((char *)&block_size, sizeof(block_size));
+	f.read((char *)&rel_len, sizeof(rel_len));
+	if(!f || rel_len > 4096)
+		return false;
+	rel_path_.resize(rel_len);
+	f.read(&rel_path_[0], rel_len);
+	f.read((char *)&count, sizeof(count));
+	size_ = size;
+	block_size_ = block_size;
+	mtime_.tv_sec = sec;
+	mtime_.tv_nsec = nsec;
+	if(!f || count != blocks())
+		return false;
+	hashes_.resize(count);
+	f.read((char *)hashes_.data(), count * sizeof(uint64_t));
+	return (bool)f;
+}
+
+bool BlockSignatures::save(const std::string &path) const{
+	std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+		uint64_t size = size_, block_size = block_size_, rel_len = rel_path_.length(), count = hashes_.size();
+		int64_t sec = mtime_.tv_sec, nsec = mtime_.tv_nsec;
+		f.write(SIG_MAGIC, sizeof(SIG_MAGIC) - 1);
+		f.write((const char *)&size, sizeof(size));
+		f.write((const char *)&sec, sizeof(sec));
+		f.write((const char *)&nsec, sizeof(nsec));
+		f.write((const char *)&block_size, sizeof(block_size));
+		f.write((const char *)&rel_len, sizeof(rel_len));
+		f.write(rel_path_.data(), rel_len);
+		f.write((const char *)&count, sizeof(count));
+		f.write((const char *)hashes_.data(), count * sizeof(uint64_t));
+		if(!f){
+			Logging::log.warning("Error writing block signatures to " + tmp_path);
+			return false;
+		}
+	}
+	if(rename(tmp_path.c_str(), path.c_str()) == -1){
+		int err = errno;
+		Logging::log.warning("Error renaming " + tmp_path + ": " + strerror(err));
+		return false;
+	}
+	return true;
+}
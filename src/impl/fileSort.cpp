@@ -0,0 +1,161 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fileSort.hpp"
+#include "file.hpp"
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace{
+	struct SortKey{
+		uintmax_t key_;
+		size_t index_;
+	};
+	
+	const size_t DIGITS = size_t(1) << FILE_SORT_DIGIT_BITS;
+	
+	template<class Fn>
+	void run_parallel(int nthreads, Fn fn){
+		// fn(thread index) on nthreads threads, the calling one included
+		std::vector<std::thread> threads;
+		for(int t = 1; t < nthreads; t++)
+			threads.emplace_back(fn, t);
+		fn(0);
+		for(std::thread &th : threads)
+			th.join();
+	}
+	
+	inline uintmax_t sort_key(const File &file, SORT_KEY_T key){
+		switch(key){
+		case SORT_SIZE_CLASS:
+			{
+				uintmax_t size = file.size();
+				uintmax_t bits = 0;
+				while(size){
+					bits++;
+					size >>= 1;
+				}
+				return bits;
+			}
+		case SORT_INODE:
+			return file.ino();
+		case SORT_SIZE:
+		default:
+			return file.size();
+		}
+	}
+	
+	// with reallocate, files may end up in new storage, saving a move of each
+	void sort_files(std::vector<File> &files, size_t first, size_t last, SORT_KEY_T key, int nthreads, bool reallocate){
+		size_t count = last - first;
+		if(count < 2)
+			return;
+		if(nthreads < 1)
+			nthreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+		nthreads = (int)std::min<size_t>(nthreads, count / FILE_SORT_MIN_PER_THREAD + 1);
+		
+		std::vector<SortKey> keys(count);
+		std::vector<SortKey> scratch(count);
+		// each thread handles one contiguous part of the keys in every pass
+		std::vector<size_t> bounds(nthreads + 1);
+		for(int t = 0; t <= nthreads; t++)
+			bounds[t] = count * t / nthreads;
+		std::vector<uintmax_t> max_key(nthreads, 0);
+		run_parallel(nthreads, [&](int t){
+			for(size_t i = bounds[t]; i < bounds[t + 1]; i++){
+				keys[i].key_ = sort_key(files[first + i], key);
+				keys[i].index_ = first + i;
+				max_key[t] = std::max(max_key[t], keys[i].key_);
+			}
+		});
+		uintmax_t largest = *std::max_element(max_key.begin(), max_key.end());
+		
+		// counts[t * DIGITS + d] is how many keys of thread t have digit d,
+		// then where the first of them goes
+		std::vector<size_t> counts(nthreads * DIGITS);
+		for(int shift = 0; shift < (int)(sizeof(uintmax_t) * 8) && (largest >> shift); shift += FILE_SORT_DIGIT_BITS){
+			std::fill(counts.begin(), counts.end(), 0);
+			run_parallel(nthreads, [&](int t){
+				size_t *count_t = &counts[t * DIGITS];
+				for(size_t i = bounds[t]; i < bounds[t + 1]; i++)
+					count_t[(keys[i].key_ >> shift) & (DIGITS - 1)]++;
+			});
+			size_t offset = 0;
+			bool same_digit = false;
+			for(size_t d = 0; d < DIGITS; d++){
+				size_t start = offset;
+				for(int t = 0; t < nthreads; t++){
+					size_t n = counts[t * DIGITS + d];
+					counts[t * DIGITS + d] = offset;
+					offset += n;
+				}
+				same_digit = same_digit || (offset - start == count);
+			}
+			if(same_digit)
+				continue; // order already holds for this digit
+			run_parallel(nthreads, [&](int t){
+				size_t *next = &counts[t * DIGITS];
+				for(size_t i = bounds[t]; i < bounds[t + 1]; i++)
+					scratch[next[(keys[i].key_ >> shift) & (DIGITS - 1)]++] = keys[i];
+			});
+			keys.swap(scratch);
+		}
+		std::vector<SortKey>().swap(scratch);
+		
+		std::vector<File> sorted(count);
+		run_parallel(nthreads, [&](int t){
+			for(size_t i = bounds[t]; i < bounds[t + 1]; i++)
+				sorted[i] = std::move(files[keys[i].index_]);
+		});
+		if(reallocate && count == files.size()){
+			files.swap(sorted);
+			return;
+		}
+		run_parallel(nthreads, [&](int t){
+			for(size_t i = bounds[t]; i < bounds[t + 1]; i++)
+				files[first + i] = std::move(sorted[i]);
+		});
+	}
+}
+
+void radix_sort(std::vector<File> &files, size_t first, size_t last, SORT_KEY_T key, int nthreads){
+	sort_files(files, first, last, key, nthreads, false);
+}
+
+void sort_by_size(std::vector<File> &files){
+	sort_files(files, 0, files.size(), SORT_SIZE, 0, true);
+}
+
+void sort_by_path(std::vector<File> &files, size_t first, size_t last){
+	// by directory, then name, so a directory's files aren't split by its subdirectories
+	std::sort(files.begin() + first, files.begin() + last, [](const File &a, const File &b){
+		const char *a_name = strrchr(a.path(), '/');
+		const char *b_name = strrchr(b.path(), '/');
+		size_t a_dir = a_name - a.path();
+		size_t b_dir = b_name - b.path();
+		int res = memcmp(a.path(), b.path(), std::min(a_dir, b_dir));
+		if(res != 0)
+			return res < 0;
+		if(a_dir != b_dir)
+			return a_dir < b_dir;
+		return strcmp(a_name, b_name) < 0;
+	});
+}
@@ -0,0 +1,139 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "filter.hpp"
+#include <cstring>
+#include <boost/tokenizer.hpp>
+
+extern "C" {
+	#include <fnmatch.h>
+}
+
+inline bool has_wildcard(const std::string &str){
+	return str.find_first_of("*?[\\") != std::string::npos;
+}
+
+void PatternSet::add_affix(std::vector<LengthSet> &sets, const std::string &affix){
+	for(LengthSet &set : sets){
+		if(set.len_ == affix.length()){
+			set.strings_.insert(affix);
+			return;
+		}
+	}
+	sets.push_back(LengthSet{affix.length(), {affix}});
+}
+
+bool PatternSet::match_affix(const std::vector<LengthSet> &sets, const char *str, size_t len, bool suffix){
+	for(const LengthSet &set : sets){
+		if(set.len_ > len)
+			continue;
+		const char *start = (suffix)? str + len - set.len_ : str;
+		if(set.strings_.count(std::string(start, set.len_)))
+			return true;
+	}
+	return false;
+}
+
+bool PatternSet::Rules::empty(void) const{
+	return exact_.empty() && suffixes_.empty() && prefixes_.empty() && globs_.empty();
+}
+
+void PatternSet::Rules::add(const std::string &pattern, bool path){
+	if(!has_wildcard(pattern)){
+		exact_.insert(pattern);
+		return;
+	}
+	// a single leading or trailing '*' around a literal, "*" can't cross '/' in paths
+	std::string inner = pattern.substr(1);
+	if(pattern[0] == '*' && !has_wildcard(inner) && (!path || inner.find('/') == std::string::npos)){
+		add_affix(suffixes_, inner);
+		return;
+	}
+	inner = pattern.substr(0, pattern.length() - 1);
+	if(pattern.back() == '*' && !has_wildcard(inner) && (!path || inner.find('/') == std::string::npos)){
+		add_affix(prefixes_, inner);
+		return;
+	}
+	globs_.push_back(pattern);
+}
+
+bool PatternSet::Rules::match(const char *str, size_t len, bool path) const{
+	if(!exact_.empty() && exact_.count(std::string(str, len)))
+		return true;
+	if(match_affix(suffixes_, str, len, true))
+		return true;
+	if(match_affix(prefixes_, str, len, false))
+		return true;
+	for(const std::string &glob : globs_)
+		if(fnmatch(glob.c_str(), str, (path)? FNM_PATHNAME : 0) == 0)
+			return true;
+	return false;
+}
+
+bool PatternSet::add(std::string pattern){
+	bool dir_only = false;
+	while(pattern.length() > 1 && pattern.back() == '/'){
+		pattern.pop_back();
+		dir_only = true;
+	}
+	bool path = (pattern.find('/') != std::string::npos);
+	while(!pattern.empty() && pattern[0] == '/')
+		pattern.erase(0, 1); // anchored at Source Directory either way
+	if(pattern.empty())
+		return false;
+	if(path)
+		((dir_only)? path_dir_rules_ : path_rules_).add(pattern, true);
+	else
+		((dir_only)? name_dir_rules_ : name_rules_).add(pattern, false);
+	return true;
+}
+
+bool PatternSet::empty(void) const{
+	return name_rules_.empty() && name_dir_rules_.empty() && path_rules_.empty() && path_dir_rules_.empty();
+}
+
+bool PatternSet::match(const char *name, size_t name_len, const char *rel_path, size_t rel_len, bool is_dir) const{
+	return name_rules_.match(name, name_len, false)
+		|| (is_dir && name_dir_rules_.match(name, name_len, false))
+		|| path_rules_.match(rel_path, rel_len, true)
+		|| (is_dir && path_dir_rules_.match(rel_path, rel_len, true));
+}
+
+inline bool compile_list(PatternSet &set, const std::string &list){
+	boost::tokenizer<boost::escaped_list_separator<char>> tokens(
+		list,
+		boost::escaped_list_separator<char>(
+			std::string(""), std::string(","), std::string("\"\'")
+		)
+	);
+	for(std::string pattern : tokens){
+		// strip surrounding whitespace, patterns may contain spaces
+		size_t start = pattern.find_first_not_of(" \t");
+		if(start == std::string::npos)
+			continue;
+		pattern = pattern.substr(start, pattern.find_last_not_of(" \t") - start + 1);
+		if(!set.add(pattern))
+			return false;
+	}
+	return true;
+}
+
+bool FilterRules::compile(const std::string &include, const std::string &exclude){
+	return compile_list(include_, include) && compile_list(exclude_, exclude);
+}
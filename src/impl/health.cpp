@@ -0,0 +1,118 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "health.hpp"
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <ctime>
+#include <algorithm>
+
+DestinationHealth::DestinationHealth(void)
+	: state_(CLOSED)
+	, consecutive_failures_(0)
+	, failure_rate_(0)
+	, latency_s_(0)
+	, last_success_()
+	, open_until_()
+	, probing_(false){}
+
+bool DestinationHealth::available(void){
+	if(state_ == OPEN && std::chrono::steady_clock::now() >= open_until_)
+		state_ = HALF_OPEN;
+	return state_ == CLOSED || (state_ == HALF_OPEN && !probing_);
+}
+
+bool DestinationHealth::admit(bool &probe){
+	probe = false;
+	if(state_ == OPEN && std::chrono::steady_clock::now() >= open_until_)
+		state_ = HALF_OPEN;
+	if(state_ != HALF_OPEN)
+		return true; // open ones are failed over by the caller
+	if(probing_)
+		return false;
+	probing_ = probe = true;
+	return true;
+}
+
+void DestinationHealth::end_probe(void){
+	probing_ = false;
+}
+
+DestinationHealth::State DestinationHealth::state(void) const{
+	return state_;
+}
+
+void DestinationHealth::record_success(std::chrono::steady_clock::duration latency){
+	double latency_s = std::chrono::duration<double>(latency).count();
+	latency_s_ = (latency_s_ == 0)? latency_s : (1.0 - HEALTH_EWMA_WEIGHT) * latency_s_ + HEALTH_EWMA_WEIGHT * latency_s;
+	failure_rate_ *= 1.0 - HEALTH_EWMA_WEIGHT;
+	consecutive_failures_ = 0;
+	last_success_ = std::chrono::system_clock::now();
+	state_ = CLOSED;
+	probing_ = false;
+}
+
+void DestinationHealth::record_failure(void){
+	static thread_local std::mt19937 gen{std::random_device{}()};
+	failure_rate_ = (1.0 - HEALTH_EWMA_WEIGHT) * failure_rate_ + HEALTH_EWMA_WEIGHT;
+	// base * 2^(failures - 1), capped, with jitter between half and full backoff
+	int exponent = std::min(consecutive_failures_++, 16);
+	std::chrono::duration<double> backoff = std::min<std::chrono::duration<double>>(
+		HEALTH_BACKOFF_BASE * (1 << exponent), HEALTH_BACKOFF_MAX
+	);
+	std::uniform_real_distribution<double> jitter(0.5, 1.0);
+	open_until_ = std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(backoff * jitter(gen));
+	state_ = OPEN;
+	probing_ = false;
+}
+
+std::chrono::steady_clock::duration DestinationHealth::backoff_remaining(void) const{
+	if(state_ != OPEN)
+		return std::chrono::steady_clock::duration(0);
+	return std::max(open_until_ - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration(0));
+}
+
+std::string DestinationHealth::summary(void) const{
+	std::stringstream ss;
+	switch(state_){
+		case CLOSED:
+			ss << "healthy";
+			break;
+		case OPEN:
+			ss << "backing off for " << std::chrono::duration_cast<std::chrono::seconds>(backoff_remaining()).count() << "s";
+			break;
+		case HALF_OPEN:
+			ss << ((probing_)? "probing" : "retrying");
+			break;
+	}
+	ss << ", failure rate " << std::fixed << std::setprecision(0) << failure_rate_ * 100 << "%";
+	ss << ", batch latency " << std::setprecision(1) << latency_s_ << "s";
+	ss << ", last success ";
+	if(last_success_ == std::chrono::system_clock::time_point()){
+		ss << "never";
+	}else{
+		std::time_t t = std::chrono::system_clock::to_time_t(last_success_);
+		std::tm local;
+		localtime_r(&t, &local);
+		ss << std::put_time(&local, "%F %T");
+	}
+	return ss.str();
+}
@@ -0,0 +1,273 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "lease.hpp"
+#include "alert.hpp"
+#include "signal.hpp"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+extern "C" {
+	#include <unistd.h>
+	#include <stdio.h>
+	#include <string.h>
+}
+
+namespace fs = boost::filesystem;
+
+namespace Leases{
+	LeaseManager manager;
+}
+
+LeaseManager::LeaseManager(void) : timeout_(0), live_(1), stop_(false){}
+
+LeaseManager::~LeaseManager(void){
+	if(heartbeat_.joinable())
+		heartbeat_.detach();
+}
+
+void LeaseManager::start(const std::string &dir, const std::string &node, std::chrono::seconds timeout){
+	dir_ = dir;
+	if(dir_.back() != '/')
+		dir_.push_back('/');
+	node_ = node;
+	timeout_ = timeout;
+	boost::system::error_code ec;
+	fs::create_directories(dir_ + LEASE_NODES_DIR, ec);
+	if(ec){
+		Logging::log.error("Cannot create lease directory " + dir_ + LEASE_NODES_DIR + ": " + ec.message());
+		l::exit(EXIT_FAILURE);
+	}
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		write_heartbeat();
+		live_ = count_live_nodes();
+	}
+	heartbeat_ = std::thread(&LeaseManager::beat, this);
+	Logging::log.message("Sharing " + std::to_string(units_.size()) + " units as " + node_ + " with " + std::to_string(live_ - 1) + " other gateways through " + dir_, 1);
+}
+
+void LeaseManager::add_unit(const std::string &unit){
+	std::lock_guard<std::mutex> lk(mutex_);
+	units_.insert(unit);
+}
+
+std::string LeaseManager::lease_path(const std::string &unit, long generation) const{
+	return dir_ + unit + LEASE_SUFFIX "." + std::to_string(generation);
+}
+
+long LeaseManager::generation(const std::string &unit) const{
+	std::string prefix = unit + LEASE_SUFFIX ".";
+	long highest = -1;
+	boost::system::error_code ec;
+	for(fs::directory_iterator itr(dir_, ec), end; !ec && itr != end; itr.increment(ec)){
+		std::string name = itr->path().filename().string();
+		if(name.length() <= prefix.length() || name.compare(0, prefix.length(), prefix) != 0)
+			continue;
+		if(name.length() - prefix.length() > 18 || name.find_first_not_of("0123456789", prefix.length()) != std::string::npos)
+			continue; // lease of another unit with a longer name
+		highest = std::max(highest, std::stol(name.substr(prefix.length())));
+	}
+	return highest;
+}
+
+std::string LeaseManager::node_path(void) const{
+	return dir_ + LEASE_NODES_DIR + node_;
+}
+
+bool LeaseManager::write_temp(const std::string &tmp_path) const{
+	std::ofstream f(tmp_path, std::ofstream::trunc);
+	f << node_ << ' ' << time(NULL) + timeout_.count() << std::endl;
+	f.close();
+	return !f.fail();
+}
+
+bool LeaseManager::read_lease(const std::string &path, std::string &node, time_t &expires){
+	std::ifstream f(path);
+	long long expires_ll;
+	if(!(f >> node >> expires_ll))
+		return false;
+	expires = (time_t)expires_ll;
+	return true;
+}
+
+bool LeaseManager::claim(const std::string &unit, long &generation){
+	long current = this->generation(unit);
+	std::string owner;
+	time_t expires = 0;
+	bool valid = false;
+	if(current >= 0){
+		valid = read_lease(lease_path(unit, current), owner, expires);
+		if(valid && owner != node_ && expires >= time(NULL))
+			return false; // held by a live gateway
+	}
+	std::string tmp = dir_ + "." + unit + "." + node_ + ".tmp";
+	if(!write_temp(tmp)){
+		Logging::log.warning("Failed to write " + tmp + ": " + strerror(errno));
+		return false;
+	}
+	bool claimed = false;
+	if(current >= 0 && valid && owner == node_ && expires >= time(NULL)){
+		// held before a restart
+		claimed = (rename(tmp.c_str(), lease_path(unit, current).c_str()) == 0);
+		generation = current;
+	}else{
+		// free, or its holder died. Of gateways taking over at once, only one creates the next generation
+		std::string path = lease_path(unit, current + 1);
+		if(link(tmp.c_str(), path.c_str()) == 0){
+			claimed = true;
+			generation = current + 1;
+			if(current >= 0){
+				unlink(lease_path(unit, current).c_str());
+				Logging::log.message("Took over " + unit + " from " + ((valid)? owner : std::string("unknown gateway")) + ".", 1);
+			}
+		}else if(errno != EEXIST){
+			Logging::log.warning("Failed to create " + path + ": " + strerror(errno));
+		}
+	}
+	unlink(tmp.c_str());
+	return claimed;
+}
+
+bool LeaseManager::renew(const std::string &unit, long generation){
+	if(this->generation(unit) != generation)
+		return false; // taken over
+	std::string path = lease_path(unit, generation);
+	std::string owner;
+	time_t expires;
+	if(!read_lease(path, owner, expires) || owner != node_)
+		return false;
+	std::string tmp = dir_ + "." + unit + "." + node_ + ".tmp";
+	if(!write_temp(tmp) || rename(tmp.c_str(), path.c_str()) == -1){
+		Logging::log.warning("Failed to renew lease " + path + ": " + strerror(errno));
+		unlink(tmp.c_str());
+	}
+	return true;
+}
+
+void LeaseManager::release(const std::string &unit, long generation){
+	std::string path = lease_path(unit, generation);
+	std::string owner;
+	time_t expires;
+	if(read_lease(path, owner, expires) && owner == node_)
+		unlink(path.c_str());
+}
+
+void LeaseManager::write_heartbeat(void) const{
+	std::string tmp = node_path() + ".tmp";
+	if(!write_temp(tmp) || rename(tmp.c_str(), node_path().c_str()) == -1){
+		Logging::log.warning("Failed to write heartbeat " + node_path() + ": " + strerror(errno));
+		unlink(tmp.c_str());
+	}
+}
+
+int LeaseManager::count_live_nodes(void) const{
+	int live = 0;
+	time_t now = time(NULL);
+	boost::system::error_code ec;
+	for(fs::directory_iterator itr(dir_ + LEASE_NODES_DIR, ec), end; !ec && itr != end; itr.increment(ec)){
+		std::string node;
+		time_t expires;
+		if(itr->path().extension() != ".tmp" && read_lease(itr->path().string(), node, expires) && expires >= now)
+			live++;
+	}
+	return std::max(live, 1);
+}
+
+size_t LeaseManager::share(void) const{
+	return (units_.size() + live_ - 1) / live_;
+}
+
+bool LeaseManager::hold(const std::string &unit){
+	if(!enabled())
+		return true;
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(held_.count(unit))
+		return true;
+	long generation;
+	if(stop_ || held_.size() >= share() || !claim(unit, generation))
+		return false;
+	held_[unit] = generation;
+	Logging::log.message("Leased " + unit + ".", 1);
+	return true;
+}
+
+bool LeaseManager::holds(const std::string &unit){
+	if(!enabled())
+		return true;
+	std::lock_guard<std::mutex> lk(mutex_);
+	return held_.count(unit) != 0;
+}
+
+bool LeaseManager::done(const std::string &unit){
+	if(!enabled())
+		return true;
+	std::lock_guard<std::mutex> lk(mutex_);
+	std::map<std::string, long>::iterator held = held_.find(unit);
+	if(held == held_.end())
+		return false;
+	if(held_.size() <= share())
+		return true;
+	release(unit, held->second);
+	held_.erase(held);
+	Logging::log.message("Handing " + unit + " over to another gateway.", 1);
+	return false;
+}
+
+void LeaseManager::beat(void){
+	std::unique_lock<std::mutex> lk(mutex_);
+	while(!stop_){
+		stop_cv_.wait_for(lk, timeout_ / 3);
+		if(stop_)
+			break;
+		write_heartbeat();
+		int live = count_live_nodes();
+		if(live != live_)
+			Logging::log.message("Gateways sharing the work: " + std::to_string(live), 1);
+		live_ = live;
+		for(std::map<std::string, long>::iterator unit = held_.begin(); unit != held_.end();){
+			if(renew(unit->first, unit->second)){
+				++unit;
+				continue;
+			}
+			Logging::log.warning("Lost lease of " + unit->first + " to another gateway.");
+			unit = held_.erase(unit);
+		}
+	}
+}
+
+void LeaseManager::release_all(void){
+	if(!enabled())
+		return;
+	// may be called from a signal handler, don't wait forever for the heartbeat
+	std::unique_lock<std::mutex> lk(mutex_, std::defer_lock);
+	for(int tries = 0; !lk.try_lock(); tries++){
+		if(tries == 100)
+			return; // leases will expire instead
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	stop_ = true;
+	for(const std::pair<const std::string, long> &unit : held_)
+		release(unit.first, unit.second);
+	held_.clear();
+	unlink(node_path().c_str());
+	stop_cv_.notify_all();
+}
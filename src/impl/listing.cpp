@@ -0,0 +1,446 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "listing.hpp"
+#include "destination.hpp"
+#include "alert.hpp"
+#include "signal.hpp"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <boost/filesystem.hpp>
+
+extern "C" {
+	#include <stdio.h>
+	#include <unistd.h>
+}
+
+namespace fs = boost::filesystem;
+
+static size_t depth(const std::string &path){
+	return std::count(path.begin(), path.end(), '/');
+}
+
+std::vector<std::string> TreeOp::scripts(const std::vector<TreeOp> &ops, const std::string &root){
+	std::vector<std::string> lines;
+	std::vector<size_t> moves;
+	for(size_t i = 0; i < ops.size(); i++){
+		if(ops[i].type_ == MOVE)
+			moves.push_back(i);
+	}
+	// park renamed entries, children before the directories holding them
+	std::vector<std::string> staged(ops.size());
+	std::stable_sort(moves.begin(), moves.end(), [&ops](size_t a, size_t b){
+		return depth(ops[a].from_) > depth(ops[b].from_);
+	});
+	for(size_t i : moves){
+		staged[i] = std::string(TREE_OPS_STAGING "/") + std::to_string(lines.size());
+		std::string from = shell_quote(ops[i].from_);
+		lines.push_back("if [ -e " + from + " ] || [ -L " + from + " ]; then mv -f -- " + from + " " + staged[i] + " || s=1; fi");
+	}
+	for(const TreeOp &op : ops){
+		if(op.type_ == REMOVE && !op.late_)
+			lines.push_back("rm -rf -- " + shell_quote(op.from_) + " || s=1");
+	}
+	// unpark, directories before entries renamed into them
+	std::stable_sort(moves.begin(), moves.end(), [&ops](size_t a, size_t b){
+		return depth(ops[a].to_) < depth(ops[b].to_);
+	});
+	for(size_t i : moves){
+		std::string line = "if [ -e " + staged[i] + " ] || [ -L " + staged[i] + " ]; then { ";
+		size_t slash = ops[i].to_.rfind('/');
+		if(slash != std::string::npos)
+			line += "mkdir -p -- " + shell_quote(ops[i].to_.substr(0, slash)) + " && ";
+		line += "rm -rf -- " + shell_quote(ops[i].to_) + " && mv -f -- " + staged[i] + " " + shell_quote(ops[i].to_) + "; } || s=1; fi";
+		lines.push_back(line);
+	}
+	if(!moves.empty())
+		lines.push_back("rm -rf " TREE_OPS_STAGING " || s=1");
+	for(const TreeOp &op : ops){
+		if(op.type_ == REMOVE && op.late_)
+			lines.push_back("rm -rf -- " + shell_quote(op.from_) + " || s=1");
+	}
+	
+	std::vector<std::string> scripts;
+	// every op runs, a failed one makes the script fail so the cycle is replayed
+	std::string header = "cd -- " + shell_quote(root) + " || exit 1\ns=0\n";
+	for(size_t start = 0; start < lines.size(); start += TREE_OPS_PER_SCRIPT){
+		std::string script = header;
+		if(start == 0 && !moves.empty())
+			script += "rm -rf " TREE_OPS_STAGING "; mkdir -p " TREE_OPS_STAGING " || exit 1\n"; // left over from an interrupted cycle
+		size_t end = std::min(lines.size(), start + TREE_OPS_PER_SCRIPT);
+		for(size_t i = start; i < end; i++)
+			script += lines[i] + "\n";
+		script += "exit $s\n";
+		scripts.push_back(script);
+	}
+	return scripts;
+}
+
+std::string ListingStore::path_of(const std::string &rel) const{
+	std::string path = dir_;
+	size_t start = 0;
+	while(start < rel.length()){
+		size_t end = rel.find('/', start);
+		if(end == std::string::npos)
+			end = rel.length();
+		path += "/" LISTING_CHILDREN "/" + rel.substr(start, end - start);
+		start = end + 1;
+	}
+	return path;
+}
+
+bool ListingStore::exists(const std::string &rel) const{
+	boost::system::error_code ec;
+	return fs::exists(path_of(rel) + "/" LISTING_FILE, ec);
+}
+
+bool ListingStore::load(const std::string &rel, std::vector<ListEntry> &entries) const{
+	std::ifstream f(path_of(rel) + "/" LISTING_FILE, std::ios::binary);
+	if(!f)
+		return false;
+	char magic[sizeof(LISTING_MAGIC) - 1];
+	uint64_t count;
+	f.read(magic, sizeof(magic));
+	if(!f || memcmp(magic, LISTING_MAGIC, sizeof(magic)) != 0)
+		return false;
+	f.read((char *)&count, sizeof(count));
+	if(!f)
+		return false;
+	entries.clear();
+	entries.reserve(std::min(count, (uint64_t)1 << 20));
+	for(uint64_t i = 0; i < count; i++){
+		uint64_t ino;
+		uint8_t is_dir;
+		uint16_t name_len;
+		f.read((char *)&ino, sizeof(ino));
+		f.read((char *)&is_dir, sizeof(is_dir));
+		f.read((char *)&name_len, sizeof(name_len));
+		if(!f)
+			return false;
+		ListEntry entry = {(ino_t)ino, is_dir != 0, std::string(name_len, '\0')};
+		f.read(&entry.name_[0], name_len);
+		entries.push_back(std::move(entry));
+	}
+	return (bool)f;
+}
+
+void ListingStore::save(const std::string &rel, const std::vector<ListEntry> &entries) const{
+	std::string dir = path_of(rel);
+	boost::system::error_code ec;
+	fs::create_directories(dir, ec);
+	if(ec){
+		Logging::log.warning("Error creating " + dir + ": " + ec.message());
+		return;
+	}
+	std::string path = dir + "/" LISTING_FILE;
+	std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+		uint64_t count = entries.size();
+		f.write(LISTING_MAGIC, sizeof(LISTING_MAGIC) - 1);
+		f.write((const char *)&count, sizeof(count));
+		for(const ListEntry &entry : entries){
+			uint64_t ino = entry.ino_;
+			uint8_t is_dir = entry.is_dir_;
+			uint16_t name_len = entry.name_.length();
+			f.write((const char *)&ino, sizeof(ino));
+			f.write((const char *)&is_dir, sizeof(is_dir));
+			f.write((const char *)&name_len, sizeof(name_len));
+			f.write(entry.name_.data(), name_len);
+		}
+		if(!f){
+			Logging::log.warning("Error writing directory listing to " + tmp_path);
+			return;
+		}
+	}
+	if(rename(tmp_path.c_str(), path.c_str()) == -1){
+		int err = errno;
+		Logging::log.warning("Error renaming " + tmp_path + ": " + strerror(err));
+	}
+}
+
+void ListingStore::remove(const std::string &rel) const{
+	std::string path = path_of(rel) + "/" LISTING_FILE;
+	if(unlink(path.c_str()) == -1 && errno != ENOENT){
+		int err = errno;
+		Logging::log.warning("Error removing " + path + ": " + strerror(err));
+	}
+}
+
+void ListingStore::remove_tree(const std::string &rel) const{
+	boost::system::error_code ec;
+	fs::remove_all(path_of(rel), ec);
+	if(ec)
+		Logging::log.warning("Error removing listings of " + rel + ": " + ec.message());
+}
+
+bool ListingStore::park(const std::string &rel, size_t slot) const{
+	std::string from_path = path_of(rel);
+	std::string to_path = dir_ + "/" LISTING_PARKED "/" + std::to_string(slot);
+	boost::system::error_code ec;
+	if(!fs::exists(from_path, ec))
+		return false;
+	fs::create_directories(fs::path(to_path).parent_path(), ec);
+	fs::rename(from_path, to_path, ec);
+	if(ec){
+		Logging::log.warning("Error moving listings of " + rel + ": " + ec.message());
+		return false;
+	}
+	return true;
+}
+
+void ListingStore::unpark(size_t slot, const std::string &rel) const{
+	std::string from_path = dir_ + "/" LISTING_PARKED "/" + std::to_string(slot);
+	std::string to_path = path_of(rel);
+	boost::system::error_code ec;
+	fs::remove_all(to_path, ec);
+	fs::create_directories(fs::path(to_path).parent_path(), ec);
+	fs::rename(from_path, to_path, ec);
+	if(ec)
+		Logging::log.warning("Error moving listings to " + rel + ": " + ec.message());
+}
+
+bool TreeChanges::entry_gone(const std::string &path, bool &failed){
+	struct stat st;
+	if(lstat(path.c_str(), &st) == 0)
+		return false; // still there, only filtered out
+	int err = errno;
+	if(err == ENOENT)
+		return true;
+	// can't tell, keep it rather than delete it on destinations
+	Logging::log.warning("Error calling stat on " + path + ": " + strerror(err) + ". Deletes will be looked for again next cycle.");
+	failed = true;
+	return false;
+}
+
+void TreeChanges::enable(const std::string &dir){
+	store_.set_dir(dir);
+	boost::system::error_code ec;
+	fs::create_directories(dir, ec);
+	if(ec){
+		Logging::log.error("Cannot create listing directory " + dir + ": " + ec.message());
+		l::exit(EXIT_FAILURE);
+	}
+}
+
+void TreeChanges::open(DirListing &listing, const std::string &rel, bool first_only) const{
+	listing.rel_ = rel;
+	listing.enabled_ = listing.diff_ = listing.changed_ = false;
+	listing.old_.clear();
+	listing.current_.clear();
+	if(!enabled())
+		return;
+	std::vector<ListEntry> entries;
+	bool loaded = store_.load(rel, entries);
+	if(first_only && (loaded || store_.exists(rel)))
+		return;
+	listing.enabled_ = true;
+	listing.diff_ = loaded;
+	for(ListEntry &entry : entries){
+		std::string name = entry.name_;
+		listing.old_.emplace(std::move(name), std::move(entry));
+	}
+}
+
+bool TreeChanges::record(DirListing &listing, const char *name, size_t len, const struct stat &st){
+	if(!listing.enabled_)
+		return false;
+	bool is_dir = S_ISDIR(st.st_mode);
+	listing.current_.push_back({st.st_ino, is_dir, std::string(name, len)});
+	if(!listing.diff_)
+		return false;
+	const std::string &entry_name = listing.current_.back().name_;
+	std::unordered_map<std::string, ListEntry>::iterator old = listing.old_.find(entry_name);
+	if(old != listing.old_.end() && old->second.ino_ == st.st_ino && old->second.is_dir_ == is_dir){
+		listing.old_.erase(old);
+		return false;
+	}
+	listing.changed_ = true;
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(old != listing.old_.end()){
+		// replaced by another inode, the old one was deleted or moved
+		removed_.push_back(std::make_pair(old->second.ino_, Change{child_path(listing.rel_, entry_name), old->second.is_dir_, false, ""}));
+		listing.old_.erase(old);
+	}
+	added_[st.st_ino] = {child_path(listing.rel_, entry_name), is_dir, true, ""};
+	return true;
+}
+
+void TreeChanges::close(DirListing &listing, const std::string &dir_path){
+	if(!listing.enabled_)
+		return;
+	if(!listing.diff_){
+		store_.save(listing.rel_, listing.current_);
+		std::lock_guard<std::mutex> lk(mutex_);
+		fresh_.insert(listing.rel_);
+		return;
+	}
+	std::vector<std::pair<ino_t, Change>> gone;
+	std::string path = dir_path;
+	if(path.back() != '/')
+		path.push_back('/');
+	size_t dir_len = path.length();
+	bool failed = false;
+	for(const std::pair<const std::string, ListEntry> &old : listing.old_){
+		path.resize(dir_len);
+		path.append(old.first);
+		if(!entry_gone(path, failed))
+			continue;
+		listing.changed_ = true;
+		gone.push_back(std::make_pair(old.second.ino_, Change{child_path(listing.rel_, old.first), old.second.is_dir_, false, ""}));
+	}
+	if(!listing.changed_ && !failed)
+		return;
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(failed)
+		failed_ = true; // cycle is discarded, so the listing is not staged
+	if(!listing.changed_)
+		return;
+	removed_.insert(removed_.end(), gone.begin(), gone.end());
+	staged_.emplace_back(listing.rel_, std::move(listing.current_));
+}
+
+void TreeChanges::resolve(const std::string &snap_path, std::vector<std::string> &new_dirs, std::vector<std::string> &new_files){
+	std::lock_guard<std::mutex> lk(mutex_);
+	ops_.clear();
+	std::vector<std::pair<ino_t, Change>> unmatched;
+	// renamed directories may hold more changes, which may pair up with earlier ones
+	while(!removed_.empty()){
+		std::vector<std::pair<ino_t, Change>> gone;
+		gone.swap(removed_);
+		gone.insert(gone.end(), unmatched.begin(), unmatched.end());
+		unmatched.clear();
+		std::vector<std::pair<std::string, std::string>> moved_dirs;
+		for(const std::pair<ino_t, Change> &entry : gone){
+			std::unordered_map<ino_t, Change>::iterator moved = added_.find(entry.first);
+			if(moved == added_.end() || moved->second.is_dir_ != entry.second.is_dir_){
+				unmatched.push_back(entry);
+				continue;
+			}
+			ops_.push_back({TreeOp::MOVE, entry.second.is_dir_, entry.second.path_, moved->second.path_, false});
+			if(entry.second.is_dir_)
+				moved_dirs.push_back(std::make_pair(entry.second.path_, moved->second.path_));
+			added_.erase(moved);
+		}
+		for(const std::pair<std::string, std::string> &dir : moved_dirs)
+			reconcile(dir.first, dir.second, snap_path);
+	}
+	for(const std::pair<ino_t, Change> &entry : unmatched){
+		bool late = !entry.second.late_path_.empty();
+		ops_.push_back({TreeOp::REMOVE, entry.second.is_dir_, (late)? entry.second.late_path_ : entry.second.path_, "", late});
+	}
+	for(const std::pair<const ino_t, Change> &entry : added_){
+		if(entry.second.is_dir_)
+			new_dirs.push_back(entry.second.path_);
+		else if(!entry.second.queued_)
+			new_files.push_back(entry.second.path_);
+	}
+	added_.clear();
+}
+
+void TreeChanges::reconcile(const std::string &from, const std::string &to, const std::string &snap_path){
+	if(!fresh_.count(to))
+		return; // not read this cycle, listings below from move along unchanged
+	std::vector<ListEntry> old_entries, entries;
+	if(!store_.load(from, old_entries) || !store_.load(to, entries))
+		return;
+	std::unordered_map<std::string, ListEntry> old;
+	for(ListEntry &entry : old_entries){
+		std::string name = entry.name_;
+		old.emplace(std::move(name), std::move(entry));
+	}
+	std::vector<std::string> subdirs;
+	for(const ListEntry &entry : entries){
+		std::unordered_map<std::string, ListEntry>::iterator prev = old.find(entry.name_);
+		if(prev != old.end() && prev->second.ino_ == entry.ino_ && prev->second.is_dir_ == entry.is_dir_){
+			if(entry.is_dir_)
+				subdirs.push_back(entry.name_);
+			old.erase(prev);
+			continue;
+		}
+		if(prev != old.end()){
+			removed_.push_back(std::make_pair(prev->second.ino_, Change{child_path(from, entry.name_), prev->second.is_dir_, false, child_path(to, entry.name_)}));
+			old.erase(prev);
+		}
+		added_[entry.ino_] = {child_path(to, entry.name_), entry.is_dir_, false, ""};
+	}
+	std::string path = snap_path + "/" + to + "/";
+	size_t dir_len = path.length();
+	for(const std::pair<const std::string, ListEntry> &prev : old){
+		path.resize(dir_len);
+		path.append(prev.first);
+		if(!entry_gone(path, failed_))
+			continue;
+		removed_.push_back(std::make_pair(prev.second.ino_, Change{child_path(from, prev.first), prev.second.is_dir_, false, child_path(to, prev.first)}));
+	}
+	staged_.emplace_back(to, std::move(entries)); // replaces the old listing moved here on commit
+	for(const std::string &subdir : subdirs)
+		reconcile(child_path(from, subdir), child_path(to, subdir), snap_path);
+}
+
+void TreeChanges::commit(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	// same order as on destinations, so swapped directories keep their listings
+	std::vector<size_t> moves;
+	for(size_t i = 0; i < ops_.size(); i++){
+		if(ops_[i].is_dir_ && ops_[i].type_ == TreeOp::MOVE)
+			moves.push_back(i);
+	}
+	std::stable_sort(moves.begin(), moves.end(), [this](size_t a, size_t b){
+		return depth(ops_[a].from_) > depth(ops_[b].from_);
+	});
+	std::vector<bool> parked(ops_.size(), false);
+	for(size_t i : moves)
+		parked[i] = store_.park(ops_[i].from_, i);
+	for(const TreeOp &op : ops_){
+		if(op.is_dir_ && op.type_ == TreeOp::REMOVE && !op.late_)
+			store_.remove_tree(op.from_);
+	}
+	std::stable_sort(moves.begin(), moves.end(), [this](size_t a, size_t b){
+		return depth(ops_[a].to_) < depth(ops_[b].to_);
+	});
+	for(size_t i : moves){
+		if(parked[i])
+			store_.unpark(i, ops_[i].to_);
+	}
+	for(const TreeOp &op : ops_){
+		if(op.is_dir_ && op.type_ == TreeOp::REMOVE && op.late_)
+			store_.remove_tree(op.from_);
+	}
+	for(const std::pair<std::string, std::vector<ListEntry>> &listing : staged_)
+		store_.save(listing.first, listing.second);
+	fresh_.clear();
+	staged_.clear();
+	ops_.clear();
+	failed_ = false;
+}
+
+void TreeChanges::discard(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	// a renamed directory must still look new next cycle to be compared with its old listing
+	for(const std::string &rel : fresh_)
+		store_.remove(rel);
+	removed_.clear();
+	added_.clear();
+	fresh_.clear();
+	staged_.clear();
+	ops_.clear();
+	failed_ = false;
+}
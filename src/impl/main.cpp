@@ -26,7 +26,13 @@
 #include "config.hpp"
 #include "crawler.hpp"
 #include "alert.hpp"
+#include "profiler.hpp"
+#include "concurrency.hpp"
+#include "lease.hpp"
+#include "signal.hpp"
 #include <boost/filesystem.hpp>
+#include <list>
+#include <thread>
 
 extern "C" {
 	#include <getopt.h>
@@ -59,6 +65,7 @@ inline void usage(){
 		"  -h --help                     - print this message\n"
 		"  -n --nproc <# of processes>   - number of sync processes to run in parallel\n"
 		"  -o --oneshot                  - manually sync changes once and exit\n"
+		"  -p --profile <path>           - write Chrome trace of each cycle to path\n"
 		"  -q --quiet                    - set log level to 0\n"
 		"  -s --seed                     - send all files to seed destination\n"
 		"  -S --set-last-change          - prime last change time to only sync changes\n"
@@ -94,10 +101,11 @@ int main(int argc, char *argv[], char *envp[]){
 		{"dry-run",         no_argument,       0, 'd'},
 		{"threads",         required_argument, 0, 't'},
 		{"version",         no_argument,       0, 'V'},
+		{"profile",         required_argument, 0, 'p'},
 		{0, 0, 0, 0}
 	};
 	
-	while((opt = getopt_long(argc, argv, "c:hvqsSn:odt:V", long_options, &option_ind)) != -1){
+	while((opt = getopt_long(argc, argv, "c:hvqsSn:odt:Vp:", long_options, &option_ind)) != -1){
 		switch(opt){
 			case 0:
 				// flag set
@@ -123,6 +131,7 @@ int main(int argc, char *argv[], char *envp[]){
 					config_overrides.nproc_override = ConfigOverride<int>(std::stoi(optarg));
 				}catch(const std::invalid_argument &){
 					Logging::log.error("Invalid number of processes.");
+					Logging::log.flush();
 					abort();
 				}
 				break;
@@ -137,6 +146,7 @@ int main(int argc, char *argv[], char *envp[]){
 					config_overrides.threads_override = ConfigOverride<int>(std::stoi(optarg));
 				}catch(const std::invalid_argument &){
 					Logging::log.error("Invalid number of threads.");
+					Logging::log.flush();
 					abort();
 				}
 				break;
@@ -146,6 +156,9 @@ int main(int argc, char *argv[], char *envp[]){
 			case 'V':
 				print_vers_and_exit = true;
 				break;
+			case 'p':
+				Profiling::profiler.enable_trace(optarg);
+				break;
 			case '?':
 				break; // getopt_long prints errors
 			default:
@@ -158,8 +171,65 @@ int main(int argc, char *argv[], char *envp[]){
 		return 0;
 	}
 	
-	Crawler crawler(config_path, get_env_size(envp), config_overrides);
-	crawler.poll_base(seed, dry_run, set_rctime, oneshot);
+	// before any thread but the logger is made, so all of them inherit the blocked signals
+	signal_handling::start();
+	
+	std::vector<std::string> sections = Config::sections(config_path);
+	if(sections.empty())
+		sections.push_back(""); // whole file is one root
+	
+	// one crawler per [section] or shard, each with its own snapshot, last rctime and destinations
+	std::list<Crawler> crawlers;
+	int total_nproc = 0, total_threads = 0;
+	bool active_active = false;
+	std::string lease_dir, node_name;
+	std::chrono::seconds lease_timeout(0);
+	uintmax_t bw_limit = 0;
+	intmax_t meta_op_limit = 0;
+	for(const std::string &section : sections){
+		Config config(config_path, config_overrides, section);
+		if(crawlers.empty()){
+			total_nproc = config.total_nproc();
+			total_threads = config.total_threads();
+			active_active = config.active_active();
+			lease_dir = config.lease_dir();
+			node_name = config.node_name();
+			lease_timeout = config.lease_timeout();
+			bw_limit = config.bw_limit();
+			meta_op_limit = config.meta_op_limit();
+			// before any crawler is made, so every root draws from the same limits
+			Limits::configure(bw_limit, meta_op_limit, config.limit_schedule());
+		}else if(config.bw_limit() != bw_limit || config.meta_op_limit() != meta_op_limit || config.limit_schedule().str() != Limits::schedule.str()){
+			Logging::log.warning("Bandwidth Limit, Metadata Op Limit and Limit Schedule are shared by all roots. Ignoring those set in [" + config.name() + "].");
+		}
+		if(config.shard_depth()){
+			std::vector<Config> shards = config.shards();
+			Logging::log.message("Split " + ((config.name().empty())? std::string("source") : "[" + config.name() + "]") + " into " + std::to_string(shards.size()) + " shards.", 1);
+			for(const Config &shard : shards)
+				crawlers.emplace_back(shard, get_env_size(envp));
+		}else{
+			crawlers.emplace_back(config, get_env_size(envp));
+		}
+	}
+	if(active_active)
+		Leases::manager.start(lease_dir, node_name, lease_timeout);
+	Budgets::threads.set_capacity(total_threads, crawlers.size());
+	Budgets::procs.set_capacity(total_nproc, crawlers.size());
+	if(crawlers.size() == 1){
+		crawlers.front().poll_base(seed, dry_run, set_rctime, oneshot);
+		if(signal_handling::stopping())
+			signal_handling::stop_cleanup();
+		Leases::manager.release_all();
+		return 0;
+	}
+	std::vector<std::thread> threads;
+	for(Crawler &crawler : crawlers)
+		threads.emplace_back(&Crawler::poll_base, &crawler, seed, dry_run, set_rctime, oneshot);
+	for(std::thread &th : threads)
+		th.join();
+	if(signal_handling::stopping())
+		signal_handling::stop_cleanup();
+	Leases::manager.release_all();
 	
 	return 0;
 }
@@ -0,0 +1,248 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.hpp"
+#include "alert.hpp"
+#include "signal.hpp"
+#include <sstream>
+#include <cstring>
+
+extern "C" {
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+	#include <unistd.h>
+	#include <errno.h>
+}
+
+namespace Metrics{
+	std::atomic<unsigned> next_shard(0);
+	MetricsRegistry &registry = *new MetricsRegistry;
+	bool enabled = false;
+	Counter &entries_scanned = registry.counter("cephgeorep_entries_scanned_total", "Directory entries stat'ed by the crawler.");
+	Histogram &stat_latency = registry.histogram("cephgeorep_stat_seconds", "Latency of lstat on snapshot entries.", 1e-9);
+	Histogram &getxattr_latency = registry.histogram("cephgeorep_getxattr_seconds", "Latency of reading ceph.dir.rctime.", 1e-9);
+	Counter &files_queued = registry.counter("cephgeorep_files_queued_total", "Files queued for sync.");
+	Counter &bytes_queued = registry.counter("cephgeorep_bytes_queued_total", "Bytes queued for sync.");
+	Histogram &batch_launch_latency = registry.histogram("cephgeorep_batch_launch_seconds", "Time to fork a sync process for a batch.", 1e-9);
+	Histogram &batch_duration = registry.histogram("cephgeorep_batch_duration_seconds", "Run time of successful sync batches.", 1e-9);
+	Counter &bytes_prefetched = registry.counter("cephgeorep_bytes_prefetched_total", "Bytes of batch files read ahead into the page cache.");
+	Histogram &cycle_duration = registry.histogram("cephgeorep_cycle_duration_seconds", "Time from snapshot to end of sync for each cycle.", 1e-9);
+	Gauge &replication_lag = registry.gauge("cephgeorep_replication_lag_seconds", "Age of the newest change at the end of the last completed sync.");
+	Gauge &last_sync = registry.gauge("cephgeorep_last_sync_timestamp_seconds", "Unix time of the last completed sync.");
+	Gauge &status = registry.gauge("cephgeorep_status", "Daemon status code, see status.hpp.");
+}
+
+Counter::Counter(void){
+	for(Shard &shard : shards_)
+		shard.value_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value(void) const{
+	uint64_t sum = 0;
+	for(const Shard &shard : shards_)
+		sum += shard.value_.load(std::memory_order_relaxed);
+	return sum;
+}
+
+Histogram::Histogram(double scale) : scale_(scale){
+	for(Shard &shard : shards_){
+		for(std::atomic<uint64_t> &bucket : shard.buckets_)
+			bucket.store(0, std::memory_order_relaxed);
+		shard.sum_.store(0, std::memory_order_relaxed);
+	}
+}
+
+void Histogram::render(std::string &out, const std::string &name, const std::string &labels) const{
+	std::string prefix = (labels.empty())? "" : labels + ",";
+	std::ostringstream ss;
+	uint64_t cumulative = 0;
+	uint64_t sum = 0;
+	for(int i = 0; i < METRICS_HIST_BUCKETS; i++){
+		for(const Shard &shard : shards_)
+			cumulative += shard.buckets_[i].load(std::memory_order_relaxed);
+		if(i == METRICS_HIST_BUCKETS - 1)
+			ss << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+		else
+			ss << name << "_bucket{" << prefix << "le=\"" << (double)(UINT64_C(1) << i) * scale_ << "\"} " << cumulative << "\n";
+	}
+	for(const Shard &shard : shards_)
+		sum += shard.sum_.load(std::memory_order_relaxed);
+	std::string braces = (labels.empty())? "" : "{" + labels + "}";
+	ss << name << "_sum" << braces << " " << (double)sum * scale_ << "\n";
+	ss << name << "_count" << braces << " " << cumulative << "\n";
+	out += ss.str();
+}
+
+MetricsRegistry::Entry *MetricsRegistry::find(const std::string &name, const std::string &labels){
+	for(Entry &entry : entries_)
+		if(entry.name_ == name && entry.labels_ == labels)
+			return &entry;
+	return nullptr;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help, const std::string &labels){
+	std::lock_guard<std::mutex> lk(mutex_);
+	Entry *entry = find(name, labels);
+	if(entry)
+		return *static_cast<Counter *>(entry->metric_);
+	counters_.emplace_back();
+	entries_.push_back(Entry{name, help, labels, COUNTER, &counters_.back()});
+	return counters_.back();
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help, const std::string &labels){
+	std::lock_guard<std::mutex> lk(mutex_);
+	Entry *entry = find(name, labels);
+	if(entry)
+		return *static_cast<Gauge *>(entry->metric_);
+	gauges_.emplace_back();
+	entries_.push_back(Entry{name, help, labels, GAUGE, &gauges_.back()});
+	return gauges_.back();
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help, double scale, const std::string &labels){
+	std::lock_guard<std::mutex> lk(mutex_);
+	Entry *entry = find(name, labels);
+	if(entry)
+		return *static_cast<Histogram *>(entry->metric_);
+	histograms_.emplace_back(scale);
+	entries_.push_back(Entry{name, help, labels, HISTOGRAM, &histograms_.back()});
+	return histograms_.back();
+}
+
+std::string MetricsRegistry::render(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	std::string out;
+	std::vector<const std::string *> done;
+	for(const Entry &family : entries_){
+		// group every label set of a name under one HELP and TYPE
+		bool seen = false;
+		for(const std::string *name : done)
+			if(*name == family.name_)
+				seen = true;
+		if(seen)
+			continue;
+		done.push_back(&family.name_);
+		static const char *type_names[] = {"counter", "gauge", "histogram"};
+		out += "# HELP " + family.name_ + " " + family.help_ + "\n";
+		out += "# TYPE " + family.name_ + " " + type_names[family.type_] + "\n";
+		for(const Entry &entry : entries_){
+			if(entry.name_ != family.name_)
+				continue;
+			std::string braces = (entry.labels_.empty())? "" : "{" + entry.labels_ + "}";
+			std::ostringstream ss;
+			switch(entry.type_){
+				case COUNTER:
+					ss << entry.name_ << braces << " " << static_cast<const Counter *>(entry.metric_)->value() << "\n";
+					break;
+				case GAUGE:
+					ss << entry.name_ << braces << " " << static_cast<const Gauge *>(entry.metric_)->value() << "\n";
+					break;
+				case HISTOGRAM:
+					static_cast<const Histogram *>(entry.metric_)->render(out, entry.name_, entry.labels_);
+					break;
+			}
+			out += ss.str();
+		}
+	}
+	return out;
+}
+
+std::string MetricsRegistry::label(const std::string &key, const std::string &value){
+	std::string escaped;
+	for(char c : value){
+		if(c == '\\' || c == '"')
+			escaped += '\\';
+		if(c == '\n'){
+			escaped += "\\n";
+			continue;
+		}
+		escaped += c;
+	}
+	return key + "=\"" + escaped + "\"";
+}
+
+MetricsServer::MetricsServer(void) : listen_fd_(-1){}
+
+MetricsServer::~MetricsServer(void){
+	if(thread_.joinable())
+		thread_.detach();
+}
+
+void MetricsServer::start(int port){
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); // sync processes must not inherit it
+	if(listen_fd_ == -1){
+		Logging::log.error(std::string("Failed to create metrics socket: ") + strerror(errno));
+		l::exit(EXIT_FAILURE);
+	}
+	int opt = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd_, 8) == -1){
+		Logging::log.error("Failed to listen on 127.0.0.1:" + std::to_string(port) + " for metrics: " + strerror(errno));
+		l::exit(EXIT_FAILURE);
+	}
+	Metrics::enabled = true;
+	thread_ = std::thread(&MetricsServer::serve, this);
+	Logging::log.message("Serving metrics on http://127.0.0.1:" + std::to_string(port) + "/metrics", 2);
+}
+
+void MetricsServer::serve(void){
+	for(;;){
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			Logging::log.warning(std::string("Metrics server stopped: ") + strerror(errno));
+			return;
+		}
+		struct timeval timeout = {1, 0}; // don't let a stuck client block scrapes
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		char request[METRICS_REQUEST_MAX];
+		ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+		std::string response;
+		if(len <= 0){
+			close(fd);
+			continue;
+		}
+		request[len] = '\0';
+		if(strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0){
+			std::string body = Metrics::registry.render();
+			response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+		}else{
+			response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		}
+		const char *ptr = response.c_str();
+		size_t left = response.length();
+		while(left){
+			ssize_t res = send(fd, ptr, left, MSG_NOSIGNAL);
+			if(res <= 0)
+				break;
+			ptr += res;
+			left -= res;
+		}
+		close(fd);
+	}
+}
@@ -0,0 +1,133 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "prefetch.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+}
+
+Prefetcher::Prefetcher(uintmax_t budget) : budget_(budget), outstanding_(0), stop_(false){}
+
+Prefetcher::~Prefetcher(void){
+	stop();
+}
+
+void Prefetcher::start(void){
+	if(!enabled() || thread_.joinable())
+		return;
+	stop_ = false;
+	thread_ = std::thread(&Prefetcher::work, this);
+}
+
+void Prefetcher::stop(void){
+	if(!thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		stop_ = true;
+		for(std::shared_ptr<PrefetchBatch> &batch : batches_)
+			batch->done_ = true;
+		batches_.clear();
+	}
+	cv_.notify_all();
+	thread_.join();
+	outstanding_ = 0;
+}
+
+std::shared_ptr<PrefetchBatch> Prefetcher::add(char *const *begin, char *const *end, int shares){
+	if(!enabled() || begin == end)
+		return nullptr;
+	std::shared_ptr<PrefetchBatch> batch = std::make_shared<PrefetchBatch>();
+	batch->paths_.assign(begin, end);
+	batch->cap_ = std::max<uintmax_t>(budget_ / std::max(shares, 1), 1);
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		batches_.push_back(batch);
+	}
+	cv_.notify_all();
+	return batch;
+}
+
+void Prefetcher::finish(std::shared_ptr<PrefetchBatch> &batch){
+	if(!batch)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		batch->done_ = true;
+		outstanding_ -= std::min(outstanding_, batch->bytes_);
+		batch->bytes_ = 0;
+		batches_.erase(std::remove(batches_.begin(), batches_.end(), batch), batches_.end());
+	}
+	cv_.notify_all();
+	batch.reset();
+}
+
+void Prefetcher::work(void){
+	std::unique_lock<std::mutex> lk(mutex_);
+	for(;;){
+		// oldest batch with a file left and room in its share and the budget
+		std::shared_ptr<PrefetchBatch> batch;
+		cv_.wait(lk, [&]{
+			if(stop_)
+				return true;
+			for(std::shared_ptr<PrefetchBatch> &candidate : batches_){
+				if(candidate->bytes_ < candidate->cap_ && outstanding_ < budget_){
+					batch = candidate;
+					return true;
+				}
+			}
+			return false;
+		});
+		if(stop_)
+			return;
+		const char *path = batch->paths_[batch->next_++];
+		if(batch->next_ == batch->paths_.size())
+			batches_.erase(std::find(batches_.begin(), batches_.end(), batch));
+		lk.unlock();
+		// open and stat outside the lock, each can take a round trip to the MDS
+		int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+		struct stat st;
+		if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+			if(fd != -1)
+				close(fd);
+			lk.lock();
+			continue;
+		}
+		lk.lock();
+		if(batch->done_){
+			lk.unlock();
+			close(fd);
+			lk.lock();
+			continue;
+		}
+		uintmax_t len = std::min<uintmax_t>(st.st_size, std::min(batch->cap_ - batch->bytes_, budget_ - outstanding_));
+		batch->bytes_ += len;
+		outstanding_ += len;
+		lk.unlock();
+		posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED); // starts readahead without waiting for it
+		close(fd);
+		Metrics::bytes_prefetched.add(len);
+		lk.lock();
+	}
+}
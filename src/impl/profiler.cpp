@@ -0,0 +1,169 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.hpp"
+#include "alert.hpp"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+namespace Profiling{
+	Profiler profiler;
+}
+
+Profiler::Profiler(void) : open_cycles_(0), origin_(std::chrono::steady_clock::now()), truncated_(false), truncation_reported_(false){
+	reset();
+}
+
+void Profiler::enable_trace(const std::string &path){
+	trace_path_ = path;
+}
+
+void Profiler::begin_cycle(void){
+	std::lock_guard<std::mutex> lk(cycle_mutex_);
+	if(open_cycles_++ == 0)
+		reset();
+}
+
+void Profiler::reset(void){
+	for(int i = 0; i < PROF_N_PHASES; i++){
+		phase_ns_[i].store(0, std::memory_order_relaxed);
+		measured_[i].store(false, std::memory_order_relaxed);
+	}
+	cycle_start_ = std::chrono::steady_clock::now();
+}
+
+const char *Profiler::phase_name(ProfilePhase phase){
+	static const char *names[PROF_N_PHASES] = {
+		"check", "snapshot_create", "prop_delay", "crawl", "readdir", "stat", "xattr",
+		"sort", "schedule", "transfer", "snapshot_delete", "flush"
+	};
+	return names[phase];
+}
+
+int Profiler::thread_id(void){
+	static std::atomic<int> next_id(1);
+	static thread_local int id = next_id.fetch_add(1, std::memory_order_relaxed);
+	return id;
+}
+
+void Profiler::span(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, const std::string &args){
+	if(!tracing())
+		return;
+	TraceEvent event = {
+		name,
+		thread_id(),
+		std::chrono::duration_cast<std::chrono::microseconds>(start - origin_).count(),
+		std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+		args
+	};
+	std::lock_guard<std::mutex> lk(trace_mutex_);
+	if(events_.size() >= PROFILE_MAX_EVENTS){
+		truncated_ = true;
+		return;
+	}
+	events_.push_back(std::move(event));
+}
+
+void Profiler::end_cycle(bool report){
+	std::lock_guard<std::mutex> lk(cycle_mutex_);
+	if(--open_cycles_ > 0 || !report)
+		return;
+	std::chrono::steady_clock::duration total = std::chrono::steady_clock::now() - cycle_start_;
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(3);
+	ss << "Cycle profile (ms): total=" << std::chrono::duration_cast<std::chrono::microseconds>(total).count() / 1000.0;
+	for(int i = 0; i < PROF_N_PHASES; i++){
+		if(!measured_[i].load(std::memory_order_relaxed))
+			continue;
+		ss << " " << phase_name((ProfilePhase)i) << "=" << phase_ns_[i].load(std::memory_order_relaxed) / 1e6;
+	}
+	Logging::log.message(ss.str(), 1, LOG_CRAWLER);
+	if(tracing())
+		write_trace();
+}
+
+std::string Profiler::json_string(const std::string &str){
+	std::ostringstream os;
+	os << '"';
+	for(char c : str){
+		switch(c){
+			case '"':
+				os << "\\\"";
+				break;
+			case '\\':
+				os << "\\\\";
+				break;
+			default:
+				if((unsigned char)c < 0x20)
+					os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+				else
+					os << c;
+		}
+	}
+	os << '"';
+	return os.str();
+}
+
+void Profiler::write_trace(void){
+	std::string tmp_path = trace_path_ + ".tmp";
+	std::ofstream f(tmp_path);
+	if(!f){
+		Logging::log.warning("Could not open profile output: " + tmp_path);
+		return;
+	}
+	int pid = getpid();
+	f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	{
+		std::lock_guard<std::mutex> lk(trace_mutex_);
+		bool first = true;
+		for(const TraceEvent &event : events_){
+			if(!first)
+				f << ",\n";
+			first = false;
+			f << "{\"name\":" << json_string(event.name_);
+			f << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << event.tid_;
+			f << ",\"ts\":" << event.ts_us_ << ",\"dur\":" << event.dur_us_;
+			if(!event.args_.empty())
+				f << ",\"args\":{" << event.args_ << "}";
+			f << "}";
+		}
+		if(truncated_ && !truncation_reported_){
+			truncation_reported_ = true;
+			Logging::log.warning("Profile trace reached " + std::to_string(PROFILE_MAX_EVENTS) + " events, later spans were dropped.");
+		}
+	}
+	f << "\n]}\n";
+	f.close();
+	if(!f || std::rename(tmp_path.c_str(), trace_path_.c_str()) != 0)
+		Logging::log.warning("Could not write profile output: " + trace_path_);
+}
+
+ProfileScope::ProfileScope(ProfilePhase phase) : phase_(phase), start_(std::chrono::steady_clock::now()){}
+
+ProfileScope::~ProfileScope(void){
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	Profiling::profiler.add(phase_, end - start_);
+	Profiling::profiler.span(Profiler::phase_name(phase_), start_, end);
+}
@@ -0,0 +1,211 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rateLimiter.hpp"
+#include <thread>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <ctime>
+#include <boost/tokenizer.hpp>
+
+inline bool parse_time_of_day(const std::string &str, int &minutes){
+	int hours, mins;
+	char colon;
+	std::istringstream ss(str);
+	if(!(ss >> hours >> colon >> mins) || colon != ':' || !ss.eof())
+		return false;
+	if(hours < 0 || hours > 24 || mins < 0 || mins > 59 || (hours == 24 && mins != 0))
+		return false;
+	minutes = hours * 60 + mins;
+	return true;
+}
+
+bool LimitSchedule::parse(const std::string &value){
+	boost::tokenizer<boost::char_separator<char>> tokens(value, boost::char_separator<char>(", "));
+	windows_.clear();
+	for(const std::string &window : tokens){
+		std::size_t dash = window.find('-');
+		if(dash == std::string::npos)
+			return false;
+		int start, end;
+		if(!parse_time_of_day(window.substr(0, dash), start) || !parse_time_of_day(window.substr(dash + 1), end))
+			return false;
+		windows_.emplace_back(start, end);
+	}
+	return true;
+}
+
+bool LimitSchedule::active(void) const{
+	if(windows_.empty())
+		return true;
+	std::time_t now = std::time(nullptr);
+	std::tm local;
+	localtime_r(&now, &local);
+	int minutes = local.tm_hour * 60 + local.tm_min;
+	for(const std::pair<int, int> &window : windows_){
+		if(window.first <= window.second){
+			if(minutes >= window.first && minutes < window.second)
+				return true;
+		}else if(minutes >= window.first || minutes < window.second){ // wraps past midnight
+			return true;
+		}
+	}
+	return false;
+}
+
+std::string LimitSchedule::str(void) const{
+	std::stringstream ss;
+	ss << std::setfill('0');
+	for(std::size_t i = 0; i < windows_.size(); i++){
+		if(i) ss << ",";
+		ss << std::setw(2) << windows_[i].first / 60 << ":" << std::setw(2) << windows_[i].first % 60 << "-";
+		ss << std::setw(2) << windows_[i].second / 60 << ":" << std::setw(2) << windows_[i].second % 60;
+	}
+	return ss.str();
+}
+
+TokenBucket::TokenBucket(double rate, const LimitSchedule *schedule)
+	: rate_(rate)
+	, burst_(rate)
+	, tokens_(rate)
+	, last_refill_(std::chrono::steady_clock::now())
+	, schedule_(schedule){}
+
+void TokenBucket::set_rate(double rate, const LimitSchedule *schedule){
+	std::lock_guard<std::mutex> lk(mutex_);
+	rate_ = rate;
+	burst_ = rate;
+	tokens_ = rate;
+	last_refill_ = std::chrono::steady_clock::now();
+	schedule_ = schedule;
+}
+
+void TokenBucket::acquire(double tokens){
+	if(rate_ <= 0 || (schedule_ && !schedule_->active()))
+		return;
+	std::chrono::duration<double> wait(0);
+	{
+		std::unique_lock<std::mutex> lk(mutex_);
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - last_refill_;
+		last_refill_ = now;
+		tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+		tokens_ -= tokens; // reserve, even if overdrawn
+		if(tokens_ < 0)
+			wait = std::chrono::duration<double>(-tokens_ / rate_);
+	}
+	if(wait.count() > 0)
+		std::this_thread::sleep_for(wait);
+}
+
+BandwidthLimiter::BandwidthLimiter(void) : bytes_per_sec_(0), schedule_(nullptr), granted_(0){}
+
+void BandwidthLimiter::configure(uintmax_t bytes_per_sec, const LimitSchedule *schedule){
+	std::lock_guard<std::mutex> lk(mutex_);
+	bytes_per_sec_ = bytes_per_sec;
+	schedule_ = schedule;
+}
+
+bool BandwidthLimiter::enabled(void) const{
+	std::lock_guard<std::mutex> lk(mutex_);
+	return bytes_per_sec_ != 0;
+}
+
+void BandwidthLimiter::set_slots(const void *owner, int slots){
+	std::lock_guard<std::mutex> lk(mutex_);
+	owners_[owner].slots_ = std::max(slots, 0);
+}
+
+bool BandwidthLimiter::grantable(const void *owner, int slots, uintmax_t &bytes_per_sec){
+	if(!bytes_per_sec_ || (schedule_ && !schedule_->active())){
+		bytes_per_sec = 0;
+		return true;
+	}
+	BandwidthShare &self = owners_[owner];
+	slots = std::max(slots, 1);
+	int total_slots = 0;
+	for(const std::pair<const void * const, BandwidthShare> &entry : owners_)
+		total_slots += entry.second.slots_;
+	if(self.slots_ < slots)
+		total_slots += slots - self.slots_; // owner did not announce these
+	// shares handed out while fewer were sending may be larger, wait for them to come back
+	uintmax_t share = std::max<uintmax_t>(bytes_per_sec_ * slots / total_slots, 1);
+	if(granted_ + share > bytes_per_sec_)
+		return false;
+	granted_ += share;
+	self.granted_ += share;
+	bytes_per_sec = share;
+	return true;
+}
+
+bool BandwidthLimiter::try_grant(const void *owner, int slots, uintmax_t &bytes_per_sec){
+	std::lock_guard<std::mutex> lk(mutex_);
+	return grantable(owner, slots, bytes_per_sec);
+}
+
+uintmax_t BandwidthLimiter::grant(const void *owner, int slots){
+	std::unique_lock<std::mutex> lk(mutex_);
+	uintmax_t bytes_per_sec;
+	while(!grantable(owner, slots, bytes_per_sec))
+		released_.wait(lk);
+	return bytes_per_sec;
+}
+
+void BandwidthLimiter::release(const void *owner, uintmax_t bytes_per_sec){
+	if(!bytes_per_sec)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		BandwidthShare &self = owners_[owner];
+		bytes_per_sec = std::min(bytes_per_sec, self.granted_);
+		self.granted_ -= bytes_per_sec;
+		granted_ -= bytes_per_sec;
+	}
+	released_.notify_all();
+}
+
+void BandwidthLimiter::release_all(const void *owner){
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		std::map<const void *, BandwidthShare>::iterator entry = owners_.find(owner);
+		if(entry == owners_.end())
+			return;
+		granted_ -= entry->second.granted_;
+		owners_.erase(entry);
+	}
+	released_.notify_all();
+}
+
+uintmax_t BandwidthLimiter::granted(void) const{
+	std::lock_guard<std::mutex> lk(mutex_);
+	return granted_;
+}
+
+namespace Limits{
+	LimitSchedule schedule;
+	BandwidthLimiter bandwidth;
+	TokenBucket meta_ops(0);
+	
+	void configure(uintmax_t bw_limit, double meta_op_limit, const LimitSchedule &limit_schedule){
+		schedule = limit_schedule;
+		bandwidth.configure(bw_limit, &schedule);
+		meta_ops.set_rate(meta_op_limit, &schedule);
+	}
+}
@@ -20,27 +20,31 @@
 #include "rctime.hpp"
 #include "alert.hpp"
 #include "signal.hpp"
-#include "file.hpp"
+#include "rctimeProvider.hpp"
 #include <fstream>
 
 extern "C" {
-	#include <sys/xattr.h>
 	#include <sys/stat.h>
 }
 
-inline bool operator>(const timespec &lhs, const timespec &rhs){
-	return (lhs.tv_sec > rhs.tv_sec) ||
-	((lhs.tv_sec == rhs.tv_sec) && (lhs.tv_nsec > rhs.tv_nsec));
+LastRctime::LastRctime(const fs::path &last_rctime_path, const timespec &initial) : last_rctime_path_(last_rctime_path), writable_(true){
+	Logging::log.message("Reading last rctime from disk.", 2);
+	if(!fs::exists(last_rctime_path_) && (initial.tv_sec || initial.tv_nsec)){
+		last_rctime_ = initial;
+		write_last_rctime();
+		return;
+	}
+	if(!read()){
+		init_last_rctime();
+		last_rctime_.tv_sec = last_rctime_.tv_nsec = 0;
+	}
 }
 
-LastRctime::LastRctime(const fs::path &last_rctime_path) : last_rctime_path_(last_rctime_path){
-	Logging::log.message("Reading last rctime from disk.", 2);
+bool LastRctime::read(void){
 	std::ifstream f(last_rctime_path_.string());
 	std::string str;
-	if(!f){
-		init_last_rctime();
-		f.open(last_rctime_path_.string());
-	}
+	if(!f)
+		return false;
 	try{
 		getline(f, str, '.');
 		last_rctime_.tv_sec = (time_t)stoul(str);
@@ -49,9 +53,18 @@ LastRctime::LastRctime(const fs::path &last_rctime_path) : last_rctime_path_(las
 	}catch(const std::invalid_argument &){
 		// last_rctime.dat corrupted
 		Logging::log.warning(last_rctime_path_.string() + " is corrupt. Reinitializing.");
-		init_last_rctime();
-		last_rctime_.tv_sec = last_rctime_.tv_nsec = 0;
+		return false;
 	}
+	return true;
+}
+
+void LastRctime::set_writable(bool writable){
+	writable_ = writable;
+}
+
+void LastRctime::reload(void){
+	Logging::log.message("Reading last rctime from disk.", 2);
+	read();
 }
 
 LastRctime::~LastRctime(void){
@@ -59,6 +72,8 @@ LastRctime::~LastRctime(void){
 }
 
 void LastRctime::write_last_rctime(void) const{
+	if(!writable_)
+		return;
 	Logging::log.message("Writing last rctime to disk.", 2);
 	std::ofstream f(last_rctime_path_.string());
 	if(!f){
@@ -82,77 +97,23 @@ void LastRctime::init_last_rctime(void) const{
 	f.close();
 }
 
-bool LastRctime::is_newer(const File &file) const{
-	return get_rctime(file) > last_rctime_;
-}
-
-timespec LastRctime::get_rctime(const File &file) const{
-	if(file.is_directory()){
-		timespec rctime;
-		char value[XATTR_SIZE] = {0};
-		if(lgetxattr(file.path(), "ceph.dir.rctime", value, XATTR_SIZE) == -1){
-			int err = errno;
-			Logging::log.warning(std::string("getxattr failed: ") + strerror(err));
-			Logging::log.warning(std::string("Cannot read ceph.dir.rctime of ") + file.path());
-			rctime.tv_sec = 0;
-			rctime.tv_nsec = 0;
-		}else{
-			// value = <seconds> + '.09' + <nanoseconds>
-			char *seconds = value;
-			// cut value at '.'
-			char *ptr = value;
-			while(*ptr != '.' && *ptr != '\0')
-				ptr++;
-			*ptr = '\0'; // cut string
-			ptr += 3; // advance past .09
-			char *nanoseconds = ptr;
-			rctime.tv_sec = (time_t)strtoul(seconds, &ptr, 10);
-			rctime.tv_nsec = strtol(nanoseconds, &ptr, 10);
-		}
-		return rctime;
-	}else{ // file
-		return file.rctime();
-	}
-}
-
-timespec LastRctime::get_rctime(const fs::path &path) const{
-	timespec rctime;
-	if(is_directory(fs::symlink_status(path))){
-		char value[XATTR_SIZE] = {0};
-		if(lgetxattr(path.c_str(), "ceph.dir.rctime", value, XATTR_SIZE) == -1){
-			Logging::log.warning("Cannot read ceph.dir.rctime of " + path.string() + "\nIgnoring " + path.string());
-			rctime.tv_sec = 0;
-			rctime.tv_nsec = 0;
-		}else{
-			std::string str(value);
-			rctime.tv_sec = (time_t)stoul(str.substr(0,str.find('.')));
-			// value = <seconds> + '.09' + <nanoseconds>
-			// +3 is to remove the '.09'
-			rctime.tv_nsec = stol(str.substr(str.find('.')+3, std::string::npos));
-		}
-	}else{ // file
-		struct stat t_stat;
-		if(lstat(path.c_str(), &t_stat) == -1){
-			Logging::log.warning("Cannot read mtime of " + path.string() + "\nIgnoring " + path.string());
-			rctime.tv_sec = 0;
-			rctime.tv_nsec = 0;
-		}else{
-			rctime.tv_sec = t_stat.st_mtim.tv_sec;
-			rctime.tv_nsec = t_stat.st_mtim.tv_nsec;
-		}
-	}
-	return rctime;
+bool LastRctime::is_newer(const timespec &rctime) const{
+	return rctime > last_rctime_;
 }
 
 const timespec &LastRctime::rctime(void) const{
 	return last_rctime_;
 }
 
-bool LastRctime::check_for_change(const fs::path &path, timespec &new_rctime) const{
+bool LastRctime::check_for_change(const fs::path &path, timespec &new_rctime, RctimeProvider &provider) const{
+	return changed_since(path, last_rctime_, new_rctime, provider);
+}
+
+bool LastRctime::changed_since(const fs::path &path, const timespec &since, timespec &new_rctime, RctimeProvider &provider){
 	bool change = false;
 	timespec temp_rctime;
 	for(fs::directory_iterator itr(path); itr != fs::directory_iterator(); *itr++){
-		if((temp_rctime = get_rctime(*itr)) > last_rctime_){
+		if((temp_rctime = provider.get_rctime(itr->path())) > since){
 			change = true;
 			if(temp_rctime > new_rctime){ // get highest
 				new_rctime.tv_sec = temp_rctime.tv_sec;
@@ -163,6 +124,15 @@ bool LastRctime::check_for_change(const fs::path &path, timespec &new_rctime) co
 	return change;
 }
 
+bool LastRctime::check_root_change(const fs::path &path, timespec &new_rctime) const{
+	struct stat st;
+	if(lstat(path.c_str(), &st) == -1 || !(st.st_ctim > last_rctime_))
+		return false;
+	if(st.st_ctim > new_rctime)
+		new_rctime = st.st_ctim;
+	return true;
+}
+
 void LastRctime::update(const timespec &new_rctime){
 	last_rctime_.tv_sec = new_rctime.tv_sec;
 	last_rctime_.tv_nsec = new_rctime.tv_nsec;
@@ -0,0 +1,175 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rctimeProvider.hpp"
+#include "rctime.hpp"
+#include "file.hpp"
+#include "alert.hpp"
+#include <cstring>
+
+extern "C" {
+	#include <sys/xattr.h>
+	#include <sys/stat.h>
+	#include <dirent.h>
+}
+
+inline timespec newest(const timespec &a, const timespec &b){
+	return (b > a)? b : a;
+}
+
+timespec RctimeProvider::get_rctime(const File &file){
+	if(file.is_directory()){
+		timespec rctime;
+		if(!dir_rctime(file.path(), rctime)){
+			rctime.tv_sec = 0;
+			rctime.tv_nsec = 0;
+		}
+		return rctime;
+	}else{ // file
+		return file.rctime();
+	}
+}
+
+timespec RctimeProvider::get_rctime(const fs::path &path){
+	timespec rctime;
+	if(is_directory(fs::symlink_status(path))){
+		if(!dir_rctime(path.c_str(), rctime)){
+			Logging::log.warning("Ignoring " + path.string());
+			rctime.tv_sec = 0;
+			rctime.tv_nsec = 0;
+		}
+	}else{ // file
+		struct stat t_stat;
+		if(lstat(path.c_str(), &t_stat) == -1){
+			Logging::log.warning("Cannot read mtime of " + path.string() + "\nIgnoring " + path.string());
+			rctime.tv_sec = 0;
+			rctime.tv_nsec = 0;
+		}else{
+			rctime.tv_sec = t_stat.st_mtim.tv_sec;
+			rctime.tv_nsec = t_stat.st_mtim.tv_nsec;
+		}
+	}
+	return rctime;
+}
+
+XattrRctime::XattrRctime(const std::string &name, bool ceph) : name_(name), ceph_(ceph){}
+
+bool XattrRctime::dir_rctime(const char *path, timespec &rctime){
+	char value[XATTR_SIZE] = {0};
+	if(lgetxattr(path, name_.c_str(), value, XATTR_SIZE - 1) == -1){
+		int err = errno;
+		Logging::log.warning(std::string("getxattr failed: ") + strerror(err));
+		Logging::log.warning("Cannot read " + name_ + " of " + path);
+		return false;
+	}
+	// value = <seconds> + '.09' + <nanoseconds> for ceph, <seconds>.<nanoseconds> otherwise
+	char *seconds = value;
+	// cut value at '.'
+	char *ptr = value;
+	while(*ptr != '.' && *ptr != '\0')
+		ptr++;
+	bool has_nsec = (*ptr == '.');
+	*ptr = '\0'; // cut string
+	char *nanoseconds = ptr;
+	if(has_nsec)
+		nanoseconds += (ceph_)? 3 : 1; // advance past .09 or .
+	rctime.tv_sec = (time_t)strtoul(seconds, &ptr, 10);
+	rctime.tv_nsec = (has_nsec)? strtol(nanoseconds, &ptr, 10) : 0;
+	return true;
+}
+
+bool XattrRctime::snapshots(void) const{
+	return ceph_;
+}
+
+std::string XattrRctime::describe(void) const{
+	return "xattr " + name_;
+}
+
+timespec ScanRctime::scan(const std::string &path, std::unordered_map<std::string, timespec> &found){
+	timespec rctime = {0, 0};
+	struct stat st;
+	if(lstat(path.c_str(), &st) == 0)
+		rctime = st.st_ctim; // catches entries being added, removed or renamed
+	DIR *dir = opendir(path.c_str());
+	if(!dir){
+		int err = errno;
+		Logging::log.warning("Cannot scan " + path + ": " + strerror(err));
+		found[path] = rctime;
+		return rctime;
+	}
+	struct dirent *ent;
+	while((ent = readdir(dir)) != nullptr){
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		std::string child = path + "/" + ent->d_name;
+		if(lstat(child.c_str(), &st) == -1)
+			continue; // removed while scanning
+		if(S_ISDIR(st.st_mode))
+			rctime = newest(rctime, scan(child, found));
+		else
+			rctime = newest(rctime, newest(st.st_mtim, st.st_ctim));
+	}
+	closedir(dir);
+	found[path] = rctime;
+	return rctime;
+}
+
+bool ScanRctime::dir_rctime(const char *path, timespec &rctime){
+	std::string key(path);
+	while(key.length() > 1 && key.back() == '/')
+		key.pop_back();
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		std::unordered_map<std::string, timespec>::const_iterator itr = cache_.find(key);
+		if(itr != cache_.end()){
+			rctime = itr->second;
+			return true;
+		}
+	}
+	// scan without holding lock, other threads may scan other subtrees
+	std::unordered_map<std::string, timespec> found;
+	rctime = scan(key, found);
+	std::lock_guard<std::mutex> lk(mutex_);
+	cache_.insert(found.begin(), found.end());
+	return true;
+}
+
+bool ScanRctime::snapshots(void) const{
+	return false;
+}
+
+void ScanRctime::new_cycle(void){
+	std::lock_guard<std::mutex> lk(mutex_);
+	cache_.clear();
+}
+
+std::string ScanRctime::describe(void) const{
+	return "recursive scan";
+}
+
+RctimeProvider *make_rctime_provider(const std::string &source){
+	if(source == "ceph")
+		return new XattrRctime(CEPH_RCTIME_XATTR, true);
+	if(source == "xattr")
+		return new XattrRctime(USER_RCTIME_XATTR, false);
+	if(source == "scan")
+		return new ScanRctime;
+	return nullptr;
+}
@@ -20,42 +20,102 @@
 #include "signal.hpp"
 #include "crawler.hpp"
 #include "status.hpp"
+#include "alert.hpp"
+#include "lease.hpp"
 #include <csignal>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
-namespace signal_handling{
-	const Crawler *crawler_ = nullptr;
+extern "C" {
+	#include <pthread.h>
 }
 
-void sig_hdlr(int signum){
-	// cleanup from termination
-	if(signal_handling::crawler_){
-		signal_handling::crawler_->write_last_rctime();
-		signal_handling::crawler_->delete_snap();
+namespace signal_handling{
+	std::vector<const Crawler *> crawlers_; // one per source root
+	std::mutex crawlers_mutex_;
+	std::atomic<bool> stopping_(false);
+	std::mutex stop_mutex_;
+	std::condition_variable stop_cv_;
+	
+	void termination_signals(sigset_t &set){
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGTERM);
+		sigaddset(&set, SIGQUIT);
 	}
-	switch(signum){
-		case SIGINT:
-		case SIGTERM:
-		case SIGQUIT:
-			Status::status.set(Status::NOT_RUNNING);
-			exit(EXIT_SUCCESS);
-		default:
-			Status::status.set(Status::EXIT_FAILED);
-			exit(signum);
+	
+	void wait_signals(void){
+		sigset_t set;
+		termination_signals(set);
+		for(;;){
+			int signum;
+			if(sigwait(&set, &signum) != 0)
+				continue;
+			if(!stopping_.exchange(true)){
+				Logging::log.message(std::string("Caught ") + strsignal(signum) + ", stopping.", 1);
+				std::unique_lock<std::mutex> lk(stop_mutex_);
+				stop_cv_.notify_all();
+				continue;
+			}
+			// asked again, don't wait for the roots
+			Logging::log.message(std::string("Caught ") + strsignal(signum) + " again, exiting now.", 1);
+			{
+				std::unique_lock<std::mutex> lk(crawlers_mutex_);
+				for(const Crawler *crawler : crawlers_)
+					crawler->write_last_rctime();
+			}
+			l::exit(EXIT_SUCCESS);
+		}
 	}
 }
 
 void set_signal_handlers(const Crawler *crawler){
-	signal_handling::crawler_ = crawler;
-	signal(SIGINT, sig_hdlr);
-	signal(SIGTERM, sig_hdlr);
-	signal(SIGQUIT, sig_hdlr);
+	std::unique_lock<std::mutex> lk(signal_handling::crawlers_mutex_);
+	signal_handling::crawlers_.push_back(crawler);
+}
+
+void signal_handling::block(void){
+	sigset_t set;
+	termination_signals(set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void signal_handling::start(void){
+	block();
+	std::thread(wait_signals).detach();
+}
+
+bool signal_handling::stopping(void){
+	return stopping_.load(std::memory_order_relaxed);
+}
+
+bool signal_handling::sleep_for(std::chrono::steady_clock::duration duration){
+	std::unique_lock<std::mutex> lk(stop_mutex_);
+	return !stop_cv_.wait_for(lk, duration, [](){ return stopping_.load(); });
+}
+
+void signal_handling::stop_cleanup(void){
+	{
+		std::unique_lock<std::mutex> lk(crawlers_mutex_);
+		for(const Crawler *crawler : crawlers_)
+			crawler->write_last_rctime();
+	}
+	Status::status.set(Status::NOT_RUNNING);
 }
 
 void signal_handling::error_cleanup(void){
-	if(signal_handling::crawler_)
-		signal_handling::crawler_->delete_snap();
+	{
+		std::unique_lock<std::mutex> lk(signal_handling::crawlers_mutex_);
+		for(const Crawler *crawler : signal_handling::crawlers_)
+			crawler->delete_snap();
+	}
+	Leases::manager.release_all();
 }
 
 void l::exit(int num, int status){
@@ -64,5 +124,6 @@ void l::exit(int num, int status){
 	else
 		Status::status.set(status);
 	signal_handling::error_cleanup();
+	Logging::log.flush();
 	::exit(num);
 }
@@ -19,6 +19,7 @@
 
 #include "status.hpp"
 #include "alert.hpp"
+#include "metrics.hpp"
 #include <fstream>
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
@@ -27,7 +28,7 @@ namespace Status{
 	StatusSetter status{};
 }
 
-StatusSetter::StatusSetter(void){
+StatusSetter::StatusSetter(void) : status_(0){
 	try{
 		fs::create_directories(STATUS_PATH);
 	}catch(const boost::system::error_code &ec){
@@ -40,6 +41,11 @@ StatusSetter::StatusSetter(void){
 }
 
 void StatusSetter::set(int status){
+	Metrics::status.set(status);
+	std::lock_guard<std::mutex> lk(mutex_);
+	if(status == status_)
+		return; // called after every batch, only touch the file on change
+	status_ = status;
 	f_.open(STATUS_PATH STATUS_FILE, std::fstream::out | std::fstream::trunc);
 	f_ << status << std::endl;
 	f_.close();
@@ -20,11 +20,15 @@
 #include "syncProcess.hpp"
 #include "syncer.hpp"
 #include "file.hpp"
+#include "rctime.hpp"
+#include "metrics.hpp"
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <ctime>
 #include <csignal>
+#include <cstdio>
+#include <algorithm>
 #include <boost/tokenizer.hpp>
 
 extern "C" {
@@ -33,24 +37,42 @@ extern "C" {
 	#include <sys/mman.h>
 }
 
-SyncProcess::SyncProcess(Syncer *parent, int id, int nproc, std::vector<File> &queue)
+SyncProcess::SyncProcess(Syncer *parent, const Lane &lane, int id, int nproc, std::vector<Destination>::iterator destination, bool filter)
 	: 	id_(id),
 		inc_(nproc),
 		pid_(0),
 		max_mem_usage_(parent->max_mem_usage_),
-		start_mem_usage_(parent->start_mem_usage_),
+		start_mem_usage_(lane.start_mem_usage_),
 		curr_payload_bytes_(0),
 		pipefd_{-1,-1},
-		destination_(parent->destination_),
-		sending_to_(*destination_),
-		file_itr_(queue.begin()),
-		payload_(parent->start_payload_){
+		destination_(destination),
+		filter_(filter),
+		sending_to_(destination_->target_),
+		lane_(&lane),
+		file_itr_(lane.begin_),
+		end_(lane.end_),
+		payload_(lane.start_payload_),
+		bwlimit_idx_(lane.bwlimit_idx_),
+		bwgrant_(0),
+		probe_(false){
 	
 	curr_mem_usage_ = start_mem_usage_;
 	
+	if(bwlimit_idx_){
+		set_bwlimit(0);
+		payload_[bwlimit_idx_] = bwlimit_arg_;
+	}
+	
 	start_payload_sz_ = payload_.size();
 	
-	std::advance(file_itr_, id_);
+	if(lane.splits_.empty()){
+		std::advance(file_itr_, id_);
+	}else{
+		// contiguous part of the lane
+		inc_ = 1;
+		file_itr_ = lane.splits_[id_];
+		end_ = lane.splits_[id_ + 1];
+	}
 }
 
 SyncProcess::~SyncProcess(){
@@ -77,42 +99,73 @@ uintmax_t SyncProcess::payload_sz(void) const{
 }
 
 uintmax_t SyncProcess::payload_count(void) const{
-	return payload_.size() - start_payload_sz_ - 2; // subtract NULL and destination
+	return payload_.size() - start_payload_sz_ - ((destination_->target_.empty())? 1 : 2); // subtract NULL and destination
+}
+
+size_t SyncProcess::arg_cost(const File &file){
+	return file.path_len() + 1 + sizeof(char *);
 }
 
 void SyncProcess::add(const std::vector<File>::iterator &itr){
 	payload_.push_back(itr->path());
-	curr_mem_usage_ += itr->path_len() + 1 + sizeof(char *);
+	curr_mem_usage_ += arg_cost(*itr);
 	curr_payload_bytes_ += itr->size();
 }
 
-bool SyncProcess::full_test(const File &file) const{
-	return (curr_mem_usage_ + file.path_len() + 1 + sizeof(char *) >= max_mem_usage_);
-}
-
-void SyncProcess::consume(std::vector<File> &queue){
-	while(file_itr_ < queue.end() && !full_test(*file_itr_)){
-		add(file_itr_);
-		std::advance(file_itr_, inc_);
+void SyncProcess::consume(void){
+	const std::vector<uintmax_t> &cost = lane_->argv_cost_;
+	while(file_itr_ < end_ && curr_mem_usage_ < max_mem_usage_){
+		// count files that fit, costs being summed over every inc_'th file
+		size_t first = file_itr_ - lane_->begin_;
+		uintmax_t base = (first >= (size_t)inc_)? cost[first - inc_] : 0;
+		uintmax_t room = max_mem_usage_ - curr_mem_usage_;
+		size_t lo = 0;
+		size_t hi = (end_ - file_itr_ + inc_ - 1) / inc_;
+		while(lo < hi){
+			size_t mid = lo + (hi - lo) / 2;
+			if(cost[first + mid * inc_] - base < room)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(lo == 0)
+			break;
+		payload_.reserve(payload_.size() + lo + 2);
+		bool skipped = false;
+		for(size_t i = 0; i < lo; i++){
+			if(!filter_ || file_itr_->rctime() > destination_->since_)
+				add(file_itr_);
+			else
+				skipped = true;
+			std::advance(file_itr_, inc_);
+		}
+		if(!skipped)
+			break; // next file doesn't fit
+		// files skipped left room for more
 	}
-	if(!destination_->empty()){
-		sending_to_ = *destination_;
-		payload_.push_back((char *)destination_->c_str());
+	if(!destination_->target_.empty()){
+		sending_to_ = destination_->target_;
+		payload_.push_back((char *)destination_->target_.c_str());
 	}
 	payload_.push_back(NULL);
 }
 
-void SyncProcess::change_destination(){
-	if(!destination_->empty()){
-		payload_.pop_back();
-		payload_.pop_back();
-		sending_to_ = *destination_;
-		payload_.push_back((char *)destination_->c_str());
-		payload_.push_back(NULL);
+void SyncProcess::change_destination(std::vector<Destination>::iterator destination){
+	destination_ = destination;
+	if(!destination_->target_.empty()){
+		sending_to_ = destination_->target_;
+		payload_[payload_.size() - 2] = (char *)destination_->target_.c_str();
 	}
 }
 
+void SyncProcess::set_bwlimit(uintmax_t bytes_per_sec){
+	// rsync takes KiB/s, 0 is unlimited
+	uintmax_t kib_per_sec = (bytes_per_sec)? std::max<uintmax_t>(bytes_per_sec / 1024, 1) : 0;
+	snprintf(bwlimit_arg_, BWLIMIT_ARG_LEN, "--bwlimit=%ju", kib_per_sec);
+}
+
 void SyncProcess::sync_batch(){
+	std::chrono::steady_clock::time_point launch_start = std::chrono::steady_clock::now();
 	if(pipefd_[0] != -1)
 		close(pipefd_[0]);
 	if(pipefd_[1] != -1)
@@ -125,6 +178,7 @@ void SyncProcess::sync_batch(){
 		l::exit(EXIT_FAILURE);
 	}
 
+	launched_at_ = std::chrono::steady_clock::now();
 	pid_ = fork(); // create child process
 	int error;
 	switch(pid_){
@@ -136,6 +190,9 @@ void SyncProcess::sync_batch(){
 			{
 				close(pipefd_[0]);
 				pipefd_[0] = -1;
+				sigset_t all;
+				sigfillset(&all);
+				sigprocmask(SIG_UNBLOCK, &all, NULL); // blocked in the parent for the signal thread
 				signal(SIGINT, SIG_DFL);
 				dup2(pipefd_[1], 1);
 				dup2(pipefd_[1], 2);
@@ -145,13 +202,14 @@ void SyncProcess::sync_batch(){
 				error = errno;
 				exec_error_->exec_failed_ = true;
 				exec_error_->errno_ = error;
-				exit(CHECK_SHMEM);
+				_exit(CHECK_SHMEM); // skip atexit and static destructors of parent
 			}
 			break;
 		default: // parent process
+			Metrics::batch_launch_latency.observe(std::chrono::steady_clock::now() - launch_start);
 			close(pipefd_[1]);
 			pipefd_[1] = -1;
-			Logging::log.message(std::to_string(pid_) + " started.", 2);
+			Logging::log.message(std::to_string(pid_) + " started.", 2, LOG_SYNCER);
 			break;
 	}
 }
@@ -166,8 +224,16 @@ void SyncProcess::reset(void){
 		close(pipefd_[1]);
 }
 
-bool SyncProcess::done(const std::vector<File> &queue) const{
-	return (file_itr_ >= queue.end()); // no room to advance file_itr_ by nproc_
+bool SyncProcess::done(void) const{
+	return (file_itr_ >= end_); // no room to advance file_itr_ by nproc_
+}
+
+const std::string &SyncProcess::lane(void) const{
+	return lane_->name_;
+}
+
+const std::string &SyncProcess::flags(void) const{
+	return lane_->flags_;
 }
 
 const std::string &SyncProcess::destination(void) const{
@@ -205,7 +271,7 @@ void SyncProcess::dump_argv(int error) const{
 		if(arg)
 			f << arg << std::endl;
 	}
-	Logging::log.message(payload_[0] + std::string(" argv logged in ") + log_path, 0);
+	Logging::log.message(payload_[0] + std::string(" argv logged in ") + log_path, 0, LOG_SYNCER);
 
 	f.close();
 }
@@ -230,7 +296,7 @@ std::string SyncProcess::log_errors() const{
 		int err = errno;
 		Logging::log.error(std::string("Error reading pipe for logging error: ") + strerror(err));
 	}else{
-		Logging::log.message(payload_[0] + std::string(" error details logged in ") + log_path, 0);
+		Logging::log.message(payload_[0] + std::string(" error details logged in ") + log_path, 0, LOG_SYNCER);
 	}
 	
 	f.close();
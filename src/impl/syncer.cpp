@@ -23,14 +23,13 @@
 #include "file.hpp"
 #include "alert.hpp"
 #include "signal.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
+#include "concurrency.hpp"
+#include "fileSort.hpp"
 #include <algorithm>
 #include <boost/tokenizer.hpp>
 #include <chrono>
-#include <thread>
-
-#ifndef NO_PARALLEL_SORT
-#include <execution>
-#endif
 
 extern "C" {
 	#include <unistd.h>
@@ -41,38 +40,45 @@ extern "C" {
 	#include <limits.h>
 }
 
+static inline std::string shard_target(const std::string &target, const std::string &shard){
+	// files of a shard are relative to its directory, so they go in the same directory at the destination
+	if(shard.empty())
+		return target;
+	if(target.empty() || target.back() == '/' || target.back() == ':')
+		return target + shard;
+	return target + "/" + shard;
+}
+
+static inline bool ends_with(const std::string& str, const std::string& suffix){
+	return str.size() >= suffix.size()
+		&& str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
 Syncer::Syncer(size_t envp_size, const Config &config)
-    : exec_bin_(config.exec_bin_), exec_flags_(config.exec_flags_){
-	nproc_ = config.nproc_;
+    : exec_bin_(config.exec_bin_), exec_flags_(config.exec_flags_)
+    , fanout_(config.fanout_), running_nproc_(0)
+    , large_threshold_(config.large_threshold_)
+    , transfer_order_(ORDER_SIZE)
+    , chunk_threshold_(config.chunk_threshold_)
+    , delta_threshold_(config.delta_threshold_)
+    , chunker_(config.chunk_size_, config.nproc_)
+    , tree_ops_(config.propagate_deletes_), procs_budget_(&Budgets::procs)
+    , prefetcher_(config.prefetch_budget_){
 	max_mem_usage_ = get_mem_limit(envp_size);
 	
-	start_mem_usage_ = 0;
+	if(Limits::bandwidth.enabled() && !ends_with(exec_bin_, "rsync"))
+		Logging::log.warning("Bandwidth Limit is only supported with rsync. Ignoring.");
 	
-	start_payload_.push_back((char *)exec_bin_.c_str());
-	start_mem_usage_ += exec_bin_.length() + 1 + sizeof(char *); // length of executable name
+	if(config.transfer_order_ == "directory")
+		transfer_order_ = ORDER_DIRECTORY;
+	else if(config.transfer_order_ == "inode")
+		transfer_order_ = ORDER_INODE;
+	else if(config.transfer_order_ == "hybrid")
+		transfer_order_ = ORDER_HYBRID;
 	
-	// account for flags
-	{
-		boost::tokenizer<boost::escaped_list_separator<char>> tokens(
-			exec_flags_,
-			boost::escaped_list_separator<char>(
-				std::string("\\"), std::string(" "), std::string("\"\'")
-			)
-		);
-		for(
-			boost::tokenizer<boost::escaped_list_separator<char>>::iterator itr = tokens.begin();
-			itr != tokens.end();
-			++itr
-		){
-			// push back flags
-			char *flag = new char[(*itr).length()+1];
-			strcpy(flag, itr->c_str());
-			start_payload_.push_back(flag);
-			garbage_.push_back(flag);
-			// account for their size
-			start_mem_usage_ += itr->length() + 1 + sizeof(char *);
-		}
-	}
+	add_lane("", exec_flags_, config.nproc_);
+	if(large_threshold_)
+		add_lane("large", (config.large_flags_.empty())? exec_flags_ : config.large_flags_, config.large_nproc_);
 	
 	{
 		boost::tokenizer<boost::escaped_list_separator<char>> tokens(
@@ -88,24 +94,107 @@ Syncer::Syncer(size_t envp_size, const Config &config)
 		){
 			if(itr->empty())
 				continue;
-			destinations_.emplace_back(*itr);
+			destinations_.emplace_back(shard_target(*itr, config.shard_));
 		}
 	}
 	
 	if(destinations_.empty())
-		destinations_.push_back(construct_destination(config.remote_user_, config.remote_host_, config.remote_directory_));
+		destinations_.emplace_back(shard_target(construct_destination(config.remote_user_, config.remote_host_, config.remote_directory_), config.shard_));
+	make_paths_ = !config.shard_.empty();
 	
 	// account for destinations
 	int max_destination_len = 0;
-	for(const std::string &dest : destinations_){
-		int test_len = dest.length();
+	for(const Destination &dest : destinations_){
+		int test_len = dest.target_.length();
 		if(test_len > max_destination_len)
 			max_destination_len = test_len;
 	}
 	destination_ = destinations_.begin();
-	start_mem_usage_ += max_destination_len + 1 + sizeof(char *);
 	
-	start_mem_usage_ += sizeof(NULL);
+	if(chunk_threshold_ || delta_threshold_){
+		// ranges land where rsync --relative would put the file
+		bool supported = ends_with(exec_bin_, "rsync");
+		for(const Destination &dest : destinations_)
+			supported = supported && ChunkedTransfer::supported(dest);
+		if(!supported){
+			Logging::log.warning("Chunk Threshold and Delta Threshold are only supported with rsync and a destination path. Ignoring.");
+			chunk_threshold_ = delta_threshold_ = 0;
+		}
+	}
+	if(tree_ops_){
+		// paths are replayed where rsync --relative put them
+		bool supported = ends_with(exec_bin_, "rsync");
+		for(const Destination &dest : destinations_)
+			supported = supported && !dest.path_.empty();
+		if(!supported){
+			Logging::log.warning("Propagate Deletes is only supported with rsync and a destination path. Ignoring.");
+			tree_ops_ = false;
+		}
+	}
+	if(chunk_threshold_ || delta_threshold_){
+		ChunkedTransfer::Codec codec = ChunkedTransfer::CODEC_NONE;
+		if(config.compression_ == "auto")
+			codec = ChunkedTransfer::CODEC_AUTO;
+		else if(config.compression_ == "zstd")
+			codec = ChunkedTransfer::CODEC_ZSTD;
+		else if(config.compression_ == "lz4")
+			codec = ChunkedTransfer::CODEC_LZ4;
+		chunker_.set_compression(codec, config.compression_level_);
+		chunker_.set_flags(exec_flags_);
+	}
+	if(delta_threshold_){
+		chunker_.enable_delta(config.delta_block_size_, fs::path(config.last_rctime_path_).parent_path().string() + "/delta");
+		if(!chunk_threshold_ || delta_threshold_ < chunk_threshold_)
+			chunk_threshold_ = delta_threshold_; // delta files are sent by chunker_ too
+	}
+	
+	for(Lane &lane : lanes_){
+		lane.start_mem_usage_ += max_destination_len + 1 + sizeof(char *);
+		// account for null terminator
+		lane.start_mem_usage_ += sizeof(NULL);
+	}
+}
+
+void Syncer::add_lane(const std::string &name, const std::string &flags, int nproc){
+	Lane lane;
+	lane.name_ = name;
+	lane.flags_ = flags;
+	lane.nproc_ = nproc;
+	lane.start_mem_usage_ = 0;
+	lane.bwlimit_idx_ = 0;
+	
+	lane.start_payload_.push_back((char *)exec_bin_.c_str());
+	lane.start_mem_usage_ += exec_bin_.length() + 1 + sizeof(char *); // length of executable name
+	
+	// account for flags
+	boost::tokenizer<boost::escaped_list_separator<char>> tokens(
+		flags,
+		boost::escaped_list_separator<char>(
+			std::string("\\"), std::string(" "), std::string("\"\'")
+		)
+	);
+	for(
+		boost::tokenizer<boost::escaped_list_separator<char>>::iterator itr = tokens.begin();
+		itr != tokens.end();
+		++itr
+	){
+		// push back flags
+		char *flag = new char[(*itr).length()+1];
+		strcpy(flag, itr->c_str());
+		lane.start_payload_.push_back(flag);
+		garbage_.push_back(flag);
+		// account for their size
+		lane.start_mem_usage_ += itr->length() + 1 + sizeof(char *);
+	}
+	
+	// reserve argv slot for per-process share of bandwidth limit
+	if(Limits::bandwidth.enabled() && ends_with(exec_bin_, "rsync")){
+		lane.bwlimit_idx_ = lane.start_payload_.size();
+		lane.start_payload_.push_back(nullptr); // filled in by each SyncProcess
+		lane.start_mem_usage_ += BWLIMIT_ARG_LEN + sizeof(char *);
+	}
+	
+	lanes_.push_back(lane);
 }
 
 Syncer::~Syncer(){
@@ -113,6 +202,14 @@ Syncer::~Syncer(){
 		delete[] string;
 }
 
+std::vector<Destination> &Syncer::destinations(void){
+	return destinations_;
+}
+
+bool Syncer::fanout(void) const{
+	return fanout_;
+}
+
 std::string Syncer::construct_destination(std::string remote_user, std::string remote_host, std::string remote_directory) const{
 	std::string dest = remote_directory;
 	if(!remote_host.empty()){
@@ -124,6 +221,15 @@ std::string Syncer::construct_destination(std::string remote_user, std::string r
 	return dest;
 }
 
+void Syncer::set_nproc(int nproc){
+	lanes_.front().nproc_ = nproc;
+	chunker_.set_nproc(nproc);
+}
+
+void Syncer::reserve_procs(void){
+	procs_budget_ = &reserved_procs_;
+}
+
 size_t Syncer::get_mem_limit(size_t envp_size) const{
 	long arg_max = sysconf(_SC_ARG_MAX);
 	if(arg_max == -1){
@@ -134,23 +240,83 @@ size_t Syncer::get_mem_limit(size_t envp_size) const{
 	return arg_max - envp_size - MEM_LIM_HEADROOM;
 }
 
-void Syncer::sync(std::vector<File> &queue){
+bool Syncer::sync(std::vector<File> &queue, const std::vector<TreeOp> &ops){
 	std::list<SyncProcess> procs;
 
+	if(!fanout_){
+		destination_ = pick_destination();
+		if(destination_ == destinations_.end()){
+			destination_ = destinations_.begin();
+			Status::status.set(Status::ALL_HOSTS_DOWN);
+			Logging::log.message("All destinations are backing off. Deferring sync to next cycle.", 1, LOG_SYNCER);
+			log_health();
+			return false;
+		}
+	}
+
 	// sort files from smallest to largest to get largest files out of the way first from end
-	std::sort(
-#ifndef NO_PARALLEL_SORT
-		std::execution::par,
-#endif
-		queue.begin(), queue.end(),
-		[](const File &first, const File &second){
-		return first.size() < second.size();
-	});
+	{
+		ProfileScope scope(PROF_SORT);
+		sort_by_size(queue);
+	}
+	
+	for(Destination &dest : destinations_){
+		dest.failed_ = false;
+		if(make_paths_ && !dest.path_made_)
+			dest.path_made_ = chunker_.make_path(dest); // rsync only creates the last level
+	}
+	
+	// before files are sent, so renamed ones are found in place
+	if(!ops.empty() && !apply_tree_ops(ops)){
+		destination_ = destinations_.begin();
+		Status::status.set(Status::ALL_HOSTS_DOWN);
+		Logging::log.message("Could not replay deletes and renames on any destination. Deferring sync to next cycle.", 1, LOG_SYNCER);
+		log_health();
+		return false;
+	}
+	if(queue.empty())
+		return true;
+	
+	// sorted by size, so files to send in ranges are the tail of the queue
+	if(chunk_threshold_){
+		ProfileScope scope(PROF_TRANSFER);
+		send_chunked(queue);
+	}
+	
+	// same for the large file lane
+	{
+		std::vector<File>::iterator split = queue.end();
+		if(large_threshold_){
+			split = std::lower_bound(queue.begin(), queue.end(), large_threshold_, [](const File &file, uintmax_t threshold){
+				return file.size() < threshold;
+			});
+		}
+		lanes_.front().begin_ = queue.begin();
+		lanes_.front().end_ = split;
+		if(lanes_.size() > 1){
+			lanes_.back().begin_ = split;
+			lanes_.back().end_ = queue.end();
+			if(split != queue.end())
+				Logging::log.message(std::to_string(queue.end() - split) + " files at or above " + Logging::log.format_bytes(large_threshold_) + " go to the large file lane.", 1, LOG_SYNCER);
+		}
+	}
+	if(transfer_order_ != ORDER_SIZE){
+		ProfileScope scope(PROF_SORT);
+		for(const Lane &lane : lanes_)
+			order_lane(queue, lane);
+	}
 
+	prefetcher_.start();
 	LAUNCH_PROCS_RET_T res;
 	do{
-		launch_procs(procs, queue);
-		res = handle_returned_procs(procs, queue);
+		{
+			ProfileScope scope(PROF_SCHEDULE);
+			launch_procs(procs, queue);
+		}
+		{
+			ProfileScope scope(PROF_TRANSFER);
+			res = handle_returned_procs(procs, queue);
+		}
 		if(res == INC_HEADROOM){
 			if(max_mem_usage_ > MEM_LIM_HEADROOM*2)
 				max_mem_usage_ -= MEM_LIM_HEADROOM;
@@ -159,88 +325,509 @@ void Syncer::sync(std::vector<File> &queue){
 				res = SYNC_FAILED;
 			}
 		}
-	}while(res != SYNC_SUCCESS && res != SYNC_FAILED);
+	}while(res != SYNC_SUCCESS && res != SYNC_FAILED && res != SYNC_DEFERRED);
+	prefetcher_.stop();
+	waiting_procs_.clear();
+	procs_budget_->release_all(this);
+	Limits::bandwidth.release_all(this);
+	for(Lane &lane : lanes_){
+		std::vector<uintmax_t>().swap(lane.argv_cost_); // try to free memory
+		lane.splits_.clear();
+	}
 	if(res == SYNC_FAILED)
 		l::exit(EXIT_FAILURE);
+	if(res == SYNC_DEFERRED){
+		destination_ = destinations_.begin();
+		return false;
+	}
+	if(fanout_){
+		int failed = std::count_if(destinations_.begin(), destinations_.end(), [](const Destination &dest){
+			return dest.failed_;
+		});
+		if(failed == (int)destinations_.size())
+			Status::status.set(Status::ALL_HOSTS_DOWN);
+		else if(failed)
+			Status::status.set(Status::HOST_DOWN);
+	}
+	return true;
 }
 
-void Syncer::launch_procs(std::list<SyncProcess> &procs, std::vector<File> &queue){
-	// cap nproc to between 1 and number of files
-	int nproc = std::min(nproc_, (int)queue.size());
-	nproc = std::max(nproc, 1);
+bool Syncer::apply_tree_ops(const std::vector<TreeOp> &ops){
+	ProfileScope scope(PROF_TRANSFER);
+	Logging::log.message("Replaying " + std::to_string(ops.size()) + " deletes and renames.", 1, LOG_SYNCER);
+	if(fanout_){
+		bool any = false;
+		for(Destination &dest : destinations_){
+			if(!dest.health_.available()){
+				dest.failed_ = true;
+				Logging::log.message("Skipping " + dest.target_ + " for this cycle: " + dest.health_.summary(), 1, LOG_SYNCER);
+				continue;
+			}
+			std::vector<std::string> scripts = TreeOp::scripts(ops, dest.path_);
+			if(run_tree_ops(scripts, dest) == 0)
+				any = true;
+			else
+				dest.failed_ = true; // catches up with the same ops next cycle
+		}
+		return any;
+	}
+	std::vector<Destination>::iterator dest;
+	while((dest = pick_destination()) != destinations_.end()){
+		destination_ = dest;
+		std::vector<std::string> scripts = TreeOp::scripts(ops, dest->path_);
+		int ret = run_tree_ops(scripts, *dest);
+		if(ret == 0)
+			return true;
+		if(ret != SSH_FAIL)
+			dest->health_.record_failure(); // reachable but broken, try the next one
+	}
+	return false;
+}
+
+int Syncer::run_tree_ops(const std::vector<std::string> &scripts, Destination &dest){
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(const std::string &script : scripts){
+		int ret = chunker_.run_script(dest, script);
+		if(ret == SSH_FAIL){
+			Status::status.set(Status::HOST_DOWN);
+			dest.health_.record_failure();
+			Logging::log.message(dest.target_ + ": " + dest.health_.summary(), 1, LOG_SYNCER);
+			return ret;
+		}
+		if(ret != 0){
+			Logging::log.warning("Failed to replay deletes and renames on " + dest.target_ + ", exit code " + std::to_string(ret) + ".");
+			return ret;
+		}
+	}
+	dest.health_.record_success(std::chrono::steady_clock::now() - start);
+	return 0;
+}
+
+std::vector<Destination>::iterator Syncer::pick_destination(void){
+	std::vector<Destination>::iterator dest = (destination_ == destinations_.end())? destinations_.begin() : destination_;
+	for(size_t i = 0; i < destinations_.size(); i++){
+		if(dest->health_.available())
+			return dest;
+		if(++dest == destinations_.end())
+			dest = destinations_.begin();
+	}
+	return destinations_.end();
+}
+
+void Syncer::log_health(void) const{
+	for(const Destination &dest : destinations_){
+		Logging::log.message(dest.target_ + ": " + dest.health_.summary(), 1, LOG_SYNCER);
+	}
+}
+
+void Syncer::send_chunked(std::vector<File> &queue){
+	std::vector<File>::iterator kept = std::lower_bound(queue.begin(), queue.end(), chunk_threshold_, [](const File &file, uintmax_t threshold){
+		return file.size() < threshold;
+	});
+	for(std::vector<File>::iterator file = kept; file != queue.end(); ++file){
+		bool sent = true;
+		if(fanout_){
+			// a destination that fails here is dropped for the cycle and catches up later
+			for(Destination &dest : destinations_){
+				if(dest.failed_ || !(file->rctime() > dest.since_))
+					continue;
+				if(!dest.health_.available()){
+					dest.failed_ = true;
+					Logging::log.message("Skipping " + dest.target_ + " for this cycle: " + dest.health_.summary(), 1, LOG_SYNCER);
+					continue;
+				}
+				if(!send_ranges(*file, dest))
+					dest.failed_ = true;
+			}
+		}else{
+			// fail over while destinations are unreachable, sync processes follow destination_
+			std::vector<Destination>::iterator dest;
+			sent = false;
+			while(!sent && (dest = pick_destination()) != destinations_.end()){
+				destination_ = dest;
+				sent = send_ranges(*file, *destination_);
+				if(!sent && destination_->health_.state() != DestinationHealth::OPEN)
+					break; // reachable but failed, leave it to the sync processes
+			}
+		}
+		if(!sent){
+			// leave for the sync processes, which handle failover
+			if(kept != file)
+				std::swap(*kept, *file);
+			++kept;
+		}
+	}
+	queue.erase(kept, queue.end());
+}
+
+bool Syncer::send_ranges(const File &file, Destination &dest){
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	ChunkedTransfer::Result res = chunker_.send(file, dest, delta_threshold_ && file.size() >= delta_threshold_);
+	if(res == ChunkedTransfer::SENT){
+		std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+		dest.health_.record_success(elapsed);
+		dest.bytes_sent_->add(file.size());
+		dest.files_sent_->add(1);
+		Metrics::batch_duration.observe(elapsed);
+		return true;
+	}
+	if(res == ChunkedTransfer::UNREACHABLE){
+		Status::status.set(Status::HOST_DOWN);
+		dest.health_.record_failure();
+		Logging::log.message(dest.target_ + ": " + dest.health_.summary(), 1, LOG_SYNCER);
+	}
+	return false;
+}
+
+void Syncer::order_lane(std::vector<File> &queue, const Lane &lane) const{
+	size_t first = lane.begin_ - queue.begin();
+	size_t last = lane.end_ - queue.begin();
+	switch(transfer_order_){
+	case ORDER_DIRECTORY:
+		sort_by_path(queue, first, last);
+		break;
+	case ORDER_INODE:
+		radix_sort(queue, first, last, SORT_INODE);
+		break;
+	case ORDER_HYBRID:
+		// directories grouped within each power of two of size
+		sort_by_path(queue, first, last);
+		radix_sort(queue, first, last, SORT_SIZE_CLASS);
+		break;
+	case ORDER_SIZE:
+	default:
+		break;
+	}
+}
 
-	for(int i = 0; i < nproc; i++){
-		procs.emplace_back(this, i, nproc, queue);
+void Syncer::split_lane(Lane &lane, int nproc){
+	uintmax_t total = 0;
+	for(std::vector<File>::iterator itr = lane.begin_; itr != lane.end_; ++itr)
+		total += itr->size() + SPLIT_FILE_WEIGHT;
+	lane.splits_.assign(1, lane.begin_);
+	std::vector<File>::iterator itr = lane.begin_;
+	uintmax_t sum = 0;
+	for(int i = 1; i < nproc; i++){
+		uintmax_t target = total / nproc * i;
+		while(itr != lane.end_ && sum < target)
+			sum += (itr++)->size() + SPLIT_FILE_WEIGHT;
+		lane.splits_.push_back(itr);
+	}
+	lane.splits_.push_back(lane.end_);
+}
+
+void Syncer::sum_argv_cost(Lane &lane, int nproc){
+	size_t count = lane.end_ - lane.begin_;
+	lane.argv_cost_.resize(count);
+	for(size_t i = 0; i < count; i++){
+		uintmax_t cost = SyncProcess::arg_cost(lane.begin_[i]);
+		lane.argv_cost_[i] = (i >= (size_t)nproc)? lane.argv_cost_[i - nproc] + cost : cost;
+	}
+}
+
+void Syncer::launch_procs(std::list<SyncProcess> &procs, std::vector<File> &queue){
+	running_nproc_ = 0;
+	for(Lane &lane : lanes_){
+		if(lane.begin_ == lane.end_)
+			continue;
+		// cap nproc to between 1 and number of files
+		int nproc = std::min(lane.nproc_, (int)(lane.end_ - lane.begin_));
+		nproc = std::max(nproc, 1);
+		
+		running_nproc_ += nproc;
+		if(transfer_order_ == ORDER_SIZE){
+			lane.splits_.clear(); // interleave sizes so each process gets a fair share
+			sum_argv_cost(lane, nproc);
+		}else{
+			split_lane(lane, nproc);
+			sum_argv_cost(lane, 1);
+		}
+		
+		if(fanout_){
+			for(std::vector<Destination>::iterator dest = destinations_.begin(); dest != destinations_.end(); ++dest){
+				if(dest->failed_)
+					continue;
+				if(!dest->health_.available()){
+					dest->failed_ = true;
+					Logging::log.message("Skipping " + dest->target_ + " for this cycle: " + dest->health_.summary(), 1, LOG_SYNCER);
+					continue;
+				}
+				for(int i = 0; i < nproc; i++){
+					procs.emplace_back(this, lane, i, nproc, dest, true);
+				}
+			}
+		}else{
+			for(int i = 0; i < nproc; i++){
+				procs.emplace_back(this, lane, i, nproc, destination_, false);
+			}
+		}
+	}
+	
+	// fill each process, dropping those left with nothing to send
+	for(std::list<SyncProcess>::iterator proc = procs.begin(); proc != procs.end();){
+		proc->consume();
+		if(proc->payload_count() == 0 && proc->done())
+			proc = procs.erase(proc);
+		else
+			++proc;
 	}
 	
 	// start each process
+	Limits::bandwidth.set_slots(this, procs.size());
 	for(SyncProcess &proc : procs){
-		proc.consume(queue);
-		std::string msg = "Launching " + exec_bin_ + " " + exec_flags_ + " with " + std::to_string(proc.payload_count()) + " files.";
-		if(nproc > 1) msg = "Proc " + std::to_string(proc.id()) + ": " + msg;
-		Logging::log.message(msg, 1);
-		proc.sync_batch();
+		std::string msg = "Launching " + exec_bin_ + " " + proc.flags() + " with " + std::to_string(proc.payload_count()) + " files.";
+		msg = proc_msg(proc, msg);
+		Logging::log.message(msg, 1, LOG_SYNCER);
+		launch_batch(proc, procs.size());
 	}
 }
 
-static inline bool ends_with(const std::string& str, const std::string& suffix){
-	return str.size() >= suffix.size()
-		&& str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+std::string Syncer::proc_msg(const SyncProcess &proc, const std::string &msg) const{
+	std::string prefix;
+	if(running_nproc_ > 1)
+		prefix = "Proc " + std::to_string(proc.id());
+	if(!proc.lane().empty())
+		prefix += (prefix.empty()? "" : " ") + std::string("[") + proc.lane() + "]";
+	if(fanout_ && destinations_.size() > 1)
+		prefix += (prefix.empty()? "" : " ") + std::string("(") + proc.destination() + ")";
+	return (prefix.empty())? msg : prefix + ": " + msg;
+}
+
+void Syncer::drop_destination(std::list<SyncProcess> &procs, std::list<SyncProcess>::iterator exited_proc){
+	std::vector<Destination>::iterator dest = exited_proc->destination_;
+	dest->failed_ = true;
+	dest->health_.record_failure();
+	Status::status.set(Status::HOST_DOWN);
+	Logging::log.warning("Skipping " + dest->target_ + " for this cycle. It will catch up from its last synced change.");
+	procs.erase(exited_proc);
+	for(const SyncProcess &proc : procs){
+		if(proc.destination_ == dest && proc.pid() > 0)
+			kill(proc.pid(), SIGINT); // reaped and removed in handle_returned_procs
+	}
+}
+
+bool Syncer::take_bandwidth(SyncProcess &proc){
+	if(!proc.bwlimit_idx_)
+		return true;
+	if(!Limits::bandwidth.try_grant(this, 1, proc.bwgrant_))
+		return false;
+	proc.set_bwlimit(proc.bwgrant_);
+	return true;
+}
+
+void Syncer::return_bandwidth(SyncProcess &proc){
+	Limits::bandwidth.release(this, proc.bwgrant_);
+	proc.bwgrant_ = 0;
+}
+
+void Syncer::launch_batch(SyncProcess &proc, int running){
+	if(!procs_budget_->try_acquire(this)){
+		proc.pid_ = 0;
+		waiting_procs_.push_back(&proc);
+		return;
+	}
+	if(!take_bandwidth(proc)){
+		procs_budget_->release(this);
+		proc.pid_ = 0;
+		waiting_procs_.push_back(&proc); // until processes of any syncer return their share
+		return;
+	}
+	if(!proc.destination_->health_.admit(proc.probe_)){
+		procs_budget_->release(this);
+		return_bandwidth(proc);
+		proc.pid_ = 0;
+		waiting_procs_.push_back(&proc); // until the probe of the half open destination is back
+		return;
+	}
+	run_batch(proc, running);
+}
+
+void Syncer::run_batch(SyncProcess &proc, int running){
+	if(prefetcher_.enabled()){
+		prefetcher_.finish(proc.prefetch_); // batch is being retried
+		char *const *begin = proc.payload_.data() + proc.start_payload_sz_;
+		proc.prefetch_ = prefetcher_.add(begin, begin + proc.payload_count(), running);
+	}
+	proc.sync_batch();
+}
+
+void Syncer::launch_waiting(std::list<SyncProcess> &procs){
+	std::list<SyncProcess *>::iterator itr = waiting_procs_.begin();
+	while(itr != waiting_procs_.end()){
+		SyncProcess *proc = *itr;
+		if(fanout_ && proc->destination_->failed_){
+			itr = waiting_procs_.erase(itr);
+			procs.remove_if([proc](const SyncProcess &p){
+				return &p == proc;
+			});
+			continue;
+		}
+		if(!fanout_ && proc->destination_ != destination_)
+			proc->change_destination(destination_); // failed over while waiting
+		if(!procs_budget_->try_acquire(this))
+			break;
+		if(!take_bandwidth(*proc)){
+			procs_budget_->release(this);
+			break;
+		}
+		if(!proc->destination_->health_.admit(proc->probe_)){
+			procs_budget_->release(this);
+			return_bandwidth(*proc);
+			++itr; // probe of its destination is still out
+			continue;
+		}
+		itr = waiting_procs_.erase(itr);
+		run_batch(*proc, procs.size());
+	}
+}
+
+std::list<SyncProcess>::iterator Syncer::wait_child(std::list<SyncProcess> &procs, pid_t &pid, int &wstatus, bool &status_lost){
+	std::chrono::milliseconds backoff(1);
+	for(;;){
+		if(signal_handling::stopping())
+			return procs.end();
+		launch_waiting(procs);
+		bool running = false;
+		for(std::list<SyncProcess>::iterator proc = procs.begin(); proc != procs.end(); ++proc){
+			if(proc->pid() <= 0)
+				continue;
+			running = true;
+			pid_t ret = waitpid(proc->pid(), &wstatus, WNOHANG);
+			if(ret == proc->pid() || (ret == -1 && errno == ECHILD)){
+				status_lost = (ret == -1);
+				pid = proc->pid();
+				proc->pid_ = 0;
+				end_probe(*proc);
+				procs_budget_->release(this);
+				return_bandwidth(*proc);
+				prefetcher_.finish(proc->prefetch_);
+				return proc;
+			}
+		}
+		if(!running && waiting_procs_.empty())
+			return procs.end();
+		procs_budget_->wait_for(backoff);
+		backoff = std::min(backoff * 2, std::chrono::milliseconds(SYNC_POLL_MAX_MS));
+	}
+}
+
+void Syncer::end_probe(SyncProcess &proc){
+	if(!proc.probe_)
+		return;
+	proc.destination_->health_.end_probe(); // exit code decides with record_success() or record_failure()
+	proc.probe_ = false;
+}
+
+void Syncer::reap_all(std::list<SyncProcess> &procs){
+	for(SyncProcess &proc : procs){
+		if(proc.pid() <= 0)
+			continue;
+		while(waitpid(proc.pid(), NULL, 0) == -1 && errno == EINTR){}
+		proc.pid_ = 0;
+		end_probe(proc);
+		return_bandwidth(proc);
+		prefetcher_.finish(proc.prefetch_);
+	}
+	waiting_procs_.clear();
+	procs_budget_->release_all(this);
+	Limits::bandwidth.release_all(this);
 }
 
 LAUNCH_PROCS_RET_T Syncer::handle_returned_procs(std::list<SyncProcess> &procs, std::vector<File> &queue){
 	int wstatus;
-	const unsigned int num_ssh_fails_to_inc = procs.size(); // increment destination_ when ssh fails and this is 0
-	int nproc = procs.size();
-	std::vector<SyncProcess *> ssh_fail_procs; // hold on to procs that fail from SSH error
+	std::vector<SyncProcess *> parked_procs; // procs waiting for a destination to become reachable
 	while(!procs.empty()){ // while files are remaining in batch queues
+		if(!parked_procs.empty() && parked_procs.size() == procs.size()){
+			// nothing left running, only retry if a destination is out of backoff
+			std::vector<Destination>::iterator dest = pick_destination();
+			if(dest == destinations_.end()){
+				Status::status.set(Status::ALL_HOSTS_DOWN);
+				Logging::log.message("All destinations are backing off. Deferring sync to next cycle.", 1, LOG_SYNCER);
+				log_health();
+				procs.clear();
+				return SYNC_DEFERRED;
+			}
+			destination_ = dest;
+			Logging::log.message("Trying " + destination_->target_ + " again.", 1, LOG_SYNCER);
+			for(SyncProcess *proc_ptr : parked_procs){
+				proc_ptr->change_destination(destination_);
+				launch_batch(*proc_ptr, procs.size());
+			}
+			parked_procs.clear();
+		}
 		// wait for a child to change state then relaunch remaining batches
-		pid_t exited_pid = wait(&wstatus);
-		if(exited_pid == -1){
+		pid_t exited_pid;
+		bool status_lost;
+		std::list<SyncProcess>::iterator exited_proc = wait_child(procs, exited_pid, wstatus, status_lost);
+		if(signal_handling::stopping()){
+			Logging::log.message("Stopping " + exec_bin_ + " processes, unsent batches go out next run.", 1, LOG_SYNCER);
+			for(const SyncProcess &proc : procs){
+				if(proc.pid() > 0)
+					kill(proc.pid(), SIGTERM);
+			}
+			reap_all(procs);
+			procs.clear();
+			return SYNC_DEFERRED;
+		}
+		if(exited_proc == procs.end()){
+			if(procs.empty())
+				break; // last ones were dropped while waiting for a slot
+			if(!parked_procs.empty())
+				continue;
 			Logging::log.error("No children to wait for");
 			return SYNC_FAILED;
 		}
-		// find which object PID belongs to
-		std::list<SyncProcess>::iterator exited_proc = std::find_if (
-			procs.begin(), procs.end(),
-			[&exited_pid](const SyncProcess &proc){
-				return proc.pid() == exited_pid;
-			}
-		);
-		if(exited_proc == procs.end())
+		if(fanout_ && exited_proc->destination_->failed_){
+			// stopped after another process failed to reach its destination
+			procs.erase(exited_proc);
+			continue;
+		}
+		if(status_lost){
+			// reaped elsewhere, so the batch may not have been sent
+			Logging::log.warning(proc_msg(*exited_proc, "Lost exit status of " + std::to_string(exited_pid) + ", trying batch again."));
+			launch_batch(*exited_proc, procs.size());
 			continue;
+		}
 		// check exit code
 		int exit_code = WEXITSTATUS(wstatus);
 
 		if(exit_code == 0){ // success
-			Logging::log.message(std::to_string(exited_pid) + " exited successfully.",2);
+			Logging::log.message(std::to_string(exited_pid) + " exited successfully.", 2, LOG_SYNCER);
 			Status::status.set(Status::OK);
+			std::chrono::steady_clock::duration batch_time = std::chrono::steady_clock::now() - exited_proc->launched_at_;
+			exited_proc->destination_->health_.record_success(batch_time);
+			exited_proc->destination_->bytes_sent_->add(exited_proc->payload_sz());
+			exited_proc->destination_->files_sent_->add(exited_proc->payload_count());
+			Metrics::batch_duration.observe(batch_time);
 			exited_proc->reset();
-			if(exited_proc->done(queue)){
+			if(!fanout_)
+				exited_proc->destination_ = destination_; // next batch goes to current destination
+			if(exited_proc->done()){
 				{
 					std::string msg = "done.";
-					if(nproc > 1) msg = "Proc " + std::to_string(exited_proc->id()) + ": " + msg;
-					Logging::log.message(msg, 1);
+					msg = proc_msg(*exited_proc, msg);
+					Logging::log.message(msg, 1, LOG_SYNCER);
 				}
 				procs.erase(exited_proc);
 			}else{
-				exited_proc->consume(queue);
+				exited_proc->consume();
 				{
-					std::string msg = "Launching " + exec_bin_ + " " + exec_flags_ + " with " + std::to_string(exited_proc->payload_count()) + " files.";
-					if(nproc > 1) msg = "Proc " + std::to_string(exited_proc->id()) + ": " + msg;
-					Logging::log.message(msg, 1);
+					std::string msg = "Launching " + exec_bin_ + " " + exited_proc->flags() + " with " + std::to_string(exited_proc->payload_count()) + " files.";
+					msg = proc_msg(*exited_proc, msg);
+					Logging::log.message(msg, 1, LOG_SYNCER);
 				}
-				exited_proc->sync_batch();
+				launch_batch(*exited_proc, procs.size());
 			}
-			for(SyncProcess *proc_ptr : ssh_fail_procs){
+			for(SyncProcess *proc_ptr : parked_procs){
 				{
 					std::string msg = "Retrying since others succeeded.";
-					if(nproc > 1) msg = "Proc " + std::to_string(proc_ptr->id()) + ": " + msg;
-					Logging::log.message(msg, 1);
+					msg = proc_msg(*proc_ptr, msg);
+					Logging::log.message(msg, 1, LOG_SYNCER);
 				}
-				proc_ptr->sync_batch();
+				proc_ptr->change_destination(destination_);
+				launch_batch(*proc_ptr, procs.size());
 			}
-			ssh_fail_procs.clear();
+			parked_procs.clear();
 		}else if(exit_code == CHECK_SHMEM && exited_proc->exec_error_ && exited_proc->exec_error_->exec_failed_){
 			int returned_errno = exited_proc->exec_error_->errno_;
 			exited_proc->dump_argv(returned_errno);
@@ -248,14 +835,14 @@ LAUNCH_PROCS_RET_T Syncer::handle_returned_procs(std::list<SyncProcess> &procs,
 			if(errno_msg){
 				Logging::log.error("proc " + std::to_string(exited_proc->id()) + ": Failed to execute " + exec_bin_ + ": " + errno_msg);
 				if(returned_errno == E2BIG){
-					Logging::log.message("Changing ARG_MAX headroom and trying again.", 1);
+					Logging::log.message("Changing ARG_MAX headroom and trying again.", 1, LOG_SYNCER);
 					for(const SyncProcess &proc : procs){
-						if(proc.pid() == 0 || exited_pid == proc.pid())
+						if(proc.pid() <= 0)
 							continue;
 						kill(proc.pid(), SIGINT);
 					}
 					// wait for all children to exit
-					while((exited_pid = wait(NULL)) != -1){}
+					reap_all(procs);
 					procs.clear();
 					return INC_HEADROOM;
 				}
@@ -279,35 +866,56 @@ LAUNCH_PROCS_RET_T Syncer::handle_returned_procs(std::list<SyncProcess> &procs,
 			case TIMEOUT_CONN:
 				if(ends_with(exec_bin_, "rsync")){
 					Logging::log.error(Logging::log.rsync_error(exit_code));
-					Logging::log.message("Trying batch again.", 1);
-					exited_proc->sync_batch();
+					Logging::log.message("Trying batch again.", 1, LOG_SYNCER);
+					launch_batch(*exited_proc, procs.size());
 					break;
 				}
 				Logging::log.error("Unknown exit code from " + exec_bin_ + ": " + std::to_string(exit_code));
 				return SYNC_FAILED;
 			case SSH_FAIL:
+				if(fanout_){
+					Logging::log.warning(proc_msg(*exited_proc, exec_bin_ + " failed to connect to " + exited_proc->destination() + "."));
+					drop_destination(procs, exited_proc);
+					break;
+				}
 				{
 					std::string msg = exec_bin_ + " failed to connect to " + exited_proc->destination() + ". Is the server running and connected to your network?";
-					if(nproc > 1) msg = "Proc " + std::to_string(exited_proc->id()) + ": " + msg;
+					msg = proc_msg(*exited_proc, msg);
 					Logging::log.warning(msg);
 				}
-				ssh_fail_procs.push_back(&(*exited_proc));
-				if(ssh_fail_procs.size() >= num_ssh_fails_to_inc){
-					Status::status.set(Status::HOST_DOWN);
-					if(++destination_ == destinations_.end()){ // increment destination itr if all procs fail
-						destination_ = destinations_.begin();
-						Logging::log.message("Waiting for 30 seconds before trying first destination again.", 1);
-						std::this_thread::sleep_for(std::chrono::seconds(30));
-						Logging::log.message("Trying first destination again.", 1);
-					}else{
-						Logging::log.message("Trying next destination.", 1);
+				Status::status.set(Status::HOST_DOWN);
+				if(exited_proc->destination_->health_.state() != DestinationHealth::OPEN){
+					exited_proc->destination_->health_.record_failure();
+					Logging::log.message(exited_proc->destination() + ": " + exited_proc->destination_->health_.summary(), 1, LOG_SYNCER);
+				}
+				for(std::list<SyncProcess *>::iterator itr = waiting_procs_.begin(); itr != waiting_procs_.end();){
+					if((*itr)->destination_ != exited_proc->destination_){
+						++itr;
+						continue;
+					}
+					parked_procs.push_back(*itr); // not launched yet, would only fail the same way
+					itr = waiting_procs_.erase(itr);
+				}
+				{
+					// send to a healthy destination right away instead of waiting for other procs to fail
+					std::vector<Destination>::iterator dest = pick_destination();
+					if(dest == destinations_.end()){
+						exited_proc->pid_ = 0; // already reaped, don't signal
+						parked_procs.push_back(&(*exited_proc));
+						Logging::log.message(proc_msg(*exited_proc, "Waiting for a destination to recover."), 1, LOG_SYNCER);
+						break;
+					}
+					if(dest != destination_){
+						destination_ = dest;
+						Logging::log.message("Trying next destination: " + destination_->target_, 1, LOG_SYNCER);
 					}
-					ssh_fail_procs.clear();
-					// restart all procs
-					for(SyncProcess &proc : procs){
-						proc.change_destination();
-						proc.sync_batch();
+					exited_proc->change_destination(destination_);
+					launch_batch(*exited_proc, procs.size());
+					for(SyncProcess *proc_ptr : parked_procs){
+						proc_ptr->change_destination(destination_);
+						launch_batch(*proc_ptr, procs.size());
 					}
+					parked_procs.clear();
 				}
 				break;
 			default:
@@ -20,30 +20,145 @@
 #pragma once
 
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#define LOG_RING_SIZE 8192 // must be a power of 2
+#define LOG_DRAIN_PERIOD std::chrono::milliseconds(100) // max time between drains of ring buffer
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+enum LogSubsystem {LOG_GENERAL, LOG_CRAWLER, LOG_SYNCER, LOG_N_SUBSYSTEMS};
+
+struct LogEntry{
+	/* Slot in Logger's ring buffer.
+	 */
+	std::atomic<size_t> seq_;
+	/* Ring position this slot is ready for. pos + 1 once written.
+	 */
+	int fd_;
+	/* 1 for stdout, 2 for stderr.
+	 */
+	std::string text_;
+	/* Message with trailing newline.
+	 */
+};
 
 class Logger{
 private:
-	int log_level_;
+	std::atomic<int> log_level_;
 	/* Value from config file. Each log message
 	 * passes a log level to check against this number.
 	 * If the message's level is higher, it is printed.
 	 */
+	std::atomic<int> subsystem_levels_[LOG_N_SUBSYSTEMS];
+	/* Per subsystem override of log_level_, -1 if not overridden.
+	 */
+	std::atomic<int> rate_limit_;
+	/* Max debug (level 2+) messages per second, 0 for unlimited.
+	 */
+	std::atomic<int64_t> rate_window_;
+	/* Second that rate_count_ is counting.
+	 */
+	std::atomic<int> rate_count_;
+	/* Debug messages logged in rate_window_.
+	 */
+	std::atomic<uintmax_t> suppressed_;
+	/* Messages dropped by rate limit since last report.
+	 */
+	std::atomic<uintmax_t> dropped_;
+	/* Debug messages dropped because ring buffer was full since last report.
+	 */
+	LogEntry *ring_;
+	/* Lock free multi producer, single consumer ring buffer.
+	 */
+	std::atomic<size_t> enqueue_pos_;
+	/* Next ring position to be claimed by a producer.
+	 */
+	std::atomic<size_t> dequeue_pos_;
+	/* Next ring position to be written out by consumer.
+	 */
+	std::mutex mutex_;
+	/* Only used for sleeping and waking, never held while writing.
+	 */
+	std::condition_variable wake_;
+	/* Wakes consumer thread.
+	 */
+	std::condition_variable drained_;
+	/* Wakes threads waiting in flush() or for room in push().
+	 */
+	std::atomic<bool> sleeping_;
+	/* True while consumer is waiting for messages.
+	 */
+	std::atomic<bool> stop_;
+	/* Tells consumer to drain and exit.
+	 */
+	std::thread *consumer_;
+	/* Drains ring buffer to stdout and stderr.
+	 */
+	pid_t owner_pid_;
+	/* PID that started consumer_. Forked children must not join it.
+	 */
+	void push(int fd, const std::string &msg, bool droppable);
+	/* Copy msg into the ring buffer. If full, drops a droppable msg,
+	 * otherwise waits for the consumer to make room. Without a consumer
+	 * (forked child or stopping), writes msg directly instead.
+	 */
+	void write_now(int fd, const std::string &msg);
+	/* Write msg and a newline to fd from the calling thread.
+	 */
+	void consume(void);
+	/* Consumer thread loop.
+	 */
+	bool drain(void);
+	/* Write everything in ring buffer in batches. Returns false if empty.
+	 */
 public:
 	explicit Logger(int log_level);
 	/* Constructs Logger, assigning log_level to the
-	 * internal log_level_.
+	 * internal log_level_ and starting consumer thread.
+	 */
+	~Logger(void);
+	/* Write remaining messages and stop consumer thread.
+	 */
+	Logger(const Logger &) = delete;
+	Logger &operator=(const Logger &) = delete;
+	void set_level(int log_level);
+	/* Change default log level.
+	 */
+	void set_level(int log_level, LogSubsystem subsystem);
+	/* Override log level for one subsystem.
 	 */
-	void message(const std::string &msg, int lvl) const;
+	void clear_subsystem_levels(void);
+	/* Remove all subsystem overrides.
+	 */
+	void set_rate_limit(int lines_per_sec);
+	/* Limit debug messages to lines_per_sec. 0 for unlimited.
+	 */
+	bool enabled(int lvl, LogSubsystem subsystem = LOG_GENERAL) const;
+	/* Returns true if a message at lvl would be printed. Use to skip
+	 * building expensive messages.
+	 */
+	void message(const std::string &msg, int lvl, LogSubsystem subsystem = LOG_GENERAL);
 	/* Print message to stdout if lvl >= log_level_.
 	 * Use this for regular informational log messages.
 	 */
-	void warning(const std::string &msg) const;
+	void warning(const std::string &msg);
 	/* Print message to stderr prepended with "Warning: ".
 	 * Use this for non-fatal errors.
 	 */
-	void error(const std::string &msg) const;
+	void error(const std::string &msg);
 	/* Print message to stderr prepended with "Error: ".
 	 */
+	void flush(void);
+	/* Block until everything logged so far has been written.
+	 */
 	std::string format_bytes(uintmax_t bytes) const;
 	/* Return bytes as string in base-1024 SI units.
 	 */
@@ -0,0 +1,143 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "file.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+extern "C" {
+	#include <time.h>
+}
+
+#define CHECKPOINT_MAGIC "CGRCKP1\n"
+#define CHECKPOINT_FILE "crawl_checkpoint" // inside the directory of the last rctime file
+#define CHECKPOINT_WRITE_BYTES (1 << 20) // records buffered before they are written out
+
+struct CrawlResume{
+	/* Crawl to pick up again, read back from a checkpoint.
+	 */
+	std::string snap_path_;
+	/* Snapshot being crawled.
+	 */
+	timespec new_rctime_ = {0, 0};
+	/* Rctime of the root when the snapshot was taken.
+	 */
+	timespec since_ = {0, 0};
+	/* Last rctime the crawl compared against. The checkpoint is stale
+	 * if it moved since.
+	 */
+	timespec defer_cutoff_ = {0, 0};
+	timespec oldest_deferred_ = {0, 0};
+	uintmax_t deferred_files_ = 0;
+	/* Defer Recent state of the crawl so far.
+	 */
+	std::vector<std::string> frontier_;
+	/* Directories left to read, full paths.
+	 */
+};
+
+class CrawlCheckpoint{
+	/* Log of a crawl in progress, so a crawl interrupted by a restart
+	 * continues from where it got to instead of reading the whole tree
+	 * again. Each directory read appends one block holding the files it
+	 * queued, the subdirectories it found and then the directory itself.
+	 * Blocks are buffered and written out every CHECKPOINT_WRITE_BYTES,
+	 * and flushed to disk every interval. On resume, complete blocks
+	 * give back the queued files, and subdirectories found but never
+	 * read are the frontier. A torn block at the end is dropped and its
+	 * directory read again. The snapshot is kept until the cycle is done.
+	 */
+private:
+	std::string path_;
+	/* Checkpoint file, empty if disabled.
+	 */
+	std::chrono::seconds interval_;
+	/* Time between flushes to disk.
+	 */
+	std::mutex mutex_;
+	/* Guards everything below, shared by crawler threads.
+	 */
+	int fd_ = -1;
+	/* Open checkpoint file while recording, -1 otherwise.
+	 */
+	std::string buffer_;
+	/* Blocks not written out yet.
+	 */
+	std::chrono::steady_clock::time_point last_flush_;
+	size_t snap_root_len_ = 0;
+	/* Length of snapshot path, stripped from recorded paths.
+	 */
+	uint64_t valid_len_ = 0;
+	/* End of the last complete block found by load().
+	 */
+	std::atomic<bool> open_{false};
+	/* Set from begin() until remove(), while the snapshot is needed.
+	 */
+	bool write_out(bool flush);
+	/* Write buffer_ to fd_, and fdatasync if flush. Stops recording on
+	 * error. Call with mutex_ held.
+	 */
+	void fail(const std::string &msg);
+	/* Warn, stop recording and drop the checkpoint. Call with mutex_ held.
+	 */
+	const char *rel_of(const char *path, size_t len, size_t &rel_len) const;
+	/* Path relative to the snapshot.
+	 */
+public:
+	void enable(const std::string &path, std::chrono::seconds interval);
+	/* Keep checkpoints in path, flushed every interval.
+	 */
+	bool enabled(void) const{
+		return !path_.empty();
+	}
+	bool open(void) const{
+		return open_;
+	}
+	/* Whether the snapshot of a checkpoint must be kept.
+	 */
+	bool load(CrawlResume &resume, std::vector<File> &files, uintmax_t &total_bytes);
+	/* Read back the checkpoint left by an interrupted crawl, appending
+	 * queued files to files. Returns false if there is none or it is
+	 * unreadable.
+	 */
+	void begin(const std::string &snap_path, const timespec &new_rctime, const timespec &since, const timespec &defer_cutoff);
+	/* Start a new checkpoint for a crawl of snap_path.
+	 */
+	void resume(const std::string &snap_path);
+	/* Continue recording into the loaded checkpoint.
+	 */
+	void record(const std::string &dir, const std::vector<File> &files, const std::vector<std::string> &subdirs, const timespec &oldest_deferred, uintmax_t deferred_files);
+	/* Log one directory read, with the Defer Recent state of the crawl
+	 * so far. Does nothing unless recording.
+	 */
+	void finish(void);
+	/* Crawl done, flush and stop recording. The checkpoint stays until
+	 * remove(), so an interrupted sync sends the same files without
+	 * crawling.
+	 */
+	void remove(void);
+	/* Drop the checkpoint once the cycle is done.
+	 */
+};
@@ -0,0 +1,238 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "rateLimiter.hpp"
+#include "destination.hpp"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+#define CHUNK_BUFF_SIZE (1 << 20) // bytes read and written per call while copying a chunk
+#define CHUNK_PART_SUFFIX ".cephgeorep-part" // appended to temporary file name on destination
+#define CHUNK_DIGEST_PROG "sha256sum" // hashes each range on both ends before the file is put in place
+#define CHUNK_DIGEST_LEN 64 // hex digits printed by CHUNK_DIGEST_PROG
+#define CHUNK_MISMATCH_EXIT 3 // exit code of the verify script when a range differs
+#define COMPRESS_SAMPLES 8 // blocks read from each file to estimate compressibility
+#define COMPRESS_SAMPLE_SIZE (64 << 10) // bytes per sample block
+#define ENTROPY_FAST 7.2 // bits per byte above which a file is not worth compressing
+#define ENTROPY_STRONG 5.0 // bits per byte below which auto picks zstd over lz4
+
+extern "C" {
+	#include <sys/stat.h>
+}
+
+class File;
+
+class ChunkedTransfer{
+	/* Sends one large file as byte ranges copied in parallel. Ranges are
+	 * written into a hidden temporary file next to the destination file.
+	 * Each range is hashed as it is read, and once every range has landed,
+	 * the same ranges of the temporary file are hashed on the destination
+	 * and it is only renamed into place if all of them match. Local destinations are written with
+	 * pread/pwrite, remote ones by piping each range into dd over ssh.
+	 * Files land where rsync --relative would put them.
+	 * In delta mode, the hash of each block sent is cached per destination,
+	 * and later sends only copy the blocks whose hash changed, in place.
+	 */
+public:
+	enum Result {SENT, FAILED, UNREACHABLE};
+	enum Codec {CODEC_NONE, CODEC_LZ4, CODEC_ZSTD, CODEC_AUTO};
+private:
+	uintmax_t chunk_size_;
+	/* Bytes per range.
+	 */
+	int nproc_;
+	/* Number of ranges copied at the same time.
+	 */
+	TokenBucket bandwidth_;
+	/* Shared by all ranges of a send, refilled at the share of
+	 * Limits::bandwidth granted for it.
+	 */
+	uintmax_t block_size_;
+	/* Bytes per block in delta mode. 0 if delta mode is off.
+	 */
+	std::string sig_dir_;
+	/* Directory holding block signatures in delta mode.
+	 */
+	Codec codec_;
+	/* Compression for remote ranges. CODEC_AUTO picks per file.
+	 */
+	int level_;
+	/* Compression level passed to the codec, 0 for its default.
+	 */
+	std::map<std::string, bool> remote_codecs_;
+	/* Whether each host has each codec, checked on first use.
+	 */
+	bool owner_;
+	bool group_;
+	/* Give sent files the owner and group of the source, like rsync -o and -g.
+	 */
+	bool numeric_ids_;
+	/* Set owner and group on remote hosts by number rather than by name.
+	 */
+	struct Job{
+		const char *src_;
+		/* Source path.
+		 */
+		const Destination *dest_;
+		/* Where to send it.
+		 */
+		std::string out_path_;
+		/* File written on destination, temporary unless sent in place.
+		 */
+		uintmax_t size_;
+		/* Size of source file.
+		 */
+		std::vector<std::pair<uintmax_t, uintmax_t>> ranges_;
+		/* Offset and length of each range to copy.
+		 */
+		std::vector<uint64_t> *hashes_;
+		/* If set, hash of each block read is stored here.
+		 */
+		std::vector<std::string> digests_;
+		/* CHUNK_DIGEST_PROG output for each range as read from source.
+		 */
+		Codec codec_;
+		/* Compression for ranges sent over ssh.
+		 */
+		std::atomic<uintmax_t> next_;
+		/* Index of next range or block to work on.
+		 */
+		std::atomic<int> ssh_failed_;
+		/* Set if ssh could not reach the destination.
+		 */
+		std::atomic<int> failed_;
+		/* Set if any range failed.
+		 */
+	};
+	void run_workers(Job &job, void (ChunkedTransfer::*worker)(Job &), uintmax_t items);
+	/* Run worker on up to nproc_ threads sharing job.
+	 */
+	void copy_ranges(Job &job);
+	/* Worker thread. Copies ranges until none are left or one fails.
+	 */
+	bool copy_range(Job &job, uintmax_t idx, int src_fd, int dst_fd);
+	/* Copy range idx, hashing it into job.digests_ on the way through.
+	 */
+	void hash_blocks(Job &job);
+	/* Worker thread. Hashes blocks of source into job.hashes_.
+	 */
+	bool copy_remote(Job &job, int src_fd, uintmax_t offset, uintmax_t len, int tee_fd);
+	/* Pipe one range into dd on the destination host.
+	 */
+	bool copy_fd(Job &job, int src_fd, int out_fd, uintmax_t offset, uintmax_t len, bool positional, int tee_fd);
+	/* Read range from src_fd and write it to out_fd, at the same offset
+	 * if positional, and to tee_fd if not -1.
+	 */
+	bool write_full(const Job &job, int fd, const char *buff, size_t len, uintmax_t offset, bool positional) const;
+	/* write or pwrite exactly len bytes. Returns false on error.
+	 */
+	bool read_full(int fd, char *buff, size_t len, uintmax_t offset) const;
+	/* pread exactly len bytes. Returns false on error or if file shrank.
+	 */
+	Codec pick_codec(const File &file, const Destination &dest);
+	/* Choose compression for file: none for local destinations or hosts
+	 * without the codec, otherwise what choose_codec() picks.
+	 */
+	pid_t spawn(char *const argv[], int in_fd, int out_fd) const;
+	/* Fork and exec argv with in_fd and out_fd as stdin and stdout
+	 * if not -1. Returns pid or -1.
+	 */
+	int wait_exit(pid_t pid) const;
+	/* Wait for pid, returning its exit code or -1 if it was killed.
+	 */
+	int run_remote(const Destination &dest, const std::string &cmd) const;
+	/* Run shell command on destination host, returning its exit code.
+	 */
+	bool set_owner(const Job &job, const struct stat &src_st) const;
+	/* lchown local job.out_path_ to owner and group of source if preserved.
+	 * Only fails if running as root, since rsync skips them otherwise.
+	 */
+	std::string owner_spec(const struct stat &src_st) const;
+	/* Owner and group of source as an argument to chown on a remote host.
+	 */
+	std::string verify_script(const Job &job) const;
+	/* Shell script exiting with CHUNK_MISMATCH_EXIT unless every range of
+	 * job.out_path_ hashes to its digest.
+	 */
+	bool finish(Job &job, const struct stat &src_st, const std::string &final_path);
+	/* Check size and content of job.out_path_, copy owner, group, mode
+	 * and mtime from source and rename into place if it is temporary.
+	 */
+	std::string signature_path(const struct stat &src_st, const Destination &dest) const;
+	/* Path of cached block signatures of a source inode for dest.
+	 */
+	Result send_full(Job &job, const struct stat &src_st, const std::string &rel, const std::string &final_path);
+	/* Send whole file through a temporary file.
+	 */
+	Result send_delta(Job &job, const struct stat &src_st, const std::string &rel, const std::string &final_path);
+	/* Send blocks changed since cached signatures in place, falling back
+	 * to send_full if there are none or the destination doesn't match.
+	 */
+public:
+	ChunkedTransfer(uintmax_t chunk_size, int nproc);
+	/* Construct transfer engine.
+	 */
+	~ChunkedTransfer(void) = default;
+	/* Default destructor.
+	 */
+	void set_nproc(int nproc);
+	/* Change number of ranges copied at the same time.
+	 */
+	bool make_path(const Destination &dest) const;
+	/* Create dest.path_ and its parents on destination. Returns false
+	 * if it could not.
+	 */
+	void set_compression(Codec codec, int level);
+	/* Compress ranges sent over ssh with codec. Disabled if the codec
+	 * can't be run locally.
+	 */
+	void set_flags(const std::string &flags);
+	/* Preserve owner and group of sent files if rsync flags would.
+	 */
+	void enable_delta(uintmax_t block_size, const std::string &sig_dir);
+	/* Turn on delta mode, caching signatures in sig_dir.
+	 * Rounds chunk size up to a whole number of blocks.
+	 */
+	int run_script(const Destination &dest, const std::string &script) const;
+	/* Feed script to sh on destination, or locally if it has no host.
+	 * Returns exit code, 255 if ssh failed to connect.
+	 */
+	static Codec choose_codec(const File &file, Codec codec);
+	/* Returns CODEC_NONE for known compressed formats and data whose
+	 * sampled byte entropy is too high, zstd or lz4 by entropy if codec
+	 * is CODEC_AUTO, otherwise codec.
+	 */
+	static const char *codec_name(Codec codec);
+	/* Return program name of codec.
+	 */
+	static bool supported(const Destination &dest);
+	/* Returns true if files can be sent to dest in ranges.
+	 */
+	Result send(const File &file, const Destination &dest, bool delta);
+	/* Copy file to dest in parallel ranges, compare hashes of each range
+	 * on both ends and rename into place.
+	 * If delta, only send changed blocks. Returns UNREACHABLE if ssh failed
+	 * to connect.
+	 */
+};
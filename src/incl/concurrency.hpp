@@ -0,0 +1,229 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+
+#define ADAPT_MIN_CRAWL_ENTRIES 1000 // ignore crawl samples smaller than this
+#define ADAPT_MIN_SYNC_FILES 100 // ignore transfer samples with fewer files than this
+#define ADAPT_MIN_SAMPLE_TIME std::chrono::seconds(1) // ignore samples shorter than this
+#define ADAPT_TOLERANCE 0.05 // relative change in rate considered noise
+#define ADAPT_LATENCY_FACTOR 2.0 // stat latency above this multiple of baseline means MDS is overloaded
+
+struct CrawlSample{
+	/* Measurements taken from one crawl.
+	 */
+	uintmax_t entries;
+	/* Number of directory entries stat'ed.
+	 */
+	std::chrono::steady_clock::duration elapsed;
+	/* Wall time of crawl.
+	 */
+	std::chrono::steady_clock::duration stat_time;
+	/* Total time spent in lstat across all threads.
+	 */
+};
+
+struct SyncSample{
+	/* Measurements taken from one call to Syncer::sync.
+	 */
+	uintmax_t files;
+	/* Number of files sent.
+	 */
+	uintmax_t bytes;
+	/* Number of bytes sent.
+	 */
+	std::chrono::steady_clock::duration elapsed;
+	/* Wall time of transfer.
+	 */
+};
+
+class AimdDimension{
+	/* One tunable concurrency value. Hill climbs by additive steps
+	 * while the measured rate keeps improving, steps back when it
+	 * gets worse, and halves when told the backend is overloaded.
+	 */
+private:
+	std::string name_;
+	/* Name used in log messages.
+	 */
+	int value_;
+	/* Current value.
+	 */
+	int min_;
+	/* Lower bound.
+	 */
+	int max_;
+	/* Upper bound.
+	 */
+	double last_rate_;
+	/* Rate measured at previous decision, 0 if none yet.
+	 */
+	int last_step_;
+	/* Change made at previous decision: -1, 0 or 1.
+	 */
+	void set(int value, const std::string &reason);
+	/* Clamp value to bounds, log the decision and update last_step_.
+	 */
+public:
+	AimdDimension(const std::string &name, int initial, int min, int max);
+	/* Construct with bounds. initial is clamped to [min, max].
+	 */
+	~AimdDimension(void) = default;
+	/* Default destructor.
+	 */
+	int value(void) const;
+	/* Return current value.
+	 */
+	void update(double rate, const std::string &detail);
+	/* Feed rate measured at the current value and decide next value.
+	 */
+	void overloaded(const std::string &detail);
+	/* Multiplicative decrease.
+	 */
+};
+
+class ConcurrencyController{
+	/* Adapts number of crawler threads and sync processes between
+	 * cycles from the measured crawl rate, stat latency and transfer
+	 * throughput. Decisions only depend on the samples passed in,
+	 * so a recorded series of samples replays to the same decisions.
+	 */
+private:
+	AimdDimension threads_;
+	/* Crawler worker threads, driven by entries per second.
+	 */
+	AimdDimension nproc_;
+	/* Sync processes, driven by bytes per second.
+	 */
+	double baseline_latency_us_;
+	/* Lowest mean stat latency observed, 0 if none yet.
+	 */
+public:
+	ConcurrencyController(int threads, int max_threads, int nproc, int max_nproc);
+	/* Construct with starting values and upper bounds. Lower bounds are 1.
+	 */
+	~ConcurrencyController(void) = default;
+	/* Default destructor.
+	 */
+	int threads(void) const;
+	/* Return number of crawler threads to use for next crawl.
+	 */
+	int nproc(void) const;
+	/* Return number of sync processes to use for next transfer.
+	 */
+	void crawled(const CrawlSample &sample);
+	/* Feed crawl measurements and adjust threads.
+	 */
+	void synced(const SyncSample &sample);
+	/* Feed transfer measurements and adjust processes.
+	 */
+};
+
+struct BudgetShare{
+	/* One root's standing in a SharedBudget.
+	 */
+	int held_ = 0;
+	/* Slots taken and not yet returned.
+	 */
+	uint64_t ticket_ = 0;
+	/* Order in which root started waiting for a slot, 0 if not waiting.
+	 */
+};
+
+class SharedBudget{
+	/* Slots, crawler threads or sync processes, shared by every source
+	 * root. A freed slot goes to the waiting root holding the fewest,
+	 * ties going to the one waiting longest, so a busy root can't starve
+	 * a quiet one. Sync processes take a slot per batch, so shares
+	 * rebalance as batches finish.
+	 */
+private:
+	std::mutex mutex_;
+	/* Guards everything below.
+	 */
+	std::condition_variable released_;
+	/* Notified when slots are returned.
+	 */
+	int capacity_;
+	/* Total slots, 0 for unlimited.
+	 */
+	int available_;
+	/* Slots not held by anyone.
+	 */
+	int members_;
+	/* Number of roots sharing the budget.
+	 */
+	uint64_t next_ticket_;
+	/* Handed to the next root to start waiting.
+	 */
+	std::map<const void *, BudgetShare> owners_;
+	/* Standing of each root holding or waiting for slots.
+	 */
+	bool grantable(const void *owner);
+	/* Returns true if owner may take one more slot, otherwise queues it
+	 * as waiting. mutex_ must be held.
+	 */
+	void take(const void *owner);
+	/* Take one slot for owner. mutex_ must be held.
+	 */
+public:
+	SharedBudget(void);
+	/* Construct unlimited budget.
+	 */
+	~SharedBudget(void) = default;
+	/* Default destructor.
+	 */
+	void set_capacity(int capacity, int members);
+	/* Set total slots, 0 for unlimited, and number of roots sharing them.
+	 * Call before any are taken.
+	 */
+	bool try_acquire(const void *owner);
+	/* Take one slot if available and owner is next in line. Never blocks.
+	 */
+	int acquire(const void *owner, int wanted);
+	/* Take up to wanted slots, blocking until at least one is free.
+	 * Returns number taken. For slots held a long time, so never more
+	 * than an equal share among all members.
+	 */
+	void release(const void *owner, int count = 1);
+	/* Return slots taken by owner.
+	 */
+	void release_all(const void *owner);
+	/* Return every slot held by owner and stop waiting for more.
+	 */
+	void wait_for(std::chrono::milliseconds timeout);
+	/* Sleep until slots are returned or timeout passes.
+	 */
+};
+
+namespace Budgets{
+	extern SharedBudget threads;
+	/* Crawler worker threads, capped by Total Threads.
+	 */
+	extern SharedBudget procs;
+	/* Sync processes, capped by Total Processes.
+	 */
+}
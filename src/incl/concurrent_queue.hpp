@@ -20,49 +20,179 @@
 #pragma once
 
 #include <atomic>
-#include <queue>
-#include <list>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
+#include <thread>
+#include <climits>
+#include <cstdint>
+
+extern "C" {
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+}
+
+#define CONCURRENT_QUEUE_CAPACITY 4096 // slots in lock-free ring, rounded up to a power of 2
+#define CONCURRENT_QUEUE_ALIGN 64 // keep each end of the ring on its own cache line
 
 template<class T>
 class ConcurrentQueue{
+	/* Multi-producer multi-consumer queue for the crawler's directory
+	 * frontier. Items go through a bounded lock-free ring (Vyukov's
+	 * per-slot sequence numbers), spilling into a locked deque only
+	 * while the ring is full, so the frontier of a wide tree is never
+	 * bounded. Consumers with nothing to pop park on a futex event
+	 * count, and each push wakes at most one of them.
+	 */
 private:
-	mutable std::mutex mutex_;
-	std::condition_variable empty_;
-	std::queue<T> queue_;
+	struct Slot{
+		std::atomic<size_t> seq_;
+		/* Position this slot is ready for: pos if free to push to,
+		 * pos + 1 if holding the item pushed at pos.
+		 */
+		T val_;
+	};
+	std::unique_ptr<Slot[]> ring_;
+	size_t mask_;
+	/* Ring of mask_ + 1 slots.
+	 */
+	alignas(CONCURRENT_QUEUE_ALIGN) std::atomic<size_t> push_pos_;
+	alignas(CONCURRENT_QUEUE_ALIGN) std::atomic<size_t> pop_pos_;
+	/* Next positions to push to and pop from.
+	 */
+	alignas(CONCURRENT_QUEUE_ALIGN) std::mutex overflow_mt_;
+	std::deque<T> overflow_;
+	std::atomic<size_t> overflow_size_;
+	/* Items pushed while the ring was full.
+	 */
+	alignas(CONCURRENT_QUEUE_ALIGN) std::atomic<uint32_t> epoch_;
+	/* Futex word, bumped to wake parked consumers.
+	 */
+	std::atomic<int> waiters_;
+	/* Consumers parked or about to park on epoch_.
+	 */
 	std::atomic<bool> done_;
+	/* Set once every consumer ran out of work.
+	 */
+	bool try_push(T &val){
+		size_t pos = push_pos_.load(std::memory_order_relaxed);
+		Slot *slot;
+		for(;;){
+			slot = &ring_[pos & mask_];
+			intptr_t diff = (intptr_t)slot->seq_.load(std::memory_order_acquire) - (intptr_t)pos;
+			if(diff == 0){
+				if(push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}else if(diff < 0){
+				return false; // full
+			}else{
+				pos = push_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		slot->val_ = std::move(val);
+		slot->seq_.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	bool try_pop(T &val){
+		size_t pos = pop_pos_.load(std::memory_order_relaxed);
+		Slot *slot;
+		for(;;){
+			slot = &ring_[pos & mask_];
+			intptr_t diff = (intptr_t)slot->seq_.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+			if(diff == 0){
+				if(pop_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}else if(diff < 0){
+				return try_pop_overflow(val); // ring empty or next item not written yet
+			}else{
+				pos = pop_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		val = std::move(slot->val_);
+		slot->seq_.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+	bool try_pop_overflow(T &val){
+		if(overflow_size_.load(std::memory_order_acquire) == 0)
+			return false;
+		std::lock_guard<std::mutex> lk(overflow_mt_);
+		if(overflow_.empty())
+			return false;
+		val = std::move(overflow_.front());
+		overflow_.pop_front();
+		overflow_size_.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+	void push_item(T &val){
+		if(!try_push(val)){
+			std::lock_guard<std::mutex> lk(overflow_mt_);
+			overflow_.push_back(std::move(val));
+			overflow_size_.fetch_add(1, std::memory_order_release);
+		}
+		// read-modify-write pairs with park(): either it sees the item or we see it waiting
+		if(waiters_.fetch_add(0, std::memory_order_acq_rel) > 0)
+			wake(1);
+	}
+	void wake(int n){
+		epoch_.fetch_add(1, std::memory_order_release);
+		syscall(SYS_futex, (uint32_t *)&epoch_, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+	}
+	void park(void){
+		// wait until an item may have been pushed or every consumer is done
+		waiters_.fetch_add(1, std::memory_order_acq_rel);
+		uint32_t epoch = epoch_.load(std::memory_order_acquire);
+		if(empty() && !done_)
+			syscall(SYS_futex, (uint32_t *)&epoch_, FUTEX_WAIT_PRIVATE, epoch, nullptr, nullptr, 0);
+		else
+			std::this_thread::yield(); // item claimed but not written yet, or already taken
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
 public:
-	ConcurrentQueue() : mutex_(), empty_(), queue_(), done_(false){}
+	ConcurrentQueue(size_t capacity = CONCURRENT_QUEUE_CAPACITY)
+			: push_pos_(0), pop_pos_(0), overflow_size_(0), epoch_(0), waiters_(0), done_(false){
+		size_t slots = 2;
+		while(slots < capacity)
+			slots <<= 1;
+		ring_.reset(new Slot[slots]);
+		for(size_t i = 0; i < slots; i++)
+			ring_[i].seq_.store(i, std::memory_order_relaxed);
+		mask_ = slots - 1;
+	}
 	~ConcurrentQueue(void) = default;
 	size_t size(void) const{
-		return queue_.size();
+		// exact only while nothing is pushed or popped
+		size_t pushed = push_pos_.load(std::memory_order_acquire);
+		size_t popped = pop_pos_.load(std::memory_order_acquire);
+		return ((pushed > popped)? pushed - popped : 0) + overflow_size_.load(std::memory_order_acquire);
 	}
 	bool empty(void) const{
-		return queue_.empty();
+		return size() == 0;
 	}
 	void push(const T &val){
-		std::unique_lock<std::mutex> lk(mutex_);
-		queue_.push(val);
-		empty_.notify_all();
+		T copy(val);
+		push_item(copy);
+	}
+	void push(T &&val){
+		push_item(val);
 	}
 	bool pop(T &val, std::atomic<int> &threads_running){
 		// return true if successfully got item, false if done
-		std::unique_lock<std::mutex> lk(mutex_);
-		threads_running--;
-		if(threads_running <= 0 && queue_.empty()){
-			done_ = true;
-			empty_.notify_all();
-		}
-		while(queue_.empty() && !done_){
-			empty_.wait(lk);
+		// threads_running counts consumers that may still push, which
+		// includes this one until it finds nothing to pop
+		for(;;){
+			if(try_pop(val))
+				return true;
+			if(--threads_running == 0 && empty()){
+				// nobody left to push, so nothing will ever come
+				done_ = true;
+				wake(INT_MAX);
+				return false;
+			}
+			park();
+			if(done_)
+				return false;
+			threads_running++;
 		}
-		if(done_ && queue_.empty()){
-			return false;
-		}
-		val = queue_.front();
-		queue_.pop();
-		threads_running++;
-		return true;
 	}
 };
@@ -19,7 +19,12 @@
 
 #pragma once
 
+#include "rateLimiter.hpp"
+#include "filter.hpp"
 #include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_set>
 #include <boost/filesystem.hpp>
 
 namespace fs = boost::filesystem;
@@ -81,16 +86,79 @@ class Config{
 	/* allow Crawler and Syncer objects to access members.
 	 */
 private:
+	std::string name_;
+	/* Section of config file this root was read from, e.g. "projects" for
+	 * [projects]. Empty if the file has no sections.
+	 */
+	bool primary_ = true;
+	/* False for every section but the first, which runs the shared
+	 * services such as the metrics server.
+	 */
+	int shard_depth_ = 0;
+	/* Split source into a shard per directory this deep. 0 to disable.
+	 */
+	std::string shard_;
+	/* Directory of this shard relative to the root's Source Directory,
+	 * appended to each destination. Empty if not a shard.
+	 */
+	std::unordered_set<std::string> skip_dirs_;
+	/* Paths relative to Source Directory crawled by other shards.
+	 */
+	std::string rctime_seed_path_;
+	/* Last rctime file of the whole root, to start a new shard from
+	 * instead of sending everything again. Empty if not a shard.
+	 */
+	bool active_active_ = false;
+	/* Share roots and shards with other gateways through leases.
+	 */
+	std::string lease_dir_;
+	/* Shared directory holding lease files. Defaults to leases/ in
+	 * the global Metadata Directory.
+	 */
+	std::string node_name_;
+	/* Name of this gateway in lease files. Defaults to hostname.
+	 */
+	std::chrono::seconds lease_timeout_s_ = std::chrono::seconds(60);
+	/* Lease lifetime without renewal.
+	 */
+	
 	// daemon settings
 	int log_level_ = -1;
 	/* Log level defined in config file for Logger class.
 	 */
+	std::string log_levels_;
+	/* Per subsystem log levels, e.g. "crawler:2,syncer:1".
+	 */
+	bool log_levels_valid_ = true;
+	/* False if Log Levels could not be parsed.
+	 */
+	int log_rate_limit_ = 0;
+	/* Max debug messages per second. 0 for unlimited.
+	 */
+	int metrics_port_ = 0;
+	/* Local TCP port for Prometheus metrics. 0 to disable.
+	 */
 	int nproc_ = -1;
 	/* Number of parallel sync processes.
 	 */
 	int threads_ = -1;
 	/* Number of worker threads to search directory tree.
 	 */
+	bool adaptive_concurrency_ = false;
+	/* Tune nproc_ and threads_ between cycles from measured throughput.
+	 */
+	int max_nproc_ = 0;
+	/* Upper bound for adaptive nproc_. 0 to use nproc_.
+	 */
+	int max_threads_ = 0;
+	/* Upper bound for adaptive threads_. 0 to use threads_.
+	 */
+	int total_nproc_ = 0;
+	/* Sync processes shared by all sections. 0 for unlimited.
+	 */
+	int total_threads_ = 0;
+	/* Crawler threads shared by all sections. 0 for unlimited.
+	 */
 	bool ignore_hidden_ = false;
 	/* Ignore files starting with '.'.
 	 */
@@ -100,6 +168,24 @@ private:
 	bool ignore_vim_swap_ = false;
 	/* ignore hidden files ending in .swp
 	 */
+	std::string include_;
+	std::string exclude_;
+	/* Comma separated glob patterns from Include and Exclude.
+	 */
+	FilterRules filter_rules_;
+	/* include_ and exclude_ compiled for the crawler.
+	 */
+	bool filter_rules_valid_ = true;
+	/* False if a pattern could not be compiled.
+	 */
+	std::chrono::seconds defer_recent_s_ = std::chrono::seconds(0);
+	/* Leave files modified less than this many seconds before the crawl
+	 * for a later cycle. 0 to send everything.
+	 */
+	std::chrono::seconds crawl_checkpoint_s_ = std::chrono::seconds(0);
+	/* Save progress of a crawl to the metadata directory this often so
+	 * it resumes after a restart. 0 to start over.
+	 */
 	std::chrono::seconds sync_period_s_ = std::chrono::seconds(-1);
 	/* Polling period to check whether to send new files in seconds.
 	 */
@@ -116,11 +202,77 @@ private:
 	std::string exec_flags_;
 	/* Flags and extra args for program.
 	 */
+	std::string transfer_order_ = "size";
+	/* Order files are handed to sync processes in: size, directory,
+	 * inode or hybrid.
+	 */
+	intmax_t large_threshold_ = 0;
+	/* Files at least this many bytes are sent by their own pool of
+	 * processes. 0 to disable.
+	 */
+	int large_nproc_ = 1;
+	/* Number of parallel sync processes for large files.
+	 */
+	std::string large_flags_;
+	/* Flags for large files. Empty to use exec_flags_.
+	 */
+	intmax_t fast_lane_threshold_ = 0;
+	/* Files at most this many bytes changed while a long sync runs are
+	 * sent right away by the fast lane. 0 to disable.
+	 */
+	int fast_lane_nproc_ = 1;
+	/* Number of sync processes reserved for the fast lane.
+	 */
+	intmax_t prefetch_budget_ = 0;
+	/* Most bytes of running batches read ahead into the page cache at
+	 * once. 0 to disable.
+	 */
+	intmax_t chunk_threshold_ = 0;
+	/* Files at least this many bytes are split into ranges sent in
+	 * parallel. 0 to disable.
+	 */
+	intmax_t chunk_size_ = 1 << 30;
+	/* Bytes per range.
+	 */
+	std::string compression_ = "off";
+	/* Compression of ranges sent over ssh: off, auto, zstd or lz4.
+	 */
+	int compression_level_ = 0;
+	/* Level passed to compressor. 0 for its default.
+	 */
+	intmax_t delta_threshold_ = 0;
+	/* Files at least this many bytes are sent as changed blocks. 0 to disable.
+	 */
+	intmax_t delta_block_size_ = 128 << 10;
+	/* Bytes per block hashed in delta mode.
+	 */
+	bool propagate_deletes_ = false;
+	/* Replay deletes and renames on destinations from directory listings
+	 * kept between cycles.
+	 */
+	intmax_t bw_limit_ = 0;
+	/* Aggregate bandwidth cap in bytes per second shared by all
+	 * sync processes of the daemon. 0 for unlimited.
+	 */
+	intmax_t meta_op_limit_ = 0;
+	/* Cap on directory entries stat'ed per second by all crawler
+	 * threads of the daemon. 0 for unlimited.
+	 */
+	LimitSchedule limit_schedule_;
+	/* Time of day windows during which the above limits apply.
+	 */
+	bool limit_schedule_valid_ = true;
+	/* False if Limit Schedule could not be parsed.
+	 */
 	
 	// source
 	fs::path base_path_;
 	/* Path to CephFS directory to back up.
 	 */
+	std::string rctime_source_ = "ceph";
+	/* Where directory rctimes come from: ceph, xattr or scan.
+	 * Only ceph supports snapshots, the others crawl the live tree.
+	 */
 	
 	// target
 	std::string remote_user_;
@@ -134,12 +286,65 @@ private:
 	 */
 	std::string destinations_;
 	/* List of destinations. Conflicts with remote_user_ || remote_host_ || remote_directory_.
-	 * Used for destination failover.
+	 * Used for destination failover, or sent to concurrently if fanout_ is set.
+	 */
+	bool fanout_ = false;
+	/* Destination Mode = fanout. Replicate every change to each destination.
+	 */
+	bool destination_mode_valid_ = true;
+	/* False if Destination Mode could not be parsed.
 	 */
 public:
-	Config(const fs::path &config_path, const ConfigOverrides &config_overrides);
+	Config(const fs::path &config_path, const ConfigOverrides &config_overrides, const std::string &section = "");
 	/* Construct Config object and load in configuration settings from disk.
+	 * Settings before the first [section] line apply to every section,
+	 * settings within one apply only if it is the section passed.
+	 */
+	static std::vector<std::string> sections(const fs::path &config_path);
+	/* Return names of [section] lines in config file, in order.
+	 */
+	const std::string &name(void) const{
+		return name_;
+	}
+	int shard_depth(void) const{
+		return shard_depth_;
+	}
+	std::vector<Config> shards(void) const;
+	/* Return a config per directory Shard Depth levels below Source
+	 * Directory, plus one for everything above them that skips those
+	 * directories and keeps this root's metadata. Limits copied into
+	 * them are not used, shards draw from the process-wide ones.
+	 */
+	std::string unit(void) const;
+	/* Return name of this root or shard in lease files.
 	 */
+	bool active_active(void) const{
+		return active_active_;
+	}
+	const std::string &lease_dir(void) const{
+		return lease_dir_;
+	}
+	const std::string &node_name(void) const{
+		return node_name_;
+	}
+	std::chrono::seconds lease_timeout(void) const{
+		return lease_timeout_s_;
+	}
+	int total_nproc(void) const{
+		return total_nproc_;
+	}
+	int total_threads(void) const{
+		return total_threads_;
+	}
+	uintmax_t bw_limit(void) const{
+		return bw_limit_;
+	}
+	intmax_t meta_op_limit(void) const{
+		return meta_op_limit_;
+	}
+	const LimitSchedule &limit_schedule(void) const{
+		return limit_schedule_;
+	}
 	~Config() = default;
 	/* Default destructor.
 	 */
@@ -21,26 +21,76 @@
 
 #include "config.hpp"
 #include "rctime.hpp"
+#include "rctimeProvider.hpp"
 #include "concurrent_queue.hpp"
 #include "file.hpp"
 #include "syncer.hpp"
+#include "rateLimiter.hpp"
+#include "concurrency.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
+#include "lease.hpp"
+#include "listing.hpp"
+#include "checkpoint.hpp"
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <list>
+#include <memory>
 #include <boost/filesystem.hpp>
 
+extern "C" {
+	#include <dirent.h>
+	#include <sys/stat.h>
+}
+
 namespace fs = boost::filesystem;
 
+struct CrawlTimes{
+	/* Time one crawler thread spent in each syscall while reading
+	 * a directory. Durations are only measured if Crawler::time_crawl_.
+	 */
+	uintmax_t entries_ = 0;
+	std::chrono::steady_clock::duration readdir_ = std::chrono::steady_clock::duration(0);
+	std::chrono::steady_clock::duration stat_ = std::chrono::steady_clock::duration(0);
+	std::chrono::steady_clock::duration xattr_ = std::chrono::steady_clock::duration(0);
+};
+
+struct FastPass{
+	/* One pass of the fast lane, crawling for small files changed while
+	 * a long sync runs.
+	 */
+	timespec since_ = {0, 0};
+	/* Files changed after this are sent.
+	 */
+	timespec defer_cutoff_ = {0, 0};
+	/* Files modified after this are left for the next pass. {0} if
+	 * Defer Recent is off.
+	 */
+	timespec oldest_deferred_ = {0, 0};
+	uintmax_t deferred_files_ = 0;
+	/* Oldest mtime and count of files deferred during this pass.
+	 */
+};
+
 class Crawler{
 private:
 	Config config_;
 	/* Holds user configuration options.
 	 */
+	std::unique_ptr<RctimeProvider> rctime_provider_;
+	/* Reads recursive change time of directories.
+	 */
 	std::mutex file_list_mt_;
 	/* Make file_list_ thread safe for insertion.
 	 */
 	LastRctime last_rctime_;
-	/* Timestamp of last sync.
+	/* Timestamp of last sync. In fan-out mode, the oldest of dest_last_rctime_.
+	 */
+	std::list<LastRctime> dest_last_rctime_;
+	/* Timestamp of last sync to each destination in fan-out mode, in
+	 * the same order as syncer.destinations(). Empty in failover mode.
 	 */
 	fs::path base_path_;
 	/* Local source directory.
@@ -51,14 +101,159 @@ private:
 	Syncer syncer;
 	/* Controls executing the sync program.
 	 */
+	std::unique_ptr<Config> fast_config_;
+	/* Copy of config_ for fast_syncer_, sending every file with its own
+	 * processes and no ranges.
+	 */
+	std::unique_ptr<Syncer> fast_syncer_;
+	/* Sends small files changed during a long sync, null if Fast Lane
+	 * Threshold is off.
+	 */
+	std::thread fast_thread_;
+	std::mutex fast_mt_;
+	std::condition_variable fast_cv_;
+	bool fast_stop_ = false;
+	/* Runs fast_lane() while syncer is busy, stopped through fast_cv_.
+	 */
+	fs::path fast_snap_path_;
+	mutable std::mutex fast_snap_mt_;
+	/* Snapshot of current fast lane pass, empty if none. Guarded by
+	 * fast_snap_mt_, since delete_snap() may run on any thread that exits.
+	 */
+	ConcurrencyController concurrency_;
+	/* Picks threads and processes for each cycle if Adaptive Concurrency is set.
+	 */
+	std::atomic<uintmax_t> entries_scanned_;
+	/* Directory entries stat'ed during current crawl.
+	 */
+	std::atomic<std::chrono::steady_clock::rep> stat_time_;
+	/* Time spent in lstat during current crawl, only measured
+	 * if time_crawl_.
+	 */
+	bool time_crawl_;
+	/* Time each readdir, lstat and getxattr, for Adaptive Concurrency,
+	 * metrics or --profile.
+	 */
+	timespec defer_cutoff_;
+	/* Files modified after this are left for a later cycle. {0} if
+	 * Defer Recent is off.
+	 */
+	std::mutex deferred_mt_;
+	/* Guards oldest_deferred_ and deferred_files_.
+	 */
+	timespec oldest_deferred_;
+	uintmax_t deferred_files_;
+	/* Oldest mtime and count of files deferred during current crawl.
+	 */
+	MetricsServer metrics_server_;
+	/* Serves metrics if Metrics Port is set.
+	 */
+	TreeChanges tree_changes_;
+	/* Finds deletes and renames if Propagate Deletes is set.
+	 */
+	bool send_old_;
+	/* Set while crawling directories that moved in from outside the
+	 * source, to queue their files no matter how old.
+	 */
+	CrawlCheckpoint checkpoint_;
+	/* Logs the crawl in progress if Crawl Checkpoint Interval is set.
+	 */
+	bool resume_crawl(CrawlResume &resume, std::vector<File> &file_list, uintmax_t &total_bytes);
+	/* Load the checkpoint of an interrupted crawl into file_list if it
+	 * is still valid: its snapshot exists and last_rctime_ did not move.
+	 * Drops it and its snapshot otherwise.
+	 */
+	void checkpoint_dir(const std::string &dir, const std::vector<File> &files, const std::vector<std::string> &subdirs);
+	/* Log a directory read by the main crawl to checkpoint_.
+	 */
+	bool ignore_name(const char *file_name, size_t len) const;
+	/* Returns true if entry should be skipped based on its name alone,
+	 * before it is stat'ed.
+	 */
+	int stat_entry(const char *path, struct stat &st, CrawlTimes &times) const;
+	/* lstat, timed.
+	 */
+	bool ignore_entry_timed(const File &file, CrawlTimes &times) const;
+	/* ignore_entry(), timing the rctime lookup of directories.
+	 */
+	struct dirent *next_entry(DIR *dir, CrawlTimes &times) const;
+	/* readdir, timed.
+	 */
+	std::string unit_;
+	/* Name of lease of this root or shard, empty if not shared with
+	 * other gateways.
+	 */
+	std::atomic<bool> leased_;
+	/* Whether this gateway works on unit_ right now. Last rctimes are
+	 * only written to disk while it does.
+	 */
+	bool hold_lease(void);
+	/* Returns true if this gateway holds the lease of unit_, taking it
+	 * if possible. Reloads last rctimes on taking it, since another
+	 * gateway may have moved them.
+	 */
+	bool lost_lease(void);
+	/* Returns true and stops writing last rctimes if the heartbeat
+	 * found the lease of unit_ taken over, so the cycle must not move
+	 * the last rctime or listings.
+	 */
+	void set_leased(bool leased);
+	/* Update leased_ and allow or block writing last rctimes.
+	 */
+	static timespec seed_rctime(const Config &config);
+	/* Last rctime a new shard starts from: that of the whole root, so
+	 * enabling shards doesn't send everything again.
+	 */
+	bool skip_dir(const char *rel_path, size_t rel_len) const{
+		return !config_.skip_dirs_.empty() && config_.skip_dirs_.count(std::string(rel_path, rel_len));
+	}
+	/* Returns true if directory is crawled by another shard.
+	 */
+	void read_dir(const std::string &dir_path, size_t snap_root_len, CrawlTimes &times, std::vector<File> &files, std::vector<std::string> &subdirs, FastPass *fast = nullptr);
+	/* Read one directory, appending new files to files and new
+	 * subdirectories to subdirs. If fast is set, only picks what the
+	 * fast lane sends, and deletes and renames are not looked for.
+	 */
+	void record_times(const CrawlTimes &times);
+	/* Add times to crawl totals, metrics and profiler.
+	 */
+	bool defer_entry(const File &file);
+	/* Returns true and records the file if it changed after defer_cutoff_.
+	 */
+	static void cap_to_deferred(timespec &new_rctime, const timespec &oldest_deferred);
+	/* Lower new_rctime to just before the oldest deferred file so it is
+	 * picked up next cycle.
+	 */
+	bool skip_fast_entry(const File &file, FastPass &pass) const;
+	/* Returns true if file is unchanged since pass.since_, bigger than
+	 * Fast Lane Threshold or deferred.
+	 */
+	void start_fast_lane(const timespec &since);
+	void stop_fast_lane(void);
+	/* Run fast_lane() in fast_thread_ while syncer sends a cycle, if
+	 * enabled. Stopping waits for the pass in progress.
+	 */
+	void fast_lane(timespec since);
+	/* Call fast_pass() every Sync Period, at least a second apart,
+	 * until stopped.
+	 */
+	void fast_pass(timespec &since);
+	/* Crawl own snapshot or the live tree for small files changed after
+	 * since and send them with fast_syncer_, advancing since once sent.
+	 * The last rctime is left alone, so the next cycle sends them again,
+	 * which the sync program finds up to date.
+	 */
 public:
 	Crawler(const fs::path &config_path, size_t envp_size, const ConfigOverrides &config_overrides);
 	/* Calls config constructor with
 	 * config_path and overrides,
 	 * initialises last_rctime_ and payload_bytes_.
 	 */
-	~Crawler(void) = default;
-	/* Default destructor.
+	Crawler(const Config &config, size_t envp_size);
+	/* Same from a loaded config, for each section or shard.
+	 */
+	~Crawler(void);
+	/* Stops the fast lane if running.
 	 */
 	void poll_base(bool seed, bool dry_run, bool set_rctime, bool oneshot);
 	/* Main loop of program.
@@ -67,32 +262,36 @@ public:
 	 * taken and the file queuing
 	 * search is triggered.
 	 */
+	timespec oldest_dest_rctime(void) const;
+	/* Return lowest of dest_last_rctime_, or last_rctime_ if empty.
+	 */
 	void create_snap(const timespec &rctime);
 	/* Create snapshot in base directory
 	 */
-	void trigger_search(std::vector<File> &file_list, const boost::filesystem::path& snap_path, uintmax_t& total_bytes);
+	void trigger_search(std::vector<File> &file_list, const boost::filesystem::path& snap_path, uintmax_t& total_bytes, const std::vector<std::string> *frontier = nullptr);
 	/* Queues newly modified/created files
 	 * into file_list_, keeps tally of filesize in
-	 * total_bytes.
+	 * total_bytes. Starts from frontier instead
+	 * of snap_path when resuming a crawl.
 	 */
 	bool ignore_entry(const File &file) const;
-	/* Returns true if file should not be queued or directory should
-	 * not be searched.
+	/* Returns true if file or directory has not changed since
+	 * last_rctime_.
 	 */
-	void find_new_files_recursive(std::vector<File> &file_list, fs::path current_path, const fs::path &snap_root, uintmax_t &total_bytes);
+	void find_new_files_recursive(std::vector<File> &file_list, const std::string &current_path, size_t snap_root_len, uintmax_t &total_bytes, FastPass *fast = nullptr);
 	/* Recursive DFS on directory tree to queue files.
 	 * Keeps tally of filesize in total_bytes.
-	 * This is used if threads == 1.
+	 * This is used if threads == 1, and by the fast lane.
 	 */
-	void find_new_files_mt_bfs(std::vector<File> &file_list, ConcurrentQueue<fs::path> &queue, const fs::path &snap_root, std::atomic<uintmax_t> &total_bytes, std::atomic<int> &threads_running);
+	void find_new_files_mt_bfs(std::vector<File> &file_list, ConcurrentQueue<std::string> &queue, size_t snap_root_len, std::atomic<uintmax_t> &total_bytes, std::atomic<int> &threads_running);
 	/* Worker thread function to do multithreaded BFS on directory tree to queue files.
 	 * Keeps tally of filesize in total_bytes.
 	 * This is used if threads > 1.
 	 */
 	void delete_snap(void) const;
-	/* Deletes snapshot directory.
+	/* Deletes snapshot directory, unless a crawl checkpoint needs it.
 	 */
 	void write_last_rctime(void) const;
-	/* Call last_rctime_.write_last_rctime().
+	/* Call write_last_rctime() of last_rctime_ and each of dest_last_rctime_.
 	 */
 };
@@ -0,0 +1,64 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+#define SIG_MAGIC "CGRSIG1\n" // first bytes of a block signature cache file
+
+uint64_t block_hash(const char *data, size_t len);
+/* 64 bit hash of one block. Same construction as xxh64: four independent
+ * multiply-rotate lanes over 32 byte stripes, which keep the pipeline
+ * (or vector unit, when the compiler uses it) busy.
+ */
+
+struct BlockSignatures{
+	/* Hash of each fixed size block of a file as it was last sent to
+	 * one destination. Lets delta mode find changed blocks without
+	 * reading the destination.
+	 */
+	std::string rel_path_;
+	/* Path relative to Source Directory, to catch reused inode numbers.
+	 */
+	uintmax_t size_ = 0;
+	/* File size when sent.
+	 */
+	timespec mtime_ = {0, 0};
+	/* File mtime when sent. Equal mtime and size means unchanged.
+	 */
+	uintmax_t block_size_ = 0;
+	/* Bytes per block.
+	 */
+	std::vector<uint64_t> hashes_;
+	/* block_hash() of each block.
+	 */
+	uintmax_t blocks(void) const;
+	/* Number of blocks in size_ bytes.
+	 */
+	bool load(const std::string &path);
+	/* Read signatures from path. Returns false if missing or corrupt.
+	 */
+	bool save(const std::string &path) const;
+	/* Write signatures to path through a temporary file and rename.
+	 */
+};
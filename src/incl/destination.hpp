@@ -0,0 +1,95 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "health.hpp"
+#include "metrics.hpp"
+#include <string>
+#include <ctime>
+#include <cctype>
+
+struct Destination{
+	/* A sync target and its state for the current sync.
+	 */
+	std::string target_;
+	/* [[<user>@]<host>:][<destination path>]
+	 */
+	std::string host_;
+	/* [<user>@]<host> part of target_, empty if local.
+	 */
+	std::string path_;
+	/* <destination path> part of target_.
+	 */
+	timespec since_ = {0, 0};
+	/* In fan-out mode, only files newer than this are sent here.
+	 * Lets a destination that missed cycles catch up from its own
+	 * last synced rctime.
+	 */
+	bool failed_ = false;
+	/* Set when destination could not be reached during current sync.
+	 */
+	bool path_made_ = false;
+	/* Set once path_ is known to exist on destination.
+	 */
+	DestinationHealth health_;
+	/* Circuit breaker deciding whether to send to this destination.
+	 */
+	Counter *bytes_sent_;
+	Counter *files_sent_;
+	/* Transfer totals exported as metrics, labeled with target_.
+	 */
+	explicit Destination(const std::string &target)
+		: target_(target)
+		, bytes_sent_(&Metrics::registry.counter("cephgeorep_bytes_sent_total", "Bytes in successful batches per destination.", MetricsRegistry::label("destination", target)))
+		, files_sent_(&Metrics::registry.counter("cephgeorep_files_sent_total", "Files in successful batches per destination.", MetricsRegistry::label("destination", target))){
+		// like rsync, a colon before the first slash means remote
+		size_t colon = target_.find(':');
+		if(colon != std::string::npos && colon < target_.find('/')){
+			host_ = target_.substr(0, colon);
+			path_ = target_.substr(colon + 1);
+		}else{
+			path_ = target_;
+		}
+	}
+	/* Construct from target string.
+	 */
+	std::string file_name(void) const{
+		std::string name = target_;
+		for(char &c : name)
+			if(!isalnum(c) && c != '.' && c != '-' && c != '_')
+				c = '_';
+		return name;
+	}
+	/* Return target_ made safe to use in metadata file names.
+	 */
+};
+
+inline std::string shell_quote(const std::string &str){
+	std::string quoted = "'";
+	for(char c : str){
+		if(c == '\'')
+			quoted += "'\\''";
+		else
+			quoted += c;
+	}
+	return quoted + "'";
+}
+/* Quote str for a POSIX shell on the destination.
+ */
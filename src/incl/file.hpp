@@ -22,6 +22,8 @@
 #include "alert.hpp"
 #include "signal.hpp"
 #include <string>
+#include <cstring>
+#include <limits>
 
 extern "C" {
 	#include <sys/stat.h>
@@ -34,35 +36,27 @@ private:
 	size_t path_len_;
 	char *path_;
 	timespec rctime_;
-	inline void init(const char *path, size_t snap_root_len, const struct stat &st){
+	ino_t ino_;
+	inline void init(const char *path, size_t path_len, size_t snap_root_len, const struct stat &st){
 		size_ = st.st_size;
+		ino_ = st.st_ino;
 		is_directory_ = S_ISDIR(st.st_mode);
 		if(is_directory_){
-			path_ = new char[strlen(path) + 1];
-			strcpy(path_, path);
+			path_ = new char[path_len + 1];
+			memcpy(path_, path, path_len + 1);
 		}else{
 			// split file path with /./
 			// allocate new path
-			path_ = new char[strlen(path) + 2 + 1]; // original path + ./ + \0
-			// make copy of pointer for iteration
-			char *dst_ptr = path_;
-			// make pointer to iterate through snap path
-			const char *src_ptr = path;
-			// copy snap path into new path
-			const char *snap_root_end = path + snap_root_len;
-			while(src_ptr < snap_root_end)
-				*(dst_ptr++) = *(src_ptr++); // copy snap root
+			path_ = new char[path_len + 2 + 1]; // original path + ./ + \0
+			// copy snap root
+			memcpy(path_, path, snap_root_len);
+			char *dst_ptr = path_ + snap_root_len;
 			// append /.
 			*(dst_ptr++) = '/';
 			*(dst_ptr++) = '.';
-			// set src pointer to original path starting after the snap path root
-			src_ptr = snap_root_end;
-			// copy the rest of the original path into the new path
-			while(*src_ptr)
-				*(dst_ptr++) = *(src_ptr++);
-			// finally, append nul
-			*dst_ptr = '\0';
-			path_len_ = dst_ptr - path_;
+			// copy the rest of the original path after the snap root, including nul
+			memcpy(dst_ptr, path + snap_root_len, path_len - snap_root_len + 1);
+			path_len_ = path_len + 2;
 			
 			// get mtime
 			rctime_.tv_sec = st.st_mtim.tv_sec;
@@ -70,7 +64,7 @@ private:
 		}
 	}
 public:
-	File(void) : size_(0), is_directory_(false), path_len_(0), path_(0), rctime_{0,0} {}
+	File(void) : size_(0), is_directory_(false), path_len_(0), path_(0), rctime_{0,0}, ino_(0) {}
 	File(const char *path, size_t snap_root_len) : path_len_(0){
 		struct stat st;
 		int res = lstat(path, &st);
@@ -79,10 +73,13 @@ public:
 			Logging::log.error(std::string("Error calling stat on file: ") + strerror(err));
 			l::exit(EXIT_FAILURE);
 		}
-		init(path, snap_root_len, st);
+		init(path, strlen(path), snap_root_len, st);
 	}
 	File(const char *path, size_t snap_root_len, const struct stat &st) : path_len_(0){
-		init(path, snap_root_len, st);
+		init(path, strlen(path), snap_root_len, st);
+	}
+	File(const char *path, size_t path_len, size_t snap_root_len, const struct stat &st) : path_len_(0){
+		init(path, path_len, snap_root_len, st);
 	}
 	File(const File &other) = delete;
 	File(File &&other)
@@ -90,7 +87,8 @@ public:
 		, is_directory_(std::move(other.is_directory_))
 		, path_len_(std::move(other.path_len_))
 		, path_(std::move(other.path_))
-		, rctime_(std::move(other.rctime_)){
+		, rctime_(std::move(other.rctime_))
+		, ino_(std::move(other.ino_)){
 		other.path_ = nullptr;
 	}
 	File &operator=(File &&other){
@@ -99,6 +97,7 @@ public:
 		path_len_ = std::move(other.path_len_);
 		path_ = std::move(other.path_);
 		rctime_ = std::move(other.rctime_);
+		ino_ = std::move(other.ino_);
 		other.path_ = nullptr;
 		return *this;
 	}
@@ -124,4 +123,12 @@ public:
 	timespec rctime(void) const{
 		return rctime_;
 	}
+	ino_t ino(void) const{
+		return ino_;
+	}
+	void send_always(void){
+		// newer than any destination's last synced rctime
+		rctime_.tv_sec = std::numeric_limits<time_t>::max();
+		rctime_.tv_nsec = 0;
+	}
 };
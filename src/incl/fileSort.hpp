@@ -0,0 +1,52 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#define FILE_SORT_MIN_PER_THREAD 65536 // fewer keys than this per thread aren't worth another thread
+#ifndef FILE_SORT_DIGIT_BITS
+#define FILE_SORT_DIGIT_BITS 11 // bits of key sorted per pass, counts of one thread stay in L1
+#endif
+
+class File;
+
+enum SORT_KEY_T {SORT_SIZE, SORT_SIZE_CLASS, SORT_INODE};
+/* Size in bytes, power of two the size falls under, inode number.
+ */
+
+void radix_sort(std::vector<File> &files, size_t first, size_t last, SORT_KEY_T key, int nthreads = 0);
+/* Stable sort of files[first, last) by key, smallest first. LSD radix
+ * sort of (key, index) pairs, one pass per FILE_SORT_DIGIT_BITS bits of
+ * the largest key, split between up to nthreads threads, 0 for one per
+ * core. Iterators into files stay valid.
+ */
+
+void sort_by_size(std::vector<File> &files);
+/* radix_sort() of every file by size, moving each file once into new
+ * storage.
+ */
+
+void sort_by_path(std::vector<File> &files, size_t first, size_t last);
+/* Sort files[first, last) by directory then name, so files of a
+ * directory are next to each other and directories come before their
+ * subdirectories.
+ */
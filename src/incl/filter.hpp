@@ -0,0 +1,99 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+class PatternSet{
+	/* One list of glob patterns (Include or Exclude), sorted by
+	 * shape into the cheapest structure that can match it.
+	 * Patterns without '/' match the entry name, patterns with '/'
+	 * match the path relative to the Source Directory. A trailing
+	 * '/' only matches directories.
+	 */
+private:
+	struct LengthSet{
+		size_t len_;
+		std::unordered_set<std::string> strings_;
+	};
+	/* Literal affixes of one length, so a name is hashed once per
+	 * distinct length instead of compared to every pattern.
+	 */
+	struct Rules{
+		std::unordered_set<std::string> exact_;
+		/* Literal patterns.
+		 */
+		std::vector<LengthSet> suffixes_;
+		/* Literal parts of "*literal" patterns.
+		 */
+		std::vector<LengthSet> prefixes_;
+		/* Literal parts of "literal*" patterns.
+		 */
+		std::vector<std::string> globs_;
+		/* Everything else, matched with fnmatch.
+		 */
+		bool empty(void) const;
+		void add(const std::string &pattern, bool path);
+		bool match(const char *str, size_t len, bool path) const;
+	};
+	Rules name_rules_;
+	Rules name_dir_rules_;
+	/* Match entry name. _dir_ rules only apply to directories.
+	 */
+	Rules path_rules_;
+	Rules path_dir_rules_;
+	/* Match path relative to Source Directory.
+	 */
+	static void add_affix(std::vector<LengthSet> &sets, const std::string &affix);
+	static bool match_affix(const std::vector<LengthSet> &sets, const char *str, size_t len, bool suffix);
+public:
+	bool add(std::string pattern);
+	/* Compile one pattern. Returns false if pattern is empty.
+	 */
+	bool empty(void) const;
+	/* True if no patterns were added.
+	 */
+	bool match(const char *name, size_t name_len, const char *rel_path, size_t rel_len, bool is_dir) const;
+	/* True if entry matches any pattern.
+	 */
+};
+
+class FilterRules{
+	/* Compiled Include and Exclude settings. An entry is skipped if it
+	 * matches an Exclude pattern and no Include pattern. Skipped
+	 * directories are never descended into.
+	 */
+private:
+	PatternSet include_;
+	PatternSet exclude_;
+public:
+	bool compile(const std::string &include, const std::string &exclude);
+	/* Parse comma separated pattern lists. Returns false on bad pattern.
+	 */
+	bool empty(void) const{
+		return exclude_.empty();
+	}
+	bool excluded(const char *name, size_t name_len, const char *rel_path, size_t rel_len, bool is_dir) const{
+		return exclude_.match(name, name_len, rel_path, rel_len, is_dir)
+			&& !include_.match(name, name_len, rel_path, rel_len, is_dir);
+	}
+};
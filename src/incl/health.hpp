@@ -0,0 +1,95 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#define HEALTH_BACKOFF_BASE std::chrono::seconds(5) // backoff after first failure
+#define HEALTH_BACKOFF_MAX std::chrono::seconds(300) // cap on exponential backoff
+#define HEALTH_EWMA_WEIGHT 0.2 // weight of newest sample in latency and failure rate averages
+
+class DestinationHealth{
+	/* Circuit breaker and statistics for one destination.
+	 * A failure opens the breaker for a jittered, exponentially
+	 * growing backoff. Once the backoff expires the destination
+	 * is half open and lets a single probe through, whose result
+	 * either closes the breaker or opens it again for longer.
+	 */
+public:
+	enum State {CLOSED, OPEN, HALF_OPEN};
+private:
+	State state_;
+	/* Current breaker state.
+	 */
+	int consecutive_failures_;
+	/* Failures since last success. Sets backoff exponent.
+	 */
+	double failure_rate_;
+	/* Moving average of batch outcomes, 1.0 being all failures.
+	 */
+	double latency_s_;
+	/* Moving average of successful batch durations in seconds.
+	 */
+	std::chrono::system_clock::time_point last_success_;
+	/* Wall time of last successful batch, epoch if never.
+	 */
+	std::chrono::steady_clock::time_point open_until_;
+	/* End of current backoff.
+	 */
+	bool probing_;
+	/* A batch admitted while half open has not finished yet.
+	 */
+public:
+	DestinationHealth(void);
+	/* Construct closed breaker with empty statistics.
+	 */
+	~DestinationHealth(void) = default;
+	/* Default destructor.
+	 */
+	bool available(void);
+	/* Returns true if traffic may be sent. Moves an open breaker
+	 * to half open once its backoff has expired. A half open
+	 * destination is unavailable while its probe is out.
+	 */
+	bool admit(bool &probe);
+	/* Returns false if the destination is half open and its probe is out.
+	 * Otherwise admits a batch, setting probe if it is the one sent
+	 * to a half open destination.
+	 */
+	void end_probe(void);
+	/* Let another probe through after one ended without a result.
+	 */
+	State state(void) const;
+	/* Return breaker state without updating it.
+	 */
+	void record_success(std::chrono::steady_clock::duration latency);
+	/* Close breaker, end probe and update statistics with batch duration.
+	 */
+	void record_failure(void);
+	/* Open breaker for next backoff period, end probe and update statistics.
+	 */
+	std::chrono::steady_clock::duration backoff_remaining(void) const;
+	/* Return time left until breaker half opens, 0 if not open.
+	 */
+	std::string summary(void) const;
+	/* Return state, failure rate, latency and last success as a log string.
+	 */
+};
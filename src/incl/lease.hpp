@@ -0,0 +1,152 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <set>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+
+#define LEASE_SUFFIX ".lease"
+#define LEASE_NODES_DIR "nodes/" // heartbeat file of each gateway, to count live ones
+
+class LeaseManager{
+	/* Lets several gateways share the work of one config. Each root
+	 * or shard (unit) is leased by one gateway at a time through a
+	 * lock file in a shared directory:
+	 *   <dir>/<unit>.lease.<generation> = "<node> <expiry in seconds since epoch>"
+	 * The highest generation is the lease. Leases are only ever created
+	 * with link(), which fails if another gateway got there first: a
+	 * free unit at generation 0, and a lease that expired, because its
+	 * gateway died, at the next generation, so of several gateways taking
+	 * over at once only one wins. A background thread renews held leases
+	 * and this gateway's heartbeat file every third of the timeout. Each gateway holds at most its fair share of
+	 * units, ceil(units / live gateways), and drops the excess after
+	 * a cycle when another gateway joins. Gateway clocks must agree.
+	 */
+private:
+	std::mutex mutex_;
+	/* Guards held_ and the lease files of this node.
+	 */
+	std::string dir_;
+	/* Shared lease directory, with trailing slash. Empty if disabled.
+	 */
+	std::string node_;
+	/* Name of this gateway.
+	 */
+	std::chrono::seconds timeout_;
+	/* How long a lease lasts without renewal.
+	 */
+	std::set<std::string> units_;
+	/* Every unit in the config.
+	 */
+	std::map<std::string, long> held_;
+	/* Units leased by this node, with the generation of their lease.
+	 */
+	int live_;
+	/* Live nodes counted at last heartbeat, at least 1.
+	 */
+	std::thread heartbeat_;
+	/* Renews leases.
+	 */
+	std::condition_variable stop_cv_;
+	bool stop_;
+	/* Set on release_all() to end heartbeat_.
+	 */
+	std::string node_path(void) const;
+	/* Return path of heartbeat file of this node.
+	 */
+	std::string lease_path(const std::string &unit, long generation) const;
+	/* Return path of lease file of unit at generation.
+	 */
+	long generation(const std::string &unit) const;
+	/* Return highest generation of lease files of unit, -1 if free.
+	 */
+	bool write_temp(const std::string &tmp_path) const;
+	/* Write this node's lease with a new expiry to tmp_path.
+	 */
+	static bool read_lease(const std::string &path, std::string &node, time_t &expires);
+	/* Parse lease file. Returns false if it doesn't exist or is garbage.
+	 */
+	bool claim(const std::string &unit, long &generation);
+	/* Take lease of unit if free, expired or already ours, setting the
+	 * generation now held.
+	 */
+	bool renew(const std::string &unit, long generation);
+	/* Push expiry of a held lease. Returns false if another node has
+	 * taken it, which happens if this one stalled past the timeout.
+	 */
+	void release(const std::string &unit, long generation);
+	/* Delete lease file if it is still ours.
+	 */
+	int count_live_nodes(void) const;
+	/* Count nodes with an unexpired heartbeat file, at least 1.
+	 */
+	void write_heartbeat(void) const;
+	/* Renew heartbeat file of this node.
+	 */
+	size_t share(void) const;
+	/* Units this node may hold.
+	 */
+	void beat(void);
+	/* Heartbeat loop.
+	 */
+public:
+	LeaseManager(void);
+	/* Construct disabled manager.
+	 */
+	~LeaseManager(void);
+	/* Detach heartbeat thread.
+	 */
+	void start(const std::string &dir, const std::string &node, std::chrono::seconds timeout);
+	/* Enable leasing in dir and start heartbeat. Exits on failure.
+	 */
+	bool enabled(void) const{
+		return !dir_.empty();
+	}
+	void add_unit(const std::string &unit);
+	/* Register unit as part of the work to share.
+	 */
+	bool hold(const std::string &unit);
+	/* Call before each cycle of unit. Returns true if this node holds
+	 * the lease, claiming it if it is free and this node is under its share.
+	 */
+	bool holds(const std::string &unit);
+	/* Returns true if this node still holds unit, which it stops doing
+	 * when the heartbeat finds the lease taken over.
+	 */
+	bool done(const std::string &unit);
+	/* Call after each cycle of unit. Gives the lease up if this node
+	 * holds more than its share, so a new gateway can take it.
+	 * Returns true if the lease is still held.
+	 */
+	void release_all(void);
+	/* Stop heartbeat and give up every lease, letting other gateways
+	 * take over right away.
+	 */
+};
+
+namespace Leases{
+	extern LeaseManager manager;
+}
@@ -0,0 +1,249 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+
+extern "C" {
+	#include <sys/types.h>
+	#include <sys/stat.h>
+}
+
+#define LISTING_MAGIC "CGRLST1\n"
+#define LISTING_FILE "l" // listing of a directory inside its store directory
+#define LISTING_CHILDREN "c" // store directories of its subdirectories
+#define LISTING_PARKED "p" // listings of renamed directories while they are moved
+#define TREE_OPS_PER_SCRIPT 4096 // deletes and renames sent per remote shell
+#define TREE_OPS_STAGING ".cephgeorep-mv" // renamed entries are parked here on destination
+
+struct ListEntry{
+	/* One entry of a directory listing.
+	 */
+	ino_t ino_;
+	bool is_dir_;
+	std::string name_;
+};
+
+struct TreeOp{
+	/* Delete or rename to replay on destinations, with paths relative
+	 * to the destination path.
+	 */
+	enum Type {REMOVE, MOVE};
+	Type type_;
+	bool is_dir_;
+	std::string from_;
+	/* Path removed or renamed.
+	 */
+	std::string to_;
+	/* New path if renamed.
+	 */
+	bool late_;
+	/* Delete found inside a renamed directory, by its new path, so it
+	 * runs after renames.
+	 */
+	static std::vector<std::string> scripts(const std::vector<TreeOp> &ops, const std::string &root);
+	/* Shell scripts replaying ops in root, TREE_OPS_PER_SCRIPT at a time.
+	 * Renamed entries are first moved into a staging directory, deepest
+	 * first, then deletes run, then staged entries go to their new paths,
+	 * shallowest first, so swaps and renames into renamed directories work,
+	 * then late deletes run. Entries missing on the destination are skipped.
+	 */
+};
+
+class ListingStore{
+	/* Listing of each crawled directory as of the last synced cycle,
+	 * kept in a tree mirroring the source so whole subtrees can be
+	 * moved or dropped at once:
+	 *   <dir>/c/a/c/b/l = listing of a/b
+	 * Renamed subtrees are parked in <dir>/p/ while listings move.
+	 */
+private:
+	std::string dir_;
+	/* Root of store, empty if disabled.
+	 */
+	std::string path_of(const std::string &rel) const;
+	/* Return store directory of rel.
+	 */
+public:
+	void set_dir(const std::string &dir){
+		dir_ = dir;
+	}
+	bool enabled(void) const{
+		return !dir_.empty();
+	}
+	bool exists(const std::string &rel) const;
+	/* Returns true if a listing of rel is stored.
+	 */
+	bool load(const std::string &rel, std::vector<ListEntry> &entries) const;
+	/* Read listing of rel. Returns false if there is none or it is corrupt.
+	 */
+	void save(const std::string &rel, const std::vector<ListEntry> &entries) const;
+	/* Replace listing of rel.
+	 */
+	void remove(const std::string &rel) const;
+	/* Drop listing of rel alone.
+	 */
+	void remove_tree(const std::string &rel) const;
+	/* Drop listings of rel and everything below it.
+	 */
+	bool park(const std::string &rel, size_t slot) const;
+	/* Move listings of rel and everything below it aside into slot.
+	 * Returns false if rel was never listed.
+	 */
+	void unpark(size_t slot, const std::string &rel) const;
+	/* Move listings parked in slot to rel, replacing what is there.
+	 */
+};
+
+struct DirListing{
+	/* Listing of one directory being read by a crawler thread.
+	 */
+	std::string rel_;
+	/* Directory relative to source root, empty for the root.
+	 */
+	bool enabled_ = false;
+	/* Whether entries are recorded.
+	 */
+	bool diff_ = false;
+	/* Whether a listing from last cycle was loaded to compare with.
+	 */
+	std::unordered_map<std::string, ListEntry> old_;
+	/* Entries from last cycle not seen yet, by name.
+	 */
+	std::vector<ListEntry> current_;
+	/* Entries seen this cycle.
+	 */
+	bool changed_ = false;
+	/* Set if an entry was added or replaced.
+	 */
+};
+
+class TreeChanges{
+	/* Finds entries deleted or renamed since the last synced cycle by
+	 * comparing each directory the crawler reads with its stored
+	 * listing. An inode that left one place and showed up in another
+	 * was renamed, anything else that left was deleted. New listings
+	 * are only stored by commit(), once the cycle reached every
+	 * destination, so failed cycles find the same changes again.
+	 * Directories listed for the first time are stored right away,
+	 * as there is nothing to compare them with, unless they turn out
+	 * to be renamed, in which case they are compared with the listing
+	 * under their old path.
+	 */
+private:
+	ListingStore store_;
+	/* Listings of last synced cycle.
+	 */
+	std::mutex mutex_;
+	/* Guards everything below, shared by crawler threads.
+	 */
+	struct Change{
+		std::string path_;
+		/* Path at the start of the cycle for removed entries, current
+		 * path for added ones.
+		 */
+		bool is_dir_;
+		bool queued_;
+		/* Set if an added file was queued by the crawler.
+		 */
+		std::string late_path_;
+		/* Current path of a removed entry inside a renamed directory.
+		 */
+	};
+	std::vector<std::pair<ino_t, Change>> removed_;
+	/* Entries gone from their directory this cycle. A list, since hard
+	 * links share an inode.
+	 */
+	std::unordered_map<ino_t, Change> added_;
+	/* Entries new in their directory this cycle, by inode.
+	 */
+	std::unordered_set<std::string> fresh_;
+	/* Directories listed for the first time this cycle.
+	 */
+	std::vector<std::pair<std::string, std::vector<ListEntry>>> staged_;
+	/* Listings of changed directories, stored on commit().
+	 */
+	std::vector<TreeOp> ops_;
+	/* Result of resolve().
+	 */
+	bool failed_ = false;
+	/* Set if an entry missing from its directory could not be stat'ed,
+	 * so whether it was deleted is unknown.
+	 */
+	static bool entry_gone(const std::string &path, bool &failed);
+	/* Returns true if path no longer exists. Sets failed if lstat fails
+	 * for any other reason than ENOENT.
+	 */
+	std::string child_path(const std::string &rel, const std::string &name) const{
+		return (rel.empty())? name : rel + "/" + name;
+	}
+	void reconcile(const std::string &from, const std::string &to, const std::string &snap_path);
+	/* Compare a renamed directory, listed for the first time under to,
+	 * with its listing under from, and the same for its subdirectories.
+	 */
+public:
+	void enable(const std::string &dir);
+	/* Keep listings in dir.
+	 */
+	bool enabled(void) const{
+		return store_.enabled();
+	}
+	void open(DirListing &listing, const std::string &rel, bool first_only) const;
+	/* Start listing directory rel, loading its last listing. If
+	 * first_only, only directories never listed before are recorded.
+	 */
+	bool record(DirListing &listing, const char *name, size_t len, const struct stat &st);
+	/* Add entry to listing. Returns true if it is new or replaced since
+	 * last cycle, so it has to be sent even if it is old, e.g. renamed.
+	 */
+	void close(DirListing &listing, const std::string &dir_path);
+	/* Note entries left from last cycle as removed, unless they still
+	 * exist under dir_path and were only filtered out, and store or
+	 * stage the new listing.
+	 */
+	void resolve(const std::string &snap_path, std::vector<std::string> &new_dirs, std::vector<std::string> &new_files);
+	/* Pair removed entries with added ones into ops(). Directories that
+	 * showed up without leaving anywhere, e.g. moved in from outside of
+	 * the source, are returned in new_dirs to be sent whole. Files found
+	 * in renamed directories that were not queued are returned in
+	 * new_files.
+	 */
+	const std::vector<TreeOp> &ops(void) const{
+		return ops_;
+	}
+	bool failed(void){
+		std::lock_guard<std::mutex> lk(mutex_);
+		return failed_;
+	}
+	/* Returns true if the cycle must be discarded and found again,
+	 * since some entries could not be checked for deletes.
+	 */
+	void commit(void);
+	/* Store listings of this cycle.
+	 */
+	void discard(void);
+	/* Forget changes of this cycle, and listings stored for the first
+	 * time, so they are found again next cycle.
+	 */
+};
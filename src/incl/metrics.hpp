@@ -0,0 +1,219 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#define METRICS_SHARDS 16 // independent copies of each counter, picked per thread
+#define METRICS_HIST_BUCKETS 48 // log2 buckets, up to 2^47 ns (~39 hours) or 128 TiB
+#define METRICS_REQUEST_MAX 4096 // bytes of HTTP request read before replying
+
+namespace Metrics{
+	extern std::atomic<unsigned> next_shard;
+	/* Round robin source for shard().
+	 */
+	inline unsigned shard(void){
+		/* Index of calling thread's shard. Threads get consecutive
+		 * shards so crawler workers never share a cache line.
+		 */
+		static thread_local unsigned idx = next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+		return idx;
+	}
+}
+
+class Counter{
+	/* Monotonic counter. add() is one relaxed atomic add on a
+	 * cache line owned by the calling thread.
+	 */
+private:
+	struct Shard{
+		std::atomic<uint64_t> value_;
+		char pad_[64 - sizeof(std::atomic<uint64_t>)];
+	};
+	Shard shards_[METRICS_SHARDS];
+	/* Per thread partial sums.
+	 */
+public:
+	Counter(void);
+	/* Construct zeroed counter.
+	 */
+	void add(uint64_t n = 1){
+		shards_[Metrics::shard()].value_.fetch_add(n, std::memory_order_relaxed);
+	}
+	uint64_t value(void) const;
+	/* Sum of all shards.
+	 */
+};
+
+class Gauge{
+	/* Value that can go up and down, set from one place.
+	 */
+private:
+	std::atomic<double> value_;
+public:
+	Gauge(void) : value_(0.0){}
+	/* Construct zeroed gauge.
+	 */
+	void set(double value){
+		value_.store(value, std::memory_order_relaxed);
+	}
+	double value(void) const{
+		return value_.load(std::memory_order_relaxed);
+	}
+};
+
+class Histogram{
+	/* Distribution of integer samples (nanoseconds or bytes) in
+	 * power of two buckets. observe() is a count leading zeros and
+	 * three relaxed atomic adds on the calling thread's shard.
+	 */
+private:
+	struct Shard{
+		std::atomic<uint64_t> buckets_[METRICS_HIST_BUCKETS];
+		std::atomic<uint64_t> sum_;
+		char pad_[64];
+	};
+	Shard shards_[METRICS_SHARDS];
+	/* Per thread partial counts.
+	 */
+	double scale_;
+	/* Multiplier from sample units to exported units, e.g. 1e-9 for
+	 * nanoseconds exported as seconds.
+	 */
+public:
+	explicit Histogram(double scale);
+	/* Construct empty histogram.
+	 */
+	void observe(uint64_t value){
+		int bucket = (value)? 64 - __builtin_clzll(value) : 0; // value < 2^bucket
+		if(bucket >= METRICS_HIST_BUCKETS)
+			bucket = METRICS_HIST_BUCKETS - 1;
+		Shard &shard = shards_[Metrics::shard()];
+		shard.buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+		shard.sum_.fetch_add(value, std::memory_order_relaxed);
+	}
+	void observe(std::chrono::steady_clock::duration elapsed){
+		observe((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+	void render(std::string &out, const std::string &name, const std::string &labels) const;
+	/* Append _bucket, _sum and _count lines in Prometheus text format.
+	 */
+};
+
+class MetricsRegistry{
+	/* Owns every metric and renders them in Prometheus text format.
+	 * Metrics are never removed, so references stay valid.
+	 */
+private:
+	enum Type {COUNTER, GAUGE, HISTOGRAM};
+	struct Entry{
+		std::string name_;
+		std::string help_;
+		std::string labels_;
+		Type type_;
+		void *metric_;
+	};
+	std::mutex mutex_;
+	/* Guards registration against rendering.
+	 */
+	std::list<Entry> entries_;
+	/* In registration order.
+	 */
+	std::list<Counter> counters_;
+	std::list<Gauge> gauges_;
+	std::list<Histogram> histograms_;
+	/* Storage with stable addresses.
+	 */
+	Entry *find(const std::string &name, const std::string &labels);
+	/* Return existing entry or nullptr. Call with mutex_ held.
+	 */
+public:
+	Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+	/* Return counter with name and labels, creating it if needed.
+	 * labels is either empty or a list like destination="host:/path".
+	 */
+	Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+	/* Return gauge with name and labels, creating it if needed.
+	 */
+	Histogram &histogram(const std::string &name, const std::string &help, double scale, const std::string &labels = "");
+	/* Return histogram with name and labels, creating it if needed.
+	 */
+	std::string render(void);
+	/* Return all metrics in Prometheus text exposition format.
+	 */
+	static std::string label(const std::string &key, const std::string &value);
+	/* Return key="value" with value escaped.
+	 */
+};
+
+class MetricsServer{
+	/* Serves MetricsRegistry over HTTP on the loopback interface.
+	 */
+private:
+	int listen_fd_;
+	/* Bound socket, -1 until started.
+	 */
+	std::thread thread_;
+	/* Accept loop.
+	 */
+	void serve(void);
+	/* Answer one request at a time until process exits.
+	 */
+public:
+	MetricsServer(void);
+	/* Construct stopped server.
+	 */
+	~MetricsServer(void);
+	/* Detach accept loop. The socket closes with the process.
+	 */
+	void start(int port);
+	/* Bind 127.0.0.1:port and start accept loop. Exits on failure.
+	 */
+};
+
+namespace Metrics{
+	extern MetricsRegistry &registry;
+	/* Global registry, never destroyed so the server thread can
+	 * keep rendering while static objects are torn down.
+	 */
+	extern bool enabled;
+	/* True once the server is running. Latency is only timed
+	 * when something will read it.
+	 */
+	extern Counter &entries_scanned;
+	extern Histogram &stat_latency;
+	extern Histogram &getxattr_latency;
+	extern Counter &files_queued;
+	extern Counter &bytes_queued;
+	extern Histogram &batch_launch_latency;
+	extern Histogram &batch_duration;
+	extern Counter &bytes_prefetched;
+	extern Histogram &cycle_duration;
+	extern Gauge &replication_lag;
+	extern Gauge &last_sync;
+	extern Gauge &status;
+}
@@ -0,0 +1,47 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstring>
+
+// Name checks for Ignore Hidden, Ignore Windows Lock and Ignore Vim Swap,
+// run on the dirent name before an entry is stat'ed.
+
+inline bool check_hidden(const char *file_name){
+	// /^\./
+	return *file_name == '.';
+}
+
+inline bool check_win_lock(const char *file_name){
+	// /^~\$/
+	return (file_name[0] == '~' && file_name[1] == '$');
+}
+
+inline bool check_vim_swap(const char *file_name, size_t len){
+	// /^\..*\.swpx?$/
+	// ".swp" holds no other '.', so matching the suffix finds the last '.'
+	// the suffix must not start at the leading '.'
+	if(!check_hidden(file_name))
+		return false;
+	return (
+		   (len > 4 && memcmp(file_name + len - 4, ".swp", 4) == 0)
+		|| (len > 5 && memcmp(file_name + len - 5, ".swpx", 5) == 0)
+	);
+}
@@ -0,0 +1,110 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+struct PrefetchBatch{
+	/* Files of one sync batch to warm in the page cache, in the order
+	 * they were handed to the sync process.
+	 */
+	std::vector<const char *> paths_;
+	/* Paths, owned by the sync queue.
+	 */
+	uintmax_t cap_ = 0;
+	/* Most bytes of this batch to hold in the page cache at once.
+	 */
+	uintmax_t bytes_ = 0;
+	/* Bytes prefetched for this batch, counted against the budget.
+	 */
+	size_t next_ = 0;
+	/* Index of next path to prefetch.
+	 */
+	bool done_ = false;
+	/* Set once the batch exited, so the rest is skipped.
+	 */
+};
+
+class Prefetcher{
+	/* Background thread that reads ahead the files of running sync
+	 * batches with posix_fadvise(POSIX_FADV_WILLNEED), so the sync
+	 * program finds them in the page cache instead of waiting on the
+	 * OSDs for each file. Bytes prefetched for running batches are
+	 * capped by a budget and returned when the batch exits.
+	 */
+private:
+	uintmax_t budget_;
+	/* Most bytes prefetched for running batches at once. 0 if disabled.
+	 */
+	uintmax_t outstanding_;
+	/* Bytes prefetched for batches that are still running.
+	 */
+	std::deque<std::shared_ptr<PrefetchBatch>> batches_;
+	/* Batches with files left to prefetch, oldest first.
+	 */
+	std::mutex mutex_;
+	/* Guards everything above and each batch's bookkeeping.
+	 */
+	std::condition_variable cv_;
+	/* Notified when a batch is added, budget is returned or stopping.
+	 */
+	bool stop_;
+	/* Set to end the thread.
+	 */
+	std::thread thread_;
+	/* Runs work().
+	 */
+	void work(void);
+	/* Prefetch files of queued batches while budget allows.
+	 */
+public:
+	Prefetcher(uintmax_t budget);
+	/* Construct with budget in bytes, 0 to disable.
+	 */
+	~Prefetcher(void);
+	/* Calls stop().
+	 */
+	bool enabled(void) const{
+		return budget_ != 0;
+	}
+	/* Returns true if a budget was given.
+	 */
+	void start(void);
+	/* Start thread if enabled and not running.
+	 */
+	void stop(void);
+	/* Drop every batch and join thread. Paths of batches must stay
+	 * valid until this returns.
+	 */
+	std::shared_ptr<PrefetchBatch> add(char *const *begin, char *const *end, int shares);
+	/* Queue paths [begin, end) of a batch that was just launched, taking
+	 * at most 1/shares of the budget. Returns nullptr if disabled.
+	 */
+	void finish(std::shared_ptr<PrefetchBatch> &batch);
+	/* Return bytes of an exited batch to the budget and reset batch.
+	 */
+};
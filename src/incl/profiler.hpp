@@ -0,0 +1,159 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define PROFILE_MAX_EVENTS (1 << 20) // stop recording trace events past this many
+#define PROFILE_DIR_SPAN_MIN std::chrono::milliseconds(1) // only trace directories slower than this
+
+enum ProfilePhase {
+	PROF_CHECK,
+	PROF_SNAP_CREATE,
+	PROF_PROP_DELAY,
+	PROF_CRAWL,
+	PROF_READDIR,
+	PROF_STAT,
+	PROF_XATTR,
+	PROF_SORT,
+	PROF_SCHEDULE,
+	PROF_TRANSFER,
+	PROF_SNAP_DELETE,
+	PROF_FLUSH,
+	PROF_N_PHASES
+};
+/* PROF_READDIR, PROF_STAT and PROF_XATTR are parts of PROF_CRAWL summed
+ * over all crawler threads, so together they can exceed it.
+ */
+
+struct TraceEvent{
+	/* One complete ("ph":"X") Chrome trace event.
+	 */
+	const char *name_;
+	int tid_;
+	int64_t ts_us_;
+	int64_t dur_us_;
+	std::string args_;
+	/* JSON object body without braces, may be empty.
+	 */
+};
+
+class Profiler{
+	/* Per-phase timing of each sync cycle, logged as one summary line,
+	 * plus an optional Chrome trace-event file (--profile).
+	 */
+private:
+	std::atomic<int64_t> phase_ns_[PROF_N_PHASES];
+	/* Time spent in each phase this cycle.
+	 */
+	std::atomic<bool> measured_[PROF_N_PHASES];
+	/* Whether phase was timed at all this cycle, to leave unmeasured
+	 * crawl details out of the summary.
+	 */
+	std::chrono::steady_clock::time_point cycle_start_;
+	/* Start of current cycle.
+	 */
+	std::mutex cycle_mutex_;
+	int open_cycles_;
+	/* Cycles of different source roots begun and not yet ended. Timers
+	 * are zeroed by the first and reported by the last, so overlapping
+	 * cycles are summed into one summary.
+	 */
+	void reset(void);
+	/* Zero phase timers and restart cycle clock.
+	 */
+	std::chrono::steady_clock::time_point origin_;
+	/* Time zero for trace timestamps.
+	 */
+	std::string trace_path_;
+	/* Where to write trace events, empty if not tracing.
+	 */
+	std::mutex trace_mutex_;
+	/* Guards events_.
+	 */
+	std::vector<TraceEvent> events_;
+	/* Every recorded span since start.
+	 */
+	bool truncated_;
+	/* Set once PROFILE_MAX_EVENTS is reached.
+	 */
+	bool truncation_reported_;
+	/* Warn about truncation only once.
+	 */
+	void write_trace(void);
+	/* Rewrite trace_path_ with all events.
+	 */
+public:
+	Profiler(void);
+	/* Construct profiler with tracing off.
+	 */
+	void enable_trace(const std::string &path);
+	/* Record trace events and write them to path after each cycle.
+	 */
+	bool tracing(void) const{
+		return !trace_path_.empty();
+	}
+	void begin_cycle(void);
+	/* Zero phase timers unless another cycle is open.
+	 */
+	void add(ProfilePhase phase, std::chrono::steady_clock::duration elapsed){
+		phase_ns_[phase].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+		measured_[phase].store(true, std::memory_order_relaxed);
+	}
+	void span(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, const std::string &args = "");
+	/* Record a trace event for the calling thread if tracing.
+	 */
+	void end_cycle(bool report = true);
+	/* Log summary of phase timers and write trace file once no other
+	 * cycle is open. Pass false for a cycle that found nothing to do.
+	 */
+	static const char *phase_name(ProfilePhase phase);
+	/* Return name of phase as used in summary and trace.
+	 */
+	static std::string json_string(const std::string &str);
+	/* Return str as a quoted JSON string for span args.
+	 */
+	static int thread_id(void);
+	/* Small sequential ID of calling thread for trace events.
+	 */
+};
+
+class ProfileScope{
+	/* Times enclosing scope as one phase and traces it.
+	 */
+private:
+	ProfilePhase phase_;
+	std::chrono::steady_clock::time_point start_;
+public:
+	explicit ProfileScope(ProfilePhase phase);
+	~ProfileScope(void);
+	ProfileScope(const ProfileScope &) = delete;
+	ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+namespace Profiling{
+	extern Profiler profiler;
+	/* Global Profiler object.
+	 */
+}
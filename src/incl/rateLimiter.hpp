@@ -0,0 +1,194 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#define BWLIMIT_ARG_LEN 32 // room for "--bwlimit=<KiB/s>" in argv of each sync process
+
+class LimitSchedule{
+	/* Time of day windows during which rate limits apply.
+	 * With no windows defined, limits always apply.
+	 */
+private:
+	std::vector<std::pair<int, int>> windows_;
+	/* Start and end of each window in minutes since midnight, local time.
+	 * Windows with end < start wrap past midnight.
+	 */
+public:
+	LimitSchedule(void) = default;
+	/* Construct schedule that is always active.
+	 */
+	~LimitSchedule(void) = default;
+	/* Default destructor.
+	 */
+	bool parse(const std::string &value);
+	/* Parse comma or space separated list of HH:MM-HH:MM windows.
+	 * Returns false if value is malformed.
+	 */
+	bool active(void) const;
+	/* Returns true if the current local time falls in any window,
+	 * or if there are no windows.
+	 */
+	std::string str(void) const;
+	/* Return windows formatted as HH:MM-HH:MM list.
+	 */
+};
+
+class TokenBucket{
+	/* Thread safe token bucket. Tokens are reserved up front so
+	 * callers that overdraw the bucket sleep outside of the lock
+	 * until their reservation is paid back.
+	 */
+private:
+	std::mutex mutex_;
+	/* Protects tokens_ and last_refill_.
+	 */
+	double rate_;
+	/* Tokens added per second. 0 means unlimited.
+	 */
+	double burst_;
+	/* Maximum tokens that can accumulate while idle.
+	 */
+	double tokens_;
+	/* Tokens currently available. Goes negative when overdrawn.
+	 */
+	std::chrono::steady_clock::time_point last_refill_;
+	/* Time tokens_ was last topped up.
+	 */
+	const LimitSchedule *schedule_;
+	/* When set, acquire() only limits while the schedule is active.
+	 */
+public:
+	TokenBucket(double rate, const LimitSchedule *schedule = nullptr);
+	/* Construct bucket adding rate tokens per second, with a
+	 * burst of one second worth of tokens.
+	 */
+	~TokenBucket(void) = default;
+	/* Default destructor.
+	 */
+	void set_rate(double rate, const LimitSchedule *schedule = nullptr);
+	/* Change rate and schedule, refilling the bucket to one second worth.
+	 */
+	void acquire(double tokens = 1.0);
+	/* Take tokens from the bucket, sleeping if the bucket is overdrawn.
+	 * Returns immediately if unlimited or outside of the schedule.
+	 */
+};
+
+struct BandwidthShare{
+	/* One syncer's or transfer engine's standing in a BandwidthLimiter.
+	 */
+	int slots_ = 0;
+	/* Processes it may run at once.
+	 */
+	uintmax_t granted_ = 0;
+	/* Bytes per second granted and not yet returned.
+	 */
+};
+
+class BandwidthLimiter{
+	/* Divides an aggregate bandwidth cap between every sync process and
+	 * ranged transfer of the daemon, across all roots, shards and fast
+	 * lanes. Since the sync program is external, each process is granted
+	 * a share before launch, handed to it through its bandwidth limit flag
+	 * and returned when it exits. A share is the cap divided by the slots
+	 * of every owner currently sending, and is only granted once that much
+	 * is free, so grants never add up to more than the cap.
+	 */
+private:
+	mutable std::mutex mutex_;
+	/* Guards everything below.
+	 */
+	std::condition_variable released_;
+	/* Notified when grants are returned.
+	 */
+	uintmax_t bytes_per_sec_;
+	/* Aggregate limit in bytes per second. 0 means unlimited.
+	 */
+	const LimitSchedule *schedule_;
+	/* Limit only applies while this schedule is active, if set.
+	 */
+	uintmax_t granted_;
+	/* Sum of grants held by all owners.
+	 */
+	std::map<const void *, BandwidthShare> owners_;
+	/* Standing of each owner with slots or grants.
+	 */
+	bool grantable(const void *owner, int slots, uintmax_t &bytes_per_sec);
+	/* Work out owner's share for slots processes and take it if free.
+	 * mutex_ must be held.
+	 */
+public:
+	BandwidthLimiter(void);
+	/* Construct unlimited limiter.
+	 */
+	~BandwidthLimiter(void) = default;
+	/* Default destructor.
+	 */
+	void configure(uintmax_t bytes_per_sec, const LimitSchedule *schedule);
+	/* Set aggregate limit, 0 for unlimited. Call before any grants.
+	 */
+	bool enabled(void) const;
+	/* Returns true if a limit is configured.
+	 */
+	void set_slots(const void *owner, int slots);
+	/* Number of processes owner is about to run at once, counted when
+	 * dividing the limit.
+	 */
+	bool try_grant(const void *owner, int slots, uintmax_t &bytes_per_sec);
+	/* Grant owner the share of slots processes in bytes_per_sec, 0 if
+	 * unlimited at this time of day. Returns false without blocking if
+	 * that much is not free yet.
+	 */
+	uintmax_t grant(const void *owner, int slots);
+	/* Like try_grant, blocking until the share is free.
+	 */
+	void release(const void *owner, uintmax_t bytes_per_sec);
+	/* Return a grant taken by owner.
+	 */
+	void release_all(const void *owner);
+	/* Return every grant held by owner and drop its slots.
+	 */
+	uintmax_t granted(void) const;
+	/* Return sum of grants currently held.
+	 */
+};
+
+namespace Limits{
+	extern LimitSchedule schedule;
+	/* Limit Schedule, shared by both limits below.
+	 */
+	extern BandwidthLimiter bandwidth;
+	/* Bandwidth Limit, shared by every sync process and ranged transfer.
+	 */
+	extern TokenBucket meta_ops;
+	/* Metadata Op Limit, shared by every crawler thread.
+	 */
+	void configure(uintmax_t bw_limit, double meta_op_limit, const LimitSchedule &limit_schedule);
+	/* Set the process-wide limits. Call once before any crawler starts.
+	 */
+}
@@ -23,9 +23,12 @@
 
 namespace fs = boost::filesystem;
 
-#define XATTR_SIZE 1024
+class RctimeProvider;
 
-class File;
+inline bool operator>(const timespec &lhs, const timespec &rhs){
+	return (lhs.tv_sec > rhs.tv_sec) ||
+	((lhs.tv_sec == rhs.tv_sec) && (lhs.tv_nsec > rhs.tv_nsec));
+}
 
 class LastRctime{
 	/* holds timestamp of previous file sync
@@ -40,39 +43,55 @@ private:
 	/* location to store last_rctime_
 	 * on disk
 	 */
+	bool writable_;
+	/* false while another gateway owns the file
+	 */
+	bool read(void);
+	/* reads last_rctime_ from disk
+	 * returns false if file is missing or corrupt
+	 */
 public:
-	explicit LastRctime(const fs::path &last_rctime_path);
+	explicit LastRctime(const fs::path &last_rctime_path, const timespec &initial = timespec{0, 0});
 	/* tries to read last_rctime_ from disk
-	 * if not on disk, initializes to 0.0
+	 * if not on disk, initializes to initial
 	 */
 	~LastRctime(void);
 	/* calls write_last_rctime()
 	 */
 	void write_last_rctime(void) const;
 	/* writes last_rctime_ to disk
+	 * unless set_writable(false) was called
+	 */
+	void set_writable(bool writable);
+	/* allow or block writing last_rctime_ to disk
+	 */
+	void reload(void);
+	/* reads last_rctime_ from disk again, to pick up
+	 * where another gateway left off
 	 */
 	void init_last_rctime(void) const;
 	/* creates file to store last_rctime_
 	 * and initializes to 0.0
 	 */
-	bool is_newer(const File &file) const;
-	/* calls get_rctime on path, returns true
-	 * if rctime of path is > last_rctime_
-	 */
-	timespec get_rctime(const File &file) const;
-	timespec get_rctime(const fs::path &path) const;
-	/* returns timespec of mtime if path is a file
-	 * or ceph.dir.rctime if path is a directory
+	bool is_newer(const timespec &rctime) const;
+	/* returns true if rctime is > last_rctime_
 	 */
 	const timespec &rctime(void) const;
 	/* return value of last_rctime_
 	 */
-	bool check_for_change(const fs::path &path, timespec &new_rctime) const;
+	bool check_for_change(const fs::path &path, timespec &new_rctime, RctimeProvider &provider) const;
 	/* checks rctimes and mtimes of each entry in the root directory
 	 * against last_rctime_ and returns true if there are new changes,
 	 * returns lowest rctime or mtime above last_rctime_ by reference
 	 * in new_rctime.
 	 */
+	static bool changed_since(const fs::path &path, const timespec &since, timespec &new_rctime, RctimeProvider &provider);
+	/* Same against since instead of last_rctime_.
+	 */
+	bool check_root_change(const fs::path &path, timespec &new_rctime) const;
+	/* Same for the ctime of the root directory itself, which is all
+	 * that changes when an entry in it is deleted or renamed.
+	 */
 	void update(const timespec &new_rctime);
 	/* copies new_rctime into last_rctime_
 	 */
@@ -0,0 +1,112 @@
+/*
+ *    Copyright (C) 2019-2021 Joshua Boudreau <jboudreau@45drives.com>
+ *    
+ *    This file is part of cephgeorep.
+ * 
+ *    cephgeorep is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ * 
+ *    cephgeorep is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ * 
+ *    You should have received a copy of the GNU General Public License
+ *    along with cephgeorep.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+#define XATTR_SIZE 1024
+#define CEPH_RCTIME_XATTR "ceph.dir.rctime"
+#define USER_RCTIME_XATTR "user.cephgeorep.rctime"
+
+class File;
+
+class RctimeProvider{
+	/* Source of recursive change times (rctime) of directories.
+	 * Files always use mtime from stat.
+	 */
+public:
+	virtual ~RctimeProvider(void) = default;
+	/* Virtual destructor.
+	 */
+	timespec get_rctime(const File &file);
+	timespec get_rctime(const fs::path &path);
+	/* returns timespec of mtime if path is a file
+	 * or rctime from dir_rctime() if path is a directory.
+	 * Returns 0.0 if it cannot be read.
+	 */
+	virtual bool dir_rctime(const char *path, timespec &rctime) = 0;
+	/* Get rctime of directory. Returns false on failure.
+	 */
+	virtual bool snapshots(void) const = 0;
+	/* True if the filesystem supports CephFS snapshots. Otherwise
+	 * the live tree is crawled.
+	 */
+	virtual void new_cycle(void){}
+	/* Called before each check for changes to drop cached rctimes.
+	 */
+	virtual std::string describe(void) const = 0;
+	/* Name for log messages.
+	 */
+};
+
+class XattrRctime : public RctimeProvider{
+	/* Reads rctime from an extended attribute. CephFS maintains
+	 * ceph.dir.rctime; on other filesystems an external tool can keep
+	 * user.cephgeorep.rctime up to date.
+	 */
+private:
+	std::string name_;
+	/* Name of xattr to read.
+	 */
+	bool ceph_;
+	/* Value is in ceph format (<seconds>.09<nanoseconds>) and
+	 * snapshots are available.
+	 */
+public:
+	XattrRctime(const std::string &name, bool ceph);
+	/* Construct provider reading name.
+	 */
+	bool dir_rctime(const char *path, timespec &rctime) override;
+	bool snapshots(void) const override;
+	std::string describe(void) const override;
+};
+
+class ScanRctime : public RctimeProvider{
+	/* Emulates rctime on any filesystem by scanning each subtree for
+	 * its newest ctime. A directory's subtree is scanned once per
+	 * cycle and every directory in it is cached, so the crawl reuses
+	 * what the change check computed.
+	 */
+private:
+	std::mutex mutex_;
+	/* Guards cache_.
+	 */
+	std::unordered_map<std::string, timespec> cache_;
+	/* Recursive ctime of each directory scanned this cycle.
+	 */
+	timespec scan(const std::string &path, std::unordered_map<std::string, timespec> &found);
+	/* Return newest ctime under path, recording each subdirectory in found.
+	 */
+public:
+	bool dir_rctime(const char *path, timespec &rctime) override;
+	bool snapshots(void) const override;
+	void new_cycle(void) override;
+	std::string describe(void) const override;
+};
+
+RctimeProvider *make_rctime_provider(const std::string &source);
+/* Return new provider for Rctime Source value ceph, xattr or scan,
+ * nullptr if source is not recognized.
+ */
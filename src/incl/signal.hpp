@@ -22,17 +22,38 @@
 #include "rctime.hpp"
 #include "status.hpp"
 
+#include <chrono>
+
 class Crawler;
 
 void set_signal_handlers(const Crawler *crawler);
-/* Save pointer to crawler in signal_handling::crawler_
- * and call signal() to set up each signal to be handled by the
- * signal handler in signal.cpp.
+/* Add pointer to crawler to signal_handling::crawlers_.
+ * Signals are taken by the thread started in signal_handling::start().
  */
 
 namespace signal_handling{
+	void block(void);
+	/* Block SIGINT, SIGTERM and SIGQUIT in the calling thread, so only the
+	 * signal thread takes them. Threads inherit the mask they are created with.
+	 */
+	void start(void);
+	/* Block the signals in the calling thread and start the thread that waits
+	 * for them with sigwait(). Call from main() before any other thread is made.
+	 * The first signal asks every root to stop, a second one exits right away.
+	 */
+	bool stopping(void);
+	/* True once a termination signal was taken.
+	 */
+	bool sleep_for(std::chrono::steady_clock::duration duration);
+	/* Sleep for duration or until a termination signal is taken.
+	 * Returns false if woken to stop.
+	 */
+	void stop_cleanup(void);
+	/* Write last rctime of each of signal_handling::crawlers_ and mark the
+	 * daemon as not running. Call after every root has returned.
+	 */
 	void error_cleanup(void);
-	/* Call signal_handling::crawler_->cleanup();
+	/* Call delete_snap() of each of signal_handling::crawlers_.
 	 */
 }
 
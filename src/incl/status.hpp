@@ -20,6 +20,7 @@
 #pragma once
 
 #include <fstream>
+#include <mutex>
 
 #define STATUS_PATH "/run/cephgeorep/"
 #define STATUS_FILE "status"
@@ -27,6 +28,12 @@
 class StatusSetter{
 private:
 	std::ofstream f_;
+	int status_;
+	/* Last status written, to skip rewriting the file.
+	 */
+	std::mutex mutex_;
+	/* Guards f_ and status_, set from each root's thread.
+	 */
 public:
 	StatusSetter(void);
 	void set(int status);
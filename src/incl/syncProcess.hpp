@@ -19,11 +19,17 @@
 
 #pragma once
 
+#include "rateLimiter.hpp"
+#include "destination.hpp"
 #include <vector>
 #include <string>
+#include <chrono>
+#include <memory>
 
 class Syncer;
 class File;
+struct Lane;
+struct PrefetchBatch;
 
 struct ExecError{
 	bool exec_failed_ = false;
@@ -63,24 +69,51 @@ private:
 	int pipefd_[2];
 	/* Pipe for logging errors of sync process.
 	 */
-	std::vector<std::string>::iterator &destination_;
+	std::vector<Destination>::iterator destination_;
 	/* [[<user>@]<host>:][<destination path>]
 	 */
+	bool filter_;
+	/* Only send files newer than destination_->since_.
+	 */
 	std::string sending_to_;
 	/* For printing failures after iterator changes.
 	 */
+	const Lane *lane_;
+	/* Lane this process sends files for.
+	 */
 	std::vector<File>::iterator file_itr_;
 	/* Iterator to list of files to sync.
 	 */
+	std::vector<File>::iterator end_;
+	/* End of the lane's slice of the queue.
+	 */
 	std::vector<char *> payload_;
 	/* argv for sync process.
 	 */
 	ExecError *exec_error_;
 	/* Struct pointer for returning errno from exec fail.
 	 */
+	std::chrono::steady_clock::time_point launched_at_;
+	/* Time current batch was started, for destination latency.
+	 */
+	char bwlimit_arg_[BWLIMIT_ARG_LEN];
+	/* Storage for bandwidth limit flag pointed to by payload_.
+	 */
+	size_t bwlimit_idx_;
+	/* Index of bwlimit_arg_ in payload_, 0 if not limited.
+	 */
+	uintmax_t bwgrant_;
+	/* Share of Limits::bandwidth held by running batch, 0 if none.
+	 */
+	std::shared_ptr<PrefetchBatch> prefetch_;
+	/* Files of running batch being read ahead, null if none.
+	 */
+	bool probe_;
+	/* Running batch is the probe of a half open destination.
+	 */
 public:
-	SyncProcess(Syncer *parent, int id, int nproc, std::vector<File> &queue);
-	/* Constructor. Grabs members from parent pointer.
+	SyncProcess(Syncer *parent, const Lane &lane, int id, int nproc, std::vector<Destination>::iterator destination, bool filter);
+	/* Constructor. Grabs members from parent pointer and lane.
 	 */
 	~SyncProcess();
 	/* Destructor.
@@ -104,16 +137,20 @@ public:
 	/* Add one file to the payload.
 	 * Incrememnts curr_mem_usage_ and curr_payload_bytes_ accordingly.
 	 */
-	bool full_test(const File &file) const;
-	/* Returns true if curr_mem_usage_ exceeds the maximum
-	 * if file were to be added.
+	static size_t arg_cost(const File &file);
+	/* Bytes file takes in argv, counting its pointer.
 	 */
-	void consume(std::vector<File> &queue);
+	void consume(void);
 	/* Push c string pointers into payload_ vector until memory
-	 * usage is full or end of queue.
+	 * usage is full or end of lane. The files that fit are found
+	 * from the lane's argv_cost_, payload_ keeping its capacity
+	 * from batch to batch.
 	 */
-	void change_destination(void);
-	/* Pop last item in payload_ (destination) and replace with new destination.
+	void change_destination(std::vector<Destination>::iterator destination);
+	/* Replace destination in payload_ with new destination.
+	 */
+	void set_bwlimit(uintmax_t bytes_per_sec);
+	/* Set bandwidth limit flag for next batch. 0 for unlimited.
 	 */
 	void sync_batch(void);
 	/* Fork and execute sync program with file batch.
@@ -124,8 +161,14 @@ public:
 	 * set curr_mem_usage_ to start_mem_usage_
 	 * set curr_payload_bytes_ to 0
 	 */
-	bool done(const std::vector<File> &queue) const;
-	/* Returns file_itr_ >= queue.end().
+	bool done(void) const;
+	/* Returns file_itr_ >= end_.
+	 */
+	const std::string &lane(void) const;
+	/* Returns name of lane, empty for the default lane.
+	 */
+	const std::string &flags(void) const;
+	/* Returns flags of lane.
 	 */
 	const std::string &destination(void) const;
 	/* Returns sending_to_.
@@ -26,56 +26,220 @@
 #define TIMEOUT_CONN 35
 #define CHECK_SHMEM 145
 #define SSH_FAIL 255
+#define SYNC_POLL_MAX_MS 50 // longest wait between polls of running processes
+#define SPLIT_FILE_WEIGHT 4096 // bytes each file counts for when splitting a lane, for per-file overhead
 
 #ifndef MEM_LIM_HEADROOM
 #define MEM_LIM_HEADROOM 2048 // POSIX suggests 2048 bytes of headroom for modifying env
 #endif
 
+#include "rateLimiter.hpp"
+#include "destination.hpp"
+#include "chunker.hpp"
+#include "listing.hpp"
+#include "concurrency.hpp"
+#include "prefetch.hpp"
 #include <list>
 #include <vector>
 #include <string>
 
-enum LAUNCH_PROCS_RET_T {SYNC_SUCCESS, SYNC_FAILED, INC_HEADROOM};
+enum LAUNCH_PROCS_RET_T {SYNC_SUCCESS, SYNC_FAILED, INC_HEADROOM, SYNC_DEFERRED};
+enum TRANSFER_ORDER_T {ORDER_SIZE, ORDER_DIRECTORY, ORDER_INODE, ORDER_HYBRID};
 
 class SyncProcess;
 class Config;
 class File;
 
+struct Lane{
+	/* Class of files sent by its own pool of processes with its own
+	 * flags, so large transfers can't hold up small ones.
+	 */
+	std::string name_;
+	/* For log messages, empty for the default lane.
+	 */
+	std::string flags_;
+	/* Flags passed to exec bin, for log messages.
+	 */
+	int nproc_;
+	/* Number of processes in this lane's pool.
+	 */
+	std::vector<char *> start_payload_;
+	/* Start of argv to pass to exec bin.
+	 */
+	size_t start_mem_usage_;
+	/* Number of bytes contained in the environment and in the
+	 * executable path and flags.
+	 */
+	size_t bwlimit_idx_;
+	/* Index of bandwidth limit flag in start_payload_, 0 if not limited.
+	 */
+	std::vector<File>::iterator begin_;
+	std::vector<File>::iterator end_;
+	/* Slice of the sorted queue sent by this lane during current sync.
+	 */
+	std::vector<std::vector<File>::iterator> splits_;
+	/* Bounds of each process's contiguous part of the slice, empty if
+	 * processes take every nproc'th file instead.
+	 */
+	std::vector<uintmax_t> argv_cost_;
+	/* Running total of argv bytes taken by the files of the slice, over
+	 * every file each process takes, so a batch is cut with a binary
+	 * search.
+	 */
+};
+
 class Syncer{
 	friend class SyncProcess;
 	/* Allow access to members for SyncProcess's constructor.
 	 */
 private:
-	int nproc_;
-	/* Number of processes to launch. Defined in configuration file or
-	 * in command line argument, but is limited to [1, # of files].
-	 */
 	size_t max_mem_usage_;
 	/* Maximum number of bytes allowed in environment and argv of called
 	 * process.
 	 */
-	size_t start_mem_usage_;
-	/* Number of bytes contained in the environment and in the
-	 * executable path and flags.
-	 */
 	std::string exec_bin_;
 	/* File syncing program name.
 	 */
 	std::string exec_flags_;
 	/* Flags and extra args for program.
 	 */
-	std::vector<std::string> destinations_;
+	std::vector<Destination> destinations_;
 	/* [[<user>@]<host>:][<destination path>]
 	 */
-	std::vector<std::string>::iterator destination_;
-	/* Iterator to current destination.
+	std::vector<Destination>::iterator destination_;
+	/* Iterator to current destination in failover mode.
 	 */
-	std::vector<char *> start_payload_;
-	/* Start of argv to pass to exec bin.
+	bool fanout_;
+	/* Send to every destination concurrently instead of using them for failover.
+	 */
+	bool make_paths_;
+	/* Create destination directories before sending, since a shard's
+	 * destinations are subdirectories that may not exist yet.
+	 */
+	int running_nproc_;
+	/* Number of processes launched per destination for current sync.
+	 */
+	std::vector<Lane> lanes_;
+	/* Default lane first, then the large file lane if configured.
+	 * nproc_ of the default lane is defined in configuration file or
+	 * in command line argument, but is limited to [1, # of files].
+	 */
+	uintmax_t large_threshold_;
+	/* Files at least this big go to the large file lane. 0 if disabled.
+	 */
+	TRANSFER_ORDER_T transfer_order_;
+	/* Order of files within each lane. Lanes are always split by size.
+	 */
+	void order_lane(std::vector<File> &queue, const Lane &lane) const;
+	/* Reorder lane's slice of the size sorted queue by transfer_order_.
+	 */
+	static void split_lane(Lane &lane, int nproc);
+	/* Fill splits_ of lane with nproc contiguous parts of about equal
+	 * weight, so neighbouring files are sent by the same process.
 	 */
 	std::vector<char *> garbage_;
 	/* For cleanup on destruction.
 	 */
+	uintmax_t chunk_threshold_;
+	/* Files at least this big are sent in ranges by chunker_. 0 if disabled.
+	 */
+	uintmax_t delta_threshold_;
+	/* Files at least this big only have changed blocks sent. 0 if disabled.
+	 */
+	ChunkedTransfer chunker_;
+	/* Sends single huge files in parallel byte ranges.
+	 */
+	bool tree_ops_;
+	/* Replay deletes and renames found by the crawler on destinations.
+	 */
+	bool apply_tree_ops(const std::vector<TreeOp> &ops);
+	/* Run ops on every destination in fan-out mode, or on the first one
+	 * reachable in failover mode. Returns false if every destination is
+	 * unreachable.
+	 */
+	int run_tree_ops(const std::vector<std::string> &scripts, Destination &dest);
+	/* Run scripts on dest, stopping at the first that fails. Returns
+	 * its exit code.
+	 */
+	void send_chunked(std::vector<File> &queue);
+	/* Send files at or above chunk_threshold_ from the tail of the sorted
+	 * queue in ranges, removing those that were sent. Files that could
+	 * not be sent are left for the sync processes.
+	 */
+	bool send_ranges(const File &file, Destination &dest);
+	/* Send one file to dest with chunker_, updating destination health
+	 * and metrics. Returns true on success.
+	 */
+	void add_lane(const std::string &name, const std::string &flags, int nproc);
+	/* Build argv prefix for a lane and append it to lanes_.
+	 */
+	static void sum_argv_cost(Lane &lane, int nproc);
+	/* Fill argv_cost_ of lane for nproc processes taking every nproc'th
+	 * file, or contiguous parts if nproc is 1.
+	 */
+	SharedBudget *procs_budget_;
+	/* Where batches take process slots, Budgets::procs unless reserved.
+	 */
+	SharedBudget reserved_procs_;
+	/* Unlimited budget used after reserve_procs(), each lane being capped
+	 * by its own process count.
+	 */
+	Prefetcher prefetcher_;
+	/* Reads ahead files of running batches if Prefetch Budget is set.
+	 */
+	std::list<SyncProcess *> waiting_procs_;
+	/* Processes with a batch ready but no slot in procs_budget_.
+	 */
+	void launch_batch(SyncProcess &proc, int running);
+	/* Take a slot from procs_budget_ and a bandwidth share and call
+	 * run_batch, or queue proc in waiting_procs_ if either is short or its
+	 * half open destination already has a probe out.
+	 */
+	bool take_bandwidth(SyncProcess &proc);
+	/* Take a share of Limits::bandwidth for proc and pass it to its
+	 * bandwidth limit flag. Returns false if processes of any syncer
+	 * must return theirs first.
+	 */
+	void return_bandwidth(SyncProcess &proc);
+	/* Return the share taken by proc, if any.
+	 */
+	void run_batch(SyncProcess &proc, int running);
+	/* Give proc its share of the prefetch budget out of running
+	 * processes, then call proc.sync_batch().
+	 */
+	void launch_waiting(std::list<SyncProcess> &procs);
+	/* Launch waiting processes while slots are available, skipping those
+	 * held back by a probe. In fan-out mode, drops those whose destination
+	 * failed meanwhile, otherwise moves them to destination_.
+	 */
+	std::list<SyncProcess>::iterator wait_child(std::list<SyncProcess> &procs, pid_t &pid, int &wstatus, bool &status_lost);
+	/* Wait for one of this syncer's processes to exit and return its slot,
+	 * launching waiting processes as slots free up. Only reaps own children,
+	 * so syncers of other roots can run alongside. Returns procs.end()
+	 * if nothing is running or waiting. Sets status_lost if the child was
+	 * reaped elsewhere, so whether its batch was sent is unknown.
+	 */
+	void end_probe(SyncProcess &proc);
+	/* If proc was the probe of a half open destination, let the
+	 * next batch be admitted.
+	 */
+	void reap_all(std::list<SyncProcess> &procs);
+	/* Block until every running process has exited.
+	 */
+	std::string proc_msg(const SyncProcess &proc, const std::string &msg) const;
+	/* Prefix msg with process ID and destination where ambiguous.
+	 */
+	std::vector<Destination>::iterator pick_destination(void);
+	/* Failover mode: return first available destination starting from
+	 * destination_, or destinations_.end() if all are backing off.
+	 */
+	void log_health(void) const;
+	/* Log health summary of each destination.
+	 */
+	void drop_destination(std::list<SyncProcess> &procs, std::list<SyncProcess>::iterator exited_proc);
+	/* Fan-out mode: mark destination of exited_proc as failed, remove
+	 * exited_proc and stop the other processes sending to it.
+	 */
 public:
 	Syncer(size_t envp_size, const Config &config);
 	/* Determines max_arg_sz_, start_arg_sz_, and constructs destination_.
@@ -83,18 +247,42 @@ public:
 	~Syncer(void);
 	/* Destructor.
 	 */
+	std::vector<Destination> &destinations(void);
+	/* Return list of destinations.
+	 */
+	bool fanout(void) const;
+	/* Return true if sending to all destinations concurrently.
+	 */
 	std::string construct_destination(std::string remote_user, std::string remote_host, std::string remote_directory) const;
 	/* Create [<user>@][<host>:][<destination path>] string.
 	 */
+	void set_nproc(int nproc);
+	/* Change number of processes in default lane and ranges copied at once
+	 * by next call to sync().
+	 */
+	void reserve_procs(void);
+	/* Stop taking slots from Budgets::procs, so this syncer's processes
+	 * are never queued behind those of other syncers.
+	 */
 	size_t get_mem_limit(size_t envp_size) const;
 	/* Determine max_arg_sz_ from stack limits
 	 */
-	void sync(std::vector<File> &queue);
-	/* Sorts queue, constructs SyncProcess objects, calls launch_procs.
+	bool tree_ops(void) const{
+		return tree_ops_;
+	}
+	/* Returns true if deletes and renames can be replayed on destinations.
+	 */
+	bool sync(std::vector<File> &queue, const std::vector<TreeOp> &ops);
+	/* Replays ops, then sorts queue, sends huge files in ranges, splits the rest into lanes by size,
+	 * constructs SyncProcess objects, calls launch_procs.
+	 * In fan-out mode, failed_ of each destination is set if it could
+	 * not be reached. In failover mode, returns false if every destination
+	 * is backing off and the sync was deferred to a later cycle.
 	 */
 	void launch_procs(std::list<SyncProcess> &procs, std::vector<File> &queue);
 	/* Creates SyncProcesses and distributes files across each one. Assigns each process an ID then launches
 	 * them in parallel. Waits for processes to return and relaunches if there are files remaining.
+	 * Each lane gets its own set of processes, and in fan-out mode, so does each destination.
 	 */
 	LAUNCH_PROCS_RET_T handle_returned_procs(std::list<SyncProcess> &procs, std::vector<File> &queue);
 	void distribute_files(std::vector<File> &queue, std::list<SyncProcess> &procs) const;